@@ -0,0 +1,420 @@
+#include "BatchProcessor.hpp"
+#include "WaveWriter.hpp"
+#include "FlacEncoder.hpp"
+#include "Convert.hpp"
+#include <algorithm>
+
+// Frames taken from the input at a time.
+#define BATCH_BLOCK_FRAMES 65536
+
+BOOL add_batch_file(std::vector<BATCH_FILE>& files, LPCTSTR pszInput,
+                    LPCTSTR pszOutputDir, LPCTSTR pszExt)
+{
+    BATCH_FILE file;
+    ZeroMemory(&file, sizeof(file));
+    lstrcpyn(file.szInput, pszInput, ARRAYSIZE(file.szInput));
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!::GetFileAttributesEx(pszInput, GetFileExInfoStandard, &data))
+        return FALSE;
+    file.cbInput = (ULONGLONG(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+
+    // The name is what follows the last separator, and the extension what
+    // follows its last dot.
+    LPCTSTR pszName = pszInput;
+    for (LPCTSTR pch = pszInput; *pch; ++pch)
+    {
+        if (*pch == TEXT('\\') || *pch == TEXT('/'))
+            pszName = pch + 1;
+    }
+    TCHAR szName[MAX_PATH];
+    lstrcpyn(szName, pszName, ARRAYSIZE(szName));
+    if (pszExt)
+    {
+        LPTSTR pchDot = NULL;
+        for (LPTSTR pch = szName; *pch; ++pch)
+        {
+            if (*pch == TEXT('.'))
+                pchDot = pch;
+        }
+        if (pchDot)
+            *pchDot = 0;
+    }
+
+    if (pszOutputDir)
+    {
+        int cchDir = lstrlen(pszOutputDir);
+        BOOL bSeparator = (cchDir > 0 && (pszOutputDir[cchDir - 1] == TEXT('\\') ||
+                                          pszOutputDir[cchDir - 1] == TEXT('/')));
+        if (cchDir + 1 + lstrlen(szName) + (pszExt ? lstrlen(pszExt) : 0) >= MAX_PATH)
+            return FALSE;
+        wsprintf(file.szOutput, TEXT("%s%s%s%s"), pszOutputDir, bSeparator ? TEXT("") : TEXT("\\"),
+                 szName, pszExt ? pszExt : TEXT(""));
+    }
+
+    files.push_back(file);
+    return TRUE;
+}
+
+BOOL add_batch_directory(std::vector<BATCH_FILE>& files, LPCTSTR pszDir,
+                         LPCTSTR pszOutputDir, LPCTSTR pszExt)
+{
+    TCHAR szPattern[MAX_PATH], szPath[MAX_PATH];
+    if (lstrlen(pszDir) + 7 >= MAX_PATH)
+        return FALSE;
+    wsprintf(szPattern, TEXT("%s\\*.wav"), pszDir);
+
+    WIN32_FIND_DATA find;
+    HANDLE hFind = ::FindFirstFile(szPattern, &find);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return ::GetLastError() == ERROR_FILE_NOT_FOUND;
+
+    BOOL bOK = TRUE;
+    do
+    {
+        if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+        if (lstrlen(pszDir) + 1 + lstrlen(find.cFileName) >= MAX_PATH)
+        {
+            bOK = FALSE;
+            continue;
+        }
+        wsprintf(szPath, TEXT("%s\\%s"), pszDir, find.cFileName);
+        if (!add_batch_file(files, szPath, pszOutputDir, pszExt))
+            bOK = FALSE;
+    } while (::FindNextFile(hFind, &find));
+
+    ::FindClose(hFind);
+    return bOK;
+}
+
+// A plain PCM or float format of the kind Recording writes.
+static void get_batch_format(WAVEFORMATEX *pwfx, SAMPLE_FORMAT format, WORD nChannels,
+                             DWORD nSamplesPerSec)
+{
+    static const WORD s_bits[] = { 0, 8, 16, 24, 32, 32 };
+    ZeroMemory(pwfx, sizeof(*pwfx));
+    pwfx->wFormatTag = (format == SAMPLE_FORMAT_F32) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+    pwfx->nChannels = nChannels;
+    pwfx->nSamplesPerSec = nSamplesPerSec;
+    pwfx->wBitsPerSample = s_bits[format];
+    pwfx->nBlockAlign = pwfx->wBitsPerSample * nChannels / 8;
+    pwfx->nAvgBytesPerSec = nSamplesPerSec * pwfx->nBlockAlign;
+}
+
+// Writes a range of the input to a WAV or FLAC file, through float when
+// the format or the rate changes, or as is.
+static BOOL transcode_batch_file(BATCH_FILE *pFile, const BATCH_OPTIONS *pOptions)
+{
+    WaveReader reader;
+    if (!reader.Open(pFile->szInput))
+        return FALSE;
+
+    const WAVEFORMATEX *pwfx = reader.GetFormat();
+    const SAMPLE_FORMAT format = reader.GetSampleFormat();
+    const WORD nChannels = pwfx->nChannels;
+    const DWORD nBlockAlign = pwfx->nBlockAlign;
+    const DWORD nInRate = pwfx->nSamplesPerSec;
+    if (format == SAMPLE_FORMAT_UNKNOWN)
+        return FALSE;
+
+    const ULONGLONG nStored = reader.GetFrameCount();
+    ULONGLONG nStart = ULONGLONG(pOptions->dwStartMilliseconds) * nInRate / 1000;
+    ULONGLONG nEnd = nStored;
+    if (pOptions->dwLengthMilliseconds)
+        nEnd = nStart + ULONGLONG(pOptions->dwLengthMilliseconds) * nInRate / 1000;
+    if (nEnd > nStored)
+        nEnd = nStored;
+    if (nStart > nEnd)
+        nStart = nEnd;
+
+    const SAMPLE_FORMAT outFormat = pOptions->format ? pOptions->format : format;
+    const DWORD nOutRate = pOptions->nRate ? pOptions->nRate : nInRate;
+    const BOOL bResampling = (nOutRate != nInRate);
+    const BOOL bConverting = bResampling || (outFormat != format);
+
+    WAVEFORMATEX wfxOut;
+    if (bConverting)
+        get_batch_format(&wfxOut, outFormat, nChannels, nOutRate);
+
+    Resampler resampler;
+    if (bResampling && !resampler.Init(nInRate, nOutRate, nChannels, pOptions->quality))
+        return FALSE;
+
+    // A single thread: the pool already keeps every processor busy.
+    const BOOL bFlac = (pOptions->operation == BATCH_ENCODE);
+    const WAVEFORMATEX *pwfxOut = bConverting ? &wfxOut : pwfx;
+    WaveWriter writer;
+    FlacEncoder encoder;
+    BOOL bOK;
+    if (bFlac)
+    {
+        bOK = encoder.Open(pFile->szOutput, pwfxOut, 1);
+    }
+    else
+    {
+        writer.SetPreallocation((nEnd - nStart) * pwfxOut->nBlockAlign * nOutRate / nInRate);
+        bOK = writer.Open(pFile->szOutput, pwfxOut);
+    }
+    if (!bOK)
+        return FALSE;
+
+    // The frames go to the output straight from the view of the file.
+    std::vector<float> in, out;
+    std::vector<BYTE> converted;
+    ULONGLONG nFrame = nStart;
+    for (BOOL bLast = FALSE; bOK && !bLast; )
+    {
+        const BYTE *pbOut;
+        DWORD cbOut;
+        if (nFrame < nEnd)
+        {
+            DWORD nFrames = (nEnd - nFrame < BATCH_BLOCK_FRAMES) ? DWORD(nEnd - nFrame)
+                                                                 : BATCH_BLOCK_FRAMES;
+            const BYTE *pb = reader.GetFrames(nFrame, nFrames);
+            if (pb == NULL)
+            {
+                bOK = FALSE;
+                break;
+            }
+            nFrame += nFrames;
+            pFile->nFrames += nFrames;
+
+            if (!bConverting)
+            {
+                pbOut = pb;
+                cbOut = nFrames * nBlockAlign;
+            }
+            else
+            {
+                in.resize(nFrames * nChannels);
+                convert_to_float(format, pb, nFrames * nChannels, in.data());
+                const float *pf = in.data();
+                DWORD nOut = nFrames;
+                if (bResampling)
+                {
+                    nOut = resampler.Process(in.data(), nFrames, out);
+                    pf = out.data();
+                }
+                converted.resize(nOut * wfxOut.nBlockAlign);
+                convert_from_float(outFormat, pf, nOut * nChannels, converted.data());
+                pbOut = converted.data();
+                cbOut = DWORD(converted.size());
+            }
+        }
+        else
+        {
+            bLast = TRUE;
+            if (!bResampling)
+                break;
+
+            DWORD nOut = resampler.Flush(out);
+            converted.resize(nOut * wfxOut.nBlockAlign);
+            convert_from_float(outFormat, out.data(), nOut * nChannels, converted.data());
+            pbOut = converted.data();
+            cbOut = DWORD(converted.size());
+        }
+
+        bOK = bFlac ? encoder.Write(pbOut, cbOut) : writer.Write(pbOut, cbOut);
+        pFile->cbOutput += cbOut;
+    }
+
+    if (bFlac)
+    {
+        bOK = encoder.Close() && bOK;
+        pFile->cbOutput = encoder.GetOutputSize();
+    }
+    else
+    {
+        bOK = writer.Close() && bOK;
+    }
+    return bOK;
+}
+
+BOOL process_batch_file(BATCH_FILE *pFile, const BATCH_OPTIONS *pOptions)
+{
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    ::QueryPerformanceFrequency(&liFreq);
+    ::QueryPerformanceCounter(&liStart);
+
+    pFile->cbOutput = pFile->nFrames = 0;
+    if (pOptions->operation == BATCH_ANALYZE)
+    {
+        ZeroMemory(&pFile->verify, sizeof(pFile->verify));
+        pFile->bOK = verify_wave_file(pFile->szInput, &pFile->verify);
+        pFile->nFrames = pFile->verify.nFrames;
+    }
+    else
+    {
+        pFile->bOK = transcode_batch_file(pFile, pOptions);
+    }
+
+    ::QueryPerformanceCounter(&liEnd);
+    pFile->seconds = double(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+    return pFile->bOK;
+}
+
+struct LARGER_FILE
+{
+    const std::vector<BATCH_FILE>& files;
+
+    explicit LARGER_FILE(const std::vector<BATCH_FILE>& f)
+        : files(f)
+    {
+    }
+    bool operator()(DWORD a, DWORD b) const
+    {
+        return files[a].cbInput > files[b].cbInput;
+    }
+};
+
+BatchProcessor::BatchProcessor()
+    : m_pFiles(NULL)
+    , m_pOptions(NULL)
+    , m_nDone(0)
+    , m_nSteals(0)
+{
+}
+
+BatchProcessor::~BatchProcessor()
+{
+}
+
+BOOL BatchProcessor::Run(std::vector<BATCH_FILE>& files, const BATCH_OPTIONS& options,
+                         DWORD nThreads, BATCH_STATS *pStats)
+{
+    if (nThreads == 0)
+    {
+        SYSTEM_INFO info;
+        ::GetSystemInfo(&info);
+        nThreads = info.dwNumberOfProcessors;
+    }
+    if (nThreads > files.size())
+        nThreads = DWORD(files.size());
+    if (nThreads == 0)
+        nThreads = 1;
+
+    m_pFiles = &files;
+    m_pOptions = &options;
+    m_nDone.store(0);
+    m_nSteals.store(0);
+
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    ::QueryPerformanceFrequency(&liFreq);
+    ::QueryPerformanceCounter(&liStart);
+
+    // The largest files go first, dealt round the queues.
+    std::vector<DWORD> order(files.size());
+    for (DWORD i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), LARGER_FILE(files));
+
+    for (DWORD i = 0; i < nThreads; ++i)
+    {
+        WORKER *pWorker = new WORKER;
+        pWorker->pOwner = this;
+        pWorker->iWorker = i;
+        pWorker->hThread = NULL;
+        ::InitializeCriticalSection(&pWorker->lock);
+        m_workers.push_back(pWorker);
+    }
+    for (DWORD i = 0; i < order.size(); ++i)
+        m_workers[i % nThreads]->queue.push_back(order[i]);
+
+    for (DWORD i = 1; i < nThreads; ++i)
+    {
+        m_workers[i]->hThread = ::CreateThread(NULL, 0, WorkerThreadFunction,
+                                               m_workers[i], 0, NULL);
+    }
+    WorkerProc(0);
+
+    // A thread that failed to start leaves its queue to be stolen.
+    for (DWORD i = 1; i < nThreads; ++i)
+    {
+        if (m_workers[i]->hThread)
+        {
+            ::WaitForSingleObject(m_workers[i]->hThread, INFINITE);
+            ::CloseHandle(m_workers[i]->hThread);
+        }
+    }
+    for (DWORD i = 0; i < nThreads; ++i)
+    {
+        ::DeleteCriticalSection(&m_workers[i]->lock);
+        delete m_workers[i];
+    }
+    m_workers.clear();
+
+    ::QueryPerformanceCounter(&liEnd);
+
+    BATCH_STATS stats;
+    ZeroMemory(&stats, sizeof(stats));
+    stats.nThreads = nThreads;
+    stats.nFiles = DWORD(files.size());
+    stats.nSteals = m_nSteals.load();
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (!files[i].bOK)
+            ++stats.nFailed;
+        stats.cbInput += files[i].cbInput;
+        stats.cbOutput += files[i].cbOutput;
+    }
+    stats.seconds = double(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+    if (pStats)
+        *pStats = stats;
+
+    m_pFiles = NULL;
+    m_pOptions = NULL;
+    return stats.nFailed == 0;
+}
+
+// The front of the worker's own queue, or the back of the next one that
+// has any left.
+BOOL BatchProcessor::TakeJob(DWORD iWorker, DWORD *piFile)
+{
+    const DWORD nWorkers = DWORD(m_workers.size());
+    for (DWORD i = 0; i < nWorkers; ++i)
+    {
+        WORKER *pWorker = m_workers[(iWorker + i) % nWorkers];
+        ::EnterCriticalSection(&pWorker->lock);
+        BOOL bFound = !pWorker->queue.empty();
+        if (bFound)
+        {
+            if (i == 0)
+            {
+                *piFile = pWorker->queue.front();
+                pWorker->queue.pop_front();
+            }
+            else
+            {
+                *piFile = pWorker->queue.back();
+                pWorker->queue.pop_back();
+            }
+        }
+        ::LeaveCriticalSection(&pWorker->lock);
+
+        if (bFound)
+        {
+            if (i != 0)
+                m_nSteals.fetch_add(1, std::memory_order_relaxed);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+DWORD WINAPI BatchProcessor::WorkerThreadFunction(LPVOID pContext)
+{
+    WORKER *pWorker = reinterpret_cast<WORKER *>(pContext);
+    return pWorker->pOwner->WorkerProc(pWorker->iWorker);
+}
+
+DWORD BatchProcessor::WorkerProc(DWORD iWorker)
+{
+    DWORD iFile;
+    while (TakeJob(iWorker, &iFile))
+    {
+        process_batch_file(&(*m_pFiles)[iFile], m_pOptions);
+        m_nDone.fetch_add(1, std::memory_order_relaxed);
+    }
+    return 0;
+}
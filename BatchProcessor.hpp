@@ -0,0 +1,113 @@
+#ifndef BATCH_PROCESSOR_HPP_
+#define BATCH_PROCESSOR_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "WaveReader.hpp"
+#include "Resampler.hpp"
+
+enum BATCH_OPERATION
+{
+    BATCH_ANALYZE,              // structure and levels, as verify_wave_file
+    BATCH_CONVERT,              // to WAV
+    BATCH_ENCODE                // to FLAC
+};
+
+// Convert and encode take a range of the input, then change its sample
+// format and rate if asked to.
+struct BATCH_OPTIONS
+{
+    BATCH_OPERATION operation;
+    SAMPLE_FORMAT format;       // SAMPLE_FORMAT_UNKNOWN keeps the input's
+    DWORD nRate;                // zero keeps the input's
+    RESAMPLE_QUALITY quality;
+    DWORD dwStartMilliseconds;
+    DWORD dwLengthMilliseconds; // zero runs to the end
+};
+
+struct BATCH_FILE
+{
+    TCHAR szInput[MAX_PATH];
+    TCHAR szOutput[MAX_PATH];   // unused by analyze
+    ULONGLONG cbInput;
+
+    BOOL bOK;
+    ULONGLONG cbOutput;         // the audio written
+    ULONGLONG nFrames;          // the input frames processed
+    double seconds;
+    WAVE_VERIFY_RESULT verify;  // analyze's
+};
+
+struct BATCH_STATS
+{
+    DWORD nThreads;
+    DWORD nFiles;
+    DWORD nFailed;
+    DWORD nSteals;              // files taken from another thread's queue
+    ULONGLONG cbInput;
+    ULONGLONG cbOutput;
+    double seconds;
+};
+
+// Appends a file, named pszOutputDir\<name><pszExt> on output. pszExt
+// replaces the extension of the input, and NULL keeps it.
+BOOL add_batch_file(std::vector<BATCH_FILE>& files, LPCTSTR pszInput,
+                    LPCTSTR pszOutputDir, LPCTSTR pszExt);
+// Appends the *.wav files of a directory, not of its subdirectories.
+BOOL add_batch_directory(std::vector<BATCH_FILE>& files, LPCTSTR pszDir,
+                         LPCTSTR pszOutputDir, LPCTSTR pszExt);
+
+// Processes one file on the caller's thread and fills in its results.
+// The output goes through WaveWriter, as save_pcm_wave_file does, or
+// FlacEncoder on a single thread.
+BOOL process_batch_file(BATCH_FILE *pFile, const BATCH_OPTIONS *pOptions);
+
+// Runs process_batch_file over many files on a pool of threads. Each
+// thread has a queue of its own, dealt the largest files first, and takes
+// from the front of it; a thread whose queue is empty steals from the back
+// of the others', so a few long files do not leave the rest idle. The
+// caller's thread is one of the pool.
+class BatchProcessor
+{
+public:
+    BatchProcessor();
+    ~BatchProcessor();
+
+    // Zero threads take one per processor.
+    BOOL Run(std::vector<BATCH_FILE>& files, const BATCH_OPTIONS& options,
+             DWORD nThreads, BATCH_STATS *pStats);
+
+    // Any thread, while Run runs.
+    DWORD GetDoneCount() const
+    {
+        return m_nDone.load(std::memory_order_relaxed);
+    }
+
+protected:
+    struct WORKER
+    {
+        BatchProcessor *pOwner;
+        DWORD iWorker;
+        HANDLE hThread;
+        CRITICAL_SECTION lock;
+        std::deque<DWORD> queue;
+    };
+
+    std::vector<BATCH_FILE> *m_pFiles;
+    const BATCH_OPTIONS *m_pOptions;
+    std::vector<WORKER *> m_workers;
+    std::atomic<DWORD> m_nDone;
+    std::atomic<DWORD> m_nSteals;
+
+    BOOL TakeJob(DWORD iWorker, DWORD *piFile);
+    static DWORD WINAPI WorkerThreadFunction(LPVOID pContext);
+    DWORD WorkerProc(DWORD iWorker);
+
+    BatchProcessor(const BatchProcessor&);
+    BatchProcessor& operator=(const BatchProcessor&);
+};
+
+#endif  // ndef BATCH_PROCESSOR_HPP_
@@ -1,3 +1,6 @@
+#ifndef CCOMPTR_HPP_
+#define CCOMPTR_HPP_
+
 #include <cassert>
 
 template <class T>
@@ -115,3 +118,5 @@ public:
         return p;
     }
 };
+
+#endif  // ndef CCOMPTR_HPP_
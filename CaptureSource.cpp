@@ -0,0 +1,22 @@
+#include "CaptureSource.hpp"
+
+UINT32 get_period_frames(LONGLONG hnsPeriod, DWORD nSamplesPerSec)
+{
+    ULONGLONG nFrames = (ULONGLONG(hnsPeriod) * nSamplesPerSec + 5000000) / 10000000;
+    return nFrames ? UINT32(nFrames) : 1;
+}
+
+LONGLONG get_frames_duration(UINT32 nFrames, DWORD nSamplesPerSec)
+{
+    return LONGLONG(10000000.0 * nFrames / nSamplesPerSec + 0.5);
+}
+
+UINT32 get_buffer_frames(UINT32 nPeriodFrames, DWORD nSamplesPerSec,
+                         DWORD dwMilliseconds)
+{
+    ULONGLONG nWanted = ULONGLONG(nSamplesPerSec) * dwMilliseconds / 1000;
+    ULONGLONG nPeriods = (nWanted + nPeriodFrames - 1) / nPeriodFrames;
+    if (nPeriods < CAPTURE_MIN_PERIODS)
+        nPeriods = CAPTURE_MIN_PERIODS;
+    return UINT32(nPeriods * nPeriodFrames);
+}
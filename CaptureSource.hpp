@@ -0,0 +1,76 @@
+#ifndef CAPTURE_SOURCE_HPP_
+#define CAPTURE_SOURCE_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+
+enum CAPTURE_LATENCY
+{
+    // The period of the audio engine, and the buffer it picks unless one
+    // is asked for.
+    CAPTURE_LATENCY_DEFAULT,
+    // The shortest period the engine allows, and the fewest periods of
+    // buffer that hold the one asked for.
+    CAPTURE_LATENCY_LOW
+};
+
+// A buffer holds at least this many periods, so a late wake-up does not
+// lose frames at once.
+#define CAPTURE_MIN_PERIODS 2
+
+// The timing of an open stream. The source wakes the capture thread once a
+// period, and the buffer is how far the thread may fall behind before the
+// source loses frames.
+struct CAPTURE_TIMING
+{
+    DWORD nSamplesPerSec;
+    UINT32 nPeriodFrames;
+    UINT32 nBufferFrames;
+};
+
+// A period of hnsPeriod 100-nanosecond units, to the nearest frame.
+UINT32 get_period_frames(LONGLONG hnsPeriod, DWORD nSamplesPerSec);
+// nFrames in 100-nanosecond units, rounded as IAudioClient::Initialize
+// wants an aligned buffer duration.
+LONGLONG get_frames_duration(UINT32 nFrames, DWORD nSamplesPerSec);
+// The whole periods that hold dwMilliseconds, CAPTURE_MIN_PERIODS at least.
+// Zero milliseconds takes the least.
+UINT32 get_buffer_frames(UINT32 nPeriodFrames, DWORD nSamplesPerSec,
+                         DWORD dwMilliseconds);
+
+// A stream of audio packets for Recording::ThreadProc. The packet methods
+// follow IAudioCaptureClient and are called from the capture thread only.
+class CaptureSource
+{
+public:
+    virtual ~CaptureSource()
+    {
+    }
+
+    // Opens the stream in the format pwfx. hWakeUp is signaled when
+    // packets may be ready.
+    virtual HRESULT Open(const WAVEFORMATEX *pwfx, HANDLE hWakeUp) = 0;
+    virtual void Close() = 0;
+
+    // The format the source delivers without converting. It may be called
+    // from any thread while the source is closed.
+    virtual HRESULT GetMixFormat(WAVEFORMATEXTENSIBLE *pwfx) = 0;
+
+    // Takes effect on the next Open. Zero milliseconds takes the default
+    // buffer of the latency.
+    virtual void SetLatency(CAPTURE_LATENCY latency, DWORD dwBufferMilliseconds) = 0;
+    // The timing the stream got from Open.
+    virtual HRESULT GetTiming(CAPTURE_TIMING *pTiming) = 0;
+
+    virtual HRESULT Start() = 0;
+    virtual HRESULT Stop() = 0;
+
+    virtual HRESULT GetNextPacketSize(UINT32 *pnFrames) = 0;
+    virtual HRESULT GetBuffer(BYTE **ppData, UINT32 *pnFrames, DWORD *pdwFlags,
+                              UINT64 *pu64DevicePosition,
+                              UINT64 *pu64QPCPosition) = 0;
+    virtual HRESULT ReleaseBuffer(UINT32 nFrames) = 0;
+};
+
+#endif  // ndef CAPTURE_SOURCE_HPP_
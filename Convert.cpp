@@ -0,0 +1,394 @@
+#include "Convert.hpp"
+#include "Simd.hpp"
+#include <cmath>
+
+void get_float_format(WAVEFORMATEXTENSIBLE *pwfx, DWORD nSamplesPerSec,
+                      WORD nChannels)
+{
+    // KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, spelled out so no GUID is linked.
+    static const GUID s_subtype_float =
+    {
+        WAVE_FORMAT_IEEE_FLOAT, 0x0000, 0x0010,
+        { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 }
+    };
+
+    ZeroMemory(pwfx, sizeof(*pwfx));
+    pwfx->Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+    pwfx->Format.nChannels = nChannels;
+    pwfx->Format.nSamplesPerSec = nSamplesPerSec;
+    pwfx->Format.wBitsPerSample = 32;
+    pwfx->Format.nBlockAlign = 4 * nChannels;
+    pwfx->Format.nAvgBytesPerSec = nSamplesPerSec * pwfx->Format.nBlockAlign;
+    pwfx->Format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+    pwfx->Samples.wValidBitsPerSample = 32;
+    pwfx->SubFormat = s_subtype_float;
+}
+
+void get_pcm_format(WAVEFORMATEXTENSIBLE *pwfx, DWORD nSamplesPerSec,
+                    WORD nChannels, WORD wBitsPerSample)
+{
+    // KSDATAFORMAT_SUBTYPE_PCM.
+    static const GUID s_subtype_pcm =
+    {
+        WAVE_FORMAT_PCM, 0x0000, 0x0010,
+        { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 }
+    };
+
+    ZeroMemory(pwfx, sizeof(*pwfx));
+    pwfx->Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+    pwfx->Format.nChannels = nChannels;
+    pwfx->Format.nSamplesPerSec = nSamplesPerSec;
+    pwfx->Format.wBitsPerSample = wBitsPerSample;
+    pwfx->Format.nBlockAlign = wBitsPerSample / 8 * nChannels;
+    pwfx->Format.nAvgBytesPerSec = nSamplesPerSec * pwfx->Format.nBlockAlign;
+    pwfx->Format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+    pwfx->Samples.wValidBitsPerSample = wBitsPerSample;
+    pwfx->SubFormat = s_subtype_pcm;
+}
+
+WORD get_sample_size(SAMPLE_FORMAT format)
+{
+    switch (format)
+    {
+    case SAMPLE_FORMAT_U8:
+        return 1;
+    case SAMPLE_FORMAT_S16:
+        return 2;
+    case SAMPLE_FORMAT_S24:
+        return 3;
+    case SAMPLE_FORMAT_S32:
+    case SAMPLE_FORMAT_F32:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// The inverse of the scales in Meter.cpp. The upper limit of a 32-bit
+// sample is the largest float below 2^31.
+static const float s_scale_u8 = 128.0f;
+static const float s_scale_s16 = 32768.0f;
+static const float s_scale_s24 = 8388608.0f;
+static const float s_scale_s32 = 2147483648.0f;
+static const float s_max_s32 = 2147483520.0f;
+
+template <SAMPLE_FORMAT F>
+static inline void get_range(float& scale, float& lo, float& hi)
+{
+    switch (F)
+    {
+    case SAMPLE_FORMAT_U8:
+        scale = s_scale_u8;
+        lo = -128.0f;
+        hi = 127.0f;
+        break;
+    case SAMPLE_FORMAT_S16:
+        scale = s_scale_s16;
+        lo = -32768.0f;
+        hi = 32767.0f;
+        break;
+    case SAMPLE_FORMAT_S24:
+        scale = s_scale_s24;
+        lo = -8388608.0f;
+        hi = 8388607.0f;
+        break;
+    default:
+        scale = s_scale_s32;
+        lo = -s_scale_s32;
+        hi = s_max_s32;
+        break;
+    }
+}
+
+template <SAMPLE_FORMAT F>
+static inline void store_sample(BYTE *pb, DWORD i, INT n)
+{
+    switch (F)
+    {
+    case SAMPLE_FORMAT_U8:
+        pb[i] = BYTE(n + 128);
+        break;
+    case SAMPLE_FORMAT_S16:
+        reinterpret_cast<SHORT *>(pb)[i] = SHORT(n);
+        break;
+    case SAMPLE_FORMAT_S24:
+        pb += i * 3;
+        pb[0] = BYTE(n);
+        pb[1] = BYTE(n >> 8);
+        pb[2] = BYTE(n >> 16);
+        break;
+    default:
+        reinterpret_cast<INT *>(pb)[i] = n;
+        break;
+    }
+}
+
+// Converts the samples [iSample, nSamples) one by one.
+template <SAMPLE_FORMAT F>
+static void convert_scalar(const float *pSrc, DWORD iSample, DWORD nSamples,
+                           BYTE *pDst)
+{
+    float scale, lo, hi;
+    get_range<F>(scale, lo, hi);
+    for (; iSample < nSamples; ++iSample)
+    {
+        // NaN fails both comparisons of the clamp; it becomes silence.
+        float y = pSrc[iSample] * scale;
+        if (y != y)
+            y = 0;
+        y = (y < lo) ? lo : ((y > hi) ? hi : y);
+        store_sample<F>(pDst, iSample, INT(std::lrint(y)));
+    }
+}
+
+#ifdef SIMD_X86
+template <SAMPLE_FORMAT F>
+TARGET_SSE2 static void convert_sse2(const float *pSrc, DWORD nSamples, BYTE *pDst)
+{
+    float scale, lo, hi;
+    get_range<F>(scale, lo, hi);
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vlo = _mm_set1_ps(lo);
+    const __m128 vhi = _mm_set1_ps(hi);
+
+    DWORD i = 0;
+    for (; i + 8 <= nSamples; i += 8)
+    {
+        // max_ps would turn NaN into lo; the ordered mask makes it 0 first.
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(pSrc + i), vscale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(pSrc + i + 4), vscale);
+        a = _mm_and_ps(a, _mm_cmpord_ps(a, a));
+        b = _mm_and_ps(b, _mm_cmpord_ps(b, b));
+        __m128i na = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(a, vlo), vhi));
+        __m128i nb = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(b, vlo), vhi));
+
+        switch (F)
+        {
+        case SAMPLE_FORMAT_U8:
+            {
+                __m128i w = _mm_packs_epi32(na, nb);
+                w = _mm_add_epi16(w, _mm_set1_epi16(128));
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(pDst + i),
+                                 _mm_packus_epi16(w, w));
+            }
+            break;
+        case SAMPLE_FORMAT_S16:
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + i * 2),
+                             _mm_packs_epi32(na, nb));
+            break;
+        case SAMPLE_FORMAT_S24:
+            {
+                // SSE2 has no byte shuffle, so the bytes are packed by hand.
+                INT n[8];
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(n), na);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(n + 4), nb);
+                for (DWORD k = 0; k < 8; ++k)
+                    store_sample<F>(pDst, i + k, n[k]);
+            }
+            break;
+        default:
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + i * 4), na);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + i * 4 + 16), nb);
+            break;
+        }
+    }
+
+    convert_scalar<F>(pSrc, i, nSamples, pDst);
+}
+
+template <SAMPLE_FORMAT F>
+TARGET_AVX2 static void convert_avx2(const float *pSrc, DWORD nSamples, BYTE *pDst)
+{
+    float scale, lo, hi;
+    get_range<F>(scale, lo, hi);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 vlo = _mm256_set1_ps(lo);
+    const __m256 vhi = _mm256_set1_ps(hi);
+
+    // The 24-bit stores write four bytes past the sixteen samples.
+    const DWORD nSafe = (F == SAMPLE_FORMAT_S24) ? 2 : 0;
+
+    DWORD i = 0;
+    for (; i + 16 + nSafe <= nSamples; i += 16)
+    {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(pSrc + i), vscale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(pSrc + i + 8), vscale);
+        a = _mm256_and_ps(a, _mm256_cmp_ps(a, a, _CMP_ORD_Q));
+        b = _mm256_and_ps(b, _mm256_cmp_ps(b, b, _CMP_ORD_Q));
+        __m256i na = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(a, vlo), vhi));
+        __m256i nb = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(b, vlo), vhi));
+
+        switch (F)
+        {
+        case SAMPLE_FORMAT_U8:
+        case SAMPLE_FORMAT_S16:
+            {
+                // The packs work within 128-bit lanes; put the quarters
+                // back in order.
+                __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(na, nb), 0xD8);
+                if (F == SAMPLE_FORMAT_S16)
+                {
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(pDst + i * 2), w);
+                    break;
+                }
+                w = _mm256_add_epi16(w, _mm256_set1_epi16(128));
+                __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(w),
+                                                 _mm256_extracti128_si256(w, 1));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + i), bytes);
+            }
+            break;
+        case SAMPLE_FORMAT_S24:
+            {
+                const __m256i shuffle = _mm256_setr_epi8(
+                    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+                __m256i pa = _mm256_shuffle_epi8(na, shuffle);
+                __m256i pb = _mm256_shuffle_epi8(nb, shuffle);
+                BYTE *p = pDst + i * 3;
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(p), _mm256_castsi256_si128(pa));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(p + 12), _mm256_extracti128_si256(pa, 1));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(p + 24), _mm256_castsi256_si128(pb));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(p + 36), _mm256_extracti128_si256(pb, 1));
+            }
+            break;
+        default:
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(pDst + i * 4), na);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(pDst + i * 4 + 32), nb);
+            break;
+        }
+    }
+
+    convert_scalar<F>(pSrc, i, nSamples, pDst);
+}
+#endif  // def SIMD_X86
+
+template <SAMPLE_FORMAT F>
+static void convert_format(const float *pSrc, DWORD nSamples, BYTE *pDst)
+{
+#ifdef SIMD_X86
+    switch (get_simd_level())
+    {
+    case SIMD_AVX2:
+        convert_avx2<F>(pSrc, nSamples, pDst);
+        return;
+    case SIMD_SSE2:
+        convert_sse2<F>(pSrc, nSamples, pDst);
+        return;
+    default:
+        break;
+    }
+#endif
+    convert_scalar<F>(pSrc, 0, nSamples, pDst);
+}
+
+void convert_from_float(SAMPLE_FORMAT format, const float *pSrc, DWORD nSamples,
+                        BYTE *pDst)
+{
+    switch (format)
+    {
+    case SAMPLE_FORMAT_U8:
+        convert_format<SAMPLE_FORMAT_U8>(pSrc, nSamples, pDst);
+        break;
+    case SAMPLE_FORMAT_S16:
+        convert_format<SAMPLE_FORMAT_S16>(pSrc, nSamples, pDst);
+        break;
+    case SAMPLE_FORMAT_S24:
+        convert_format<SAMPLE_FORMAT_S24>(pSrc, nSamples, pDst);
+        break;
+    case SAMPLE_FORMAT_S32:
+        convert_format<SAMPLE_FORMAT_S32>(pSrc, nSamples, pDst);
+        break;
+    case SAMPLE_FORMAT_F32:
+        CopyMemory(pDst, pSrc, nSamples * sizeof(float));
+        break;
+    default:
+        break;
+    }
+}
+
+void convert_to_float(SAMPLE_FORMAT format, const BYTE *pSrc, DWORD nSamples,
+                      float *pDst)
+{
+    for (DWORD i = 0; i < nSamples; ++i)
+    {
+        switch (format)
+        {
+        case SAMPLE_FORMAT_U8:
+            pDst[i] = (float(pSrc[i]) - 128) / s_scale_u8;
+            break;
+        case SAMPLE_FORMAT_S16:
+            pDst[i] = reinterpret_cast<const SHORT *>(pSrc)[i] / s_scale_s16;
+            break;
+        case SAMPLE_FORMAT_S24:
+            {
+                const BYTE *pb = pSrc + i * 3;
+                INT n = INT(DWORD(pb[0]) << 8 | DWORD(pb[1]) << 16 | DWORD(pb[2]) << 24);
+                pDst[i] = float(n) / s_scale_s32;
+            }
+            break;
+        case SAMPLE_FORMAT_S32:
+            pDst[i] = float(reinterpret_cast<const INT *>(pSrc)[i]) / s_scale_s32;
+            break;
+        case SAMPLE_FORMAT_F32:
+            pDst[i] = reinterpret_cast<const float *>(pSrc)[i];
+            break;
+        default:
+            pDst[i] = 0;
+            break;
+        }
+    }
+}
+
+void remap_channels(const float *pSrc, DWORD nFrames, WORD nSrcChannels,
+                    float *pDst, WORD nDstChannels)
+{
+    if (nDstChannels == 1 && nSrcChannels > 1)
+    {
+        const float gain = 1.0f / nSrcChannels;
+        for (DWORD i = 0; i < nFrames; ++i, pSrc += nSrcChannels)
+        {
+            float sum = 0;
+            for (WORD c = 0; c < nSrcChannels; ++c)
+                sum += pSrc[c];
+            pDst[i] = sum * gain;
+        }
+        return;
+    }
+
+    for (DWORD i = 0; i < nFrames; ++i, pSrc += nSrcChannels)
+    {
+        for (WORD c = 0; c < nDstChannels; ++c)
+            *pDst++ = pSrc[c % nSrcChannels];
+    }
+}
+
+#ifdef SIMD_X86
+TARGET_SSE2 static DWORD deinterleave_stereo_sse2(const float *pSrc, DWORD nFrames,
+                                                  float *pLeft, float *pRight)
+{
+    DWORD i = 0;
+    for (; i + 4 <= nFrames; i += 4)
+    {
+        __m128 a = _mm_loadu_ps(pSrc + i * 2);
+        __m128 b = _mm_loadu_ps(pSrc + i * 2 + 4);
+        _mm_storeu_ps(pLeft + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(pRight + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    return i;
+}
+#endif
+
+void deinterleave_float(const float *pSrc, DWORD nFrames, WORD nChannels,
+                        float *const *ppPlanes)
+{
+    DWORD i = 0;
+#ifdef SIMD_X86
+    if (nChannels == 2 && get_simd_level() >= SIMD_SSE2)
+        i = deinterleave_stereo_sse2(pSrc, nFrames, ppPlanes[0], ppPlanes[1]);
+#endif
+    for (; i < nFrames; ++i)
+    {
+        for (WORD c = 0; c < nChannels; ++c)
+            ppPlanes[c][i] = pSrc[i * nChannels + c];
+    }
+}
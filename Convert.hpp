@@ -0,0 +1,39 @@
+#ifndef CONVERT_HPP_
+#define CONVERT_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include "Meter.hpp"
+
+// A float32 WAVE_FORMAT_EXTENSIBLE format, as a shared-mode mix format is.
+void get_float_format(WAVEFORMATEXTENSIBLE *pwfx, DWORD nSamplesPerSec,
+                      WORD nChannels);
+
+// An integer PCM WAVE_FORMAT_EXTENSIBLE format with no speaker positions,
+// for files of more than two channels.
+void get_pcm_format(WAVEFORMATEXTENSIBLE *pwfx, DWORD nSamplesPerSec,
+                    WORD nChannels, WORD wBitsPerSample);
+
+WORD get_sample_size(SAMPLE_FORMAT format);
+
+// Converts interleaved float32 samples to the format in one pass with the
+// kernel of get_simd_level(). Samples are scaled like measure_levels loads
+// them, clamped to full scale and rounded to nearest. NaN becomes 0.
+void convert_from_float(SAMPLE_FORMAT format, const float *pSrc, DWORD nSamples,
+                        BYTE *pDst);
+
+// The inverse of convert_from_float, for reading files. Scalar only.
+void convert_to_float(SAMPLE_FORMAT format, const BYTE *pSrc, DWORD nSamples,
+                      float *pDst);
+
+// Mixes all channels down when nDstChannels is 1. Otherwise channel i takes
+// source channel i % nSrcChannels.
+void remap_channels(const float *pSrc, DWORD nFrames, WORD nSrcChannels,
+                    float *pDst, WORD nDstChannels);
+
+// Splits interleaved frames into one plane per channel.
+void deinterleave_float(const float *pSrc, DWORD nFrames, WORD nChannels,
+                        float *const *ppPlanes);
+
+#endif  // ndef CONVERT_HPP_
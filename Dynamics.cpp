@@ -0,0 +1,390 @@
+#include "Dynamics.hpp"
+#include "Simd.hpp"
+#include <cmath>
+
+// The time constant of the AGC's detector.
+#define AGC_WINDOW_SECONDS 0.4
+
+static float from_db(float dB)
+{
+    return float(std::pow(10.0, dB / 20.0));
+}
+
+static float to_db(float x)
+{
+    return (x > 0) ? float(20 * std::log10(x)) : -200.0f;
+}
+
+void get_default_dynamics(DYNAMICS_SETTINGS *pSettings)
+{
+    pSettings->bAgc = TRUE;
+    pSettings->targetDB = -20;
+    pSettings->maxGainDB = 24;
+    pSettings->minGainDB = -12;
+    pSettings->gateDB = -60;
+    pSettings->riseDBPerSecond = 3;
+    pSettings->fallDBPerSecond = 12;
+    pSettings->ceilingDB = -1;
+    pSettings->dwLookaheadMilliseconds = 5;
+    pSettings->dwReleaseMilliseconds = 100;
+}
+
+// pDst = px * gain. pPeak receives the highest magnitude of pDst and
+// pEnergy the sum of the squares of px.
+static void scale_scalar(const float *px, DWORD n, float gain, float *pDst,
+                         float *pPeak, float *pEnergy)
+{
+    float peak = 0, energy = 0;
+    for (DWORD i = 0; i < n; ++i)
+    {
+        float x = px[i];
+        energy += x * x;
+        float y = x * gain;
+        pDst[i] = y;
+        y = std::fabs(y);
+        if (peak < y)
+            peak = y;
+    }
+    *pPeak = peak;
+    *pEnergy = energy;
+}
+
+// pDst = px * (g0 + d * pRamp).
+static void ramp_scalar(const float *px, const float *pRamp, DWORD n, float g0, float d,
+                        float *pDst)
+{
+    for (DWORD i = 0; i < n; ++i)
+        pDst[i] = px[i] * (g0 + d * pRamp[i]);
+}
+
+#ifdef SIMD_X86
+// A block is a multiple of eight samples.
+TARGET_SSE2
+static void scale_sse2(const float *px, DWORD n, float gain, float *pDst,
+                       float *pPeak, float *pEnergy)
+{
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 g = _mm_set1_ps(gain);
+    __m128 peak = _mm_setzero_ps(), energy = _mm_setzero_ps();
+    for (DWORD i = 0; i < n; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(px + i);
+        energy = _mm_add_ps(energy, _mm_mul_ps(x, x));
+        __m128 y = _mm_mul_ps(x, g);
+        _mm_storeu_ps(pDst + i, y);
+        peak = _mm_max_ps(peak, _mm_and_ps(y, mask));
+    }
+    peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+    peak = _mm_max_ss(peak, _mm_shuffle_ps(peak, peak, 1));
+    energy = _mm_add_ps(energy, _mm_movehl_ps(energy, energy));
+    energy = _mm_add_ss(energy, _mm_shuffle_ps(energy, energy, 1));
+    *pPeak = _mm_cvtss_f32(peak);
+    *pEnergy = _mm_cvtss_f32(energy);
+}
+
+TARGET_SSE2
+static void ramp_sse2(const float *px, const float *pRamp, DWORD n, float g0, float d,
+                      float *pDst)
+{
+    const __m128 g = _mm_set1_ps(g0), dg = _mm_set1_ps(d);
+    for (DWORD i = 0; i < n; i += 4)
+    {
+        __m128 gain = _mm_add_ps(g, _mm_mul_ps(dg, _mm_loadu_ps(pRamp + i)));
+        _mm_storeu_ps(pDst + i, _mm_mul_ps(_mm_loadu_ps(px + i), gain));
+    }
+}
+
+TARGET_AVX2
+static void scale_avx2(const float *px, DWORD n, float gain, float *pDst,
+                       float *pPeak, float *pEnergy)
+{
+    const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 g = _mm256_set1_ps(gain);
+    __m256 peak = _mm256_setzero_ps(), energy = _mm256_setzero_ps();
+    for (DWORD i = 0; i < n; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(px + i);
+        energy = _mm256_fmadd_ps(x, x, energy);
+        __m256 y = _mm256_mul_ps(x, g);
+        _mm256_storeu_ps(pDst + i, y);
+        peak = _mm256_max_ps(peak, _mm256_and_ps(y, mask));
+    }
+    __m128 p = _mm_max_ps(_mm256_castps256_ps128(peak), _mm256_extractf128_ps(peak, 1));
+    __m128 e = _mm_add_ps(_mm256_castps256_ps128(energy), _mm256_extractf128_ps(energy, 1));
+    _mm256_zeroupper();
+    p = _mm_max_ps(p, _mm_movehl_ps(p, p));
+    p = _mm_max_ss(p, _mm_shuffle_ps(p, p, 1));
+    e = _mm_add_ps(e, _mm_movehl_ps(e, e));
+    e = _mm_add_ss(e, _mm_shuffle_ps(e, e, 1));
+    *pPeak = _mm_cvtss_f32(p);
+    *pEnergy = _mm_cvtss_f32(e);
+}
+
+TARGET_AVX2
+static void ramp_avx2(const float *px, const float *pRamp, DWORD n, float g0, float d,
+                      float *pDst)
+{
+    const __m256 g = _mm256_set1_ps(g0), dg = _mm256_set1_ps(d);
+    for (DWORD i = 0; i < n; i += 8)
+    {
+        __m256 gain = _mm256_fmadd_ps(dg, _mm256_loadu_ps(pRamp + i), g);
+        _mm256_storeu_ps(pDst + i, _mm256_mul_ps(_mm256_loadu_ps(px + i), gain));
+    }
+    _mm256_zeroupper();
+}
+#endif
+
+typedef void (*SCALE_PROC)(const float *px, DWORD n, float gain, float *pDst,
+                           float *pPeak, float *pEnergy);
+typedef void (*RAMP_PROC)(const float *px, const float *pRamp, DWORD n, float g0, float d,
+                          float *pDst);
+
+static SCALE_PROC get_scale_proc()
+{
+#ifdef SIMD_X86
+    switch (get_simd_level())
+    {
+    case SIMD_AVX2:
+        return scale_avx2;
+    case SIMD_SSE2:
+        return scale_sse2;
+    default:
+        break;
+    }
+#endif
+    return scale_scalar;
+}
+
+static RAMP_PROC get_ramp_proc()
+{
+#ifdef SIMD_X86
+    switch (get_simd_level())
+    {
+    case SIMD_AVX2:
+        return ramp_avx2;
+    case SIMD_SSE2:
+        return ramp_sse2;
+    default:
+        break;
+    }
+#endif
+    return ramp_scalar;
+}
+
+DynamicsProcessor::DynamicsProcessor()
+    : m_nSamplesPerSec(0)
+    , m_nChannels(0)
+    , m_nBlockSamples(0)
+    , m_nLookahead(1)
+    , m_ceiling(1)
+    , m_target(1)
+    , m_maxGain(1)
+    , m_minGain(1)
+    , m_gate(0)
+    , m_rise(1)
+    , m_fall(1)
+    , m_detectAlpha(1)
+    , m_releaseAlpha(1)
+    , m_nBlock(0)
+    , m_prevNeed(1)
+    , m_gain(1)
+    , m_agcGain(1)
+    , m_power(0)
+    , m_nPending(0)
+    , m_nDrop(0)
+    , m_nIn(0)
+    , m_nOut(0)
+    , m_lowestGain(1)
+    , m_nLimitedFrames(0)
+{
+    get_default_dynamics(&m_settings);
+}
+
+BOOL DynamicsProcessor::Init(const DYNAMICS_SETTINGS *pSettings, DWORD nSamplesPerSec,
+                             WORD nChannels)
+{
+    if (nSamplesPerSec == 0 || nChannels == 0)
+        return FALSE;
+
+    m_settings = *pSettings;
+    m_nSamplesPerSec = nSamplesPerSec;
+    m_nChannels = nChannels;
+    m_nBlockSamples = BLOCK_FRAMES * nChannels;
+
+    DWORD nLookahead = MulDiv(nSamplesPerSec, pSettings->dwLookaheadMilliseconds, 1000);
+    m_nLookahead = (nLookahead + BLOCK_FRAMES - 1) / BLOCK_FRAMES;
+    if (m_nLookahead == 0)
+        m_nLookahead = 1;
+
+    const double blockSeconds = double(BLOCK_FRAMES) / nSamplesPerSec;
+    m_ceiling = from_db(pSettings->ceilingDB);
+    m_target = from_db(pSettings->targetDB);
+    m_maxGain = from_db(pSettings->maxGainDB);
+    m_minGain = from_db(pSettings->minGainDB);
+    m_gate = from_db(pSettings->gateDB) * from_db(pSettings->gateDB);
+    m_rise = from_db(float(pSettings->riseDBPerSecond * blockSeconds));
+    m_fall = from_db(float(pSettings->fallDBPerSecond * blockSeconds));
+    m_detectAlpha = float(1 - std::exp(-blockSeconds / AGC_WINDOW_SECONDS));
+    double release = pSettings->dwReleaseMilliseconds / 1000.0;
+    m_releaseAlpha = (release > 0) ? float(1 - std::exp(-blockSeconds / release)) : 1.0f;
+
+    m_ramp.resize(m_nBlockSamples);
+    for (DWORD i = 0; i < m_nBlockSamples; ++i)
+        m_ramp[i] = float(i / nChannels) / BLOCK_FRAMES;
+
+    m_pending.resize(m_nBlockSamples);
+    // Enough silence for any Flush.
+    m_zeros.assign((m_nLookahead + 1) * m_nBlockSamples, 0.0f);
+    Reset();
+    return TRUE;
+}
+
+void DynamicsProcessor::Reset()
+{
+    // As if m_nLookahead blocks of silence had gone in; they are dropped
+    // from the output.
+    m_blocks.assign((m_nLookahead + 1) * m_nBlockSamples, 0.0f);
+    m_needs.assign(m_nLookahead + 1, 1.0f);
+    m_nBlock = m_nLookahead;
+    m_nDrop = m_nLookahead * BLOCK_FRAMES;
+    m_prevNeed = 1;
+    m_gain = 1;
+    m_agcGain = 1;
+    m_power = 0;
+    m_nPending = 0;
+    m_nIn = m_nOut = 0;
+    m_lowestGain = 1;
+    m_nLimitedFrames = 0;
+}
+
+// The block goes into the delay line with the AGC's gain, and the oldest
+// comes out with the limiter's.
+void DynamicsProcessor::ProcessBlock(const float *pIn, float *pOut)
+{
+    const DWORD nRing = m_nLookahead + 1;
+    const DWORD iIn = DWORD(m_nBlock % nRing);
+    float peak, energy;
+    SCALE_PROC scale = get_scale_proc();
+    scale(pIn, m_nBlockSamples, m_agcGain, &m_blocks[iIn * m_nBlockSamples], &peak, &energy);
+
+    if (m_settings.bAgc)
+    {
+        m_power += m_detectAlpha * (energy / m_nBlockSamples - m_power);
+        if (m_power > m_gate)
+        {
+            float desired = m_target / std::sqrt(m_power);
+            if (desired > m_maxGain)
+                desired = m_maxGain;
+            else if (desired < m_minGain)
+                desired = m_minGain;
+
+            if (desired > m_agcGain)
+                m_agcGain = (m_agcGain * m_rise < desired) ? m_agcGain * m_rise : desired;
+            else
+                m_agcGain = (m_agcGain / m_fall > desired) ? m_agcGain / m_fall : desired;
+        }
+    }
+
+    // A block needs the gain at both of its ends, so a linear ramp between
+    // them keeps all of it below the ceiling.
+    float need = (peak > m_ceiling) ? m_ceiling / peak : 1.0f;
+    m_needs[iIn] = (m_prevNeed < need) ? m_prevNeed : need;
+    m_prevNeed = need;
+
+    // The gain at the end of the block coming out: a release toward 1, or
+    // a straight line down to what a block within the look-ahead needs,
+    // which reaches it when that block comes out.
+    float gain = m_gain + (1 - m_gain) * m_releaseAlpha;
+    const ULONGLONG nFirst = m_nBlock + 1 - m_nLookahead;
+    for (DWORD m = 0; m < m_nLookahead; ++m)
+    {
+        float needed = m_needs[(nFirst + m) % nRing];
+        float candidate = m_gain + (needed - m_gain) / (m + 1);
+        if (candidate < gain)
+            gain = candidate;
+    }
+
+    const DWORD iOut = DWORD((m_nBlock + 1) % nRing);
+    RAMP_PROC ramp = get_ramp_proc();
+    ramp(&m_blocks[iOut * m_nBlockSamples], m_ramp.data(), m_nBlockSamples, m_gain,
+         gain - m_gain, pOut);
+
+    if (m_gain < 1 || gain < 1)
+    {
+        m_nLimitedFrames += BLOCK_FRAMES;
+        if (m_lowestGain > gain)
+            m_lowestGain = gain;
+    }
+    m_gain = gain;
+    ++m_nBlock;
+}
+
+DWORD DynamicsProcessor::Process(const float *pIn, DWORD nFrames, std::vector<float>& out)
+{
+    m_nIn += nFrames;
+    DWORD nMax = (m_nPending + nFrames) / BLOCK_FRAMES * BLOCK_FRAMES;
+    out.resize(size_t(nMax) * m_nChannels);
+
+    float *pOut = out.data();
+    DWORD nOut = 0;
+    while (nFrames > 0)
+    {
+        const float *pBlock;
+        if (m_nPending == 0 && nFrames >= BLOCK_FRAMES)
+        {
+            pBlock = pIn;
+            pIn += m_nBlockSamples;
+            nFrames -= BLOCK_FRAMES;
+        }
+        else
+        {
+            DWORD n = BLOCK_FRAMES - m_nPending;
+            if (n > nFrames)
+                n = nFrames;
+            CopyMemory(&m_pending[m_nPending * m_nChannels], pIn,
+                       n * m_nChannels * sizeof(float));
+            m_nPending += n;
+            pIn += n * m_nChannels;
+            nFrames -= n;
+            if (m_nPending < BLOCK_FRAMES)
+                break;
+
+            pBlock = m_pending.data();
+            m_nPending = 0;
+        }
+
+        // The blocks of the silence of Reset go where the next one will.
+        ProcessBlock(pBlock, pOut + nOut * m_nChannels);
+        if (m_nDrop)
+            m_nDrop -= BLOCK_FRAMES;
+        else
+            nOut += BLOCK_FRAMES;
+    }
+
+    out.resize(size_t(nOut) * m_nChannels);
+    m_nOut += nOut;
+    return nOut;
+}
+
+DWORD DynamicsProcessor::Flush(std::vector<float>& out)
+{
+    // Silence to fill the partial block and push the look-ahead out; what
+    // comes of it past the input is left out.
+    const ULONGLONG nIn = m_nIn, nOut = m_nOut;
+    DWORD nZeros = (BLOCK_FRAMES - m_nPending) % BLOCK_FRAMES + m_nLookahead * BLOCK_FRAMES;
+    DWORD n = Process(m_zeros.data(), nZeros, out);
+    if (n > nIn - nOut)
+        n = DWORD(nIn - nOut);
+    out.resize(size_t(n) * m_nChannels);
+    m_nIn = nIn;
+    m_nOut = nOut + n;
+    return n;
+}
+
+void DynamicsProcessor::GetInfo(DYNAMICS_INFO *pInfo) const
+{
+    pInfo->nFrames = m_nIn;
+    pInfo->agcGainDB = to_db(m_agcGain);
+    pInfo->maxReductionDB = to_db(1 / m_lowestGain);
+    pInfo->nLimitedFrames = m_nLimitedFrames;
+}
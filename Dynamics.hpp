@@ -0,0 +1,108 @@
+#ifndef DYNAMICS_HPP_
+#define DYNAMICS_HPP_
+
+#include <windows.h>
+#include <vector>
+
+// Levels in dBFS of the sample values, so a full-scale sine peaks at 0 dB
+// and has an RMS of -3 dB.
+struct DYNAMICS_SETTINGS
+{
+    BOOL bAgc;
+    float targetDB;                     // the RMS the AGC steers to
+    float maxGainDB;                    // the AGC's gain stays within these
+    float minGainDB;
+    float gateDB;                       // the AGC holds below this RMS
+    float riseDBPerSecond;              // how fast the AGC's gain may change
+    float fallDBPerSecond;
+    float ceilingDB;                    // no sample of the output exceeds it
+    DWORD dwLookaheadMilliseconds;
+    DWORD dwReleaseMilliseconds;
+};
+
+// AGC to -20 dBFS RMS within -12..+24 dB, above a gate of -60 dBFS, and a
+// limiter at -1 dBFS with 5 ms of look-ahead.
+void get_default_dynamics(DYNAMICS_SETTINGS *pSettings);
+
+struct DYNAMICS_INFO
+{
+    ULONGLONG nFrames;                  // processed since Init
+    float agcGainDB;                    // the AGC's gain now
+    float maxReductionDB;               // the limiter's deepest, since Init
+    ULONGLONG nLimitedFrames;           // frames the limiter turned down
+};
+
+// Automatic gain control then a look-ahead brickwall limiter, for
+// interleaved float32 frames on the way to the writer. The frames go
+// through in blocks of BLOCK_FRAMES: the AGC's gain is constant over a
+// block and follows the RMS over the last 400 ms; the limiter delays the
+// blocks by the look-ahead and ramps its gain across each block so that it
+// is below what every block needs by the time the block comes out. The
+// per-sample work runs with the kernels of get_simd_level().
+//
+// The output is the input delayed by at most GetLatency() frames, and
+// Flush pushes the rest out, so a stream keeps its length and alignment.
+// Nothing is allocated after Init, but for the growth of out.
+class DynamicsProcessor
+{
+public:
+    enum { BLOCK_FRAMES = 32 };
+
+    DynamicsProcessor();
+
+    BOOL Init(const DYNAMICS_SETTINGS *pSettings, DWORD nSamplesPerSec, WORD nChannels);
+    // Forgets the history and the gains, as at the start of a stream.
+    void Reset();
+
+    // out receives the output frames; returns how many there are.
+    DWORD Process(const float *pIn, DWORD nFrames, std::vector<float>& out);
+    // Pushes the delayed frames out at the end of a stream.
+    DWORD Flush(std::vector<float>& out);
+
+    // The frames an input frame may wait before it comes out.
+    DWORD GetLatency() const
+    {
+        return (m_nLookahead + 1) * BLOCK_FRAMES - 1;
+    }
+    // The writer's side, or after the stream.
+    void GetInfo(DYNAMICS_INFO *pInfo) const;
+
+protected:
+    DYNAMICS_SETTINGS m_settings;
+    DWORD m_nSamplesPerSec;
+    WORD m_nChannels;
+    DWORD m_nBlockSamples;
+    DWORD m_nLookahead;                 // in blocks
+    float m_ceiling;
+    float m_target;
+    float m_maxGain;                    // the AGC's
+    float m_minGain;
+    float m_gate;                       // as power
+    float m_rise;                       // the AGC's steps per block
+    float m_fall;
+    float m_detectAlpha;
+    float m_releaseAlpha;
+    std::vector<float> m_ramp;          // the frame's share of a block, per sample
+
+    // The last m_nLookahead + 1 blocks and the gains they need at their
+    // starts, both rings indexed by the block number.
+    std::vector<float> m_blocks;
+    std::vector<float> m_needs;
+    ULONGLONG m_nBlock;                 // of the next block in
+    float m_prevNeed;                   // of the last block in
+    float m_gain;                       // the limiter's, at the next block out
+    float m_agcGain;
+    float m_power;                      // the AGC's detector
+    std::vector<float> m_pending;       // a partial block of input
+    DWORD m_nPending;
+    DWORD m_nDrop;                      // output frames before the stream
+    std::vector<float> m_zeros;
+    ULONGLONG m_nIn;
+    ULONGLONG m_nOut;
+    float m_lowestGain;                 // the limiter's
+    ULONGLONG m_nLimitedFrames;
+
+    void ProcessBlock(const float *pIn, float *pOut);
+};
+
+#endif  // ndef DYNAMICS_HPP_
@@ -0,0 +1,1041 @@
+#include "FlacEncoder.hpp"
+#include <mmreg.h>
+#include "Meter.hpp"
+#include "WaveReader.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// MD5 (RFC 1321)
+
+static const DWORD s_md5_k[64] =
+{
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const BYTE s_md5_r[64] =
+{
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_transform(DWORD state[4], const BYTE *pb)
+{
+    DWORD w[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = DWORD(pb[i * 4]) | (DWORD(pb[i * 4 + 1]) << 8) |
+               (DWORD(pb[i * 4 + 2]) << 16) | (DWORD(pb[i * 4 + 3]) << 24);
+    }
+
+    DWORD a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; ++i)
+    {
+        DWORD f;
+        int g;
+        if (i < 16)
+        {
+            f = (b & c) | (~b & d);
+            g = i;
+        }
+        else if (i < 32)
+        {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        }
+        else if (i < 48)
+        {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+
+        DWORD x = a + f + s_md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (x << s_md5_r[i]) | (x >> (32 - s_md5_r[i]));
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void md5_init(MD5_CONTEXT *pContext)
+{
+    pContext->state[0] = 0x67452301;
+    pContext->state[1] = 0xefcdab89;
+    pContext->state[2] = 0x98badcfe;
+    pContext->state[3] = 0x10325476;
+    pContext->cbTotal = 0;
+}
+
+void md5_update(MD5_CONTEXT *pContext, const BYTE *pb, DWORD cb)
+{
+    DWORD cbBuffered = DWORD(pContext->cbTotal % 64);
+    pContext->cbTotal += cb;
+
+    if (cbBuffered > 0)
+    {
+        DWORD cbCopy = 64 - cbBuffered;
+        if (cbCopy > cb)
+            cbCopy = cb;
+        CopyMemory(pContext->buffer + cbBuffered, pb, cbCopy);
+        pb += cbCopy;
+        cb -= cbCopy;
+        if (cbBuffered + cbCopy < 64)
+            return;
+        md5_transform(pContext->state, pContext->buffer);
+    }
+
+    for (; cb >= 64; pb += 64, cb -= 64)
+        md5_transform(pContext->state, pb);
+
+    CopyMemory(pContext->buffer, pb, cb);
+}
+
+void md5_final(MD5_CONTEXT *pContext, BYTE digest[16])
+{
+    ULONGLONG nBits = pContext->cbTotal * 8;
+
+    static const BYTE s_pad[64] = { 0x80 };
+    DWORD cbBuffered = DWORD(pContext->cbTotal % 64);
+    md5_update(pContext, s_pad, (cbBuffered < 56) ? 56 - cbBuffered : 120 - cbBuffered);
+
+    BYTE length[8];
+    for (int i = 0; i < 8; ++i)
+        length[i] = BYTE(nBits >> (i * 8));
+    md5_update(pContext, length, 8);
+
+    for (int i = 0; i < 16; ++i)
+        digest[i] = BYTE(pContext->state[i / 4] >> ((i % 4) * 8));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Frames
+
+#define MAX_PARTITION_ORDER 8
+#define MAX_FIXED_ORDER 4
+
+enum SUBFRAME_TYPE
+{
+    SUBFRAME_CONSTANT,
+    SUBFRAME_VERBATIM,
+    SUBFRAME_FIXED
+};
+
+struct SUBFRAME_PLAN
+{
+    SUBFRAME_TYPE type;
+    int order;
+    int nPartitionOrder;
+    BOOL bRice5;
+    BYTE params[1 << MAX_PARTITION_ORDER];
+    ULONGLONG nBits;
+};
+
+// MSB first into a byte vector.
+class BitWriter
+{
+public:
+    explicit BitWriter(std::vector<BYTE>& out)
+        : m_out(out)
+        , m_acc(0)
+        , m_nBits(0)
+    {
+    }
+
+    // Up to 32 bits; value is masked, so negative samples work.
+    void Put(DWORD value, int nBits)
+    {
+        m_acc = (m_acc << nBits) | (value & ((ULONGLONG(1) << nBits) - 1));
+        m_nBits += nBits;
+        while (m_nBits >= 8)
+        {
+            m_nBits -= 8;
+            m_out.push_back(BYTE(m_acc >> m_nBits));
+        }
+    }
+
+    // q zeros, a one, then the k low bits.
+    void PutRice(DWORD u, int k)
+    {
+        DWORD q = u >> k;
+        for (; q >= 31; q -= 31)
+            Put(0, 31);
+        Put(1, q + 1);
+        Put(u, k);
+    }
+
+    void Align()
+    {
+        if (m_nBits > 0)
+            Put(0, 8 - m_nBits);
+    }
+
+protected:
+    std::vector<BYTE>& m_out;
+    ULONGLONG m_acc;
+    int m_nBits;
+};
+
+// The frame header has a CRC-8 (x^8 + x^2 + x + 1), the frame a CRC-16
+// (x^16 + x^15 + x^2 + 1), both MSB first from zero.
+struct CRC_TABLES
+{
+    BYTE crc8[256];
+    WORD crc16[256];
+
+    CRC_TABLES()
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            BYTE c8 = BYTE(i);
+            WORD c16 = WORD(i << 8);
+            for (int j = 0; j < 8; ++j)
+            {
+                c8 = BYTE((c8 & 0x80) ? (c8 << 1) ^ 0x07 : (c8 << 1));
+                c16 = WORD((c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : (c16 << 1));
+            }
+            crc8[i] = c8;
+            crc16[i] = c16;
+        }
+    }
+};
+
+static const CRC_TABLES s_crc;
+
+static BYTE get_crc8(const BYTE *pb, DWORD cb)
+{
+    BYTE crc = 0;
+    for (DWORD i = 0; i < cb; ++i)
+        crc = s_crc.crc8[crc ^ pb[i]];
+    return crc;
+}
+
+static WORD get_crc16(const BYTE *pb, DWORD cb)
+{
+    WORD crc = 0;
+    for (DWORD i = 0; i < cb; ++i)
+        crc = WORD((crc << 8) ^ s_crc.crc16[(crc >> 8) ^ pb[i]]);
+    return crc;
+}
+
+static inline DWORD zigzag(INT32 e)
+{
+    return (DWORD(e) << 1) ^ DWORD(e >> 31);
+}
+
+// The fixed predictor with the least absolute error, as libFLAC picks it.
+static int get_best_fixed_order(const INT32 *x, DWORD n)
+{
+    ULONGLONG sums[MAX_FIXED_ORDER + 1] = { 0 };
+    LONGLONG last0 = x[3];
+    LONGLONG last1 = LONGLONG(x[3]) - x[2];
+    LONGLONG last2 = last1 - (LONGLONG(x[2]) - x[1]);
+    LONGLONG last3 = last2 - (LONGLONG(x[2]) - 2 * LONGLONG(x[1]) + x[0]);
+    for (DWORD i = MAX_FIXED_ORDER; i < n; ++i)
+    {
+        LONGLONG e0 = x[i];
+        LONGLONG e1 = e0 - last0;
+        LONGLONG e2 = e1 - last1;
+        LONGLONG e3 = e2 - last2;
+        LONGLONG e4 = e3 - last3;
+        sums[0] += ULONGLONG(e0 < 0 ? -e0 : e0);
+        sums[1] += ULONGLONG(e1 < 0 ? -e1 : e1);
+        sums[2] += ULONGLONG(e2 < 0 ? -e2 : e2);
+        sums[3] += ULONGLONG(e3 < 0 ? -e3 : e3);
+        sums[4] += ULONGLONG(e4 < 0 ? -e4 : e4);
+        last0 = e0;
+        last1 = e1;
+        last2 = e2;
+        last3 = e3;
+    }
+
+    int order = 0;
+    for (int i = 1; i <= MAX_FIXED_ORDER; ++i)
+    {
+        if (sums[i] < sums[order])
+            order = i;
+    }
+    return order;
+}
+
+// residual[i - order] for i in [order, n).
+static void get_fixed_residual(const INT32 *x, DWORD n, int order, INT32 *residual)
+{
+    switch (order)
+    {
+    case 0:
+        for (DWORD i = 0; i < n; ++i)
+            residual[i] = x[i];
+        break;
+    case 1:
+        for (DWORD i = 1; i < n; ++i)
+            residual[i - 1] = x[i] - x[i - 1];
+        break;
+    case 2:
+        for (DWORD i = 2; i < n; ++i)
+            residual[i - 2] = x[i] - 2 * x[i - 1] + x[i - 2];
+        break;
+    case 3:
+        for (DWORD i = 3; i < n; ++i)
+            residual[i - 3] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+        break;
+    case 4:
+        for (DWORD i = 4; i < n; ++i)
+            residual[i - 4] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+        break;
+    }
+}
+
+// The Rice parameter with the fewest bits for count values summing to
+// sum, estimating each value's quotient as sum >> k.
+static int get_rice_param(ULONGLONG sum, DWORD count, ULONGLONG *pnBits)
+{
+    int k = 0;
+    while (k < 30 && (ULONGLONG(count) << (k + 1)) < sum)
+        ++k;
+    *pnBits = ULONGLONG(count) * (k + 1) + (sum >> k);
+    return k;
+}
+
+// Tries every partition order from the finest the block allows.
+static ULONGLONG plan_residual(const INT32 *residual, DWORD n, int order,
+                               SUBFRAME_PLAN *pPlan)
+{
+    int nMaxOrder = 0;
+    while (nMaxOrder < MAX_PARTITION_ORDER && n % (2u << nMaxOrder) == 0 &&
+           (n >> (nMaxOrder + 1)) > DWORD(order))
+    {
+        ++nMaxOrder;
+    }
+
+    ULONGLONG sums[1 << MAX_PARTITION_ORDER];
+    DWORD nParts = 1u << nMaxOrder, cbPart = n >> nMaxOrder;
+    const INT32 *pe = residual;
+    for (DWORD j = 0; j < nParts; ++j)
+    {
+        DWORD count = cbPart - (j == 0 ? order : 0);
+        ULONGLONG sum = 0;
+        for (DWORD i = 0; i < count; ++i)
+            sum += zigzag(*pe++);
+        sums[j] = sum;
+    }
+
+    ULONGLONG nBest = ~ULONGLONG(0);
+    for (int p = nMaxOrder; p >= 0; --p)
+    {
+        nParts = 1u << p;
+        cbPart = n >> p;
+
+        BYTE params[1 << MAX_PARTITION_ORDER];
+        ULONGLONG nBits = 0;
+        BOOL bRice5 = FALSE;
+        for (DWORD j = 0; j < nParts; ++j)
+        {
+            ULONGLONG nPartBits;
+            int k = get_rice_param(sums[j], cbPart - (j == 0 ? order : 0), &nPartBits);
+            params[j] = BYTE(k);
+            nBits += nPartBits;
+            if (k > 14)
+                bRice5 = TRUE;
+        }
+        nBits += 2 + 4 + nParts * (bRice5 ? 5 : 4);
+
+        if (nBits < nBest)
+        {
+            nBest = nBits;
+            pPlan->nPartitionOrder = p;
+            pPlan->bRice5 = bRice5;
+            CopyMemory(pPlan->params, params, nParts);
+        }
+
+        for (DWORD j = 0; j < nParts / 2; ++j)
+            sums[j] = sums[2 * j] + sums[2 * j + 1];
+    }
+
+    return nBest;
+}
+
+static void plan_subframe(const INT32 *x, DWORD n, int bps, INT32 *residual,
+                          SUBFRAME_PLAN *pPlan)
+{
+    DWORD i;
+    for (i = 1; i < n && x[i] == x[0]; ++i)
+        ;
+    if (i == n)
+    {
+        pPlan->type = SUBFRAME_CONSTANT;
+        pPlan->nBits = 8 + bps;
+        return;
+    }
+
+    pPlan->type = SUBFRAME_VERBATIM;
+    pPlan->nBits = 8 + ULONGLONG(n) * bps;
+    if (n <= MAX_FIXED_ORDER)
+        return;
+
+    SUBFRAME_PLAN fixed;
+    fixed.type = SUBFRAME_FIXED;
+    fixed.order = get_best_fixed_order(x, n);
+    get_fixed_residual(x, n, fixed.order, residual);
+    fixed.nBits = 8 + fixed.order * bps + plan_residual(residual, n, fixed.order, &fixed);
+    if (fixed.nBits < pPlan->nBits)
+        *pPlan = fixed;
+}
+
+static void write_subframe(BitWriter& bw, const INT32 *x, DWORD n, int bps,
+                           const SUBFRAME_PLAN& plan, INT32 *residual)
+{
+    switch (plan.type)
+    {
+    case SUBFRAME_CONSTANT:
+        bw.Put(0x00, 8);
+        bw.Put(x[0], bps);
+        break;
+
+    case SUBFRAME_VERBATIM:
+        bw.Put(0x02, 8);
+        for (DWORD i = 0; i < n; ++i)
+            bw.Put(x[i], bps);
+        break;
+
+    case SUBFRAME_FIXED:
+        bw.Put((0x08 | plan.order) << 1, 8);
+        for (int i = 0; i < plan.order; ++i)
+            bw.Put(x[i], bps);
+
+        get_fixed_residual(x, n, plan.order, residual);
+        bw.Put(plan.bRice5 ? 1 : 0, 2);
+        bw.Put(plan.nPartitionOrder, 4);
+        {
+            const DWORD nParts = 1u << plan.nPartitionOrder;
+            const DWORD cbPart = n >> plan.nPartitionOrder;
+            const INT32 *pe = residual;
+            for (DWORD j = 0; j < nParts; ++j)
+            {
+                int k = plan.params[j];
+                bw.Put(k, plan.bRice5 ? 5 : 4);
+                DWORD count = cbPart - (j == 0 ? plan.order : 0);
+                for (DWORD i = 0; i < count; ++i)
+                    bw.PutRice(zigzag(*pe++), k);
+            }
+        }
+        break;
+    }
+}
+
+static void put_frame_number(BitWriter& bw, DWORD nNumber)
+{
+    if (nNumber < 0x80)
+    {
+        bw.Put(nNumber, 8);
+        return;
+    }
+
+    int nExtra = (nNumber < 0x800) ? 1 : (nNumber < 0x10000) ? 2 :
+                 (nNumber < 0x200000) ? 3 : (nNumber < 0x4000000) ? 4 : 5;
+    DWORD lead = (0xFF00 >> (nExtra + 1)) & 0xFF;
+    bw.Put(lead | (nNumber >> (6 * nExtra)), 8);
+    for (int i = nExtra - 1; i >= 0; --i)
+        bw.Put(0x80 | ((nNumber >> (6 * i)) & 0x3F), 8);
+}
+
+static int get_rate_code(DWORD nSamplesPerSec)
+{
+    switch (nSamplesPerSec)
+    {
+    case 88200: return 1;
+    case 176400: return 2;
+    case 192000: return 3;
+    case 8000: return 4;
+    case 16000: return 5;
+    case 22050: return 6;
+    case 24000: return 7;
+    case 32000: return 8;
+    case 44100: return 9;
+    case 48000: return 10;
+    case 96000: return 11;
+    }
+    if (nSamplesPerSec % 1000 == 0 && nSamplesPerSec / 1000 < 256)
+        return 12;
+    if (nSamplesPerSec < 65536)
+        return 13;
+    if (nSamplesPerSec % 10 == 0 && nSamplesPerSec / 10 < 65536)
+        return 14;
+    return 0;
+}
+
+static void deinterleave_pcm(const BYTE *pb, DWORD nFrames, WORD nChannels,
+                             WORD wBitsPerSample, INT32 *pPlanes)
+{
+    for (DWORD i = 0; i < nFrames; ++i)
+    {
+        for (WORD c = 0; c < nChannels; ++c)
+        {
+            INT32 *plane = pPlanes + c * FlacEncoder::BLOCK_FRAMES;
+            switch (wBitsPerSample)
+            {
+            case 8:
+                plane[i] = INT32(*pb++) - 128;
+                break;
+            case 16:
+                plane[i] = INT16(pb[0] | (pb[1] << 8));
+                pb += 2;
+                break;
+            case 24:
+                plane[i] = INT32(DWORD(pb[0] | (pb[1] << 8) | (pb[2] << 16)) << 8) >> 8;
+                pb += 3;
+                break;
+            }
+        }
+    }
+}
+
+// One block into one frame: the header, a subframe per channel, the CRC.
+void FlacEncoder::Encode(JOB& job, std::vector<INT32>& scratch) const
+{
+    const DWORD n = job.nFrames;
+    const WORD nChannels = m_wfx.nChannels;
+    const int bps = m_wfx.wBitsPerSample;
+
+    scratch.resize((nChannels + 3) * BLOCK_FRAMES);
+    INT32 *pPlanes = scratch.data();
+    INT32 *pMid = pPlanes + nChannels * BLOCK_FRAMES;
+    INT32 *pSide = pMid + BLOCK_FRAMES;
+    INT32 *pResidual = pSide + BLOCK_FRAMES;
+    deinterleave_pcm(job.input.data(), n, nChannels, m_wfx.wBitsPerSample, pPlanes);
+
+    const INT32 *sources[MAX_CHANNELS];
+    int bits[MAX_CHANNELS];
+    SUBFRAME_PLAN plans[MAX_CHANNELS];
+    int nAssignment = nChannels - 1;
+    for (WORD c = 0; c < nChannels; ++c)
+    {
+        sources[c] = pPlanes + c * BLOCK_FRAMES;
+        bits[c] = bps;
+        plan_subframe(sources[c], n, bps, pResidual, &plans[c]);
+    }
+
+    if (nChannels == 2)
+    {
+        const INT32 *pLeft = sources[0], *pRight = sources[1];
+        for (DWORD i = 0; i < n; ++i)
+        {
+            pMid[i] = (pLeft[i] + pRight[i]) >> 1;
+            pSide[i] = pLeft[i] - pRight[i];
+        }
+
+        SUBFRAME_PLAN mid, side;
+        plan_subframe(pMid, n, bps, pResidual, &mid);
+        plan_subframe(pSide, n, bps + 1, pResidual, &side);
+
+        // Independent, left/side, side/right or mid/side.
+        ULONGLONG costs[4] =
+        {
+            plans[0].nBits + plans[1].nBits,
+            plans[0].nBits + side.nBits,
+            side.nBits + plans[1].nBits,
+            mid.nBits + side.nBits
+        };
+        int iBest = 0;
+        for (int i = 1; i < 4; ++i)
+        {
+            if (costs[i] < costs[iBest])
+                iBest = i;
+        }
+
+        switch (iBest)
+        {
+        case 1:
+            nAssignment = 8;
+            sources[1] = pSide;
+            bits[1] = bps + 1;
+            plans[1] = side;
+            break;
+        case 2:
+            nAssignment = 9;
+            sources[0] = pSide;
+            bits[0] = bps + 1;
+            plans[0] = side;
+            break;
+        case 3:
+            nAssignment = 10;
+            sources[0] = pMid;
+            plans[0] = mid;
+            sources[1] = pSide;
+            bits[1] = bps + 1;
+            plans[1] = side;
+            break;
+        }
+    }
+
+    job.output.clear();
+    job.output.reserve(n * m_wfx.nBlockAlign + 64);
+    BitWriter bw(job.output);
+
+    int nBlockCode = (n == BLOCK_FRAMES) ? 12 : (n <= 256) ? 6 : 7;
+    int nRateCode = get_rate_code(m_wfx.nSamplesPerSec);
+    int nSizeCode = (bps == 8) ? 1 : (bps == 16) ? 4 : 6;
+    bw.Put(0x3FFE, 14);
+    bw.Put(0, 1);
+    bw.Put(0, 1);               // fixed block size
+    bw.Put(nBlockCode, 4);
+    bw.Put(nRateCode, 4);
+    bw.Put(nAssignment, 4);
+    bw.Put(nSizeCode, 3);
+    bw.Put(0, 1);
+    put_frame_number(bw, job.nNumber);
+    if (nBlockCode == 6)
+        bw.Put(n - 1, 8);
+    else if (nBlockCode == 7)
+        bw.Put(n - 1, 16);
+    if (nRateCode == 12)
+        bw.Put(m_wfx.nSamplesPerSec / 1000, 8);
+    else if (nRateCode == 13)
+        bw.Put(m_wfx.nSamplesPerSec, 16);
+    else if (nRateCode == 14)
+        bw.Put(m_wfx.nSamplesPerSec / 10, 16);
+    bw.Put(get_crc8(job.output.data(), DWORD(job.output.size())), 8);
+
+    for (WORD c = 0; c < nChannels; ++c)
+        write_subframe(bw, sources[c], n, bits[c], plans[c], pResidual);
+    bw.Align();
+
+    WORD crc = get_crc16(job.output.data(), DWORD(job.output.size()));
+    bw.Put(crc, 16);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// FlacEncoder
+
+BOOL is_flac_format(const WAVEFORMATEX *pwfx)
+{
+    SAMPLE_FORMAT format = get_sample_format(pwfx);
+    if (format != SAMPLE_FORMAT_U8 && format != SAMPLE_FORMAT_S16 &&
+        format != SAMPLE_FORMAT_S24)
+    {
+        return FALSE;
+    }
+    return pwfx->nChannels >= 1 && pwfx->nChannels <= FlacEncoder::MAX_CHANNELS &&
+           pwfx->nBlockAlign == pwfx->nChannels * pwfx->wBitsPerSample / 8 &&
+           pwfx->nSamplesPerSec > 0 && pwfx->nSamplesPerSec < (1 << 20);
+}
+
+FlacEncoder::FlacEncoder()
+    : m_hFile(INVALID_HANDLE_VALUE)
+    , m_nThreads(0)
+    , m_nSlots(0)
+    , m_hJobs(NULL)
+    , m_hShutdown(NULL)
+    , m_nTaken(0)
+    , m_nSubmitted(0)
+    , m_nWritten(0)
+    , m_cbPending(0)
+    , m_nTotalFrames(0)
+    , m_cbMinFrame(0)
+    , m_cbMaxFrame(0)
+    , m_cbInput(0)
+    , m_cbOutput(0)
+    , m_bOK(FALSE)
+{
+    ZeroMemory(&m_wfx, sizeof(m_wfx));
+    md5_init(&m_md5);
+}
+
+FlacEncoder::~FlacEncoder()
+{
+    Close();
+}
+
+BOOL FlacEncoder::Open(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx, DWORD nThreads)
+{
+    Close();
+
+    if (!is_flac_format(pwfx))
+        return FALSE;
+
+    m_hFile = ::CreateFile(pszFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    m_wfx = *pwfx;
+    m_wfx.wFormatTag = WAVE_FORMAT_PCM;
+    m_wfx.cbSize = 0;
+    m_nTaken = 0;
+    m_nSubmitted = m_nWritten = m_cbPending = 0;
+    m_nTotalFrames = 0;
+    m_cbMinFrame = 0xFFFFFFFF;
+    m_cbMaxFrame = 0;
+    m_cbInput = m_cbOutput = 0;
+    m_bOK = TRUE;
+    md5_init(&m_md5);
+
+    if (nThreads == 0)
+    {
+        SYSTEM_INFO info;
+        ::GetSystemInfo(&info);
+        nThreads = info.dwNumberOfProcessors;
+    }
+    if (nThreads > MAX_THREADS)
+        nThreads = MAX_THREADS;
+    m_nThreads = nThreads;
+
+    // A power of two, so a job number maps to a slot even as it wraps.
+    m_nSlots = 1;
+    if (nThreads > 1)
+    {
+        while (m_nSlots < 2 * nThreads)
+            m_nSlots *= 2;
+    }
+
+    m_jobs.resize(m_nSlots);
+    for (DWORD i = 0; i < m_nSlots; ++i)
+    {
+        m_jobs[i].input.resize(BLOCK_FRAMES * m_wfx.nBlockAlign);
+        m_jobs[i].hDone = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    }
+
+    // "fLaC", then STREAMINFO as the last metadata block, patched on Close.
+    static const BYTE s_header[8] = { 'f', 'L', 'a', 'C', 0x80, 0, 0, 34 };
+    WriteOut(s_header, sizeof(s_header), FALSE);
+    WriteStreamInfo();
+
+    if (nThreads > 1)
+    {
+        m_hJobs = ::CreateSemaphore(NULL, 0, m_nSlots, NULL);
+        m_hShutdown = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        for (DWORD i = 0; i < nThreads; ++i)
+        {
+            DWORD tid = 0;
+            HANDLE hThread = ::CreateThread(NULL, 0, FlacEncoder::WorkerThreadFunction,
+                                            this, 0, &tid);
+            if (hThread)
+                m_threads.push_back(hThread);
+        }
+    }
+
+    return TRUE;
+}
+
+DWORD WINAPI FlacEncoder::WorkerThreadFunction(LPVOID pContext)
+{
+    FlacEncoder *pThis = reinterpret_cast<FlacEncoder *>(pContext);
+    return pThis->WorkerProc();
+}
+
+// Each wake-up on the semaphore is one submitted job; they are taken in
+// order of submission.
+DWORD FlacEncoder::WorkerProc()
+{
+    std::vector<INT32> scratch;
+    HANDLE waitArray[2] = { m_hShutdown, m_hJobs };
+    for (;;)
+    {
+        DWORD waitResult = ::WaitForMultipleObjects(2, waitArray, FALSE, INFINITE);
+        if (waitResult != WAIT_OBJECT_0 + 1)
+            break;
+
+        DWORD nJob = DWORD(::InterlockedIncrement(&m_nTaken) - 1);
+        JOB& job = m_jobs[nJob & (m_nSlots - 1)];
+        Encode(job, scratch);
+        ::SetEvent(job.hDone);
+    }
+    return 0;
+}
+
+BOOL FlacEncoder::Write(LPCVOID pvData, DWORD cbData)
+{
+    if (!IsOpen())
+        return FALSE;
+
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    const DWORD cbBlock = BLOCK_FRAMES * m_wfx.nBlockAlign;
+    m_cbInput += cbData;
+
+    while (cbData > 0)
+    {
+        // A slot is reused once its frame is in the file.
+        if (m_cbPending == 0)
+        {
+            while (m_nSubmitted - m_nWritten >= m_nSlots)
+                WriteNext(TRUE);
+        }
+
+        JOB& job = m_jobs[m_nSubmitted & (m_nSlots - 1)];
+        DWORD cbCopy = cbBlock - m_cbPending;
+        if (cbCopy > cbData)
+            cbCopy = cbData;
+        CopyMemory(&job.input[m_cbPending], pb, cbCopy);
+        m_cbPending += cbCopy;
+        pb += cbCopy;
+        cbData -= cbCopy;
+
+        if (m_cbPending == cbBlock)
+            Submit();
+    }
+
+    while (m_nWritten != m_nSubmitted && WriteNext(FALSE))
+        ;
+
+    return m_bOK;
+}
+
+void FlacEncoder::Submit()
+{
+    JOB& job = m_jobs[m_nSubmitted & (m_nSlots - 1)];
+    job.nNumber = m_nSubmitted;
+    job.nFrames = m_cbPending / m_wfx.nBlockAlign;
+    const DWORD cb = job.nFrames * m_wfx.nBlockAlign;
+
+    // The signature is of signed samples, so 8-bit ones are flipped.
+    if (m_wfx.wBitsPerSample == 8)
+    {
+        BYTE signed8[256];
+        for (DWORD i = 0; i < cb; i += sizeof(signed8))
+        {
+            DWORD cbChunk = (cb - i < sizeof(signed8)) ? cb - i : DWORD(sizeof(signed8));
+            for (DWORD j = 0; j < cbChunk; ++j)
+                signed8[j] = job.input[i + j] ^ 0x80;
+            md5_update(&m_md5, signed8, cbChunk);
+        }
+    }
+    else
+    {
+        md5_update(&m_md5, job.input.data(), cb);
+    }
+
+    m_nTotalFrames += job.nFrames;
+    m_cbPending = 0;
+    ++m_nSubmitted;
+
+    if (m_threads.empty())
+        Encode(job, m_scratch);
+    else
+        ::ReleaseSemaphore(m_hJobs, 1, NULL);
+}
+
+// Writes the oldest frame if it is encoded, or after waiting for it.
+BOOL FlacEncoder::WriteNext(BOOL bWait)
+{
+    JOB& job = m_jobs[m_nWritten & (m_nSlots - 1)];
+    if (!m_threads.empty() &&
+        ::WaitForSingleObject(job.hDone, bWait ? INFINITE : 0) != WAIT_OBJECT_0)
+    {
+        return FALSE;
+    }
+
+    DWORD cb = DWORD(job.output.size());
+    if (m_cbMinFrame > cb)
+        m_cbMinFrame = cb;
+    if (m_cbMaxFrame < cb)
+        m_cbMaxFrame = cb;
+    WriteOut(job.output.data(), cb, FALSE);
+    ++m_nWritten;
+    return TRUE;
+}
+
+BOOL FlacEncoder::WriteOut(const BYTE *pb, DWORD cb, BOOL bFlush)
+{
+    const DWORD cbBlock = 256 * 1024;
+    m_cbOutput += cb;
+    if (m_block.size() + cb > cbBlock || bFlush)
+    {
+        DWORD cbWritten;
+        if (!m_block.empty() &&
+            !::WriteFile(m_hFile, m_block.data(), DWORD(m_block.size()), &cbWritten, NULL))
+        {
+            m_bOK = FALSE;
+        }
+        m_block.clear();
+    }
+    m_block.insert(m_block.end(), pb, pb + cb);
+    if (bFlush && !m_block.empty())
+    {
+        DWORD cbWritten;
+        if (!::WriteFile(m_hFile, m_block.data(), DWORD(m_block.size()), &cbWritten, NULL))
+            m_bOK = FALSE;
+        m_block.clear();
+    }
+    return m_bOK;
+}
+
+// The 34 bytes of STREAMINFO at offset 8, with what is known so far.
+BOOL FlacEncoder::WriteStreamInfo()
+{
+    std::vector<BYTE> info;
+    info.reserve(34);
+    {
+        BitWriter bw(info);
+        bw.Put(BLOCK_FRAMES, 16);
+        bw.Put(BLOCK_FRAMES, 16);
+        bw.Put(m_cbMaxFrame ? m_cbMinFrame : 0, 24);
+        bw.Put(m_cbMaxFrame, 24);
+        bw.Put(m_wfx.nSamplesPerSec, 20);
+        bw.Put(m_wfx.nChannels - 1, 3);
+        bw.Put(m_wfx.wBitsPerSample - 1, 5);
+        bw.Put(DWORD(m_nTotalFrames >> 32), 4);
+        bw.Put(DWORD(m_nTotalFrames), 32);
+    }
+
+    BYTE digest[16] = { 0 };
+    if (m_nTotalFrames > 0)
+    {
+        MD5_CONTEXT md5 = m_md5;
+        md5_final(&md5, digest);
+    }
+    info.insert(info.end(), digest, digest + 16);
+
+    if (m_nSubmitted == 0)
+        return WriteOut(info.data(), DWORD(info.size()), FALSE);
+
+    DWORD cbWritten;
+    ::SetFilePointer(m_hFile, 8, NULL, FILE_BEGIN);
+    return ::WriteFile(m_hFile, info.data(), DWORD(info.size()), &cbWritten, NULL);
+}
+
+BOOL FlacEncoder::Close()
+{
+    if (!IsOpen())
+        return FALSE;
+
+    if (m_cbPending >= m_wfx.nBlockAlign)
+        Submit();
+    while (m_nWritten != m_nSubmitted)
+        WriteNext(TRUE);
+
+    if (!m_threads.empty())
+    {
+        ::SetEvent(m_hShutdown);
+        for (size_t i = 0; i < m_threads.size(); ++i)
+        {
+            ::WaitForSingleObject(m_threads[i], INFINITE);
+            ::CloseHandle(m_threads[i]);
+        }
+        m_threads.clear();
+    }
+    if (m_hJobs)
+    {
+        ::CloseHandle(m_hJobs);
+        m_hJobs = NULL;
+    }
+    if (m_hShutdown)
+    {
+        ::CloseHandle(m_hShutdown);
+        m_hShutdown = NULL;
+    }
+    for (size_t i = 0; i < m_jobs.size(); ++i)
+        ::CloseHandle(m_jobs[i].hDone);
+    m_jobs.clear();
+
+    WriteOut(NULL, 0, TRUE);
+    if (m_nSubmitted > 0 && !WriteStreamInfo())
+        m_bOK = FALSE;
+
+    ::CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+    return m_bOK;
+}
+
+BOOL save_flac_file(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx,
+                    LPCVOID pvData, SIZE_T cbData, DWORD nThreads)
+{
+    FlacEncoder encoder;
+    if (!encoder.Open(pszFileName, pwfx, nThreads))
+        return FALSE;
+
+    // Write takes 32-bit sizes.
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    BOOL bOK = TRUE;
+    while (bOK && cbData > 0)
+    {
+        DWORD cb = (cbData < 0x40000000) ? DWORD(cbData) : 0x40000000;
+        bOK = encoder.Write(pb, cb);
+        pb += cb;
+        cbData -= cb;
+    }
+    return encoder.Close() && bOK;
+}
+
+BOOL save_flac_file(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx,
+                    const SegmentedBuffer& data, DWORD nThreads)
+{
+    FlacEncoder encoder;
+    if (!encoder.Open(pszFileName, pwfx, nThreads))
+        return FALSE;
+
+    BOOL bOK = TRUE;
+    for (DWORD i = 0; bOK && i < data.GetSegmentCount(); ++i)
+    {
+        DWORD cb;
+        const BYTE *pb = data.GetSegment(i, &cb);
+        bOK = encoder.Write(pb, cb);
+    }
+    return encoder.Close() && bOK;
+}
+
+BOOL flac_encode_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput, DWORD nThreads,
+                           double *pRealtime, double *pRatio)
+{
+    WaveReader reader;
+    if (!reader.Open(pszInput))
+        return FALSE;
+
+    const WAVEFORMATEX *pwfx = reader.GetFormat();
+    FlacEncoder encoder;
+    if (!encoder.Open(pszOutput, pwfx, nThreads))
+        return FALSE;
+
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    ::QueryPerformanceFrequency(&liFreq);
+    ::QueryPerformanceCounter(&liStart);
+
+    const WORD nBlockAlign = pwfx->nBlockAlign;
+    const ULONGLONG nTotal = reader.GetFrameCount();
+    const DWORD nBlockFrames = 65536;
+    BOOL bOK = TRUE;
+    for (ULONGLONG nFrame = 0; bOK && nFrame < nTotal; nFrame += nBlockFrames)
+    {
+        DWORD nFrames = (nTotal - nFrame < nBlockFrames) ? DWORD(nTotal - nFrame) : nBlockFrames;
+        const BYTE *pb = reader.GetFrames(nFrame, nFrames);
+        bOK = pb && encoder.Write(pb, nFrames * nBlockAlign);
+    }
+
+    ULONGLONG cbInput = encoder.GetInputSize();
+    bOK = encoder.Close() && bOK;
+
+    ::QueryPerformanceCounter(&liEnd);
+    if (pRealtime)
+    {
+        double seconds = double(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+        double audio = double(cbInput / nBlockAlign) / pwfx->nSamplesPerSec;
+        *pRealtime = (seconds > 0) ? audio / seconds : 0;
+    }
+    if (pRatio)
+        *pRatio = cbInput ? double(encoder.GetOutputSize()) / cbInput : 0;
+
+    return bOK;
+}
@@ -0,0 +1,111 @@
+#ifndef FLAC_ENCODER_HPP_
+#define FLAC_ENCODER_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <vector>
+#include "SegmentedBuffer.hpp"
+
+// The state of an MD5 digest, for the signature in STREAMINFO.
+struct MD5_CONTEXT
+{
+    DWORD state[4];
+    ULONGLONG cbTotal;
+    BYTE buffer[64];
+};
+
+void md5_init(MD5_CONTEXT *pContext);
+void md5_update(MD5_CONTEXT *pContext, const BYTE *pb, DWORD cb);
+void md5_final(MD5_CONTEXT *pContext, BYTE digest[16]);
+
+// Writes a FLAC file incrementally. The audio is cut into blocks of
+// BLOCK_FRAMES frames. The blocks are independent, so a pool of threads
+// encodes them while the caller goes on, and the frames are written in
+// order. Subframes use the fixed predictors with partitioned Rice coding,
+// and stereo picks the cheapest of left/right, left/side, side/right and
+// mid/side. STREAMINFO is patched on Close.
+class FlacEncoder
+{
+public:
+    enum { BLOCK_FRAMES = 4096, MAX_CHANNELS = 8, MAX_THREADS = 32 };
+
+    FlacEncoder();
+    ~FlacEncoder();
+
+    // 8, 16 or 24-bit integer PCM of up to MAX_CHANNELS channels. Zero
+    // threads take one per processor; one encodes on the caller's thread.
+    BOOL Open(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx, DWORD nThreads = 0);
+    BOOL Write(LPCVOID pvData, DWORD cbData);
+    BOOL Close();
+
+    BOOL IsOpen() const
+    {
+        return m_hFile != INVALID_HANDLE_VALUE;
+    }
+    ULONGLONG GetInputSize() const
+    {
+        return m_cbInput;
+    }
+    ULONGLONG GetOutputSize() const
+    {
+        return m_cbOutput;
+    }
+
+protected:
+    struct JOB
+    {
+        DWORD nNumber;
+        DWORD nFrames;
+        std::vector<BYTE> input;
+        std::vector<BYTE> output;
+        HANDLE hDone;
+    };
+
+    HANDLE m_hFile;
+    WAVEFORMATEX m_wfx;
+    DWORD m_nThreads;
+    std::vector<HANDLE> m_threads;
+    std::vector<JOB> m_jobs;
+    DWORD m_nSlots;
+    HANDLE m_hJobs;
+    HANDLE m_hShutdown;
+    LONG m_nTaken;
+    DWORD m_nSubmitted;
+    DWORD m_nWritten;
+    DWORD m_cbPending;
+    std::vector<BYTE> m_block;      // output not yet in the file
+    std::vector<INT32> m_scratch;
+    MD5_CONTEXT m_md5;
+    ULONGLONG m_nTotalFrames;
+    DWORD m_cbMinFrame;
+    DWORD m_cbMaxFrame;
+    ULONGLONG m_cbInput;
+    ULONGLONG m_cbOutput;
+    BOOL m_bOK;
+
+    static DWORD WINAPI WorkerThreadFunction(LPVOID pContext);
+    DWORD WorkerProc();
+    void Encode(JOB& job, std::vector<INT32>& scratch) const;
+    void Submit();
+    BOOL WriteNext(BOOL bWait);
+    BOOL WriteOut(const BYTE *pb, DWORD cb, BOOL bFlush);
+    BOOL WriteStreamInfo();
+
+    FlacEncoder(const FlacEncoder&);
+    FlacEncoder& operator=(const FlacEncoder&);
+};
+
+BOOL is_flac_format(const WAVEFORMATEX *pwfx);
+
+// The FLAC counterpart of save_pcm_wave_file.
+BOOL save_flac_file(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx,
+                    LPCVOID pvData, SIZE_T cbData, DWORD nThreads = 0);
+BOOL save_flac_file(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx,
+                    const SegmentedBuffer& data, DWORD nThreads = 0);
+
+// Transcodes a WAV file offline. pRealtime receives the speed in multiples
+// of real time, and pRatio the size of the output over the input.
+BOOL flac_encode_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput, DWORD nThreads,
+                           double *pRealtime, double *pRatio);
+
+#endif  // ndef FLAC_ENCODER_HPP_
@@ -0,0 +1,460 @@
+#include "ImaAdpcm.hpp"
+#include "WaveReader.hpp"
+#include "Meter.hpp"
+#include <cmath>
+#include <cstring>
+
+// Blocks decoded at a time by ima_adpcm_decode_wave_file.
+#define DECODE_BLOCKS 64
+
+static const INT s_indexes[16] =
+{
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const INT s_steps[89] =
+{
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+// The nibble for x, moving the state as the decoder will. The bits come
+// from masks rather than branches, which noise would mispredict half the
+// time.
+static inline BYTE encode_sample(IMA_ADPCM_STATE *pState, INT x)
+{
+    INT step = s_steps[pState->index];
+    INT diff = x - pState->predictor;
+    const INT sign = diff >> 31;
+    diff = (diff ^ sign) - sign;
+    INT nibble = sign & 8;
+
+    INT delta = step >> 3;
+    INT mask = -INT(diff >= step);
+    nibble |= mask & 4;
+    diff -= mask & step;
+    delta += mask & step;
+    step >>= 1;
+    mask = -INT(diff >= step);
+    nibble |= mask & 2;
+    diff -= mask & step;
+    delta += mask & step;
+    step >>= 1;
+    mask = -INT(diff >= step);
+    nibble |= mask & 1;
+    delta += mask & step;
+
+    INT predictor = pState->predictor + ((delta ^ sign) - sign);
+    predictor = (predictor > 32767) ? 32767 : predictor;
+    predictor = (predictor < -32768) ? -32768 : predictor;
+    pState->predictor = predictor;
+
+    INT index = pState->index + s_indexes[nibble];
+    index = (index < 0) ? 0 : index;
+    pState->index = (index > 88) ? 88 : index;
+    return BYTE(nibble);
+}
+
+static inline INT16 decode_sample(IMA_ADPCM_STATE *pState, BYTE nibble)
+{
+    INT step = s_steps[pState->index];
+    INT delta = step >> 3;
+    if (nibble & 4)
+        delta += step;
+    if (nibble & 2)
+        delta += step >> 1;
+    if (nibble & 1)
+        delta += step >> 2;
+
+    INT predictor = (nibble & 8) ? pState->predictor - delta : pState->predictor + delta;
+    if (predictor > 32767)
+        predictor = 32767;
+    else if (predictor < -32768)
+        predictor = -32768;
+    pState->predictor = predictor;
+
+    INT index = pState->index + s_indexes[nibble];
+    pState->index = (index < 0) ? 0 : (index > 88) ? 88 : index;
+    return INT16(predictor);
+}
+
+// The blocks are 256 bytes per channel per this.
+static DWORD get_block_multiple(DWORD nSamplesPerSec)
+{
+    DWORD nMultiple = nSamplesPerSec / 11025;
+    return nMultiple ? nMultiple : 1;
+}
+
+void get_ima_adpcm_format(const WAVEFORMATEX *pwfxPcm, IMAADPCMWAVEFORMAT *pwfx)
+{
+    const WORD nChannels = pwfxPcm->nChannels;
+    const DWORD nMultiple = get_block_multiple(pwfxPcm->nSamplesPerSec);
+
+    ZeroMemory(pwfx, sizeof(*pwfx));
+    pwfx->wfx.wFormatTag = WAVE_FORMAT_IMA_ADPCM;
+    pwfx->wfx.nChannels = nChannels;
+    pwfx->wfx.nSamplesPerSec = pwfxPcm->nSamplesPerSec;
+    pwfx->wfx.nBlockAlign = WORD(256 * nChannels * nMultiple);
+    pwfx->wfx.wBitsPerSample = 4;
+    pwfx->wfx.cbSize = sizeof(WORD);
+    pwfx->wSamplesPerBlock = WORD((pwfx->wfx.nBlockAlign - 4 * nChannels) * 2 / nChannels + 1);
+    pwfx->wfx.nAvgBytesPerSec = MulDiv(pwfx->wfx.nSamplesPerSec, pwfx->wfx.nBlockAlign,
+                                       pwfx->wSamplesPerBlock);
+}
+
+BOOL is_ima_adpcm_input(const WAVEFORMATEX *pwfx)
+{
+    if (get_sample_format(pwfx) != SAMPLE_FORMAT_S16 ||
+        pwfx->nChannels < 1 || pwfx->nChannels > ImaAdpcmEncoder::MAX_CHANNELS ||
+        pwfx->nBlockAlign != pwfx->nChannels * sizeof(INT16) ||
+        pwfx->nSamplesPerSec == 0)
+    {
+        return FALSE;
+    }
+
+    // nBlockAlign and wSamplesPerBlock are WORDs.
+    const DWORD nMultiple = get_block_multiple(pwfx->nSamplesPerSec);
+    return 256 * pwfx->nChannels * nMultiple <= 0xFFFF &&
+           (256 * nMultiple - 4) * 2 + 1 <= 0xFFFF;
+}
+
+void ima_adpcm_encode_block(const IMAADPCMWAVEFORMAT *pwfx, const INT16 *pSamples,
+                            IMA_ADPCM_STATE *pStates, BYTE *pBlock)
+{
+    const WORD nChannels = pwfx->wfx.nChannels;
+    for (WORD ch = 0; ch < nChannels; ++ch)
+    {
+        // The first sample is kept as it is.
+        INT16 x = pSamples[ch];
+        pStates[ch].predictor = x;
+        pBlock[0] = BYTE(x);
+        pBlock[1] = BYTE(x >> 8);
+        pBlock[2] = BYTE(pStates[ch].index);
+        pBlock[3] = 0;
+        pBlock += 4;
+    }
+
+    // The channels go side by side, so that their chains of samples
+    // overlap; a copy of the states, as the stores into the block could
+    // alias them.
+    IMA_ADPCM_STATE states[ImaAdpcmEncoder::MAX_CHANNELS];
+    CopyMemory(states, pStates, nChannels * sizeof(IMA_ADPCM_STATE));
+    const DWORD nGroups = (pwfx->wSamplesPerBlock - 1) / 8;
+    const INT16 *px = pSamples + nChannels;
+    for (DWORD g = 0; g < nGroups; ++g, pBlock += 4 * nChannels)
+    {
+        for (int i = 0; i < 4; ++i, px += 2 * nChannels)
+        {
+            for (WORD ch = 0; ch < nChannels; ++ch)
+            {
+                BYTE lo = encode_sample(&states[ch], px[ch]);
+                BYTE hi = encode_sample(&states[ch], px[nChannels + ch]);
+                pBlock[4 * ch + i] = BYTE(lo | (hi << 4));
+            }
+        }
+    }
+    CopyMemory(pStates, states, nChannels * sizeof(IMA_ADPCM_STATE));
+}
+
+BOOL ima_adpcm_decode_block(const IMAADPCMWAVEFORMAT *pwfx, const BYTE *pBlock,
+                            INT16 *pSamples)
+{
+    const WORD nChannels = pwfx->wfx.nChannels;
+    IMA_ADPCM_STATE states[ImaAdpcmEncoder::MAX_CHANNELS];
+    if (nChannels == 0 || nChannels > ImaAdpcmEncoder::MAX_CHANNELS)
+        return FALSE;
+
+    for (WORD ch = 0; ch < nChannels; ++ch)
+    {
+        states[ch].predictor = INT16(pBlock[0] | (pBlock[1] << 8));
+        states[ch].index = pBlock[2];
+        if (states[ch].index > 88)
+            return FALSE;
+        pSamples[ch] = INT16(states[ch].predictor);
+        pBlock += 4;
+    }
+
+    const DWORD nGroups = (pwfx->wSamplesPerBlock - 1) / 8;
+    INT16 *px = pSamples + nChannels;
+    for (DWORD g = 0; g < nGroups; ++g, px += 8 * nChannels)
+    {
+        for (WORD ch = 0; ch < nChannels; ++ch)
+        {
+            IMA_ADPCM_STATE *pState = &states[ch];
+            INT16 *p = px + ch;
+            for (int i = 0; i < 4; ++i, p += 2 * nChannels)
+            {
+                BYTE b = *pBlock++;
+                p[0] = decode_sample(pState, BYTE(b & 15));
+                p[nChannels] = decode_sample(pState, BYTE(b >> 4));
+            }
+        }
+    }
+    return TRUE;
+}
+
+ImaAdpcmEncoder::ImaAdpcmEncoder()
+    : m_nPending(0)
+    , m_bVerify(FALSE)
+    , m_signal(0)
+    , m_noise(0)
+    , m_nFrames(0)
+    , m_cbInput(0)
+    , m_cbOutput(0)
+    , m_bOK(FALSE)
+{
+    ZeroMemory(&m_wfx, sizeof(m_wfx));
+    ZeroMemory(m_states, sizeof(m_states));
+}
+
+ImaAdpcmEncoder::~ImaAdpcmEncoder()
+{
+    Close();
+}
+
+void ImaAdpcmEncoder::SetVerification(BOOL bVerify)
+{
+    m_bVerify = bVerify;
+}
+
+BOOL ImaAdpcmEncoder::Open(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx)
+{
+    Close();
+
+    if (!is_ima_adpcm_input(pwfx))
+        return FALSE;
+
+    get_ima_adpcm_format(pwfx, &m_wfx);
+    if (!m_writer.Open(pszFileName, &m_wfx.wfx))
+        return FALSE;
+
+    ZeroMemory(m_states, sizeof(m_states));
+    m_pending.resize(m_wfx.wSamplesPerBlock * m_wfx.wfx.nChannels);
+    m_nPending = 0;
+    m_block.resize(m_wfx.wfx.nBlockAlign);
+    if (m_bVerify)
+        m_decoded.resize(m_pending.size());
+    m_signal = m_noise = 0;
+    m_nFrames = 0;
+    m_cbInput = m_cbOutput = 0;
+    m_bOK = TRUE;
+    return TRUE;
+}
+
+void ImaAdpcmEncoder::EncodeBlock()
+{
+    ima_adpcm_encode_block(&m_wfx, m_pending.data(), m_states, m_block.data());
+    m_bOK = m_writer.Write(m_block.data(), m_wfx.wfx.nBlockAlign);
+    m_cbOutput += m_wfx.wfx.nBlockAlign;
+
+    if (m_bVerify && ima_adpcm_decode_block(&m_wfx, m_block.data(), m_decoded.data()))
+    {
+        const DWORD nSamples = m_nPending * m_wfx.wfx.nChannels;
+        for (DWORD i = 0; i < nSamples; ++i)
+        {
+            double x = m_pending[i], e = x - m_decoded[i];
+            m_signal += x * x;
+            m_noise += e * e;
+        }
+    }
+    m_nPending = 0;
+}
+
+BOOL ImaAdpcmEncoder::Write(LPCVOID pvData, DWORD cbData)
+{
+    if (!m_writer.IsOpen() || !m_bOK)
+        return FALSE;
+
+    const WORD nChannels = m_wfx.wfx.nChannels;
+    const INT16 *px = reinterpret_cast<const INT16 *>(pvData);
+    DWORD nFrames = cbData / (nChannels * sizeof(INT16));
+    m_cbInput += cbData;
+    m_nFrames += nFrames;
+    while (m_bOK && nFrames > 0)
+    {
+        DWORD n = m_wfx.wSamplesPerBlock - m_nPending;
+        if (n > nFrames)
+            n = nFrames;
+        CopyMemory(&m_pending[m_nPending * nChannels], px, n * nChannels * sizeof(INT16));
+        m_nPending += n;
+        px += n * nChannels;
+        nFrames -= n;
+
+        if (m_nPending == m_wfx.wSamplesPerBlock)
+            EncodeBlock();
+    }
+    return m_bOK;
+}
+
+BOOL ImaAdpcmEncoder::Close()
+{
+    if (!m_writer.IsOpen())
+        return FALSE;
+
+    // The last block holds its last frame to the end.
+    BOOL bOK = m_bOK;
+    if (bOK && m_nPending > 0)
+    {
+        const WORD nChannels = m_wfx.wfx.nChannels;
+        const DWORD nFrames = m_nPending;
+        for (DWORD i = nFrames; i < m_wfx.wSamplesPerBlock; ++i)
+        {
+            CopyMemory(&m_pending[i * nChannels], &m_pending[(nFrames - 1) * nChannels],
+                       nChannels * sizeof(INT16));
+        }
+        EncodeBlock();
+        bOK = m_bOK;
+    }
+
+    m_writer.SetSampleLength(m_nFrames);
+    if (!m_writer.Close())
+        bOK = FALSE;
+    m_bOK = FALSE;
+    return bOK;
+}
+
+double ImaAdpcmEncoder::GetSnr() const
+{
+    if (m_noise <= 0)
+        return (m_signal > 0) ? 200.0 : 0.0;
+    return 10 * std::log10(m_signal / m_noise);
+}
+
+BOOL save_ima_adpcm_file(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx,
+                         const SegmentedBuffer& data)
+{
+    ImaAdpcmEncoder encoder;
+    if (!encoder.Open(pszFileName, pwfx))
+        return FALSE;
+
+    BOOL bOK = TRUE;
+    for (DWORD i = 0; bOK && i < data.GetSegmentCount(); ++i)
+    {
+        DWORD cb;
+        const BYTE *pb = data.GetSegment(i, &cb);
+        bOK = encoder.Write(pb, cb);
+    }
+    return encoder.Close() && bOK;
+}
+
+BOOL ima_adpcm_encode_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput,
+                                double *pRealtime, double *pRatio, double *pSnr)
+{
+    WaveReader reader;
+    if (!reader.Open(pszInput))
+        return FALSE;
+
+    ImaAdpcmEncoder encoder;
+    encoder.SetVerification(TRUE);
+    const WAVEFORMATEX *pwfx = reader.GetFormat();
+    if (!encoder.Open(pszOutput, pwfx))
+        return FALSE;
+
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    ::QueryPerformanceFrequency(&liFreq);
+    ::QueryPerformanceCounter(&liStart);
+
+    const ULONGLONG nTotal = reader.GetFrameCount();
+    const DWORD nChunk = 1024 * 1024;
+    BOOL bOK = TRUE;
+    for (ULONGLONG nFrame = 0; bOK && nFrame < nTotal; nFrame += nChunk)
+    {
+        DWORD nFrames = (nTotal - nFrame < nChunk) ? DWORD(nTotal - nFrame) : nChunk;
+        const BYTE *pb = reader.GetFrames(nFrame, nFrames);
+        bOK = pb && encoder.Write(pb, nFrames * pwfx->nBlockAlign);
+    }
+    if (!encoder.Close())
+        bOK = FALSE;
+
+    ::QueryPerformanceCounter(&liEnd);
+    double seconds = double(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+    double audio = double(nTotal) / pwfx->nSamplesPerSec;
+    *pRealtime = (seconds > 0) ? audio / seconds : 0;
+    *pRatio = encoder.GetInputSize() ? double(encoder.GetOutputSize()) / encoder.GetInputSize() : 0;
+    *pSnr = encoder.GetSnr();
+    return bOK;
+}
+
+BOOL ima_adpcm_decode_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput, ULONGLONG *pnFrames)
+{
+    *pnFrames = 0;
+
+    WaveReader reader;
+    if (!reader.Open(pszInput) || reader.GetFormat()->wFormatTag != WAVE_FORMAT_IMA_ADPCM ||
+        reader.GetFormat()->cbSize < sizeof(WORD))
+    {
+        return FALSE;
+    }
+
+    // WaveReader counts the blocks as frames.
+    const IMAADPCMWAVEFORMAT *pwfx =
+        reinterpret_cast<const IMAADPCMWAVEFORMAT *>(reader.GetFormat());
+    const WORD nChannels = pwfx->wfx.nChannels;
+    const DWORD nPerBlock = pwfx->wSamplesPerBlock;
+    if (nChannels == 0 || nChannels > ImaAdpcmEncoder::MAX_CHANNELS || nPerBlock == 0 ||
+        pwfx->wfx.nBlockAlign < 4 * nChannels + (nPerBlock - 1) / 2 * nChannels)
+    {
+        return FALSE;
+    }
+
+    const ULONGLONG nBlocks = reader.GetFrameCount();
+    ULONGLONG nLength = nBlocks * nPerBlock;
+    ULONGLONG cbFact;
+    const WAVE_CHUNK *pFact = reader.FindChunk("fact");
+    const BYTE *pbFact = pFact ? reader.GetChunkData(pFact, &cbFact) : NULL;
+    if (pbFact && cbFact >= sizeof(DWORD))
+    {
+        DWORD nFact;
+        CopyMemory(&nFact, pbFact, sizeof(nFact));
+        if (nFact < nLength)
+            nLength = nFact;
+    }
+
+    WAVEFORMATEX wfx;
+    ZeroMemory(&wfx, sizeof(wfx));
+    wfx.wFormatTag = WAVE_FORMAT_PCM;
+    wfx.nChannels = nChannels;
+    wfx.nSamplesPerSec = pwfx->wfx.nSamplesPerSec;
+    wfx.wBitsPerSample = 16;
+    wfx.nBlockAlign = WORD(nChannels * sizeof(INT16));
+    wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
+
+    WaveWriter writer;
+    writer.SetPreallocation(nLength * wfx.nBlockAlign);
+    if (!writer.Open(pszOutput, &wfx))
+        return FALSE;
+
+    std::vector<INT16> samples(DECODE_BLOCKS * nPerBlock * nChannels);
+    const DWORD cbBlock = pwfx->wfx.nBlockAlign;
+    BOOL bOK = TRUE;
+    ULONGLONG nLeft = nLength;
+    for (ULONGLONG iBlock = 0; bOK && nLeft > 0; iBlock += DECODE_BLOCKS)
+    {
+        DWORD n = (nBlocks - iBlock < DECODE_BLOCKS) ? DWORD(nBlocks - iBlock) : DECODE_BLOCKS;
+        const BYTE *pb = reader.GetFrames(iBlock, n);
+        if (pb == NULL)
+        {
+            bOK = FALSE;
+            break;
+        }
+        for (DWORD i = 0; bOK && i < n; ++i)
+            bOK = ima_adpcm_decode_block(pwfx, pb + i * cbBlock, &samples[i * nPerBlock * nChannels]);
+
+        DWORD nFrames = n * nPerBlock;
+        if (nFrames > nLeft)
+            nFrames = DWORD(nLeft);
+        if (bOK)
+            bOK = writer.Write(samples.data(), nFrames * wfx.nBlockAlign);
+        nLeft -= nFrames;
+        *pnFrames += nFrames;
+    }
+    return writer.Close() && bOK;
+}
@@ -0,0 +1,109 @@
+#ifndef IMA_ADPCM_HPP_
+#define IMA_ADPCM_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include <vector>
+#include "WaveWriter.hpp"
+#include "SegmentedBuffer.hpp"
+
+// The coder of one channel between samples.
+struct IMA_ADPCM_STATE
+{
+    INT predictor;
+    INT index;                  // into the step table, 0 to 88
+};
+
+// The IMA ADPCM format of 16-bit PCM of pwfxPcm's rate and channels, in
+// blocks of 256 bytes per channel per 11025 Hz, as the Windows codec
+// makes them. 4 bits a sample, so about a quarter of the PCM.
+void get_ima_adpcm_format(const WAVEFORMATEX *pwfxPcm, IMAADPCMWAVEFORMAT *pwfx);
+// Whether the PCM can be encoded: 16-bit, up to MAX_CHANNELS channels, at
+// a rate whose block size and samples per block fit in a WORD.
+BOOL is_ima_adpcm_input(const WAVEFORMATEX *pwfx);
+
+// Encodes nSamplesPerBlock interleaved frames into a block of
+// pwfx->wfx.nBlockAlign bytes: per channel a header of the first sample
+// and the step index, then per channel in turn 4 bytes of 8 samples, low
+// nibble first. pStates carry the step indexes from block to block.
+void ima_adpcm_encode_block(const IMAADPCMWAVEFORMAT *pwfx, const INT16 *pSamples,
+                            IMA_ADPCM_STATE *pStates, BYTE *pBlock);
+// The inverse, into wSamplesPerBlock interleaved frames. FALSE for a
+// damaged header.
+BOOL ima_adpcm_decode_block(const IMAADPCMWAVEFORMAT *pwfx, const BYTE *pBlock,
+                            INT16 *pSamples);
+
+// Writes an IMA ADPCM WAVE file incrementally from 16-bit PCM. Each block
+// is encoded as soon as its frames are in, on the caller's thread, at a
+// few operations a sample; the last one is padded on Close, and the
+// "fact" chunk says how many frames are real.
+//
+// With verification each block is decoded again as it is written and
+// compared with its input; GetSnr tells how faithful the file is.
+class ImaAdpcmEncoder
+{
+public:
+    enum { MAX_CHANNELS = 8 };
+
+    ImaAdpcmEncoder();
+    ~ImaAdpcmEncoder();
+
+    // Takes effect on the next Open.
+    void SetVerification(BOOL bVerify);
+
+    BOOL Open(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx);
+    BOOL Write(LPCVOID pvData, DWORD cbData);
+    BOOL Close();
+
+    BOOL IsOpen() const
+    {
+        return m_writer.IsOpen();
+    }
+    ULONGLONG GetInputSize() const
+    {
+        return m_cbInput;
+    }
+    ULONGLONG GetOutputSize() const
+    {
+        return m_cbOutput;
+    }
+    // The signal to the coding error in dB, with verification.
+    double GetSnr() const;
+
+protected:
+    WaveWriter m_writer;
+    IMAADPCMWAVEFORMAT m_wfx;
+    IMA_ADPCM_STATE m_states[MAX_CHANNELS];
+    std::vector<INT16> m_pending;       // a block of input
+    DWORD m_nPending;                   // frames in it
+    std::vector<BYTE> m_block;
+    BOOL m_bVerify;
+    std::vector<INT16> m_decoded;
+    double m_signal;
+    double m_noise;
+    ULONGLONG m_nFrames;
+    ULONGLONG m_cbInput;
+    ULONGLONG m_cbOutput;
+    BOOL m_bOK;
+
+    void EncodeBlock();
+
+    ImaAdpcmEncoder(const ImaAdpcmEncoder&);
+    ImaAdpcmEncoder& operator=(const ImaAdpcmEncoder&);
+};
+
+// The IMA ADPCM counterpart of save_pcm_wave_file.
+BOOL save_ima_adpcm_file(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx,
+                         const SegmentedBuffer& data);
+
+// Encodes a 16-bit WAV file offline. pRealtime receives the speed in
+// multiples of real time, pRatio the size of the output over the input,
+// and pSnr the signal to the coding error in dB.
+BOOL ima_adpcm_encode_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput,
+                                double *pRealtime, double *pRatio, double *pSnr);
+// Decodes an IMA ADPCM WAV file to 16-bit PCM, up to the length of its
+// "fact" chunk. pnFrames receives the frames decoded.
+BOOL ima_adpcm_decode_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput, ULONGLONG *pnFrames);
+
+#endif  // ndef IMA_ADPCM_HPP_
@@ -0,0 +1,665 @@
+#include "Loudness.hpp"
+#include "Convert.hpp"
+#include "WaveReader.hpp"
+#include "Simd.hpp"
+#include <cmath>
+#include <cstring>
+
+static const double PI = 3.14159265358979323846;
+
+// Frames measured at a time.
+#define LOUDNESS_CHUNK 1024
+// Frames read from a file at a time.
+#define LOUDNESS_READ_FRAMES (1024 * 1024)
+
+#define TP_PHASES 4
+#define TP_TAPS 12
+#define TP_HISTORY (TP_TAPS - 1)
+
+// Filter states below this are flushed to zero after each chunk, long
+// before a decay into denormals could slow the filter down.
+#define DENORMAL_GUARD 1e-15f
+
+static double to_lufs(double energy)
+{
+    return (energy > 0) ? -0.691 + 10 * std::log10(energy) : LOUDNESS_NONE;
+}
+
+static int get_bin(double lufs)
+{
+    int i = int(std::floor((lufs + 70) * 10));
+    if (i < 0)
+        return 0;
+    return (i < LOUDNESS_BINS) ? i : LOUDNESS_BINS - 1;
+}
+
+double get_true_peak_db(const LOUDNESS_INFO *pInfo)
+{
+    float peak = 0;
+    for (WORD ch = 0; ch < pInfo->nChannels; ++ch)
+    {
+        if (peak < pInfo->truePeak[ch])
+            peak = pInfo->truePeak[ch];
+    }
+    return (peak > 0) ? 20 * std::log10(peak) : LOUDNESS_NONE;
+}
+
+// Two transposed direct form II biquads in a row over lanes [iLane, iLane +
+// nLanes) of nFrames frames of nStride lanes. pSum receives the energy of
+// each lane.
+static void kweight_scalar(const float *k, float *pState, const float *px, DWORD nFrames,
+                           DWORD nStride, DWORD iLane, DWORD nLanes, float *pSum)
+{
+    for (DWORD lane = iLane; lane < iLane + nLanes; ++lane)
+    {
+        float z1 = pState[lane], z2 = pState[nStride + lane];
+        float w1 = pState[2 * nStride + lane], w2 = pState[3 * nStride + lane];
+        float sum = 0;
+        for (DWORD i = 0; i < nFrames; ++i)
+        {
+            float x = px[i * nStride + lane];
+            float y = k[0] * x + z1;
+            z1 = k[1] * x - k[3] * y + z2;
+            z2 = k[2] * x - k[4] * y;
+            float v = k[5] * y + w1;
+            w1 = k[6] * y - k[8] * v + w2;
+            w2 = k[7] * y - k[9] * v;
+            sum += v * v;
+        }
+        pState[lane] = z1;
+        pState[nStride + lane] = z2;
+        pState[2 * nStride + lane] = w1;
+        pState[3 * nStride + lane] = w2;
+        pSum[lane] = sum;
+    }
+}
+
+// The oversampled peak of n samples of px, after TP_HISTORY samples of
+// history before px.
+static float true_peak_scalar(const float *pTaps, const float *px, DWORD n, float peak)
+{
+    for (DWORD i = 0; i < n; ++i)
+    {
+        for (DWORD p = 0; p < TP_PHASES; ++p)
+        {
+            const float *h = pTaps + p * TP_TAPS;
+            const float *pz = px + i;
+            float y = 0;
+            for (DWORD k = 0; k < TP_TAPS; ++k)
+                y += h[k] * *(pz - k);
+            y = std::fabs(y);
+            if (peak < y)
+                peak = y;
+        }
+    }
+    return peak;
+}
+
+#ifdef SIMD_X86
+// nLanes is a multiple of 4.
+TARGET_SSE2
+static void kweight_sse2(const float *k, float *pState, const float *px, DWORD nFrames,
+                         DWORD nStride, DWORD iLane, DWORD nLanes, float *pSum)
+{
+    const __m128 b0 = _mm_set1_ps(k[0]), b1 = _mm_set1_ps(k[1]), b2 = _mm_set1_ps(k[2]);
+    const __m128 a1 = _mm_set1_ps(k[3]), a2 = _mm_set1_ps(k[4]);
+    const __m128 c0 = _mm_set1_ps(k[5]), c1 = _mm_set1_ps(k[6]), c2 = _mm_set1_ps(k[7]);
+    const __m128 d1 = _mm_set1_ps(k[8]), d2 = _mm_set1_ps(k[9]);
+    for (DWORD lane = iLane; lane < iLane + nLanes; lane += 4)
+    {
+        __m128 z1 = _mm_loadu_ps(pState + lane), z2 = _mm_loadu_ps(pState + nStride + lane);
+        __m128 w1 = _mm_loadu_ps(pState + 2 * nStride + lane);
+        __m128 w2 = _mm_loadu_ps(pState + 3 * nStride + lane);
+        __m128 sum = _mm_setzero_ps();
+        for (DWORD i = 0; i < nFrames; ++i)
+        {
+            __m128 x = _mm_loadu_ps(px + i * nStride + lane);
+            __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+            z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+            z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+            __m128 v = _mm_add_ps(_mm_mul_ps(c0, y), w1);
+            w1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(c1, y), _mm_mul_ps(d1, v)), w2);
+            w2 = _mm_sub_ps(_mm_mul_ps(c2, y), _mm_mul_ps(d2, v));
+            sum = _mm_add_ps(sum, _mm_mul_ps(v, v));
+        }
+        _mm_storeu_ps(pState + lane, z1);
+        _mm_storeu_ps(pState + nStride + lane, z2);
+        _mm_storeu_ps(pState + 2 * nStride + lane, w1);
+        _mm_storeu_ps(pState + 3 * nStride + lane, w2);
+        _mm_storeu_ps(pSum + lane, sum);
+    }
+}
+
+TARGET_SSE2
+static float true_peak_sse2(const float *pTaps, const float *px, DWORD n, float peak)
+{
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 m = _mm_set1_ps(peak);
+    DWORD i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        for (DWORD p = 0; p < TP_PHASES; ++p)
+        {
+            const float *h = pTaps + p * TP_TAPS;
+            __m128 y = _mm_setzero_ps();
+            for (DWORD k = 0; k < TP_TAPS; ++k)
+                y = _mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(h[k]), _mm_loadu_ps(px + i - k)));
+            m = _mm_max_ps(m, _mm_and_ps(y, mask));
+        }
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, m);
+    for (int j = 0; j < 4; ++j)
+    {
+        if (peak < lanes[j])
+            peak = lanes[j];
+    }
+    return true_peak_scalar(pTaps, px + i, n - i, peak);
+}
+
+// The groups of 8 lanes, then one of 4.
+TARGET_AVX2
+static void kweight_avx2(const float *k, float *pState, const float *px, DWORD nFrames,
+                         DWORD nStride, DWORD iLane, DWORD nLanes, float *pSum)
+{
+    const __m256 b0 = _mm256_set1_ps(k[0]), b1 = _mm256_set1_ps(k[1]);
+    const __m256 b2 = _mm256_set1_ps(k[2]);
+    const __m256 a1 = _mm256_set1_ps(k[3]), a2 = _mm256_set1_ps(k[4]);
+    const __m256 c0 = _mm256_set1_ps(k[5]), c1 = _mm256_set1_ps(k[6]);
+    const __m256 c2 = _mm256_set1_ps(k[7]);
+    const __m256 d1 = _mm256_set1_ps(k[8]), d2 = _mm256_set1_ps(k[9]);
+    DWORD lane = iLane;
+    for (; lane + 8 <= iLane + nLanes; lane += 8)
+    {
+        __m256 z1 = _mm256_loadu_ps(pState + lane);
+        __m256 z2 = _mm256_loadu_ps(pState + nStride + lane);
+        __m256 w1 = _mm256_loadu_ps(pState + 2 * nStride + lane);
+        __m256 w2 = _mm256_loadu_ps(pState + 3 * nStride + lane);
+        __m256 sum = _mm256_setzero_ps();
+        for (DWORD i = 0; i < nFrames; ++i)
+        {
+            __m256 x = _mm256_loadu_ps(px + i * nStride + lane);
+            __m256 y = _mm256_fmadd_ps(b0, x, z1);
+            z1 = _mm256_fnmadd_ps(a1, y, _mm256_fmadd_ps(b1, x, z2));
+            z2 = _mm256_fnmadd_ps(a2, y, _mm256_mul_ps(b2, x));
+            __m256 v = _mm256_fmadd_ps(c0, y, w1);
+            w1 = _mm256_fnmadd_ps(d1, v, _mm256_fmadd_ps(c1, y, w2));
+            w2 = _mm256_fnmadd_ps(d2, v, _mm256_mul_ps(c2, y));
+            sum = _mm256_fmadd_ps(v, v, sum);
+        }
+        _mm256_storeu_ps(pState + lane, z1);
+        _mm256_storeu_ps(pState + nStride + lane, z2);
+        _mm256_storeu_ps(pState + 2 * nStride + lane, w1);
+        _mm256_storeu_ps(pState + 3 * nStride + lane, w2);
+        _mm256_storeu_ps(pSum + lane, sum);
+    }
+    _mm256_zeroupper();
+
+    if (lane < iLane + nLanes)
+        kweight_sse2(k, pState, px, nFrames, nStride, lane, iLane + nLanes - lane, pSum);
+}
+
+TARGET_AVX2
+static float true_peak_avx2(const float *pTaps, const float *px, DWORD n, float peak)
+{
+    const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 m = _mm256_set1_ps(peak);
+    DWORD i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        for (DWORD p = 0; p < TP_PHASES; ++p)
+        {
+            const float *h = pTaps + p * TP_TAPS;
+            __m256 y = _mm256_mul_ps(_mm256_broadcast_ss(h), _mm256_loadu_ps(px + i));
+            for (DWORD k = 1; k < TP_TAPS; ++k)
+                y = _mm256_fmadd_ps(_mm256_broadcast_ss(h + k), _mm256_loadu_ps(px + i - k), y);
+            m = _mm256_max_ps(m, _mm256_and_ps(y, mask));
+        }
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, m);
+    _mm256_zeroupper();
+    for (int j = 0; j < 8; ++j)
+    {
+        if (peak < lanes[j])
+            peak = lanes[j];
+    }
+    return true_peak_scalar(pTaps, px + i, n - i, peak);
+}
+#endif
+
+typedef void (*KWEIGHT_PROC)(const float *k, float *pState, const float *px, DWORD nFrames,
+                             DWORD nStride, DWORD iLane, DWORD nLanes, float *pSum);
+typedef float (*TRUE_PEAK_PROC)(const float *pTaps, const float *px, DWORD n, float peak);
+
+static KWEIGHT_PROC get_kweight_proc()
+{
+#ifdef SIMD_X86
+    switch (get_simd_level())
+    {
+    case SIMD_AVX2:
+        return kweight_avx2;
+    case SIMD_SSE2:
+        return kweight_sse2;
+    default:
+        break;
+    }
+#endif
+    return kweight_scalar;
+}
+
+static TRUE_PEAK_PROC get_true_peak_proc()
+{
+#ifdef SIMD_X86
+    switch (get_simd_level())
+    {
+    case SIMD_AVX2:
+        return true_peak_avx2;
+    case SIMD_SSE2:
+        return true_peak_sse2;
+    default:
+        break;
+    }
+#endif
+    return true_peak_scalar;
+}
+
+// The K-weighting of BS.1770 at any rate: a high shelf for the head, then
+// the RLB high-pass, designed as libebur128 does from their analog
+// prototypes.
+static void get_kweighting(DWORD nSamplesPerSec, float *k)
+{
+    double f0 = 1681.974450955533;
+    double G = 3.999843853973347;
+    double Q = 0.7071752369554196;
+    double K = std::tan(PI * f0 / nSamplesPerSec);
+    double Vh = std::pow(10.0, G / 20);
+    double Vb = std::pow(Vh, 0.4996667741545416);
+    double a0 = 1 + K / Q + K * K;
+    k[0] = float((Vh + Vb * K / Q + K * K) / a0);
+    k[1] = float(2 * (K * K - Vh) / a0);
+    k[2] = float((Vh - Vb * K / Q + K * K) / a0);
+    k[3] = float(2 * (K * K - 1) / a0);
+    k[4] = float((1 - K / Q + K * K) / a0);
+
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = std::tan(PI * f0 / nSamplesPerSec);
+    a0 = 1 + K / Q + K * K;
+    k[5] = 1;
+    k[6] = -2;
+    k[7] = 1;
+    k[8] = float(2 * (K * K - 1) / a0);
+    k[9] = float((1 - K / Q + K * K) / a0);
+}
+
+// A Hann-windowed sinc of 48 taps cut at the input's Nyquist frequency,
+// split into 4 phases of unit gain.
+static void get_true_peak_taps(float *pTaps)
+{
+    const DWORD n = TP_PHASES * TP_TAPS;
+    double h[TP_PHASES * TP_TAPS];
+    for (DWORD j = 0; j < n; ++j)
+    {
+        double t = (j - (n - 1) / 2.0) / TP_PHASES;
+        double sinc = (t == 0) ? 1 : std::sin(PI * t) / (PI * t);
+        h[j] = sinc * (0.5 - 0.5 * std::cos(2 * PI * (j + 1) / (n + 1)));
+    }
+    for (DWORD p = 0; p < TP_PHASES; ++p)
+    {
+        double sum = 0;
+        for (DWORD k = 0; k < TP_TAPS; ++k)
+            sum += h[p + k * TP_PHASES];
+        for (DWORD k = 0; k < TP_TAPS; ++k)
+            pTaps[p * TP_TAPS + k] = float(h[p + k * TP_PHASES] / sum);
+    }
+}
+
+// BS.1770 weighs the channels behind and beside the listener by 1.41 and
+// leaves out the LFE.
+static void get_channel_weights(const WAVEFORMATEX *pwfx, float *pWeights)
+{
+    DWORD dwMask = 0;
+    if (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+        pwfx->cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX))
+    {
+        dwMask = reinterpret_cast<const WAVEFORMATEXTENSIBLE *>(pwfx)->dwChannelMask;
+    }
+    if (dwMask == 0)
+    {
+        switch (pwfx->nChannels)
+        {
+        case 5:     // 5.0
+            dwMask = 0x37;
+            break;
+        case 6:     // 5.1
+            dwMask = 0x3F;
+            break;
+        case 8:     // 7.1
+            dwMask = 0x63F;
+            break;
+        default:
+            break;
+        }
+    }
+
+    const DWORD dwSurround = SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT | SPEAKER_BACK_CENTER |
+                             SPEAKER_SIDE_LEFT | SPEAKER_SIDE_RIGHT;
+    for (WORD ch = 0; ch < METER_MAX_CHANNELS; ++ch)
+    {
+        DWORD dwSpeaker = dwMask & (~dwMask + 1);
+        dwMask &= ~dwSpeaker;
+        if (dwSpeaker == SPEAKER_LOW_FREQUENCY)
+            pWeights[ch] = 0;
+        else if (dwSpeaker & dwSurround)
+            pWeights[ch] = 1.41f;
+        else
+            pWeights[ch] = 1;
+    }
+}
+
+LoudnessMeter::LoudnessMeter()
+    : m_format(SAMPLE_FORMAT_UNKNOWN)
+    , m_nChannels(0)
+    , m_nStride(0)
+    , m_nBlockAlign(0)
+    , m_nSubBlockFrames(0)
+    , m_nSubBlockLeft(0)
+    , m_nSubBlocks(0)
+    , m_nSequence(0)
+{
+    ZeroMemory(m_weights, sizeof(m_weights));
+    ZeroMemory(m_coeffs, sizeof(m_coeffs));
+    ZeroMemory(m_taps, sizeof(m_taps));
+    ZeroMemory(m_history, sizeof(m_history));
+    ZeroMemory(m_channelEnergy, sizeof(m_channelEnergy));
+    ZeroMemory(m_subBlocks, sizeof(m_subBlocks));
+    ZeroMemory(&m_blocks, sizeof(m_blocks));
+    ZeroMemory(&m_shortTerms, sizeof(m_shortTerms));
+    ZeroMemory(&m_info, sizeof(m_info));
+    m_published = m_info;
+}
+
+BOOL LoudnessMeter::Reset(const WAVEFORMATEX *pwfx)
+{
+    m_format = get_sample_format(pwfx);
+    if (m_format == SAMPLE_FORMAT_UNKNOWN || pwfx->nChannels == 0 ||
+        pwfx->nSamplesPerSec < 10)
+    {
+        return FALSE;
+    }
+
+    m_nChannels = pwfx->nChannels;
+    m_nBlockAlign = pwfx->nBlockAlign;
+    const WORD nMeasured = (m_nChannels < METER_MAX_CHANNELS) ? m_nChannels : METER_MAX_CHANNELS;
+    m_nStride = (nMeasured + 3) & ~3;
+    get_channel_weights(pwfx, m_weights);
+    get_kweighting(pwfx->nSamplesPerSec, m_coeffs);
+    get_true_peak_taps(m_taps);
+
+    // The padding lanes stay zero.
+    m_interleaved.resize(LOUDNESS_CHUNK * m_nChannels);
+    m_lanes.assign(LOUDNESS_CHUNK * m_nStride, 0.0f);
+    m_filterState.assign(4 * m_nStride, 0.0f);
+    m_sums.assign(m_nStride, 0.0f);
+    m_plane.assign(TP_HISTORY + LOUDNESS_CHUNK, 0.0f);
+    ZeroMemory(m_history, sizeof(m_history));
+
+    m_nSubBlockFrames = (pwfx->nSamplesPerSec + 5) / 10;
+    m_nSubBlockLeft = m_nSubBlockFrames;
+    ZeroMemory(m_channelEnergy, sizeof(m_channelEnergy));
+    ZeroMemory(m_subBlocks, sizeof(m_subBlocks));
+    m_nSubBlocks = 0;
+    ZeroMemory(&m_blocks, sizeof(m_blocks));
+    ZeroMemory(&m_shortTerms, sizeof(m_shortTerms));
+
+    ZeroMemory(&m_info, sizeof(m_info));
+    m_info.nChannels = nMeasured;
+    m_info.momentary = m_info.shortTerm = m_info.integrated = LOUDNESS_NONE;
+    m_info.maxMomentary = m_info.maxShortTerm = LOUDNESS_NONE;
+    Publish();
+    return TRUE;
+}
+
+void LoudnessMeter::Update(const BYTE *pb, DWORD nFrames)
+{
+    const WORD nMeasured = m_info.nChannels;
+    while (nFrames > 0)
+    {
+        DWORD n = (nFrames < LOUDNESS_CHUNK) ? nFrames : LOUDNESS_CHUNK;
+        if (n > m_nSubBlockLeft)
+            n = m_nSubBlockLeft;
+
+        if (pb == NULL)
+        {
+            ZeroMemory(m_lanes.data(), n * m_nStride * sizeof(float));
+        }
+        else if (m_nChannels == m_nStride)
+        {
+            convert_to_float(m_format, pb, n * m_nChannels, m_lanes.data());
+            pb += n * m_nBlockAlign;
+        }
+        else
+        {
+            convert_to_float(m_format, pb, n * m_nChannels, m_interleaved.data());
+            const float *pSrc = m_interleaved.data();
+            float *pDst = m_lanes.data();
+            for (DWORD i = 0; i < n; ++i)
+            {
+                for (WORD ch = 0; ch < nMeasured; ++ch)
+                    pDst[ch] = pSrc[ch];
+                pSrc += m_nChannels;
+                pDst += m_nStride;
+            }
+            pb += n * m_nBlockAlign;
+        }
+
+        Measure(n);
+        m_info.nFrames += n;
+        nFrames -= n;
+        m_nSubBlockLeft -= n;
+        if (m_nSubBlockLeft == 0)
+            EndSubBlock();
+    }
+}
+
+void LoudnessMeter::Measure(DWORD nFrames)
+{
+    const WORD nMeasured = m_info.nChannels;
+
+    KWEIGHT_PROC kweight = get_kweight_proc();
+    kweight(m_coeffs, m_filterState.data(), m_lanes.data(), nFrames, m_nStride,
+            0, m_nStride, m_sums.data());
+    for (WORD ch = 0; ch < nMeasured; ++ch)
+        m_channelEnergy[ch] += m_sums[ch];
+    for (size_t i = 0; i < m_filterState.size(); ++i)
+    {
+        if (std::fabs(m_filterState[i]) < DENORMAL_GUARD)
+            m_filterState[i] = 0;
+    }
+
+    TRUE_PEAK_PROC truePeak = get_true_peak_proc();
+    float *pPlane = m_plane.data();
+    for (WORD ch = 0; ch < nMeasured; ++ch)
+    {
+        CopyMemory(pPlane, m_history[ch], TP_HISTORY * sizeof(float));
+        const float *pSrc = m_lanes.data() + ch;
+        float peak = m_info.samplePeak[ch];
+        for (DWORD i = 0; i < nFrames; ++i)
+        {
+            float x = pSrc[i * m_nStride];
+            pPlane[TP_HISTORY + i] = x;
+            x = std::fabs(x);
+            if (peak < x)
+                peak = x;
+        }
+        m_info.samplePeak[ch] = peak;
+
+        // The interpolator's phases fall between the samples.
+        if (peak < m_info.truePeak[ch])
+            peak = m_info.truePeak[ch];
+        m_info.truePeak[ch] = truePeak(m_taps, pPlane + TP_HISTORY, nFrames, peak);
+        CopyMemory(m_history[ch], pPlane + nFrames, TP_HISTORY * sizeof(float));
+    }
+}
+
+static void add_to_histogram(ULONGLONG *pCount, double *pEnergy, ULONGLONG *pCounts,
+                             double *pEnergies, double energy)
+{
+    int i = get_bin(to_lufs(energy));
+    pCounts[i]++;
+    pEnergies[i] += energy;
+    (*pCount)++;
+    *pEnergy += energy;
+}
+
+void LoudnessMeter::EndSubBlock()
+{
+    double energy = 0;
+    for (WORD ch = 0; ch < m_info.nChannels; ++ch)
+    {
+        energy += m_weights[ch] * m_channelEnergy[ch];
+        m_channelEnergy[ch] = 0;
+    }
+    m_subBlocks[m_nSubBlocks % ARRAYSIZE(m_subBlocks)] = energy / m_nSubBlockFrames;
+    ++m_nSubBlocks;
+    m_nSubBlockLeft = m_nSubBlockFrames;
+
+    // The mean of the last 4 sub-blocks and of the last 30.
+    double sum = 0;
+    for (ULONGLONG i = 1; i <= 30 && i <= m_nSubBlocks; ++i)
+    {
+        sum += m_subBlocks[(m_nSubBlocks - i) % ARRAYSIZE(m_subBlocks)];
+        if (i == 4)
+        {
+            m_info.momentary = to_lufs(sum / 4);
+            if (m_info.maxMomentary < m_info.momentary)
+                m_info.maxMomentary = m_info.momentary;
+            if (m_info.momentary > -70)
+            {
+                add_to_histogram(&m_blocks.nCount, &m_blocks.energy, m_blocks.counts,
+                                 m_blocks.energies, sum / 4);
+            }
+        }
+        else if (i == 30)
+        {
+            m_info.shortTerm = to_lufs(sum / 30);
+            if (m_info.maxShortTerm < m_info.shortTerm)
+                m_info.maxShortTerm = m_info.shortTerm;
+            if (m_info.shortTerm > -70)
+            {
+                add_to_histogram(&m_shortTerms.nCount, &m_shortTerms.energy,
+                                 m_shortTerms.counts, m_shortTerms.energies, sum / 30);
+            }
+        }
+    }
+
+    // The integrated loudness is that of the blocks within 10 LU of the
+    // loudness of all the blocks over the absolute gate, to a bin of 0.1 LU.
+    m_info.integrated = LOUDNESS_NONE;
+    if (m_blocks.nCount)
+    {
+        int iGate = get_bin(to_lufs(m_blocks.energy / m_blocks.nCount) - 10);
+        ULONGLONG nCount = 0;
+        double energy = 0;
+        for (int i = iGate; i < LOUDNESS_BINS; ++i)
+        {
+            nCount += m_blocks.counts[i];
+            energy += m_blocks.energies[i];
+        }
+        if (nCount)
+            m_info.integrated = to_lufs(energy / nCount);
+    }
+
+    // The range is from the 10th to the 95th percentile of the short-term
+    // loudness within 20 LU of that of all the windows over the gate.
+    m_info.range = 0;
+    if (m_shortTerms.nCount)
+    {
+        int iGate = get_bin(to_lufs(m_shortTerms.energy / m_shortTerms.nCount) - 20);
+        ULONGLONG nCount = 0;
+        for (int i = iGate; i < LOUDNESS_BINS; ++i)
+            nCount += m_shortTerms.counts[i];
+        if (nCount)
+        {
+            ULONGLONG nLow = ULONGLONG((nCount - 1) * 0.10);
+            ULONGLONG nHigh = ULONGLONG((nCount - 1) * 0.95);
+            int iLow = -1, iHigh = -1;
+            ULONGLONG nSeen = 0;
+            for (int i = iGate; i < LOUDNESS_BINS && iHigh < 0; ++i)
+            {
+                nSeen += m_shortTerms.counts[i];
+                if (iLow < 0 && nSeen > nLow)
+                    iLow = i;
+                if (nSeen > nHigh)
+                    iHigh = i;
+            }
+            m_info.range = double(iHigh - iLow) / 10;
+        }
+    }
+
+    Publish();
+}
+
+void LoudnessMeter::Publish()
+{
+    const DWORD nSequence = m_nSequence.load(std::memory_order_relaxed);
+    m_nSequence.store(nSequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_published = m_info;
+    m_nSequence.store(nSequence + 2, std::memory_order_release);
+}
+
+void LoudnessMeter::GetState(LOUDNESS_INFO *pInfo) const
+{
+    *pInfo = m_info;
+}
+
+void LoudnessMeter::GetInfo(LOUDNESS_INFO *pInfo) const
+{
+    for (;;)
+    {
+        const DWORD nSequence = m_nSequence.load(std::memory_order_acquire);
+        if (nSequence & 1)
+        {
+            ::YieldProcessor();
+            continue;
+        }
+
+        *pInfo = m_published;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_nSequence.load(std::memory_order_relaxed) == nSequence)
+            return;
+    }
+}
+
+BOOL measure_wave_loudness(LPCTSTR pszFileName, LOUDNESS_INFO *pInfo)
+{
+    ZeroMemory(pInfo, sizeof(*pInfo));
+
+    WaveReader reader;
+    if (!reader.Open(pszFileName))
+        return FALSE;
+
+    LoudnessMeter meter;
+    if (!meter.Reset(reader.GetFormat()))
+        return FALSE;
+
+    const ULONGLONG nTotal = reader.GetFrameCount();
+    for (ULONGLONG nFrame = 0; nFrame < nTotal; )
+    {
+        ULONGLONG nLeft = nTotal - nFrame;
+        DWORD nFrames = (nLeft < LOUDNESS_READ_FRAMES) ? DWORD(nLeft) : LOUDNESS_READ_FRAMES;
+        const BYTE *pb = reader.GetFrames(nFrame, nFrames);
+        if (pb == NULL)
+            return FALSE;
+
+        meter.Update(pb, nFrames);
+        nFrame += nFrames;
+    }
+
+    meter.GetState(pInfo);
+    return TRUE;
+}
@@ -0,0 +1,116 @@
+#ifndef LOUDNESS_HPP_
+#define LOUDNESS_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include <atomic>
+#include <vector>
+#include "Meter.hpp"
+
+// A loudness not measured yet, or below the absolute gate of -70 LUFS.
+#define LOUDNESS_NONE (-200.0)
+
+// The histograms of the gated loudness: bins of 0.1 LU from -70 to +30
+// LUFS, as libebur128 keeps them.
+#define LOUDNESS_BINS 1000
+
+// What a LoudnessMeter has measured since Reset, as ITU-R BS.1770-4 and
+// EBU R 128 define it. Loudness is in LUFS and the range in LU. Peaks are
+// linear, on the scale of METER_LEVELS.
+struct LOUDNESS_INFO
+{
+    ULONGLONG nFrames;
+    WORD nChannels;                     // measured, up to METER_MAX_CHANNELS
+    double momentary;                   // over the last 400 ms
+    double shortTerm;                   // over the last 3 s
+    double integrated;                  // gated, over everything
+    double range;                       // LRA, as EBU Tech 3342
+    double maxMomentary;
+    double maxShortTerm;
+    float truePeak[METER_MAX_CHANNELS]; // 4x oversampled
+    float samplePeak[METER_MAX_CHANNELS];
+};
+
+// The highest true peak of all the channels in dBTP, LOUDNESS_NONE for
+// silence.
+double get_true_peak_db(const LOUDNESS_INFO *pInfo);
+
+// Measures loudness and true peak incrementally, on the capture thread or
+// over a file. The K-weighting runs as two biquads on all the channels at
+// once, a channel per SIMD lane, and the true peak through a 4x polyphase
+// interpolator, several frames per SIMD step, with the kernels of
+// get_simd_level(). The 400 ms blocks overlap by 300 ms, so only the
+// energies of the last 3 s of 100 ms sub-blocks are kept; the gated
+// values come from histograms, so hours of audio take no more memory
+// than a second.
+//
+// The result is published every 100 ms under a sequence lock, as a
+// LevelMeter publishes its snapshot, for readers on any thread.
+class LoudnessMeter
+{
+public:
+    LoudnessMeter();
+
+    // Not thread-safe. pwfx is the format of the frames to come. The
+    // weights of the channels follow its channel mask, or the usual
+    // layout of its channel count: an LFE is left out and the surround
+    // channels weigh 1.41.
+    BOOL Reset(const WAVEFORMATEX *pwfx);
+
+    // Producer side. NULL measures nFrames of silence.
+    void Update(const BYTE *pb, DWORD nFrames);
+    // Producer side: everything so far, up to the last frame.
+    void GetState(LOUDNESS_INFO *pInfo) const;
+
+    // Any thread: the state as of the last 100 ms.
+    void GetInfo(LOUDNESS_INFO *pInfo) const;
+
+protected:
+    struct HISTOGRAM
+    {
+        ULONGLONG nCount;
+        double energy;
+        ULONGLONG counts[LOUDNESS_BINS];
+        double energies[LOUDNESS_BINS];
+    };
+
+    SAMPLE_FORMAT m_format;
+    WORD m_nChannels;                   // of the frames
+    DWORD m_nStride;                    // lanes, whole SIMD vectors
+    float m_weights[METER_MAX_CHANNELS];
+    DWORD m_nBlockAlign;
+    float m_coeffs[10];                 // b0 b1 b2 a1 a2 of the two stages
+    float m_taps[48];                   // 4 phases of 12
+
+    // The producer's.
+    std::vector<float> m_interleaved;
+    std::vector<float> m_lanes;         // the measured channels at m_nStride
+    std::vector<float> m_filterState;   // 4 planes of m_nStride
+    std::vector<float> m_sums;
+    std::vector<float> m_plane;         // the history, then one channel
+    float m_history[METER_MAX_CHANNELS][11];
+    DWORD m_nSubBlockFrames;
+    DWORD m_nSubBlockLeft;
+    double m_channelEnergy[METER_MAX_CHANNELS];
+    double m_subBlocks[30];             // the last 3 s, a ring
+    ULONGLONG m_nSubBlocks;
+    HISTOGRAM m_blocks;                 // the 400 ms blocks over -70 LUFS
+    HISTOGRAM m_shortTerms;             // the 3 s windows over -70 LUFS
+    LOUDNESS_INFO m_info;
+
+    std::atomic<DWORD> m_nSequence;     // odd while m_published changes
+    LOUDNESS_INFO m_published;
+
+    void Measure(DWORD nFrames);
+    void EndSubBlock();
+    void Publish();
+
+    LoudnessMeter(const LoudnessMeter&);
+    LoudnessMeter& operator=(const LoudnessMeter&);
+};
+
+// Measures a whole WAVE file on the caller's thread, through a WaveReader.
+BOOL measure_wave_loudness(LPCTSTR pszFileName, LOUDNESS_INFO *pInfo);
+
+#endif  // ndef LOUDNESS_HPP_
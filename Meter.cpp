@@ -0,0 +1,490 @@
+#include "Meter.hpp"
+#include "Simd.hpp"
+#include <mmreg.h>
+#include <cmath>
+
+SAMPLE_FORMAT get_sample_format(const WAVEFORMATEX *pwfx)
+{
+    // The first member of an extensible sub-format GUID is the format tag.
+    WORD wFormatTag = pwfx->wFormatTag;
+    if (wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+        pwfx->cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX))
+    {
+        wFormatTag = WORD(reinterpret_cast<const WAVEFORMATEXTENSIBLE *>(pwfx)->SubFormat.Data1);
+    }
+
+    switch (pwfx->wBitsPerSample)
+    {
+    case 8:
+        return SAMPLE_FORMAT_U8;
+    case 16:
+        return SAMPLE_FORMAT_S16;
+    case 24:
+        return SAMPLE_FORMAT_S24;
+    case 32:
+        if (wFormatTag == WAVE_FORMAT_IEEE_FLOAT)
+            return SAMPLE_FORMAT_F32;
+        return SAMPLE_FORMAT_S32;
+    default:
+        return SAMPLE_FORMAT_UNKNOWN;
+    }
+}
+
+// A 24-bit sample is loaded into the upper bytes of an INT, so it shares
+// the scale of a 32-bit sample.
+static const float s_scale_u8 = 1.0f / 128;
+static const float s_scale_s16 = 1.0f / 32768;
+static const float s_scale_s32 = 1.0f / 2147483648.0f;
+
+static float get_clip_level(SAMPLE_FORMAT format)
+{
+    switch (format)
+    {
+    case SAMPLE_FORMAT_U8:
+        return 127.0f / 128;
+    case SAMPLE_FORMAT_S16:
+        return 32767.0f / 32768;
+    case SAMPLE_FORMAT_S24:
+        return 8388607.0f / 8388608;
+    default:
+        return 1.0f;
+    }
+}
+
+static inline INT load_s24(const BYTE *pb)
+{
+    return INT(DWORD(pb[0]) << 8 | DWORD(pb[1]) << 16 | DWORD(pb[2]) << 24);
+}
+
+template <SAMPLE_FORMAT F>
+static inline float load_sample(const BYTE *pb, DWORD i)
+{
+    switch (F)
+    {
+    case SAMPLE_FORMAT_U8:
+        return (float(pb[i]) - 128) * s_scale_u8;
+    case SAMPLE_FORMAT_S16:
+        return reinterpret_cast<const SHORT *>(pb)[i] * s_scale_s16;
+    case SAMPLE_FORMAT_S24:
+        return float(load_s24(pb + i * 3)) * s_scale_s32;
+    case SAMPLE_FORMAT_S32:
+        return float(reinterpret_cast<const INT *>(pb)[i]) * s_scale_s32;
+    default:
+        return reinterpret_cast<const float *>(pb)[i];
+    }
+}
+
+// Measures the samples [iSample, nSamples) one by one.
+template <SAMPLE_FORMAT F>
+static void measure_scalar(const BYTE *pb, DWORD iSample, DWORD nSamples,
+                           WORD nChannels, METER_LEVELS *pLevels)
+{
+    const float clip = get_clip_level(F);
+    WORD iChannel = WORD(iSample % nChannels);
+    for (; iSample < nSamples; ++iSample)
+    {
+        if (iChannel < METER_MAX_CHANNELS)
+        {
+            float e = std::fabs(load_sample<F>(pb, iSample));
+            if (e > pLevels->peak[iChannel])
+                pLevels->peak[iChannel] = e;
+            pLevels->sumsq[iChannel] += e * e;
+            if (e >= clip)
+                ++pLevels->clips[iChannel];
+        }
+        if (++iChannel == nChannels)
+            iChannel = 0;
+    }
+}
+
+#ifdef SIMD_X86
+// The vector kernels keep K accumulators of W lanes, where K * W is the
+// least common multiple of the channel count and W. Lane j of the K * W
+// lanes then always holds channel j % nChannels.
+static DWORD get_accumulator_count(WORD nChannels, DWORD nLanes)
+{
+    DWORD a = nChannels, b = nLanes;
+    while (b)
+    {
+        DWORD t = a % b;
+        a = b;
+        b = t;
+    }
+    return nChannels / a;
+}
+
+// The float sums are moved into doubles every FLUSH_INTERVAL steps so long
+// buffers do not lose precision.
+#define FLUSH_INTERVAL 4096
+#define MAX_LANES (METER_MAX_CHANNELS * 8)
+
+static void reduce_lanes(const float *peak, const float *sumsq,
+                         const float *clips, DWORD nLanes, WORD nChannels,
+                         METER_LEVELS *pLevels)
+{
+    for (DWORD j = 0; j < nLanes; ++j)
+    {
+        WORD iChannel = WORD(j % nChannels);
+        if (peak[j] > pLevels->peak[iChannel])
+            pLevels->peak[iChannel] = peak[j];
+        pLevels->sumsq[iChannel] += sumsq[j];
+        pLevels->clips[iChannel] += DWORD(clips[j]);
+    }
+}
+
+template <SAMPLE_FORMAT F>
+TARGET_SSE2 static inline __m128 load4(const BYTE *pb, DWORD i)
+{
+    switch (F)
+    {
+    case SAMPLE_FORMAT_U8:
+        {
+            INT n;
+            CopyMemory(&n, pb + i, sizeof(n));
+            __m128i v = _mm_cvtsi32_si128(n);
+            v = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+            v = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+            __m128 f = _mm_sub_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(128));
+            return _mm_mul_ps(f, _mm_set1_ps(s_scale_u8));
+        }
+    case SAMPLE_FORMAT_S16:
+        {
+            __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pb + i * 2));
+            v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(s_scale_s16));
+        }
+    case SAMPLE_FORMAT_S24:
+        {
+            const BYTE *p = pb + i * 3;
+            __m128i v = _mm_setr_epi32(load_s24(p), load_s24(p + 3),
+                                       load_s24(p + 6), load_s24(p + 9));
+            return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(s_scale_s32));
+        }
+    case SAMPLE_FORMAT_S32:
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pb + i * 4));
+            return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(s_scale_s32));
+        }
+    default:
+        return _mm_loadu_ps(reinterpret_cast<const float *>(pb) + i);
+    }
+}
+
+template <SAMPLE_FORMAT F>
+TARGET_SSE2 static void measure_sse2(const BYTE *pb, DWORD nSamples,
+                                     WORD nChannels, METER_LEVELS *pLevels)
+{
+    const DWORD K = get_accumulator_count(nChannels, 4);
+    const DWORD nStep = K * 4;
+    const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 clip = _mm_set1_ps(get_clip_level(F));
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    __m128 peak[METER_MAX_CHANNELS], sumsq[METER_MAX_CHANNELS], clips[METER_MAX_CHANNELS];
+    float lane_peak[MAX_LANES], lane_sumsq[MAX_LANES], lane_clips[MAX_LANES];
+    for (DWORD k = 0; k < K; ++k)
+        peak[k] = sumsq[k] = clips[k] = _mm_setzero_ps();
+
+    DWORD i = 0, nSteps = 0;
+    for (; i + nStep <= nSamples; i += nStep)
+    {
+        for (DWORD k = 0; k < K; ++k)
+        {
+            __m128 e = _mm_and_ps(load4<F>(pb, i + k * 4), absmask);
+            peak[k] = _mm_max_ps(peak[k], e);
+            sumsq[k] = _mm_add_ps(sumsq[k], _mm_mul_ps(e, e));
+            clips[k] = _mm_add_ps(clips[k], _mm_and_ps(_mm_cmpge_ps(e, clip), one));
+        }
+
+        if (++nSteps == FLUSH_INTERVAL || i + 2 * nStep > nSamples)
+        {
+            for (DWORD k = 0; k < K; ++k)
+            {
+                _mm_storeu_ps(&lane_peak[k * 4], peak[k]);
+                _mm_storeu_ps(&lane_sumsq[k * 4], sumsq[k]);
+                _mm_storeu_ps(&lane_clips[k * 4], clips[k]);
+                sumsq[k] = clips[k] = _mm_setzero_ps();
+            }
+            reduce_lanes(lane_peak, lane_sumsq, lane_clips, nStep, nChannels, pLevels);
+            nSteps = 0;
+        }
+    }
+
+    measure_scalar<F>(pb, i, nSamples, nChannels, pLevels);
+}
+
+template <SAMPLE_FORMAT F>
+TARGET_AVX2 static inline __m256 load8(const BYTE *pb, DWORD i)
+{
+    switch (F)
+    {
+    case SAMPLE_FORMAT_U8:
+        {
+            __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pb + i));
+            __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+            f = _mm256_sub_ps(f, _mm256_set1_ps(128));
+            return _mm256_mul_ps(f, _mm256_set1_ps(s_scale_u8));
+        }
+    case SAMPLE_FORMAT_S16:
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pb + i * 2));
+            __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+            return _mm256_mul_ps(f, _mm256_set1_ps(s_scale_s16));
+        }
+    case SAMPLE_FORMAT_S24:
+        {
+            // Each 16-byte load holds four samples plus four bytes we ignore.
+            const __m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+                                                  -1, 6, 7, 8, -1, 9, 10, 11);
+            const BYTE *p = pb + i * 3;
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 12));
+            lo = _mm_shuffle_epi8(lo, shuffle);
+            hi = _mm_shuffle_epi8(hi, shuffle);
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(s_scale_s32));
+        }
+    case SAMPLE_FORMAT_S32:
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pb + i * 4));
+            return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(s_scale_s32));
+        }
+    default:
+        return _mm256_loadu_ps(reinterpret_cast<const float *>(pb) + i);
+    }
+}
+
+template <SAMPLE_FORMAT F>
+TARGET_AVX2 static void measure_avx2(const BYTE *pb, DWORD nSamples,
+                                     WORD nChannels, METER_LEVELS *pLevels)
+{
+    const DWORD K = get_accumulator_count(nChannels, 8);
+    const DWORD nStep = K * 8;
+    const __m256 absmask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    const __m256 clip = _mm256_set1_ps(get_clip_level(F));
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    // The 24-bit loads read four bytes past the eight samples.
+    const DWORD nSafe = (F == SAMPLE_FORMAT_S24) ? 2 : 0;
+
+    __m256 peak[METER_MAX_CHANNELS], sumsq[METER_MAX_CHANNELS], clips[METER_MAX_CHANNELS];
+    float lane_peak[MAX_LANES], lane_sumsq[MAX_LANES], lane_clips[MAX_LANES];
+    for (DWORD k = 0; k < K; ++k)
+        peak[k] = sumsq[k] = clips[k] = _mm256_setzero_ps();
+
+    DWORD i = 0, nSteps = 0;
+    for (; i + nStep + nSafe <= nSamples; i += nStep)
+    {
+        for (DWORD k = 0; k < K; ++k)
+        {
+            __m256 e = _mm256_and_ps(load8<F>(pb, i + k * 8), absmask);
+            peak[k] = _mm256_max_ps(peak[k], e);
+            sumsq[k] = _mm256_fmadd_ps(e, e, sumsq[k]);
+            __m256 mask = _mm256_cmp_ps(e, clip, _CMP_GE_OQ);
+            clips[k] = _mm256_add_ps(clips[k], _mm256_and_ps(mask, one));
+        }
+
+        if (++nSteps == FLUSH_INTERVAL || i + 2 * nStep + nSafe > nSamples)
+        {
+            for (DWORD k = 0; k < K; ++k)
+            {
+                _mm256_storeu_ps(&lane_peak[k * 8], peak[k]);
+                _mm256_storeu_ps(&lane_sumsq[k * 8], sumsq[k]);
+                _mm256_storeu_ps(&lane_clips[k * 8], clips[k]);
+                sumsq[k] = clips[k] = _mm256_setzero_ps();
+            }
+            reduce_lanes(lane_peak, lane_sumsq, lane_clips, nStep, nChannels, pLevels);
+            nSteps = 0;
+        }
+    }
+
+    measure_scalar<F>(pb, i, nSamples, nChannels, pLevels);
+}
+#endif  // def SIMD_X86
+
+template <SAMPLE_FORMAT F>
+static void measure_format(const BYTE *pb, DWORD nSamples, WORD nChannels,
+                           METER_LEVELS *pLevels)
+{
+#ifdef SIMD_X86
+    if (nChannels <= METER_MAX_CHANNELS)
+    {
+        switch (get_simd_level())
+        {
+        case SIMD_AVX2:
+            measure_avx2<F>(pb, nSamples, nChannels, pLevels);
+            return;
+        case SIMD_SSE2:
+            measure_sse2<F>(pb, nSamples, nChannels, pLevels);
+            return;
+        default:
+            break;
+        }
+    }
+#endif
+    measure_scalar<F>(pb, 0, nSamples, nChannels, pLevels);
+}
+
+void measure_levels(SAMPLE_FORMAT format, const BYTE *pb, DWORD nFrames,
+                    WORD nChannels, METER_LEVELS *pLevels)
+{
+    ZeroMemory(pLevels, sizeof(*pLevels));
+    pLevels->nFrames = nFrames;
+    pLevels->nChannels = (nChannels < METER_MAX_CHANNELS) ? nChannels : METER_MAX_CHANNELS;
+    if (nChannels == 0)
+        return;
+
+    DWORD nSamples = nFrames * nChannels;
+    switch (format)
+    {
+    case SAMPLE_FORMAT_U8:
+        measure_format<SAMPLE_FORMAT_U8>(pb, nSamples, nChannels, pLevels);
+        break;
+    case SAMPLE_FORMAT_S16:
+        measure_format<SAMPLE_FORMAT_S16>(pb, nSamples, nChannels, pLevels);
+        break;
+    case SAMPLE_FORMAT_S24:
+        measure_format<SAMPLE_FORMAT_S24>(pb, nSamples, nChannels, pLevels);
+        break;
+    case SAMPLE_FORMAT_S32:
+        measure_format<SAMPLE_FORMAT_S32>(pb, nSamples, nChannels, pLevels);
+        break;
+    case SAMPLE_FORMAT_F32:
+        measure_format<SAMPLE_FORMAT_F32>(pb, nSamples, nChannels, pLevels);
+        break;
+    default:
+        break;
+    }
+}
+
+double get_rms(const METER_LEVELS *pLevels, WORD iChannel)
+{
+    if (pLevels->nFrames == 0 || iChannel >= pLevels->nChannels)
+        return 0;
+    return std::sqrt(pLevels->sumsq[iChannel] / pLevels->nFrames);
+}
+
+float get_peak(const METER_LEVELS *pLevels)
+{
+    float peak = 0;
+    for (WORD iChannel = 0; iChannel < pLevels->nChannels; ++iChannel)
+    {
+        if (peak < pLevels->peak[iChannel])
+            peak = pLevels->peak[iChannel];
+    }
+    return peak;
+}
+
+double get_mean_square(const METER_LEVELS *pLevels)
+{
+    if (pLevels->nFrames == 0 || pLevels->nChannels == 0)
+        return 0;
+
+    double sum = 0;
+    for (WORD iChannel = 0; iChannel < pLevels->nChannels; ++iChannel)
+        sum += pLevels->sumsq[iChannel];
+    return sum / (double(pLevels->nFrames) * pLevels->nChannels);
+}
+
+LevelMeter::LevelMeter()
+    : m_nSamplesPerSec(48000)
+    , m_nSequence(0)
+{
+    // A VU-like RMS, and a peak that falls like a PPM.
+    SetBallistics(300, 300, 1500, 12);
+    Reset(m_nSamplesPerSec);
+}
+
+void LevelMeter::SetBallistics(DWORD dwAttackMilliseconds, DWORD dwReleaseMilliseconds,
+                               DWORD dwHoldMilliseconds, DWORD nFallDBPerSecond)
+{
+    m_attack = dwAttackMilliseconds / 1000.0;
+    m_release = dwReleaseMilliseconds / 1000.0;
+    m_hold = dwHoldMilliseconds / 1000.0;
+    m_fall = nFallDBPerSecond;
+}
+
+void LevelMeter::Reset(DWORD nSamplesPerSec)
+{
+    m_nSamplesPerSec = nSamplesPerSec;
+    ZeroMemory(&m_state, sizeof(m_state));
+    ZeroMemory(m_meanSquare, sizeof(m_meanSquare));
+    ZeroMemory(m_holdLeft, sizeof(m_holdLeft));
+    Publish();
+}
+
+// The one-pole coefficient of a time constant over dt seconds.
+static double get_coefficient(double dt, double tau)
+{
+    return (tau > 0) ? 1 - std::exp(-dt / tau) : 1;
+}
+
+void LevelMeter::Update(const METER_LEVELS *pLevels)
+{
+    if (pLevels->nFrames == 0)
+        return;
+
+    const double dt = double(pLevels->nFrames) / m_nSamplesPerSec;
+    const float fall = float(std::pow(10.0, -m_fall * dt / 20));
+    m_state.nFrames += pLevels->nFrames;
+    m_state.nChannels = pLevels->nChannels;
+
+    for (WORD ch = 0; ch < pLevels->nChannels; ++ch)
+    {
+        const float peak = pLevels->peak[ch];
+
+        m_state.peak[ch] = (peak > m_state.peak[ch] * fall) ? peak : m_state.peak[ch] * fall;
+
+        if (peak >= m_state.hold[ch])
+        {
+            m_state.hold[ch] = peak;
+            m_holdLeft[ch] = m_hold;
+        }
+        else if (m_holdLeft[ch] > 0)
+        {
+            m_holdLeft[ch] -= dt;
+        }
+        else
+        {
+            m_state.hold[ch] = m_state.peak[ch];
+        }
+
+        double ms = pLevels->sumsq[ch] / pLevels->nFrames;
+        double tau = (ms > m_meanSquare[ch]) ? m_attack : m_release;
+        m_meanSquare[ch] += (ms - m_meanSquare[ch]) * get_coefficient(dt, tau);
+        m_state.rms[ch] = float(std::sqrt(m_meanSquare[ch]));
+
+        m_state.clips[ch] += pLevels->clips[ch];
+    }
+
+    Publish();
+}
+
+// Copies m_state for GetSnapshot, which retries while the sequence is odd
+// or has changed.
+void LevelMeter::Publish()
+{
+    const DWORD nSequence = m_nSequence.load(std::memory_order_relaxed);
+    m_nSequence.store(nSequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_published = m_state;
+    m_nSequence.store(nSequence + 2, std::memory_order_release);
+}
+
+void LevelMeter::GetSnapshot(METER_SNAPSHOT *pSnapshot) const
+{
+    for (;;)
+    {
+        const DWORD nSequence = m_nSequence.load(std::memory_order_acquire);
+        if (nSequence & 1)
+        {
+            ::YieldProcessor();
+            continue;
+        }
+
+        *pSnapshot = m_published;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_nSequence.load(std::memory_order_relaxed) == nSequence)
+            return;
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef METER_HPP_
+#define METER_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <atomic>
+
+enum SAMPLE_FORMAT
+{
+    SAMPLE_FORMAT_UNKNOWN,
+    SAMPLE_FORMAT_U8,
+    SAMPLE_FORMAT_S16,
+    SAMPLE_FORMAT_S24,
+    SAMPLE_FORMAT_S32,
+    SAMPLE_FORMAT_F32
+};
+
+SAMPLE_FORMAT get_sample_format(const WAVEFORMATEX *pwfx);
+
+#define METER_MAX_CHANNELS 16
+
+// The levels of a buffer per channel. Samples are normalized to [-1, 1),
+// and a sample within one step of full scale counts as a clip. Channels
+// beyond METER_MAX_CHANNELS are not measured.
+struct METER_LEVELS
+{
+    DWORD nFrames;
+    WORD nChannels;
+    float peak[METER_MAX_CHANNELS];
+    double sumsq[METER_MAX_CHANNELS];
+    DWORD clips[METER_MAX_CHANNELS];
+};
+
+// Measures the interleaved buffer in one pass with the kernel of
+// get_simd_level().
+void measure_levels(SAMPLE_FORMAT format, const BYTE *pb, DWORD nFrames,
+                    WORD nChannels, METER_LEVELS *pLevels);
+
+double get_rms(const METER_LEVELS *pLevels, WORD iChannel);
+// The highest peak of all the channels.
+float get_peak(const METER_LEVELS *pLevels);
+double get_mean_square(const METER_LEVELS *pLevels);
+
+// What a LevelMeter shows, per channel, on the scale of METER_LEVELS.
+struct METER_SNAPSHOT
+{
+    ULONGLONG nFrames;                  // measured since Reset
+    WORD nChannels;
+    float peak[METER_MAX_CHANNELS];     // rises at once, falls at the fall rate
+    float hold[METER_MAX_CHANNELS];     // the highest peak, held for a while
+    float rms[METER_MAX_CHANNELS];      // through the attack/release integrator
+    ULONGLONG clips[METER_MAX_CHANNELS];
+};
+
+// Runs the levels of every packet through meter ballistics on the capture
+// thread, and publishes the result under a sequence lock. The capture
+// thread never waits: Update copies one snapshot between two increments
+// of the sequence. Readers on any thread, at any rate, copy it and retry
+// if the sequence moved meanwhile. The hold outlasts the reading interval,
+// so a reader sees every peak since its last read.
+class LevelMeter
+{
+public:
+    LevelMeter();
+
+    // Not thread-safe. Call these while the capture thread is stopped;
+    // readers may still take snapshots meanwhile.
+    void SetBallistics(DWORD dwAttackMilliseconds, DWORD dwReleaseMilliseconds,
+                       DWORD dwHoldMilliseconds, DWORD nFallDBPerSecond);
+    void Reset(DWORD nSamplesPerSec);
+
+    // Producer side.
+    void Update(const METER_LEVELS *pLevels);
+
+    // Any thread.
+    void GetSnapshot(METER_SNAPSHOT *pSnapshot) const;
+
+protected:
+    DWORD m_nSamplesPerSec;
+    double m_attack;
+    double m_release;
+    double m_hold;
+    double m_fall;                      // in dB per second
+
+    // The producer's.
+    METER_SNAPSHOT m_state;
+    double m_meanSquare[METER_MAX_CHANNELS];
+    double m_holdLeft[METER_MAX_CHANNELS];
+
+    std::atomic<DWORD> m_nSequence;     // odd while m_published changes
+    METER_SNAPSHOT m_published;
+
+    void Publish();
+};
+
+#endif  // ndef METER_HPP_
@@ -0,0 +1,682 @@
+#include "MultiRecording.hpp"
+#include "Telemetry.hpp"
+
+// The most frames moved through the multitrack file at a time.
+#define SILENCE_FRAMES 4096
+
+MultiRecording::MultiRecording()
+    : m_nSamplesPerSec(48000)
+    , m_wBitsPerSample(16)
+    , m_dwRingMilliseconds(2000)
+    , m_nThreads(0)
+    , m_bMultitrack(FALSE)
+    , m_bAligned(FALSE)
+    , m_u64First(0)
+    , m_hShutdownEvent(NULL)
+    , m_hWriterWakeUp(NULL)
+    , m_hWriterShutdown(NULL)
+    , m_hWriterThread(NULL)
+{
+    // Manual reset: every capture thread sees the shutdown.
+    m_hShutdownEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_hWriterWakeUp = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_hWriterShutdown = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_szMultitrack[0] = 0;
+    ZeroMemory(&m_wfxMultitrack, sizeof(m_wfxMultitrack));
+}
+
+MultiRecording::~MultiRecording()
+{
+    Stop();
+    RemoveAll();
+
+    if (m_hShutdownEvent)
+    {
+        ::CloseHandle(m_hShutdownEvent);
+        m_hShutdownEvent = NULL;
+    }
+    if (m_hWriterWakeUp)
+    {
+        ::CloseHandle(m_hWriterWakeUp);
+        m_hWriterWakeUp = NULL;
+    }
+    if (m_hWriterShutdown)
+    {
+        ::CloseHandle(m_hWriterShutdown);
+        m_hWriterShutdown = NULL;
+    }
+}
+
+void MultiRecording::SetInfo(DWORD nSamplesPerSec, WORD wBitsPerSample)
+{
+    m_nSamplesPerSec = nSamplesPerSec;
+    m_wBitsPerSample = wBitsPerSample;
+}
+
+void MultiRecording::SetRingDuration(DWORD dwMilliseconds)
+{
+    m_dwRingMilliseconds = dwMilliseconds;
+}
+
+void MultiRecording::SetThreadCount(DWORD nThreads)
+{
+    m_nThreads = nThreads;
+}
+
+void MultiRecording::SetMultitrack(LPCTSTR pszFileName)
+{
+    m_bMultitrack = (pszFileName != NULL);
+    if (pszFileName)
+        lstrcpyn(m_szMultitrack, pszFileName, ARRAYSIZE(m_szMultitrack));
+}
+
+INT MultiRecording::AddDevice(CComPtr<IMMDevice> pDevice, WORD nChannels,
+                              LPCTSTR pszFileName)
+{
+    INT iStream = AddSource(NULL, nChannels, pszFileName);
+    if (iStream >= 0)
+        m_streams[iStream]->wasapi.SetDevice(pDevice);
+    return iStream;
+}
+
+INT MultiRecording::AddSource(CaptureSource *pSource, WORD nChannels,
+                              LPCTSTR pszFileName)
+{
+    if (IsRunning() || nChannels == 0 || m_streams.size() >= MAX_STREAMS)
+        return -1;
+
+    STREAM *pStream = new STREAM();
+    pStream->pSource = pSource ? pSource : &pStream->wasapi;
+    pStream->wfx.nChannels = nChannels;
+    pStream->hWakeUp = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    pStream->state.store(STREAM_OPENING);
+    pStream->hr = S_OK;
+    if (pszFileName)
+        lstrcpyn(pStream->szFileName, pszFileName, ARRAYSIZE(pStream->szFileName));
+
+    m_streams.push_back(pStream);
+    return INT(m_streams.size() - 1);
+}
+
+void MultiRecording::RemoveAll()
+{
+    Stop();
+
+    for (size_t i = 0; i < m_streams.size(); ++i)
+    {
+        ::CloseHandle(m_streams[i]->hWakeUp);
+        delete m_streams[i];
+    }
+    m_streams.clear();
+}
+
+DWORD MultiRecording::GetStreamCount() const
+{
+    return DWORD(m_streams.size());
+}
+
+void MultiRecording::GetStreamInfo(DWORD iStream, MULTI_STREAM_INFO& info) const
+{
+    const STREAM *pStream = m_streams[iStream];
+    info.hr = pStream->hr;
+    info.nFrames = pStream->nFrames.load(std::memory_order_relaxed);
+    info.nGapFrames = pStream->nGapFrames.load(std::memory_order_relaxed);
+    info.u64StartPosition = pStream->u64StartPosition;
+    info.nOverflows = pStream->ring.GetOverflowCount();
+    pStream->meter.GetSnapshot(&info.meter);
+}
+
+const WAVEFORMATEX *MultiRecording::GetStreamFormat(DWORD iStream) const
+{
+    return &m_streams[iStream]->wfx;
+}
+
+LONGLONG MultiRecording::GetTrackOffset(DWORD iStream) const
+{
+    const STREAM *pStream = m_streams[iStream];
+    return pStream->bPlaced ? pStream->nOffset : 0;
+}
+
+BOOL MultiRecording::Start()
+{
+    if (IsRunning() || m_streams.empty())
+        return FALSE;
+
+    WORD nTotalChannels = 0, cbMaxFrame = 0;
+    for (size_t i = 0; i < m_streams.size(); ++i)
+    {
+        STREAM *pStream = m_streams[i];
+        WAVEFORMATEX& wfx = pStream->wfx;
+        wfx.wFormatTag = WAVE_FORMAT_PCM;
+        wfx.nSamplesPerSec = m_nSamplesPerSec;
+        wfx.wBitsPerSample = m_wBitsPerSample;
+        wfx.nBlockAlign = wfx.wBitsPerSample * wfx.nChannels / 8;
+        wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
+        wfx.cbSize = 0;
+        pStream->format = get_sample_format(&wfx);
+
+        // Whole frames only, so a frame never wraps around the ring.
+        DWORD nFrames = MulDiv(wfx.nSamplesPerSec, m_dwRingMilliseconds, 1000);
+        if (!pStream->ring.Allocate(nFrames * wfx.nBlockAlign))
+        {
+            CloseFiles();
+            return FALSE;
+        }
+
+        pStream->state.store(STREAM_OPENING);
+        pStream->hr = S_OK;
+        pStream->nFrames.store(0, std::memory_order_relaxed);
+        pStream->nGapFrames.store(0, std::memory_order_relaxed);
+        pStream->nNextPosition = 0;
+        pStream->u64StartPosition = 0;
+        ZeroMemory(&pStream->levels, sizeof(pStream->levels));
+        pStream->meter.Reset(wfx.nSamplesPerSec);
+        pStream->bPlaced = FALSE;
+        pStream->nPadded = pStream->nLeadIn = pStream->nDebt = 0;
+        pStream->nOffset = 0;
+        ::ResetEvent(pStream->hWakeUp);
+
+        if (!m_bMultitrack && !pStream->writer.Open(pStream->szFileName, &wfx))
+        {
+            CloseFiles();
+            return FALSE;
+        }
+
+        nTotalChannels += wfx.nChannels;
+        if (cbMaxFrame < wfx.nBlockAlign)
+            cbMaxFrame = wfx.nBlockAlign;
+    }
+
+    if (m_bMultitrack)
+    {
+        get_pcm_format(&m_wfxMultitrack, m_nSamplesPerSec, nTotalChannels,
+                       m_wBitsPerSample);
+        if (!m_writer.Open(m_szMultitrack, &m_wfxMultitrack.Format))
+            return FALSE;
+    }
+
+    m_silence.assign(SILENCE_FRAMES * cbMaxFrame, BYTE(m_wBitsPerSample == 8 ? 0x80 : 0));
+    m_bAligned = FALSE;
+    m_u64First = 0;
+
+    ::ResetEvent(m_hShutdownEvent);
+    ::ResetEvent(m_hWriterShutdown);
+
+    DWORD tid = 0;
+    m_hWriterThread = ::CreateThread(NULL, 0, MultiRecording::WriterThreadFunction, this, 0, &tid);
+    if (!m_hWriterThread)
+    {
+        CloseFiles();
+        return FALSE;
+    }
+
+    // The streams are split evenly and in order between the threads.
+    const DWORD nStreams = DWORD(m_streams.size());
+    DWORD nThreads = m_nThreads;
+    if (nThreads == 0)
+        nThreads = (nStreams + STREAMS_PER_THREAD - 1) / STREAMS_PER_THREAD;
+    if (nThreads > nStreams)
+        nThreads = nStreams;
+
+    m_groups.resize(nThreads);
+    for (DWORD i = 0; i < nThreads; ++i)
+    {
+        CAPTURE_GROUP& group = m_groups[i];
+        group.pThis = this;
+        group.iFirst = i * nStreams / nThreads;
+        group.nCount = (i + 1) * nStreams / nThreads - group.iFirst;
+        group.hThread = ::CreateThread(NULL, 0, MultiRecording::CaptureThreadFunction,
+                                       &group, 0, &tid);
+        if (group.hThread)
+            continue;
+
+        // The writer does not wait for streams nobody captures.
+        HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+        for (DWORD j = 0; j < group.nCount; ++j)
+        {
+            STREAM *pStream = m_streams[group.iFirst + j];
+            pStream->hr = hr;
+            pStream->state.store(STREAM_FAILED, std::memory_order_release);
+        }
+    }
+
+    return TRUE;
+}
+
+BOOL MultiRecording::Stop()
+{
+    if (!IsRunning())
+        return FALSE;
+
+    SetEvent(m_hShutdownEvent);
+    for (size_t i = 0; i < m_groups.size(); ++i)
+    {
+        if (m_groups[i].hThread)
+        {
+            WaitForSingleObject(m_groups[i].hThread, INFINITE);
+            CloseHandle(m_groups[i].hThread);
+        }
+    }
+    m_groups.clear();
+
+    // The writer drains the rings, then finalizes the files.
+    SetEvent(m_hWriterShutdown);
+    WaitForSingleObject(m_hWriterThread, INFINITE);
+    CloseHandle(m_hWriterThread);
+    m_hWriterThread = NULL;
+
+    return TRUE;
+}
+
+void MultiRecording::CloseFiles()
+{
+    for (size_t i = 0; i < m_streams.size(); ++i)
+        m_streams[i]->writer.Close();
+    m_writer.Close();
+}
+
+DWORD WINAPI MultiRecording::CaptureThreadFunction(LPVOID pContext)
+{
+    CAPTURE_GROUP *pGroup = reinterpret_cast<CAPTURE_GROUP *>(pContext);
+    MultiRecording *pThis = pGroup->pThis;
+
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (FAILED(hr))
+    {
+        for (DWORD i = 0; i < pGroup->nCount; ++i)
+        {
+            STREAM *pStream = pThis->m_streams[pGroup->iFirst + i];
+            pStream->hr = hr;
+            pStream->state.store(STREAM_FAILED, std::memory_order_release);
+        }
+        return FALSE;
+    }
+
+    DWORD ret = pThis->CaptureProc(pGroup);
+    CoUninitialize();
+    return ret;
+}
+
+DWORD WINAPI MultiRecording::WriterThreadFunction(LPVOID pContext)
+{
+    MultiRecording *pThis = reinterpret_cast<MultiRecording *>(pContext);
+    return pThis->WriterProc();
+}
+
+// Waits on the shutdown and the events of the open streams of the group.
+DWORD MultiRecording::CaptureProc(CAPTURE_GROUP *pGroup)
+{
+    HANDLE waitArray[MAXIMUM_WAIT_OBJECTS] = { m_hShutdownEvent };
+    STREAM *streams[MAXIMUM_WAIT_OBJECTS];
+    DWORD nOpen = 0;
+
+    for (DWORD i = 0; i < pGroup->nCount && nOpen + 1 < MAXIMUM_WAIT_OBJECTS; ++i)
+    {
+        STREAM *pStream = m_streams[pGroup->iFirst + i];
+        HRESULT hr = pStream->pSource->Open(&pStream->wfx, pStream->hWakeUp);
+        if (SUCCEEDED(hr))
+        {
+            hr = pStream->pSource->Start();
+            if (FAILED(hr))
+                pStream->pSource->Close();
+        }
+
+        pStream->hr = hr;
+        if (FAILED(hr))
+        {
+            pStream->state.store(STREAM_FAILED, std::memory_order_release);
+            continue;
+        }
+
+        pStream->state.store(STREAM_OPEN, std::memory_order_release);
+        streams[nOpen] = pStream;
+        waitArray[++nOpen] = pStream->hWakeUp;
+    }
+    ::SetEvent(m_hWriterWakeUp);
+
+    DWORD nTaskIndex = 0;
+    HANDLE hTask = AvSetMmThreadCharacteristics(L"Audio", &nTaskIndex);
+
+    for (;;)
+    {
+        // Any event drains every stream of the group, so a busy stream
+        // never starves the ones after it in the wait array.
+        for (DWORD i = 0; i < nOpen; ++i)
+            CaptureStream(streams[i]);
+        ::SetEvent(m_hWriterWakeUp);
+
+        DWORD waitResult = ::WaitForMultipleObjects(nOpen + 1, waitArray, FALSE, INFINITE);
+        if (waitResult <= WAIT_OBJECT_0 || waitResult > WAIT_OBJECT_0 + nOpen)
+            break;
+    }
+
+    for (DWORD i = 0; i < nOpen; ++i)
+    {
+        streams[i]->pSource->Stop();
+        streams[i]->pSource->Close();
+    }
+
+    if (hTask)
+        AvRevertMmThreadCharacteristics(hTask);
+
+    return 0;
+}
+
+void MultiRecording::CaptureStream(STREAM *pStream)
+{
+    CaptureSource *pSource = pStream->pSource;
+    const DWORD cbFrame = pStream->wfx.nBlockAlign;
+
+    HRESULT hr;
+    UINT32 nNextPacketSize;
+    for (hr = pSource->GetNextPacketSize(&nNextPacketSize);
+         SUCCEEDED(hr) && nNextPacketSize > 0;
+         hr = pSource->GetNextPacketSize(&nNextPacketSize))
+    {
+        BYTE *pbData;
+        UINT32 nFrames;
+        DWORD dwFlags;
+        UINT64 u64DevicePosition = 0, u64QPCPosition = 0;
+        hr = pSource->GetBuffer(&pbData, &nFrames, &dwFlags,
+                                &u64DevicePosition, &u64QPCPosition);
+        if (FAILED(hr) || hr == AUDCLNT_S_BUFFER_EMPTY)
+            break;
+
+        if (pStream->state.load(std::memory_order_relaxed) == STREAM_OPEN)
+        {
+            // The writer aligns the tracks on this.
+            pStream->u64StartPosition = u64QPCPosition;
+            pStream->nNextPosition = u64DevicePosition;
+            pStream->state.store(STREAM_RUNNING, std::memory_order_release);
+        }
+        else if (u64DevicePosition > pStream->nNextPosition)
+        {
+            // Frames the device lost become silence, so the stream keeps
+            // its place on the timeline.
+            ULONGLONG nGap = u64DevicePosition - pStream->nNextPosition;
+            WriteSilence(pStream, nGap);
+            increase_counter(pStream->nGapFrames, nGap);
+            increase_counter(pStream->nFrames, nGap);
+        }
+        pStream->nNextPosition = u64DevicePosition + nFrames;
+
+        if (dwFlags & AUDCLNT_BUFFERFLAGS_SILENT)
+        {
+            WriteSilence(pStream, nFrames);
+            ZeroMemory(&pStream->levels, sizeof(pStream->levels));
+            pStream->levels.nFrames = nFrames;
+            pStream->levels.nChannels = pStream->wfx.nChannels;
+        }
+        else
+        {
+            pStream->ring.Write(pbData, nFrames * cbFrame);
+            measure_levels(pStream->format, pbData, nFrames,
+                           pStream->wfx.nChannels, &pStream->levels);
+        }
+        pStream->meter.Update(&pStream->levels);
+
+        increase_counter(pStream->nFrames, nFrames);
+        pSource->ReleaseBuffer(nFrames);
+    }
+}
+
+void MultiRecording::WriteSilence(STREAM *pStream, ULONGLONG nFrames)
+{
+    // More than the ring holds would only overflow it.
+    const DWORD cbFrame = pStream->wfx.nBlockAlign;
+    ULONGLONG nMax = pStream->ring.GetCapacity() / cbFrame;
+    if (nFrames > nMax)
+        nFrames = nMax;
+
+    while (nFrames > 0)
+    {
+        DWORD nChunk = DWORD(nFrames < SILENCE_FRAMES ? nFrames : SILENCE_FRAMES);
+        pStream->ring.Write(m_silence.data(), nChunk * cbFrame);
+        nFrames -= nChunk;
+    }
+}
+
+DWORD MultiRecording::WriterProc()
+{
+    HANDLE waitArray[2] = { m_hWriterShutdown, m_hWriterWakeUp };
+
+    bool bKeepWriting = true;
+    while (bKeepWriting)
+    {
+        DWORD waitResult = ::WaitForMultipleObjects(2, waitArray, FALSE, INFINITE);
+        if (waitResult != WAIT_OBJECT_0 + 1)
+            bKeepWriting = false;
+
+        if (m_bMultitrack)
+            DrainMultitrack(!bKeepWriting);
+        else
+            DrainSeparate();
+    }
+
+    CloseFiles();
+    return 0;
+}
+
+void MultiRecording::DrainSeparate()
+{
+    for (size_t i = 0; i < m_streams.size(); ++i)
+    {
+        STREAM *pStream = m_streams[i];
+
+        const BYTE *pb1, *pb2;
+        DWORD cb1, cb2;
+        DWORD cb = pStream->ring.Peek(&pb1, &cb1, &pb2, &cb2);
+        if (cb == 0)
+            continue;
+
+        pStream->writer.Write(pb1, cb1);
+        if (cb2)
+            pStream->writer.Write(pb2, cb2);
+        pStream->ring.Consume(cb);
+    }
+}
+
+// A ring more than half full: the tracks are not waited for any longer.
+BOOL MultiRecording::IsPressed() const
+{
+    for (size_t i = 0; i < m_streams.size(); ++i)
+    {
+        const RingBuffer& ring = m_streams[i]->ring;
+        if (ring.GetReadable() > ring.GetCapacity() / 2)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// The file starts at the first frame of the earliest stream. That is known
+// once every stream has delivered a packet or failed to open, or when the
+// wait for the others would overflow a ring.
+BOOL MultiRecording::AlignTracks(BOOL bFinal)
+{
+    if (m_bAligned)
+        return TRUE;
+
+    BOOL bAny = FALSE, bWaiting = FALSE;
+    UINT64 u64First = 0;
+    for (size_t i = 0; i < m_streams.size(); ++i)
+    {
+        const STREAM *pStream = m_streams[i];
+        LONG state = pStream->state.load(std::memory_order_acquire);
+        if (state == STREAM_RUNNING)
+        {
+            if (!bAny || pStream->u64StartPosition < u64First)
+                u64First = pStream->u64StartPosition;
+            bAny = TRUE;
+        }
+        else if (state != STREAM_FAILED)
+        {
+            bWaiting = TRUE;
+        }
+    }
+
+    if (!bAny || (bWaiting && !bFinal && !IsPressed()))
+        return FALSE;
+
+    m_u64First = u64First;
+    m_bAligned = TRUE;
+    return TRUE;
+}
+
+// A stream that starts late has been silent up to now; the rest of its
+// offset becomes lead-in, and an overshoot becomes debt.
+void MultiRecording::PlaceTrack(STREAM *pStream)
+{
+    if (pStream->bPlaced ||
+        pStream->state.load(std::memory_order_acquire) != STREAM_RUNNING)
+    {
+        return;
+    }
+
+    LONGLONG nDelta = LONGLONG(pStream->u64StartPosition - m_u64First);
+    LONGLONG nHalf = (nDelta < 0) ? -5000000 : 5000000;
+    pStream->nOffset = (nDelta * LONGLONG(m_nSamplesPerSec) + nHalf) / 10000000;
+
+    LONGLONG nLeadIn = pStream->nOffset - LONGLONG(pStream->nPadded);
+    if (nLeadIn >= 0)
+        pStream->nLeadIn = nLeadIn;
+    else
+        pStream->nDebt = -nLeadIn;
+    pStream->bPlaced = TRUE;
+}
+
+// Interleaves frames of cbFrame bytes into every cbStride bytes.
+template <DWORD t_cbFrame>
+static void copy_frames(const BYTE *pSrc, DWORD nFrames, BYTE *pDst, DWORD cbStride)
+{
+    for (DWORD i = 0; i < nFrames; ++i)
+    {
+        CopyMemory(pDst, pSrc, t_cbFrame);
+        pSrc += t_cbFrame;
+        pDst += cbStride;
+    }
+}
+
+static void copy_track(const BYTE *pSrc, DWORD nFrames, DWORD cbFrame,
+                       BYTE *pDst, DWORD cbStride)
+{
+    switch (cbFrame)
+    {
+    case 2:
+        copy_frames<2>(pSrc, nFrames, pDst, cbStride);
+        break;
+    case 4:
+        copy_frames<4>(pSrc, nFrames, pDst, cbStride);
+        break;
+    case 6:
+        copy_frames<6>(pSrc, nFrames, pDst, cbStride);
+        break;
+    case 8:
+        copy_frames<8>(pSrc, nFrames, pDst, cbStride);
+        break;
+    default:
+        for (DWORD i = 0; i < nFrames; ++i)
+            CopyMemory(pDst + i * cbStride, pSrc + i * cbFrame, cbFrame);
+        break;
+    }
+}
+
+// Fills the columns of one track: lead-in silence, then the ring. Silence
+// stands in for frames the stream has not delivered yet.
+void MultiRecording::ReadTrack(STREAM *pStream, DWORD nFrames, BYTE *pDst,
+                               DWORD cbOffset)
+{
+    const DWORD cbFrame = pStream->wfx.nBlockAlign;
+    const DWORD cbStride = m_wfxMultitrack.Format.nBlockAlign;
+    BYTE *pb = pDst + cbOffset;
+
+    if (!pStream->bPlaced)
+    {
+        copy_track(m_silence.data(), nFrames, cbFrame, pb, cbStride);
+        pStream->nPadded += nFrames;
+        return;
+    }
+
+    DWORD nSilence = DWORD(pStream->nLeadIn < nFrames ? pStream->nLeadIn : nFrames);
+    copy_track(m_silence.data(), nSilence, cbFrame, pb, cbStride);
+    pStream->nLeadIn -= nSilence;
+    pb += nSilence * cbStride;
+    DWORD nLeft = nFrames - nSilence;
+
+    const BYTE *pb1, *pb2;
+    DWORD cb1, cb2;
+    pStream->ring.Peek(&pb1, &cb1, &pb2, &cb2);
+
+    DWORD n1 = cb1 / cbFrame;
+    if (n1 > nLeft)
+        n1 = nLeft;
+    copy_track(pb1, n1, cbFrame, pb, cbStride);
+    pb += n1 * cbStride;
+    nLeft -= n1;
+
+    DWORD n2 = cb2 / cbFrame;
+    if (n2 > nLeft)
+        n2 = nLeft;
+    copy_track(pb2, n2, cbFrame, pb, cbStride);
+    pb += n2 * cbStride;
+    nLeft -= n2;
+
+    pStream->ring.Consume((n1 + n2) * cbFrame);
+
+    copy_track(m_silence.data(), nLeft, cbFrame, pb, cbStride);
+    pStream->nDebt += nLeft;
+}
+
+// Writes as far as every placed track has frames. Under pressure, and at
+// the end, it writes as far as the longest and pads the others.
+void MultiRecording::DrainMultitrack(BOOL bFinal)
+{
+    if (!AlignTracks(bFinal))
+        return;
+
+    const DWORD cbStride = m_wfxMultitrack.Format.nBlockAlign;
+    for (;;)
+    {
+        BOOL bPressed = bFinal || IsPressed();
+        ULONGLONG nMin = 0, nMax = 0;
+        BOOL bAny = FALSE;
+        for (size_t i = 0; i < m_streams.size(); ++i)
+        {
+            STREAM *pStream = m_streams[i];
+            PlaceTrack(pStream);
+            if (!pStream->bPlaced)
+                continue;
+
+            const DWORD cbFrame = pStream->wfx.nBlockAlign;
+            ULONGLONG nReadable = pStream->ring.GetReadable() / cbFrame;
+            if (pStream->nDebt > 0)
+            {
+                ULONGLONG nDrop = (pStream->nDebt < nReadable) ? pStream->nDebt : nReadable;
+                pStream->ring.Consume(DWORD(nDrop * cbFrame));
+                pStream->nDebt -= nDrop;
+                nReadable -= nDrop;
+            }
+
+            ULONGLONG nAvail = pStream->nLeadIn + nReadable;
+            if (!bAny || nAvail < nMin)
+                nMin = nAvail;
+            if (nAvail > nMax)
+                nMax = nAvail;
+            bAny = TRUE;
+        }
+
+        ULONGLONG nFrames = bPressed ? nMax : nMin;
+        if (nFrames == 0)
+            break;
+        if (nFrames > SILENCE_FRAMES)
+            nFrames = SILENCE_FRAMES;
+
+        m_frames.resize(DWORD(nFrames) * cbStride);
+        DWORD cbOffset = 0;
+        for (size_t i = 0; i < m_streams.size(); ++i)
+        {
+            ReadTrack(m_streams[i], DWORD(nFrames), m_frames.data(), cbOffset);
+            cbOffset += m_streams[i]->wfx.nBlockAlign;
+        }
+        m_writer.Write(m_frames.data(), DWORD(nFrames) * cbStride);
+    }
+}
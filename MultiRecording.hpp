@@ -0,0 +1,147 @@
+#ifndef MULTI_RECORDING_HPP_
+#define MULTI_RECORDING_HPP_
+
+#include "Recording.hpp"
+#include <atomic>
+
+// The capture of one stream so far.
+struct MULTI_STREAM_INFO
+{
+    HRESULT hr;                 // the result of opening the source
+    ULONGLONG nFrames;          // frames captured
+    ULONGLONG nGapFrames;       // silence put in for lost device frames
+    UINT64 u64StartPosition;    // the QPC position of the first frame, 100 ns
+    DWORD nOverflows;
+    METER_SNAPSHOT meter;
+};
+
+// Records several sources at once. A small fixed pool of capture threads
+// each waits on the events of up to STREAMS_PER_THREAD sources, and one
+// writer thread drains the rings into a file per stream, or into one
+// multitrack file whose tracks are aligned by the time of their first
+// frame.
+class MultiRecording
+{
+public:
+    enum { MAX_STREAMS = 32, STREAMS_PER_THREAD = 8 };
+
+    MultiRecording();
+    ~MultiRecording();
+
+    // The rate and sample size of every stream.
+    void SetInfo(DWORD nSamplesPerSec, WORD wBitsPerSample);
+    void SetRingDuration(DWORD dwMilliseconds);
+    // Zero takes one thread per STREAMS_PER_THREAD streams.
+    void SetThreadCount(DWORD nThreads);
+    // Writes all the streams into one file, their channels side by side.
+    // NULL writes a file per stream.
+    void SetMultitrack(LPCTSTR pszFileName);
+
+    // Returns the index of the new stream, or -1. The file name is not used
+    // in multitrack mode.
+    INT AddDevice(CComPtr<IMMDevice> pDevice, WORD nChannels, LPCTSTR pszFileName);
+    // The source must outlive the recording.
+    INT AddSource(CaptureSource *pSource, WORD nChannels, LPCTSTR pszFileName);
+    void RemoveAll();
+    DWORD GetStreamCount() const;
+
+    BOOL Start();
+    BOOL Stop();
+    BOOL IsRunning() const
+    {
+        return m_hWriterThread != NULL;
+    }
+
+    void GetStreamInfo(DWORD iStream, MULTI_STREAM_INFO& info) const;
+    const WAVEFORMATEX *GetStreamFormat(DWORD iStream) const;
+    // Where the first frame of the stream lies in the multitrack file,
+    // relative to the earliest stream.
+    LONGLONG GetTrackOffset(DWORD iStream) const;
+
+protected:
+    enum STREAM_STATE
+    {
+        STREAM_OPENING,
+        STREAM_FAILED,
+        STREAM_OPEN,
+        STREAM_RUNNING      // the first packet has arrived
+    };
+
+    struct STREAM
+    {
+        CaptureSource *pSource;
+        WasapiCaptureSource wasapi;
+        WAVEFORMATEX wfx;
+        SAMPLE_FORMAT format;
+        HANDLE hWakeUp;
+        RingBuffer ring;
+        WaveWriter writer;
+        TCHAR szFileName[MAX_PATH];
+        std::atomic<LONG> state;
+        HRESULT hr;
+
+        // The capture thread's. The counters are read by GetStreamInfo.
+        std::atomic<ULONGLONG> nFrames;
+        ULONGLONG nNextPosition;
+        std::atomic<ULONGLONG> nGapFrames;
+        UINT64 u64StartPosition;
+        METER_LEVELS levels;
+        LevelMeter meter;
+
+        // The writer's. Until the stream is placed on the timeline its track
+        // is silent. Then nLeadIn frames of silence go before its data, and
+        // nDebt frames are dropped because silence stood in for them.
+        BOOL bPlaced;
+        ULONGLONG nPadded;
+        ULONGLONG nLeadIn;
+        ULONGLONG nDebt;
+        LONGLONG nOffset;
+    };
+
+    struct CAPTURE_GROUP
+    {
+        MultiRecording *pThis;
+        DWORD iFirst;
+        DWORD nCount;
+        HANDLE hThread;
+    };
+
+    std::vector<STREAM *> m_streams;
+    std::vector<CAPTURE_GROUP> m_groups;
+    DWORD m_nSamplesPerSec;
+    WORD m_wBitsPerSample;
+    DWORD m_dwRingMilliseconds;
+    DWORD m_nThreads;
+    BOOL m_bMultitrack;
+    TCHAR m_szMultitrack[MAX_PATH];
+    WAVEFORMATEXTENSIBLE m_wfxMultitrack;
+    WaveWriter m_writer;
+    BOOL m_bAligned;
+    UINT64 m_u64First;
+    std::vector<BYTE> m_silence;
+    std::vector<BYTE> m_frames;
+
+    HANDLE m_hShutdownEvent;
+    HANDLE m_hWriterWakeUp;
+    HANDLE m_hWriterShutdown;
+    HANDLE m_hWriterThread;
+
+    static DWORD WINAPI CaptureThreadFunction(LPVOID pContext);
+    static DWORD WINAPI WriterThreadFunction(LPVOID pContext);
+    DWORD CaptureProc(CAPTURE_GROUP *pGroup);
+    DWORD WriterProc();
+    void CaptureStream(STREAM *pStream);
+    void WriteSilence(STREAM *pStream, ULONGLONG nFrames);
+    void DrainSeparate();
+    BOOL AlignTracks(BOOL bFinal);
+    void PlaceTrack(STREAM *pStream);
+    BOOL IsPressed() const;
+    void DrainMultitrack(BOOL bFinal);
+    void ReadTrack(STREAM *pStream, DWORD nFrames, BYTE *pDst, DWORD cbOffset);
+    void CloseFiles();
+
+    MultiRecording(const MultiRecording&);
+    MultiRecording& operator=(const MultiRecording&);
+};
+
+#endif  // ndef MULTI_RECORDING_HPP_
@@ -0,0 +1,84 @@
+#include "PrerollBuffer.hpp"
+
+PrerollBuffer::PrerollBuffer()
+    : m_nWritePos(0)
+    , m_bSealed(FALSE)
+{
+}
+
+BOOL PrerollBuffer::Allocate(DWORD cbCapacity)
+{
+    m_data.assign(cbCapacity, 0);
+    Reset();
+    return TRUE;
+}
+
+void PrerollBuffer::Free()
+{
+    std::vector<BYTE>().swap(m_data);
+    Reset();
+}
+
+void PrerollBuffer::Reset()
+{
+    m_nWritePos = 0;
+    m_bSealed.store(FALSE);
+}
+
+void PrerollBuffer::Write(LPCVOID pvData, DWORD cbData)
+{
+    const DWORD cbCapacity = DWORD(m_data.size());
+    if (cbCapacity == 0 || m_bSealed.load(std::memory_order_relaxed))
+        return;
+
+    // Only the last cbCapacity bytes can be kept.
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    m_nWritePos += cbData;
+    if (cbData > cbCapacity)
+    {
+        pb += cbData - cbCapacity;
+        cbData = cbCapacity;
+    }
+
+    DWORD iStart = DWORD((m_nWritePos - cbData) % cbCapacity);
+    DWORD cb1 = cbCapacity - iStart;
+    if (cb1 > cbData)
+        cb1 = cbData;
+    CopyMemory(&m_data[iStart], pb, cb1);
+    if (cbData > cb1)
+        CopyMemory(&m_data[0], pb + cb1, cbData - cb1);
+}
+
+void PrerollBuffer::Seal()
+{
+    m_bSealed.store(TRUE, std::memory_order_release);
+}
+
+DWORD PrerollBuffer::Peek(const BYTE **ppb1, DWORD *pcb1,
+                          const BYTE **ppb2, DWORD *pcb2) const
+{
+    const DWORD cbCapacity = DWORD(m_data.size());
+    if (m_nWritePos == 0 || cbCapacity == 0)
+    {
+        *ppb1 = *ppb2 = NULL;
+        *pcb1 = *pcb2 = 0;
+        return 0;
+    }
+
+    // Until the buffer wraps, the bytes start at zero.
+    if (m_nWritePos <= cbCapacity)
+    {
+        *ppb1 = &m_data[0];
+        *pcb1 = DWORD(m_nWritePos);
+        *ppb2 = NULL;
+        *pcb2 = 0;
+        return *pcb1;
+    }
+
+    DWORD iStart = DWORD(m_nWritePos % cbCapacity);
+    *ppb1 = &m_data[iStart];
+    *pcb1 = cbCapacity - iStart;
+    *ppb2 = iStart ? &m_data[0] : NULL;
+    *pcb2 = iStart;
+    return cbCapacity;
+}
@@ -0,0 +1,50 @@
+#ifndef PREROLL_BUFFER_HPP_
+#define PREROLL_BUFFER_HPP_
+
+#include <windows.h>
+#include <atomic>
+#include <vector>
+
+// A fixed circular buffer that keeps the last bytes written, overwriting
+// the oldest. The capture thread fills it while only hearing, and seals it
+// when the recording begins; from then on it belongs to the writer, which
+// reads the bytes in place and puts them in front of the recording.
+class PrerollBuffer
+{
+public:
+    PrerollBuffer();
+
+    // Not thread-safe. Call these while no thread is using the buffer.
+    // A capacity of whole frames keeps the oldest byte on a frame.
+    BOOL Allocate(DWORD cbCapacity);
+    void Free();
+    void Reset();
+
+    // Producer side, until sealed. Only copies.
+    void Write(LPCVOID pvData, DWORD cbData);
+    void Seal();
+
+    // Consumer side, once sealed. Peek exposes the bytes oldest first as up
+    // to two regions.
+    BOOL IsSealed() const
+    {
+        return m_bSealed.load(std::memory_order_acquire);
+    }
+    DWORD Peek(const BYTE **ppb1, DWORD *pcb1,
+               const BYTE **ppb2, DWORD *pcb2) const;
+
+    DWORD GetCapacity() const
+    {
+        return DWORD(m_data.size());
+    }
+
+protected:
+    std::vector<BYTE> m_data;
+    ULONGLONG m_nWritePos;
+    std::atomic<BOOL> m_bSealed;
+
+    PrerollBuffer(const PrerollBuffer&);
+    PrerollBuffer& operator=(const PrerollBuffer&);
+};
+
+#endif  // ndef PREROLL_BUFFER_HPP_
@@ -1,6 +1,5 @@
 #define DEFINE_GUIDS
 #include "Recording.hpp"
-#include "win/resource.h"
 #include <cmath>
 
 static const WAVE_FORMAT_INFO s_wave_formats[] =
@@ -38,48 +37,110 @@ bool get_wave_formats(std::vector<WAVE_FORMAT_INFO>& formats)
 }
 
 bool save_pcm_wave_file(LPTSTR lpszFileName, LPWAVEFORMATEX lpwf,
-                        LPCVOID lpWaveData, DWORD dwDataSize)
-{
-    HMMIO    hmmio;
-    MMCKINFO mmckRiff;
-    MMCKINFO mmckFmt;
-    MMCKINFO mmckData;
-    
-    hmmio = mmioOpen(lpszFileName, NULL, MMIO_CREATE | MMIO_WRITE);
-    if (hmmio == NULL)
+                        LPCVOID lpWaveData, SIZE_T cbDataSize,
+                        const TIMELINE_GAP *pGaps, DWORD nGaps)
+{
+    WaveWriter writer;
+    writer.SetPreallocation(cbDataSize);
+    if (nGaps)
+        writer.AddChunk(TIMELINE_CHUNK_ID, pGaps, nGaps * sizeof(TIMELINE_GAP));
+    if (!writer.Open(lpszFileName, lpwf))
         return false;
 
-    mmckRiff.fccType = mmioStringToFOURCC(TEXT("WAVE"), 0);
-    mmioCreateChunk(hmmio, &mmckRiff, MMIO_CREATERIFF);
-
-    mmckFmt.ckid = mmioStringToFOURCC(TEXT("fmt "), 0);
-    mmioCreateChunk(hmmio, &mmckFmt, 0);
-    mmioWrite(hmmio, (const char *)lpwf, sizeof(PCMWAVEFORMAT));
-    mmioAscend(hmmio, &mmckFmt, 0);
-
-    mmckData.ckid = mmioStringToFOURCC(TEXT("data"), 0);
-    mmioCreateChunk(hmmio, &mmckData, 0);
-    mmioWrite(hmmio, (const char *)lpWaveData, dwDataSize);
-    mmioAscend(hmmio, &mmckData, 0);
+    // Write takes 32-bit sizes.
+    const BYTE *pb = reinterpret_cast<const BYTE *>(lpWaveData);
+    BOOL bOK = TRUE;
+    while (bOK && cbDataSize > 0)
+    {
+        DWORD cb = (cbDataSize < 0x40000000) ? DWORD(cbDataSize) : 0x40000000;
+        bOK = writer.Write(pb, cb);
+        pb += cb;
+        cbDataSize -= cb;
+    }
+    return writer.Close() && bOK;
+}
 
-    mmioAscend(hmmio, &mmckRiff, 0);
-    mmioClose(hmmio, 0);
+bool save_pcm_wave_file(LPTSTR lpszFileName, LPWAVEFORMATEX lpwf,
+                        const SegmentedBuffer& data,
+                        const TIMELINE_GAP *pGaps, DWORD nGaps)
+{
+    WaveWriter writer;
+    writer.SetPreallocation(data.GetSize());
+    if (nGaps)
+        writer.AddChunk(TIMELINE_CHUNK_ID, pGaps, nGaps * sizeof(TIMELINE_GAP));
+    if (!writer.Open(lpszFileName, lpwf))
+        return false;
 
-    return true;
+    BOOL bOK = TRUE;
+    for (DWORD i = 0; bOK && i < data.GetSegmentCount(); ++i)
+    {
+        DWORD cb;
+        const BYTE *pb = data.GetSegment(i, &cb);
+        bOK = writer.Write(pb, cb);
+    }
+    return writer.Close() && bOK;
 }
 
 Recording::Recording()
-    : m_nValue(0)
-    , m_nMax(0)
-    , m_hShutdownEvent(NULL)
+    : m_hShutdownEvent(NULL)
     , m_hWakeUp(NULL)
     , m_hThread(NULL)
+    , m_pSource(&m_wasapi)
+    , m_latency(CAPTURE_LATENCY_DEFAULT)
+    , m_dwBufferMilliseconds(0)
     , m_bRecording(FALSE)
+    , m_format(SAMPLE_FORMAT_UNKNOWN)
+    , m_dwMeterAttack(300)
+    , m_dwMeterRelease(300)
+    , m_dwMeterHold(1500)
+    , m_nMeterFall(12)
+    , m_nSpectrumSize(0)
+    , m_bLoudness(FALSE)
+    , m_bMeasuringLoudness(FALSE)
+    , m_dwTapMilliseconds(2000)
+    , m_bStreaming(FALSE)
+    , m_output(OUTPUT_WAV)
+    , m_hOutput(NULL)
+    , m_bOutputHeader(TRUE)
+    , m_dwPreallocSeconds(0)
+    , m_bMapped(FALSE)
+    , m_bNative(FALSE)
+    , m_bConverting(FALSE)
+    , m_bResampling(FALSE)
+    , m_quality(RESAMPLE_BALANCED)
+    , m_bDynamics(FALSE)
+    , m_bProcessing(FALSE)
+    , m_hWriterThread(NULL)
+    , m_hWriterWakeUp(NULL)
+    , m_hWriterShutdown(NULL)
+    , m_dwRotateSeconds(0)
+    , m_cbRotateFile(0)
+    , m_cbDiskBudget(0)
+    , m_dwRingMilliseconds(2000)
+    , m_dwPrerollMilliseconds(0)
+    , m_bPrerollSpliced(FALSE)
+    , m_nPrerollFrames(0)
+    , m_bSkipSilence(FALSE)
+    , m_fSilenceThreshold(0.001f)
+    , m_dwHoldMilliseconds(500)
+    , m_bSkipping(FALSE)
+    , m_nHoldFrames(0)
+    , m_nHoldLeft(0)
+    , m_nSkipRun(0)
+    , m_nStoredFrames(0)
+    , m_nSkippedFrames(0)
 {
     m_hShutdownEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
     m_hWakeUp = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_hWriterWakeUp = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_hWriterShutdown = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    SetFileName(TEXT("sound.wav"));
+    m_szTapName[0] = 0;
     m_nFrames = 0;
     ::InitializeCriticalSection(&m_lock);
+    ZeroMemory(&m_levels, sizeof(m_levels));
+    ZeroMemory(&m_wfxNative, sizeof(m_wfxNative));
+    get_default_dynamics(&m_dynamicsSettings);
 
     ZeroMemory(&m_wfx, sizeof(m_wfx));
     m_wfx.wFormatTag = WAVE_FORMAT_PCM;
@@ -96,8 +157,167 @@ void Recording::SetInfo(WORD nChannels, DWORD nSamplesPerSec, WORD wBitsPerSampl
     m_wfx.nAvgBytesPerSec = m_wfx.nSamplesPerSec * m_wfx.nBlockAlign;
 }
 
+void Recording::SetStreaming(BOOL bStreaming)
+{
+    m_bStreaming = bStreaming;
+}
+
+void Recording::SetFileName(LPCTSTR pszFileName)
+{
+    lstrcpyn(m_szFileName, pszFileName, ARRAYSIZE(m_szFileName));
+}
+
+void Recording::SetOutputFormat(OUTPUT_FORMAT format)
+{
+    m_output = format;
+}
+
+void Recording::SetOutputHandle(HANDLE hOutput, BOOL bHeader)
+{
+    m_hOutput = hOutput;
+    m_bOutputHeader = bHeader;
+}
+
+ULONGLONG Recording::GetStreamedBytes() const
+{
+    return m_stream.GetWrittenBytes();
+}
+
+ULONGLONG Recording::GetUnstreamedBytes() const
+{
+    return m_stream.GetDroppedBytes();
+}
+
+void Recording::SetPreallocation(DWORD dwSeconds, BOOL bMapped)
+{
+    m_dwPreallocSeconds = dwSeconds;
+    m_bMapped = bMapped;
+}
+
+void Recording::SetRotation(DWORD dwSeconds, ULONGLONG cbMaxFile, ULONGLONG cbBudget)
+{
+    m_dwRotateSeconds = dwSeconds;
+    m_cbRotateFile = cbMaxFile;
+    m_cbDiskBudget = cbBudget;
+}
+
+DWORD Recording::GetRotatedFileCount() const
+{
+    return m_rotating.GetFileCount();
+}
+
+DWORD Recording::GetDeletedFileCount() const
+{
+    return m_rotating.GetDeletedCount();
+}
+
+void Recording::SetRingDuration(DWORD dwMilliseconds)
+{
+    m_dwRingMilliseconds = dwMilliseconds;
+}
+
+void Recording::SetCaptureLatency(CAPTURE_LATENCY latency, DWORD dwBufferMilliseconds)
+{
+    m_latency = latency;
+    m_dwBufferMilliseconds = dwBufferMilliseconds;
+}
+
+void Recording::SetPrerollDuration(DWORD dwMilliseconds)
+{
+    m_dwPrerollMilliseconds = dwMilliseconds;
+}
+
+void Recording::SetSilenceSkipping(BOOL bSkip, LONG nThresholdDB,
+                                   DWORD dwHoldMilliseconds)
+{
+    m_bSkipSilence = bSkip;
+    m_fSilenceThreshold = float(std::pow(10.0, nThresholdDB / 20.0));
+    m_dwHoldMilliseconds = dwHoldMilliseconds;
+}
+
+ULONGLONG Recording::GetSkippedFrames() const
+{
+    return m_nSkippedFrames;
+}
+
+DWORD Recording::GetGapOverflowCount() const
+{
+    return m_gapRing.GetOverflowCount();
+}
+
+void Recording::SetNativeFormat(BOOL bNative)
+{
+    m_bNative = bNative;
+}
+
+void Recording::SetResampleQuality(RESAMPLE_QUALITY quality)
+{
+    m_quality = quality;
+}
+
+void Recording::SetDynamics(const DYNAMICS_SETTINGS *pSettings)
+{
+    m_bDynamics = (pSettings != NULL);
+    if (pSettings)
+        m_dynamicsSettings = *pSettings;
+}
+
+BOOL Recording::GetDynamicsInfo(DYNAMICS_INFO& info, DWORD& nLatency) const
+{
+    if (!m_bProcessing)
+        return FALSE;
+    m_dynamics.GetInfo(&info);
+    nLatency = m_dynamics.GetLatency();
+    return TRUE;
+}
+
+const WAVEFORMATEX *Recording::GetCaptureFormat() const
+{
+    return m_bConverting ? &m_wfxNative.Format : &m_wfx;
+}
+
+void Recording::PrepareFormat()
+{
+    m_bConverting = m_bResampling = FALSE;
+    if (!m_bNative)
+        return;
+
+    HRESULT hr = m_pSource->GetMixFormat(&m_wfxNative);
+    if (FAILED(hr) || get_sample_format(&m_wfxNative.Format) != SAMPLE_FORMAT_F32)
+        return;
+
+    const DWORD nMixRate = m_wfxNative.Format.nSamplesPerSec;
+    if (nMixRate != m_wfx.nSamplesPerSec)
+    {
+        m_bResampling = m_resampler.Init(nMixRate, m_wfx.nSamplesPerSec,
+                                         m_wfx.nChannels, m_quality);
+        if (!m_bResampling)
+            SetInfo(m_wfx.nChannels, nMixRate, m_wfx.wBitsPerSample);
+    }
+    m_bConverting = TRUE;
+}
+
+DWORD Recording::GetOverflowCount() const
+{
+    return m_ring.GetOverflowCount();
+}
+
+ULONGLONG Recording::GetDroppedBytes() const
+{
+    return m_ring.GetDroppedBytes();
+}
+
+void Recording::GetCaptureStats(CAPTURE_STATS& stats) const
+{
+    m_telemetry.GetStats(&stats);
+    stats.nOverflows = m_ring.GetOverflowCount();
+    stats.cbDropped = m_ring.GetDroppedBytes();
+}
+
 Recording::~Recording()
 {
+    StopWriter();
+
     if (m_hShutdownEvent)
     {
         ::CloseHandle(m_hShutdownEvent);
@@ -113,17 +333,51 @@ Recording::~Recording()
         ::CloseHandle(m_hThread);
         m_hThread = NULL;
     }
+    if (m_hWriterWakeUp)
+    {
+        ::CloseHandle(m_hWriterWakeUp);
+        m_hWriterWakeUp = NULL;
+    }
+    if (m_hWriterShutdown)
+    {
+        ::CloseHandle(m_hWriterShutdown);
+        m_hWriterShutdown = NULL;
+    }
 
     ::DeleteCriticalSection(&m_lock);
 }
 
 void Recording::SetDevice(CComPtr<IMMDevice> pDevice)
 {
-    m_pDevice = pDevice;
+    m_wasapi.SetDevice(pDevice);
+    m_pSource = &m_wasapi;
+}
+
+void Recording::SetSource(CaptureSource *pSource)
+{
+    m_pSource = pSource ? pSource : &m_wasapi;
 }
 
 BOOL Recording::StartHearing()
 {
+    PrepareFormat();
+
+    // The capture thread only copies into the pre-roll.
+    const WAVEFORMATEX *pwfx = GetCaptureFormat();
+    m_meter.SetBallistics(m_dwMeterAttack, m_dwMeterRelease, m_dwMeterHold, m_nMeterFall);
+    m_meter.Reset(pwfx->nSamplesPerSec);
+    m_telemetry.Reset(pwfx);
+    if (m_nSpectrumSize)
+        m_spectrum.Start(pwfx);
+    m_bMeasuringLoudness = m_bLoudness && m_loudness.Reset(pwfx);
+    if (m_szTapName[0])
+    {
+        m_tap.Open(m_szTapName, pwfx,
+                   MulDiv(pwfx->nSamplesPerSec, m_dwTapMilliseconds, 1000));
+    }
+    DWORD nFrames = MulDiv(pwfx->nSamplesPerSec, m_dwPrerollMilliseconds, 1000);
+    m_preroll.Allocate(nFrames * pwfx->nBlockAlign);
+
     DWORD tid = 0;
     m_hThread = ::CreateThread(NULL, 0, Recording::ThreadFunction, this, 0, &tid);
     return m_hThread != NULL;
@@ -135,19 +389,19 @@ BOOL Recording::StopHearing()
 
     SetEvent(m_hShutdownEvent);
 
-    if (m_pAudioClient)
-    {
-        m_pAudioClient->Stop();
-    }
-
     if (m_hThread)
     {
         WaitForSingleObject(m_hThread, INFINITE);
         CloseHandle(m_hThread);
         m_hThread = NULL;
     }
+    m_spectrum.Stop();
+    m_tap.Close();
 
-    ::PlaySound(NULL, NULL, 0);
+    // No packet may have come since SetRecording.
+    if (m_hWriterThread)
+        m_preroll.Seal();
+    StopWriter();
 
     return TRUE;
 }
@@ -158,10 +412,335 @@ BOOL Recording::SetRecording(BOOL bRecording)
     {
         StartHearing();
     }
+    if (!m_hWriterThread)
+    {
+        if (!StartWriter())
+            return FALSE;
+    }
     m_bRecording = TRUE;
     return TRUE;
 }
 
+BOOL Recording::StartWriter()
+{
+    // Whole frames only, so a frame never wraps around the ring.
+    const WAVEFORMATEX *pwfx = GetCaptureFormat();
+    DWORD nFrames = MulDiv(pwfx->nSamplesPerSec, m_dwRingMilliseconds, 1000);
+    if (!m_ring.Allocate(nFrames * pwfx->nBlockAlign))
+        return FALSE;
+
+    m_wave_data.Clear();
+    m_bPrerollSpliced = FALSE;
+    m_nPrerollFrames = 0;
+
+    m_bSkipping = m_bSkipSilence && m_output == OUTPUT_WAV && !(m_bStreaming && m_hOutput);
+    m_nHoldFrames = MulDiv(pwfx->nSamplesPerSec, m_dwHoldMilliseconds, 1000);
+    m_nHoldLeft = m_nSkipRun = m_nStoredFrames = 0;
+    m_gaps.clear();
+    m_nSkippedFrames = 0;
+    if (m_bSkipping && !m_gapRing.Allocate(4096 * sizeof(TIMELINE_GAP)))
+        return FALSE;
+    if (m_bResampling)
+        m_resampler.Reset();
+    m_bProcessing = m_bDynamics &&
+                    m_dynamics.Init(&m_dynamicsSettings, m_wfx.nSamplesPerSec, m_wfx.nChannels);
+    if (m_bStreaming)
+    {
+        BOOL bOpen;
+        if (m_hOutput)
+            bOpen = m_stream.Open(m_hOutput, &m_wfx, m_bOutputHeader);
+        else if (m_output == OUTPUT_FLAC)
+            bOpen = m_flac.Open(m_szFileName, &m_wfx);
+        else if (m_output == OUTPUT_IMA_ADPCM)
+            bOpen = m_adpcm.Open(m_szFileName, &m_wfx);
+        else if (m_dwRotateSeconds || m_cbRotateFile)
+        {
+            ULONGLONG nMaxFrames = ULONGLONG(-1);
+            if (m_dwRotateSeconds)
+                nMaxFrames = ULONGLONG(m_wfx.nSamplesPerSec) * m_dwRotateSeconds;
+            if (m_cbRotateFile && m_cbRotateFile / m_wfx.nBlockAlign < nMaxFrames)
+                nMaxFrames = m_cbRotateFile / m_wfx.nBlockAlign;
+            m_rotating.SetLimits(nMaxFrames, m_cbDiskBudget);
+            m_rotating.SetPreallocation(ULONGLONG(m_wfx.nAvgBytesPerSec) * m_dwPreallocSeconds);
+            m_rotating.SetMapped(m_bMapped);
+            bOpen = m_rotating.Open(m_szFileName, &m_wfx);
+            if (!bOpen)
+                m_rotating.Close();
+        }
+        else
+        {
+            m_writer.SetPreallocation(ULONGLONG(m_wfx.nAvgBytesPerSec) * m_dwPreallocSeconds);
+            m_writer.SetMapped(m_bMapped);
+            bOpen = m_writer.Open(m_szFileName, &m_wfx);
+        }
+        if (!bOpen)
+            return FALSE;
+    }
+
+    ::ResetEvent(m_hWriterShutdown);
+
+    DWORD tid = 0;
+    m_hWriterThread = ::CreateThread(NULL, 0, Recording::WriterThreadFunction, this, 0, &tid);
+    if (!m_hWriterThread)
+    {
+        m_writer.Close();
+        m_rotating.Close();
+        m_flac.Close();
+        m_adpcm.Close();
+        m_stream.Close();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void Recording::StopWriter()
+{
+    if (!m_hWriterThread)
+        return;
+
+    // The writer drains the ring, then finalizes the file.
+    SetEvent(m_hWriterShutdown);
+    WaitForSingleObject(m_hWriterThread, INFINITE);
+    CloseHandle(m_hWriterThread);
+    m_hWriterThread = NULL;
+}
+
+DWORD WINAPI Recording::WriterThreadFunction(LPVOID pContext)
+{
+    Recording *pRecording = reinterpret_cast<Recording *>(pContext);
+    return pRecording->WriterProc();
+}
+
+void Recording::WriteData(const BYTE *pb, DWORD cb)
+{
+    if (m_bStreaming)
+    {
+        if (m_stream.IsOpen())
+            m_stream.Write(pb, cb);
+        else if (m_output == OUTPUT_FLAC)
+            m_flac.Write(pb, cb);
+        else if (m_output == OUTPUT_IMA_ADPCM)
+            m_adpcm.Write(pb, cb);
+        else if (m_rotating.IsOpen())
+            m_rotating.Write(pb, cb);
+        else
+            m_writer.Write(pb, cb);
+    }
+    else
+    {
+        ::EnterCriticalSection(&m_lock);
+        m_wave_data.Append(pb, cb);
+        ::LeaveCriticalSection(&m_lock);
+    }
+}
+
+// Float frames of the mix to m_wfx: the channels, the rate, then the
+// sample format.
+void Recording::ConvertData(const BYTE *pb, DWORD cb)
+{
+    const WORD nSrcChannels = m_wfxNative.Format.nChannels;
+    DWORD nFrames = cb / m_wfxNative.Format.nBlockAlign;
+    const float *pf = reinterpret_cast<const float *>(pb);
+    if (nSrcChannels != m_wfx.nChannels)
+    {
+        m_remapped.resize(nFrames * m_wfx.nChannels);
+        remap_channels(pf, nFrames, nSrcChannels, m_remapped.data(), m_wfx.nChannels);
+        pf = m_remapped.data();
+    }
+
+    if (m_bResampling)
+    {
+        nFrames = m_resampler.Process(pf, nFrames, m_resampled);
+        pf = m_resampled.data();
+    }
+
+    ConvertFloat(pf, nFrames);
+}
+
+// Float frames of m_wfx through the dynamics, if any, to the file.
+void Recording::ConvertFloat(const float *pf, DWORD nFrames)
+{
+    if (m_bProcessing)
+    {
+        nFrames = m_dynamics.Process(pf, nFrames, m_processed);
+        pf = m_processed.data();
+    }
+    WriteFloat(pf, nFrames);
+}
+
+void Recording::WriteFloat(const float *pf, DWORD nFrames)
+{
+    DWORD cb = nFrames * m_wfx.nBlockAlign;
+    m_converted.resize(cb);
+    convert_from_float(get_sample_format(&m_wfx), pf,
+                       nFrames * m_wfx.nChannels, m_converted.data());
+    WriteData(m_converted.data(), cb);
+}
+
+// Bytes in the capture format.
+void Recording::WriteCaptured(const BYTE *pb, DWORD cb)
+{
+    if (m_bConverting)
+    {
+        ConvertData(pb, cb);
+    }
+    else if (m_bProcessing)
+    {
+        DWORD nFrames = cb / m_wfx.nBlockAlign;
+        m_unpacked.resize(nFrames * m_wfx.nChannels);
+        convert_to_float(get_sample_format(&m_wfx), pb, nFrames * m_wfx.nChannels,
+                         m_unpacked.data());
+        ConvertFloat(m_unpacked.data(), nFrames);
+    }
+    else
+    {
+        WriteData(pb, cb);
+    }
+}
+
+// The pre-roll goes to the file from where it lies, without a copy.
+void Recording::SplicePreroll()
+{
+    const BYTE *pb1, *pb2;
+    DWORD cb1, cb2;
+    if (DWORD cb = m_preroll.Peek(&pb1, &cb1, &pb2, &cb2))
+    {
+        m_nPrerollFrames = cb / GetCaptureFormat()->nBlockAlign;
+        WriteCaptured(pb1, cb1);
+        if (cb2)
+            WriteCaptured(pb2, cb2);
+    }
+    m_bPrerollSpliced = TRUE;
+}
+
+// Capture thread. Returns TRUE if the packet is to be left out. The tail
+// of a sound is kept for m_nHoldFrames. A kept packet is counted in
+// m_nStoredFrames by the caller, once it is in the ring.
+BOOL Recording::SkipSilence(UINT32 nFrames, DWORD dwFlags)
+{
+    BOOL bSilent = (dwFlags & AUDCLNT_BUFFERFLAGS_SILENT) ||
+                   get_peak(&m_levels) < m_fSilenceThreshold;
+    if (!bSilent)
+    {
+        m_nHoldLeft = m_nHoldFrames;
+    }
+    else if (m_nHoldLeft > 0)
+    {
+        m_nHoldLeft = (m_nHoldLeft > nFrames) ? m_nHoldLeft - nFrames : 0;
+        bSilent = FALSE;
+    }
+
+    if (bSilent)
+    {
+        m_nSkipRun += nFrames;
+        return TRUE;
+    }
+
+    SendGap();
+    return FALSE;
+}
+
+void Recording::SendGap()
+{
+    if (m_nSkipRun == 0)
+        return;
+
+    // If the writer has not taken the earlier gaps yet, the run goes with
+    // the next one instead, so the timeline still has its length.
+    TIMELINE_GAP gap = { m_nStoredFrames, m_nSkipRun };
+    if (m_gapRing.Write(&gap, sizeof(gap)))
+        m_nSkipRun = 0;
+}
+
+// The gaps arrive in frames of the capture format, counted from the end of
+// the pre-roll.
+void Recording::DrainGaps(DWORD cbGaps)
+{
+    const ULONGLONG nInRate = GetCaptureFormat()->nSamplesPerSec;
+    const ULONGLONG nOutRate = m_wfx.nSamplesPerSec;
+    for (; cbGaps >= sizeof(TIMELINE_GAP); cbGaps -= sizeof(TIMELINE_GAP))
+    {
+        TIMELINE_GAP gap;
+        m_gapRing.Read(&gap, sizeof(gap));
+        gap.nFrame = (m_nPrerollFrames + gap.nFrame) * nOutRate / nInRate;
+        gap.nFrames = gap.nFrames * nOutRate / nInRate;
+        m_gaps.push_back(gap);
+        m_nSkippedFrames += gap.nFrames;
+        if (m_rotating.IsOpen())
+            m_rotating.AddGap(gap);
+    }
+}
+
+void Recording::DrainRing()
+{
+    const BYTE *pb1, *pb2;
+    DWORD cb1, cb2;
+    DWORD cb = m_ring.Peek(&pb1, &cb1, &pb2, &cb2);
+    DWORD cbGaps = m_bSkipping ? m_gapRing.GetReadable() : 0;
+
+    // The capture thread seals the pre-roll before it first writes to
+    // either ring, so the pre-roll is spliced in ahead of what they hold.
+    if (!m_bPrerollSpliced && m_preroll.IsSealed())
+        SplicePreroll();
+    if (cbGaps)
+        DrainGaps(cbGaps);
+
+    if (cb == 0)
+        return;
+
+    WriteCaptured(pb1, cb1);
+    if (cb2)
+        WriteCaptured(pb2, cb2);
+
+    m_ring.Consume(cb);
+}
+
+DWORD Recording::WriterProc()
+{
+    HANDLE waitArray[2] = { m_hWriterShutdown, m_hWriterWakeUp };
+
+    bool bKeepWriting = true;
+    while (bKeepWriting)
+    {
+        DWORD waitResult = ::WaitForMultipleObjects(2, waitArray, FALSE, INFINITE);
+        if (waitResult != WAIT_OBJECT_0 + 1)
+            bKeepWriting = false;
+
+        DrainRing();
+        if (m_stream.IsOpen())
+            m_stream.Flush();
+    }
+
+    if (m_bResampling)
+    {
+        DWORD nFrames = m_resampler.Flush(m_resampled);
+        ConvertFloat(m_resampled.data(), nFrames);
+    }
+    if (m_bProcessing)
+    {
+        DWORD nFrames = m_dynamics.Flush(m_processed);
+        WriteFloat(m_processed.data(), nFrames);
+    }
+
+    if (m_bStreaming)
+    {
+        if (!m_gaps.empty() && m_writer.IsOpen())
+        {
+            m_writer.AddChunk(TIMELINE_CHUNK_ID, m_gaps.data(),
+                              DWORD(m_gaps.size() * sizeof(TIMELINE_GAP)));
+        }
+        m_writer.Close();
+        m_rotating.Close();
+        m_flac.Close();
+        m_adpcm.Close();
+        m_stream.Close();
+    }
+    else if (!m_wave_data.IsEmpty() || !m_gaps.empty())
+        SaveToFile();
+
+    return 0;
+}
+
 DWORD WINAPI Recording::ThreadFunction(LPVOID pContext)
 {
     HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
@@ -176,117 +755,128 @@ DWORD WINAPI Recording::ThreadFunction(LPVOID pContext)
 
 void Recording::ScanBuffer(const BYTE *pb, DWORD cb, DWORD dwFlags)
 {
-    m_nMax = 0;
-    m_nValue = 0;
+    const WAVEFORMATEX *pwfx = GetCaptureFormat();
+    DWORD nFrames = cb / pwfx->nBlockAlign;
     if (dwFlags & AUDCLNT_BUFFERFLAGS_SILENT)
-        return;
+    {
+        ZeroMemory(&m_levels, sizeof(m_levels));
+        m_levels.nFrames = nFrames;
+        m_levels.nChannels = pwfx->nChannels;
+        if (m_levels.nChannels > METER_MAX_CHANNELS)
+            m_levels.nChannels = METER_MAX_CHANNELS;
+    }
+    else
+    {
+        measure_levels(m_format, pb, nFrames, pwfx->nChannels, &m_levels);
+    }
+
+    m_meter.Update(&m_levels);
 
-    float sum = 0;
-    double x;
-    switch (m_wfx.wBitsPerSample)
+    if (m_bMeasuringLoudness)
+        m_loudness.Update((dwFlags & AUDCLNT_BUFFERFLAGS_SILENT) ? NULL : pb, nFrames);
+}
+
+void Recording::GetMeter(LONG& nValue, LONG& nMax) const
+{
+    nValue = 0;
+    nMax = 40;
+
+    METER_SNAPSHOT snapshot;
+    m_meter.GetSnapshot(&snapshot);
+
+    double x = 0;
+    for (WORD ch = 0; ch < snapshot.nChannels; ++ch)
+        x += double(snapshot.rms[ch]) * snapshot.rms[ch];
+    if (snapshot.nChannels)
+        x /= snapshot.nChannels;
+    if (x > 0)
     {
-    case 8:
-        // A PCM WAVE 8-bit sample is unsigned 0-to-255 value.
-        for (DWORD i = 0; i < cb; ++i)
-        {
-            INT s = INT(pb[i]) - 0xFF / 2;
-            float e = float(s) / (0xFF / 2);
-            sum += e * e;
-        }
-        x = std::sqrt(sum / cb);
-        x = 20 * std::log10(x);
+        x = 10 * std::log10(x);
         // Now, x is decibel.
-        m_nValue = 35 + INT(x);
-        m_nMax = 40;
-        break;
-    case 16:
-        // A PCM WAVE 16-bit sample is signed 16-bit value.
-        {
-            DWORD cw = cb / 2;
-            const WORD *pw = reinterpret_cast<const WORD *>(pb);
-            for (DWORD i = 0; i < cw; ++i)
-            {
-                INT s = SHORT(pw[i]);
-                float e = float(s) / (0xFFFF / 2);
-                sum += e * e;
-            }
-            x = std::sqrt(sum / cw);
-            x = 20 * std::log10(x);
-            // Now, x is decibel.
-            m_nValue = 35 + INT(x);
-            m_nMax = 40;
-        }
-        break;
-    default:
-        assert(0);
-        break;
+        nValue = 35 + INT(x);
     }
 }
 
-DWORD Recording::ThreadProc()
+void Recording::GetMeterSnapshot(METER_SNAPSHOT& snapshot) const
 {
-    HRESULT hr;
+    m_meter.GetSnapshot(&snapshot);
+}
+
+void Recording::SetMeterBallistics(DWORD dwAttackMilliseconds, DWORD dwReleaseMilliseconds,
+                                   DWORD dwHoldMilliseconds, DWORD nFallDBPerSecond)
+{
+    m_dwMeterAttack = dwAttackMilliseconds;
+    m_dwMeterRelease = dwReleaseMilliseconds;
+    m_dwMeterHold = dwHoldMilliseconds;
+    m_nMeterFall = nFallDBPerSecond;
+}
 
-    if (m_pAudioClient)
-        m_pAudioClient.Detach();
+void Recording::SetSpectrum(DWORD nFftSize, DWORD nSpectraPerSecond, LPCTSTR pszSpectrogram)
+{
+    m_nSpectrumSize = nFftSize;
+    if (nFftSize)
+        m_spectrum.SetSize(nFftSize);
+    m_spectrum.SetRate(nSpectraPerSecond);
+    m_spectrum.SetSpectrogramFile(pszSpectrogram);
+}
 
-    hr = m_pDevice->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&m_pAudioClient);
-    assert(SUCCEEDED(hr));
+BOOL Recording::GetSpectrum(SPECTRUM_INFO& info, std::vector<float>& dB) const
+{
+    return m_spectrum.GetSpectrum(info, dB);
+}
 
-    REFERENCE_TIME DevicePeriod;
-    hr = m_pAudioClient->GetDevicePeriod(&DevicePeriod, NULL);
-    assert(SUCCEEDED(hr));
+void Recording::SetLoudness(BOOL bEnable)
+{
+    m_bLoudness = bEnable;
+}
 
-    m_wave_data.clear();
+BOOL Recording::GetLoudness(LOUDNESS_INFO& info) const
+{
+    if (!m_bMeasuringLoudness)
+        return FALSE;
+    m_loudness.GetInfo(&info);
+    return TRUE;
+}
 
-    UINT32 nBlockAlign = m_wfx.nBlockAlign;
-    WORD wBitsPerSample = m_wfx.wBitsPerSample;
-    m_nFrames = 0;
+void Recording::SetTap(LPCTSTR pszName, DWORD dwMilliseconds)
+{
+    if (pszName)
+        lstrcpyn(m_szTapName, pszName, ARRAYSIZE(m_szTapName));
+    else
+        m_szTapName[0] = 0;
+    m_dwTapMilliseconds = dwMilliseconds;
+}
 
-#ifndef AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM
-    #define AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM 0x80000000
-#endif
-#ifndef AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY
-    #define AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY 0x08000000
-#endif
-    DWORD StreamFlags =
-        AUDCLNT_STREAMFLAGS_EVENTCALLBACK |
-        AUDCLNT_STREAMFLAGS_NOPERSIST |
-        AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM |
-        AUDCLNT_STREAMFLAGS_LOOPBACK;
-
-    hr = m_pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
-                                    StreamFlags,
-                                    0, 0, &m_wfx, 0);
-    if (SUCCEEDED(hr))
-    {
-        ::PlaySound(MAKEINTRESOURCE(IDR_SILENT_WAV), GetModuleHandle(NULL),
-                    SND_ASYNC | SND_LOOP | SND_NODEFAULT |
-                    SND_RESOURCE);
-    }
-    else if (hr == AUDCLNT_E_WRONG_ENDPOINT_TYPE)
-    {
-        StreamFlags &= ~AUDCLNT_STREAMFLAGS_LOOPBACK;
-        hr = m_pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
-                                        StreamFlags,
-                                        0, 0, &m_wfx, 0);
-    }
-    assert(SUCCEEDED(hr));
+DWORD Recording::ThreadProc()
+{
+    HRESULT hr;
 
-    hr = m_pAudioClient->SetEventHandle(m_hWakeUp);
-    assert(SUCCEEDED(hr));
+    const WAVEFORMATEX *pwfx = GetCaptureFormat();
+    UINT32 nBlockAlign = pwfx->nBlockAlign;
+    m_format = get_sample_format(pwfx);
+    m_nFrames = 0;
 
-    if (m_pCaptureClient)
-        m_pCaptureClient.Detach();
+    CaptureSource *pSource = m_pSource;
+    pSource->SetLatency(m_latency, m_dwBufferMilliseconds);
+    hr = pSource->Open(pwfx, m_hWakeUp);
+    if (FAILED(hr))
+        return hr;
 
-    hr = m_pAudioClient->GetService(__uuidof(IAudioCaptureClient), (void**)&m_pCaptureClient);
-    assert(SUCCEEDED(hr));
+    // A wake-up the source misses is made up for a period later, before a
+    // buffer of CAPTURE_MIN_PERIODS overflows.
+    DWORD dwTimeout = INFINITE;
+    CAPTURE_TIMING timing;
+    if (SUCCEEDED(pSource->GetTiming(&timing)) && timing.nSamplesPerSec)
+    {
+        m_telemetry.OnTiming(timing.nPeriodFrames, timing.nBufferFrames);
+        dwTimeout = MulDiv(timing.nPeriodFrames, 1000, timing.nSamplesPerSec) + 1;
+    }
 
     DWORD nTaskIndex = 0;
     HANDLE hTask = AvSetMmThreadCharacteristics(L"Audio", &nTaskIndex);
     assert(hTask);
 
-    hr = m_pAudioClient->Start();
+    hr = pSource->Start();
     assert(SUCCEEDED(hr));
 
     HANDLE waitArray[2] = { m_hShutdownEvent, m_hWakeUp };
@@ -296,44 +886,66 @@ DWORD Recording::ThreadProc()
     BYTE *pbData;
     UINT32 uNumFrames;
     DWORD dwFlags;
-    BOOL bRecorded = FALSE;
 
     for (UINT32 nPasses = 0; bKeepRecording; nPasses++)
     {
         UINT32 nNextPacketSize;
-        for (hr = m_pCaptureClient->GetNextPacketSize(&nNextPacketSize);
-             SUCCEEDED(hr) && nNextPacketSize > 0;
-             hr = m_pCaptureClient->GetNextPacketSize(&nNextPacketSize))
+        hr = pSource->GetNextPacketSize(&nNextPacketSize);
+        m_telemetry.OnWakeUp(SUCCEEDED(hr) && nNextPacketSize > 0);
+        for (; SUCCEEDED(hr) && nNextPacketSize > 0;
+             hr = pSource->GetNextPacketSize(&nNextPacketSize))
         {
-            hr = m_pCaptureClient->GetBuffer(&pbData, &uNumFrames, &dwFlags, NULL, NULL);
+            UINT64 u64DevicePosition = 0, u64QPCPosition = 0;
+            LONGLONG llBefore = m_telemetry.Now();
+            hr = pSource->GetBuffer(&pbData, &uNumFrames, &dwFlags,
+                                    &u64DevicePosition, &u64QPCPosition);
             assert(SUCCEEDED(hr));
+            m_telemetry.OnGetBuffer(llBefore, uNumFrames, dwFlags,
+                                    u64DevicePosition, u64QPCPosition);
 
             LONG cbToWrite = uNumFrames * nBlockAlign;
 
+            ScanBuffer(pbData, cbToWrite, dwFlags);
+            if (m_spectrum.IsRunning())
+                m_spectrum.Write(pbData, cbToWrite, (dwFlags & AUDCLNT_BUFFERFLAGS_SILENT) != 0);
+            if (m_tap.IsOpen())
+                m_tap.Write((dwFlags & AUDCLNT_BUFFERFLAGS_SILENT) ? NULL : pbData, uNumFrames);
+
             if (m_bRecording)
             {
-                bRecorded = TRUE;
-                ::EnterCriticalSection(&m_lock);
-                m_wave_data.insert(m_wave_data.end(), pbData, pbData + cbToWrite);
-                ::LeaveCriticalSection(&m_lock);
+                // The writer thread drains the ring; a full ring is counted.
+                if (!m_preroll.IsSealed())
+                    m_preroll.Seal();
+                if (!m_bSkipping || !SkipSilence(uNumFrames, dwFlags))
+                {
+                    if (m_ring.Write(pbData, cbToWrite))
+                        m_nStoredFrames += uNumFrames;
+                    m_telemetry.OnQueueDepth(m_ring.GetReadable());
+                    ::SetEvent(m_hWriterWakeUp);
+                }
+            }
+            else
+            {
+                m_preroll.Write(pbData, cbToWrite);
             }
-
-            ScanBuffer(pbData, cbToWrite, dwFlags);
 
             m_nFrames += uNumFrames;
-            hr = m_pCaptureClient->ReleaseBuffer(uNumFrames);
+            llBefore = m_telemetry.Now();
+            hr = pSource->ReleaseBuffer(uNumFrames);
             assert(SUCCEEDED(hr));
+            m_telemetry.OnReleaseBuffer(llBefore);
 
             bFirstPacket = false;
         }
 
-        DWORD waitResult = ::WaitForMultipleObjects(2, waitArray, FALSE, INFINITE);
+        DWORD waitResult = ::WaitForMultipleObjects(2, waitArray, FALSE, dwTimeout);
         switch (waitResult)
         {
         case WAIT_OBJECT_0:
             bKeepRecording = false;
             break;
         case WAIT_OBJECT_0 + 1:
+        case WAIT_TIMEOUT:
             break;
         default:
             bKeepRecording = false;
@@ -341,17 +953,35 @@ DWORD Recording::ThreadProc()
         }
     }
 
-    if (bRecorded)
+    pSource->Stop();
+    pSource->Close();
+
+    // The silence up to the end.
+    if (m_nSkipRun)
     {
-        SaveToFile();
+        SendGap();
+        ::SetEvent(m_hWriterWakeUp);
     }
 
+    if (hTask)
+        AvRevertMmThreadCharacteristics(hTask);
+
     return 0;
 }
 
 void Recording::SaveToFile()
 {
-    WCHAR szFileName[] = L"sound.wav";
-    save_pcm_wave_file(szFileName, &m_wfx,
-                       m_wave_data.data(), m_wave_data.size());
+    if (m_output == OUTPUT_FLAC)
+    {
+        save_flac_file(m_szFileName, &m_wfx, m_wave_data);
+        return;
+    }
+    if (m_output == OUTPUT_IMA_ADPCM)
+    {
+        save_ima_adpcm_file(m_szFileName, &m_wfx, m_wave_data);
+        return;
+    }
+
+    save_pcm_wave_file(m_szFileName, &m_wfx, m_wave_data,
+                       m_gaps.data(), DWORD(m_gaps.size()));
 }
@@ -11,6 +11,23 @@
 #include <avrt.h>
 #include <functiondiscoverykeys_devpkey.h>
 #include "CComPtr.hpp"
+#include "WasapiCaptureSource.hpp"
+#include "WaveWriter.hpp"
+#include "RotatingWaveWriter.hpp"
+#include "FlacEncoder.hpp"
+#include "ImaAdpcm.hpp"
+#include "RingBuffer.hpp"
+#include "SegmentedBuffer.hpp"
+#include "PrerollBuffer.hpp"
+#include "Meter.hpp"
+#include "Convert.hpp"
+#include "Resampler.hpp"
+#include "Timeline.hpp"
+#include "Telemetry.hpp"
+#include "Spectrum.hpp"
+#include "Loudness.hpp"
+#include "Dynamics.hpp"
+#include "SharedTap.hpp"
 #include <vector>
 #include <cstdio>
 
@@ -22,48 +39,253 @@ struct WAVE_FORMAT_INFO
     WORD channels;
 };
 
+enum OUTPUT_FORMAT
+{
+    OUTPUT_WAV,
+    OUTPUT_FLAC,    // 8, 16 or 24-bit m_wfx only
+    OUTPUT_IMA_ADPCM    // 16-bit m_wfx only
+};
+
 bool get_wave_formats(std::vector<WAVE_FORMAT_INFO>& formats);
 
+// The file is preallocated to its final size, and becomes RF64 past 4 GB.
+// The gaps of a sparse recording go into its TIMELINE_CHUNK_ID chunk.
 bool save_pcm_wave_file(LPTSTR lpszFileName, LPWAVEFORMATEX lpwf,
-                        LPCVOID lpWaveData, DWORD dwDataSize);
+                        LPCVOID lpWaveData, SIZE_T cbDataSize,
+                        const TIMELINE_GAP *pGaps = NULL, DWORD nGaps = 0);
+// Writes the segments one by one from where they lie.
+bool save_pcm_wave_file(LPTSTR lpszFileName, LPWAVEFORMATEX lpwf,
+                        const SegmentedBuffer& data,
+                        const TIMELINE_GAP *pGaps = NULL, DWORD nGaps = 0);
 
 class Recording
 {
 public:
     WAVEFORMATEX m_wfx;
-    LONG m_nValue;
-    LONG m_nMax;
     void SetInfo(WORD nChannels, DWORD nSamplesPerSec, WORD wBitsPerSample);
 
     Recording();
     ~Recording();
 
     void SetDevice(CComPtr<IMMDevice> pDevice);
+    // Captures from pSource instead of the device. NULL goes back to the
+    // device. The source must outlive the capture thread.
+    void SetSource(CaptureSource *pSource);
 
     BOOL StartHearing();
     BOOL StopHearing();
 
     BOOL SetRecording(BOOL bRecording);
 
+    // In streaming mode the recording is written to the file while capturing.
+    void SetStreaming(BOOL bStreaming);
+    void SetFileName(LPCTSTR pszFileName);
+    void SetOutputFormat(OUTPUT_FORMAT format);
+    // Streams m_wfx to hOutput instead of the file: a pipe or the standard
+    // output, as WAV of an open-ended size, or raw frames if !bHeader. The
+    // writer flushes whenever it has drained the ring, so the reader gets
+    // each packet about as it is captured; a reader that falls behind
+    // blocks the writer only, and the packets the ring cannot take are
+    // dropped and counted as overflows. The handle stays the caller's.
+    // NULL goes back to the file. Takes effect on the next SetRecording in
+    // streaming mode. See WaveStreamWriter.
+    void SetOutputHandle(HANDLE hOutput, BOOL bHeader = TRUE);
+    // The bytes written to the handle of the last recording, and those
+    // left out once its reader had gone.
+    ULONGLONG GetStreamedBytes() const;
+    ULONGLONG GetUnstreamedBytes() const;
+    // Reserves dwSeconds of m_wfx at a time in the streamed WAV file, and
+    // writes it through a mapping if bMapped. See WaveWriter.
+    void SetPreallocation(DWORD dwSeconds, BOOL bMapped);
+    // Splits a streamed WAV recording into files of dwSeconds or cbMaxFile
+    // at most, whichever comes first, and keeps the files of the recording
+    // within cbBudget by deleting the oldest. Zero turns a limit off. See
+    // RotatingWaveWriter.
+    void SetRotation(DWORD dwSeconds, ULONGLONG cbMaxFile = 0, ULONGLONG cbBudget = 0);
+    // The files of the last rotated recording, and those of them deleted.
+    DWORD GetRotatedFileCount() const;
+    DWORD GetDeletedFileCount() const;
+    // The capacity of the ring between the capture thread and the writer.
+    void SetRingDuration(DWORD dwMilliseconds);
+    // The period and the buffer the source is opened with, on the next
+    // StartHearing. A short buffer lowers the latency, but frames are lost
+    // as soon as the capture thread is late by more than it holds. The
+    // timing the source got goes into the capture stats. See CaptureSource.
+    void SetCaptureLatency(CAPTURE_LATENCY latency, DWORD dwBufferMilliseconds = 0);
+    // Keeps the last dwMilliseconds heard before SetRecording and puts them
+    // at the start of the recording. The buffer is allocated by
+    // StartHearing, in the capture format. Zero turns it off.
+    void SetPrerollDuration(DWORD dwMilliseconds);
+    // Leaves out of a WAV recording the packets flagged silent, and those
+    // whose peak stays below nThresholdDB once dwHoldMilliseconds have
+    // passed since the last louder one. The file then records where the
+    // silence was; see Timeline. FLAC keeps the silence, which it stores
+    // in constant subframes of a few bytes anyway.
+    void SetSilenceSkipping(BOOL bSkip, LONG nThresholdDB = -60,
+                            DWORD dwHoldMilliseconds = 500);
+    // The frames of m_wfx left out of the last recording.
+    ULONGLONG GetSkippedFrames() const;
+    // The times a gap found the writer behind on the earlier ones. Its
+    // silence went with the next gap, later than where it was.
+    DWORD GetGapOverflowCount() const;
+    // In native mode the source's float32 mix format is captured as is and
+    // converted to m_wfx on the writer thread, instead of by the audio
+    // engine. It falls back to m_wfx if the mix format is not float32, and
+    // to the rate of the mix if the Resampler refuses the ratio.
+    void SetNativeFormat(BOOL bNative);
+    void SetResampleQuality(RESAMPLE_QUALITY quality);
+    // Runs the recording through automatic gain control and a look-ahead
+    // limiter on the writer thread, in float32 at the rate and channels of
+    // m_wfx, before the conversion to its sample format. NULL turns it
+    // off. Takes effect on the next SetRecording. See DynamicsProcessor.
+    void SetDynamics(const DYNAMICS_SETTINGS *pSettings);
+    // What they did to the last recording, once it has stopped, and the
+    // latency they added in frames of m_wfx. FALSE if they were off.
+    BOOL GetDynamicsInfo(DYNAMICS_INFO& info, DWORD& nLatency) const;
+    // The format of the packets: the mix format while converting.
+    const WAVEFORMATEX *GetCaptureFormat() const;
+
+    // The number of packets dropped because the writer fell behind.
+    DWORD GetOverflowCount() const;
+    ULONGLONG GetDroppedBytes() const;
+    // The timing of the capture thread since StartHearing, from any thread.
+    // See CaptureTelemetry.
+    void GetCaptureStats(CAPTURE_STATS& stats) const;
+
     void SaveToFile();
 
+    // The RMS of the meter on a 40 dB scale. The dB value is computed
+    // here, on the caller's thread, not on the audio thread.
+    void GetMeter(LONG& nValue, LONG& nMax) const;
+    // The meter of all the packets so far, from any thread. See LevelMeter.
+    void GetMeterSnapshot(METER_SNAPSHOT& snapshot) const;
+    // Takes effect on the next StartHearing.
+    void SetMeterBallistics(DWORD dwAttackMilliseconds, DWORD dwReleaseMilliseconds,
+                            DWORD dwHoldMilliseconds, DWORD nFallDBPerSecond);
+    // Takes spectra of nFftSize points of the captured sound, on a thread
+    // of their own, and may append them to a spectrogram file. Takes effect
+    // on the next StartHearing; a size of zero turns it off. See
+    // SpectrumAnalyzer.
+    void SetSpectrum(DWORD nFftSize, DWORD nSpectraPerSecond = 20,
+                     LPCTSTR pszSpectrogram = NULL);
+    // The latest spectrum, from any thread. FALSE if there is none yet.
+    BOOL GetSpectrum(SPECTRUM_INFO& info, std::vector<float>& dB) const;
+    // Measures the loudness and true peak of the captured sound on the
+    // capture thread. Takes effect on the next StartHearing. See
+    // LoudnessMeter.
+    void SetLoudness(BOOL bEnable);
+    // The loudness as of the last 100 ms, from any thread. FALSE if it is
+    // not measured.
+    BOOL GetLoudness(LOUDNESS_INFO& info) const;
+    // Publishes the captured sound as it comes, in the capture format, in a
+    // shared-memory ring of dwMilliseconds named pszName, for any number of
+    // SharedTapReaders in other processes. It costs the capture thread a
+    // copy per packet. Takes effect on the next StartHearing; NULL turns it
+    // off. See SharedTapPublisher.
+    void SetTap(LPCTSTR pszName, DWORD dwMilliseconds = 2000);
+
     DWORD ThreadProc();
+    DWORD WriterProc();
 
 protected:
     HANDLE m_hShutdownEvent;
     HANDLE m_hWakeUp;
     HANDLE m_hThread;
-    CComPtr<IMMDevice> m_pDevice;
-    CComPtr<IAudioClient> m_pAudioClient;
-    CComPtr<IAudioCaptureClient> m_pCaptureClient;
-    MMCKINFO m_ckRIFF;
-    MMCKINFO m_ckData;
+    WasapiCaptureSource m_wasapi;
+    CaptureSource *m_pSource;
+    CAPTURE_LATENCY m_latency;
+    DWORD m_dwBufferMilliseconds;
     CRITICAL_SECTION m_lock;
     UINT32 m_nFrames;
-    std::vector<BYTE> m_wave_data;
+    SegmentedBuffer m_wave_data;
     BOOL m_bRecording;
+    SAMPLE_FORMAT m_format;
+    METER_LEVELS m_levels;              // the last packet's, capture thread only
+    LevelMeter m_meter;
+    DWORD m_dwMeterAttack;              // applied by StartHearing
+    DWORD m_dwMeterRelease;
+    DWORD m_dwMeterHold;
+    DWORD m_nMeterFall;
+    CaptureTelemetry m_telemetry;
+    SpectrumAnalyzer m_spectrum;
+    DWORD m_nSpectrumSize;
+    LoudnessMeter m_loudness;
+    BOOL m_bLoudness;
+    BOOL m_bMeasuringLoudness;          // as of StartHearing
+    TCHAR m_szTapName[MAX_PATH];
+    DWORD m_dwTapMilliseconds;
+    SharedTapPublisher m_tap;
+    BOOL m_bStreaming;
+    TCHAR m_szFileName[MAX_PATH];
+    OUTPUT_FORMAT m_output;
+    HANDLE m_hOutput;
+    BOOL m_bOutputHeader;
+    DWORD m_dwPreallocSeconds;
+    BOOL m_bMapped;
+    BOOL m_bNative;
+    BOOL m_bConverting;
+    WAVEFORMATEXTENSIBLE m_wfxNative;
+    std::vector<float> m_remapped;
+    std::vector<BYTE> m_converted;
+    BOOL m_bResampling;
+    RESAMPLE_QUALITY m_quality;
+    Resampler m_resampler;
+    std::vector<float> m_resampled;
+    BOOL m_bDynamics;
+    DYNAMICS_SETTINGS m_dynamicsSettings;
+    BOOL m_bProcessing;                 // the writer's, as of SetRecording
+    DynamicsProcessor m_dynamics;
+    std::vector<float> m_unpacked;
+    std::vector<float> m_processed;
+
+    HANDLE m_hWriterThread;
+    HANDLE m_hWriterWakeUp;
+    HANDLE m_hWriterShutdown;
+    WaveWriter m_writer;
+    WaveStreamWriter m_stream;
+    RotatingWaveWriter m_rotating;
+    DWORD m_dwRotateSeconds;
+    ULONGLONG m_cbRotateFile;
+    ULONGLONG m_cbDiskBudget;
+    FlacEncoder m_flac;
+    ImaAdpcmEncoder m_adpcm;
+    RingBuffer m_ring;
+    DWORD m_dwRingMilliseconds;
+    PrerollBuffer m_preroll;
+    DWORD m_dwPrerollMilliseconds;
+    BOOL m_bPrerollSpliced;
+    ULONGLONG m_nPrerollFrames;
+
+    BOOL m_bSkipSilence;
+    float m_fSilenceThreshold;
+    DWORD m_dwHoldMilliseconds;
+    // The capture thread's. A gap is sent through m_gapRing when the sound
+    // comes back, with positions in frames of the capture format.
+    BOOL m_bSkipping;
+    ULONGLONG m_nHoldFrames;
+    ULONGLONG m_nHoldLeft;
+    ULONGLONG m_nSkipRun;
+    ULONGLONG m_nStoredFrames;
+    RingBuffer m_gapRing;
+    // The writer's, in frames of m_wfx.
+    std::vector<TIMELINE_GAP> m_gaps;
+    ULONGLONG m_nSkippedFrames;
 
     static DWORD WINAPI ThreadFunction(LPVOID pContext);
+    static DWORD WINAPI WriterThreadFunction(LPVOID pContext);
+    BOOL StartWriter();
+    void StopWriter();
+    void PrepareFormat();
+    void WriteData(const BYTE *pb, DWORD cb);
+    void WriteCaptured(const BYTE *pb, DWORD cb);
+    void SplicePreroll();
+    BOOL SkipSilence(UINT32 nFrames, DWORD dwFlags);
+    void SendGap();
+    void DrainGaps(DWORD cbGaps);
+    void ConvertData(const BYTE *pb, DWORD cb);
+    void ConvertFloat(const float *pf, DWORD nFrames);
+    void WriteFloat(const float *pf, DWORD nFrames);
+    void DrainRing();
     void ScanBuffer(const BYTE *pb, DWORD cb, DWORD dwFlags);
 };
 
@@ -0,0 +1,428 @@
+#include "ReplayCaptureSource.hpp"
+#include "Convert.hpp"
+#include "WaveReader.hpp"
+#include <audioclient.h>
+#include <cmath>
+
+// In the flood mode the capture loop gets this many packets per wake-up,
+// so it still sees the shutdown event between batches.
+#define FLOOD_BATCH 16
+
+ReplayCaptureSource::ReplayCaptureSource()
+    : m_signal(REPLAY_SIGNAL_SINE)
+    , m_dwFrequency(1000)
+    , m_amplitude(0.5f)
+    , m_pacing(REPLAY_PACING_REALTIME)
+    , m_dwPeriod(10)
+    , m_latency(CAPTURE_LATENCY_DEFAULT)
+    , m_dwBufferMilliseconds(0)
+    , m_nLength(0)
+    , m_nMixSamplesPerSec(48000)
+    , m_nMixChannels(2)
+    , m_format(SAMPLE_FORMAT_UNKNOWN)
+    , m_hWakeUp(NULL)
+    , m_hFinished(NULL)
+    , m_idTimer(0)
+    , m_dwTimerPeriod(0)
+    , m_nPeriodFrames(0)
+    , m_nBufferFrames(0)
+    , m_nPosition(0)
+    , m_nDelivered(0)
+    , m_nLost(0)
+    , m_bDiscontinuity(FALSE)
+    , m_nTotal(0)
+    , m_nBatch(0)
+    , m_bStarted(FALSE)
+{
+    m_szFileName[0] = 0;
+    ZeroMemory(&m_wfx, sizeof(m_wfx));
+    m_hFinished = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    ::QueryPerformanceFrequency(&m_liFreq);
+    m_liStart.QuadPart = 0;
+}
+
+ReplayCaptureSource::~ReplayCaptureSource()
+{
+    Close();
+
+    if (m_hFinished)
+    {
+        ::CloseHandle(m_hFinished);
+        m_hFinished = NULL;
+    }
+}
+
+void ReplayCaptureSource::SetFile(LPCTSTR pszFileName)
+{
+    lstrcpyn(m_szFileName, pszFileName, ARRAYSIZE(m_szFileName));
+    m_signal = REPLAY_SIGNAL_FILE;
+}
+
+void ReplayCaptureSource::SetSignal(REPLAY_SIGNAL signal, DWORD dwFrequency,
+                                    float amplitude)
+{
+    m_signal = signal;
+    m_dwFrequency = dwFrequency;
+    m_amplitude = amplitude;
+}
+
+void ReplayCaptureSource::SetMixFormat(DWORD nSamplesPerSec, WORD nChannels)
+{
+    m_nMixSamplesPerSec = nSamplesPerSec;
+    m_nMixChannels = nChannels;
+}
+
+HRESULT ReplayCaptureSource::GetMixFormat(WAVEFORMATEXTENSIBLE *pwfx)
+{
+    if (m_signal == REPLAY_SIGNAL_FILE)
+        return E_NOTIMPL;
+
+    get_float_format(pwfx, m_nMixSamplesPerSec, m_nMixChannels);
+    return S_OK;
+}
+
+void ReplayCaptureSource::SetPacing(REPLAY_PACING pacing)
+{
+    m_pacing = pacing;
+}
+
+void ReplayCaptureSource::SetPeriod(DWORD dwMilliseconds)
+{
+    m_dwPeriod = dwMilliseconds ? dwMilliseconds : 1;
+}
+
+void ReplayCaptureSource::SetLength(ULONGLONG nFrames)
+{
+    m_nLength = nFrames;
+}
+
+void ReplayCaptureSource::SetLatency(CAPTURE_LATENCY latency, DWORD dwBufferMilliseconds)
+{
+    m_latency = latency;
+    m_dwBufferMilliseconds = dwBufferMilliseconds;
+}
+
+HRESULT ReplayCaptureSource::GetTiming(CAPTURE_TIMING *pTiming)
+{
+    if (!m_hWakeUp)
+        return E_POINTER;
+    pTiming->nSamplesPerSec = m_wfx.nSamplesPerSec;
+    pTiming->nPeriodFrames = m_nPeriodFrames;
+    pTiming->nBufferFrames = m_nBufferFrames;
+    return S_OK;
+}
+
+HRESULT ReplayCaptureSource::LoadFile()
+{
+    WaveReader reader;
+    if (!reader.Open(m_szFileName))
+    {
+        if (::GetFileAttributes(m_szFileName) == INVALID_FILE_ATTRIBUTES)
+            return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+        return AUDCLNT_E_UNSUPPORTED_FORMAT;
+    }
+
+    const WAVEFORMATEX *pwfx = reader.GetFormat();
+    if (pwfx->nChannels != m_wfx.nChannels ||
+        pwfx->nSamplesPerSec != m_wfx.nSamplesPerSec ||
+        pwfx->wBitsPerSample != m_wfx.wBitsPerSample ||
+        reader.GetSampleFormat() != m_format)
+    {
+        return AUDCLNT_E_UNSUPPORTED_FORMAT;
+    }
+
+    // Whole frames only.
+    const ULONGLONG nFrames = reader.GetFrameCount();
+    const ULONGLONG cbData = nFrames * m_wfx.nBlockAlign;
+    if (cbData > 0x7FFFFFFF)
+        return E_OUTOFMEMORY;
+    m_data.resize(size_t(cbData));
+    if (nFrames)
+    {
+        const BYTE *pb = reader.GetFrames(0, nFrames);
+        if (!pb)
+            return HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+        CopyMemory(m_data.data(), pb, size_t(cbData));
+    }
+    return S_OK;
+}
+
+HRESULT ReplayCaptureSource::Synthesize()
+{
+    if (m_format == SAMPLE_FORMAT_UNKNOWN)
+        return AUDCLNT_E_UNSUPPORTED_FORMAT;
+
+    // One second, so a sine of a whole frequency loops without a seam.
+    const DWORD nFrames = m_wfx.nSamplesPerSec;
+    const WORD nChannels = m_wfx.nChannels;
+    std::vector<float> signal(nFrames * nChannels);
+
+    const double omega = 2 * 3.14159265358979323846 * m_dwFrequency / m_wfx.nSamplesPerSec;
+    DWORD seed = 1;
+    float *pf = signal.data();
+    for (DWORD i = 0; i < nFrames; ++i)
+    {
+        float x;
+        switch (m_signal)
+        {
+        case REPLAY_SIGNAL_SINE:
+            x = m_amplitude * float(std::sin(omega * i));
+            break;
+        case REPLAY_SIGNAL_NOISE:
+            seed = seed * 1664525 + 1013904223;
+            x = m_amplitude * (float(seed >> 8) / 8388608.0f - 1.0f);
+            break;
+        default:
+            x = 0;
+            break;
+        }
+
+        for (WORD iChannel = 0; iChannel < nChannels; ++iChannel)
+            *pf++ = x;
+    }
+
+    m_data.resize(nFrames * m_wfx.nBlockAlign);
+    convert_from_float(m_format, signal.data(), DWORD(signal.size()), m_data.data());
+    return S_OK;
+}
+
+HRESULT ReplayCaptureSource::Open(const WAVEFORMATEX *pwfx, HANDLE hWakeUp)
+{
+    Close();
+
+    // Keep the plain part; the sample format carries the sub-format.
+    m_format = get_sample_format(pwfx);
+    m_wfx = *pwfx;
+    m_wfx.cbSize = 0;
+    if (m_wfx.nBlockAlign == 0)
+        return AUDCLNT_E_UNSUPPORTED_FORMAT;
+
+    HRESULT hr = (m_signal == REPLAY_SIGNAL_FILE) ? LoadFile() : Synthesize();
+    if (FAILED(hr))
+    {
+        Close();
+        ::SetEvent(m_hFinished);
+        return hr;
+    }
+
+    // The buffer is sized as WasapiCaptureSource sizes it.
+    m_dwTimerPeriod = m_dwPeriod;
+    DWORD dwBuffer = m_dwBufferMilliseconds;
+    if (m_latency == CAPTURE_LATENCY_LOW)
+    {
+        if (m_dwTimerPeriod > REPLAY_MINIMUM_PERIOD)
+            m_dwTimerPeriod = REPLAY_MINIMUM_PERIOD;
+    }
+    else if (dwBuffer == 0)
+    {
+        dwBuffer = REPLAY_DEFAULT_BUFFER;
+    }
+    m_nPeriodFrames = MulDiv(m_wfx.nSamplesPerSec, m_dwTimerPeriod, 1000);
+    if (m_nPeriodFrames == 0)
+        m_nPeriodFrames = 1;
+    m_nBufferFrames = get_buffer_frames(m_nPeriodFrames, m_wfx.nSamplesPerSec, dwBuffer);
+    m_packet.resize(m_nPeriodFrames * m_wfx.nBlockAlign);
+
+    ULONGLONG nDataFrames = m_data.size() / m_wfx.nBlockAlign;
+    if (m_nLength)
+        m_nTotal = (nDataFrames ? m_nLength : 0);
+    else if (m_signal == REPLAY_SIGNAL_FILE)
+        m_nTotal = nDataFrames;
+    else
+        m_nTotal = ~ULONGLONG(0);
+
+    m_hWakeUp = hWakeUp;
+    m_nPosition = 0;
+    m_nDelivered = 0;
+    m_nLost = 0;
+    m_bDiscontinuity = FALSE;
+    m_nBatch = 0;
+    ::ResetEvent(m_hFinished);
+    if (m_nTotal == 0)
+        ::SetEvent(m_hFinished);
+    return S_OK;
+}
+
+void ReplayCaptureSource::Close()
+{
+    Stop();
+
+    std::vector<BYTE>().swap(m_data);
+    std::vector<BYTE>().swap(m_packet);
+    m_hWakeUp = NULL;
+}
+
+HRESULT ReplayCaptureSource::Start()
+{
+    if (!m_hWakeUp)
+        return E_POINTER;
+
+    m_liStart.QuadPart = GetClock();
+    m_bStarted = TRUE;
+
+    if (m_pacing == REPLAY_PACING_REALTIME)
+    {
+        m_idTimer = ::timeSetEvent(m_dwTimerPeriod, 1, (LPTIMECALLBACK)m_hWakeUp, 0,
+                                   TIME_PERIODIC | TIME_CALLBACK_EVENT_SET);
+        if (m_idTimer == 0)
+        {
+            m_bStarted = FALSE;
+            return E_FAIL;
+        }
+    }
+    else
+    {
+        ::SetEvent(m_hWakeUp);
+    }
+    return S_OK;
+}
+
+HRESULT ReplayCaptureSource::Stop()
+{
+    if (m_idTimer)
+    {
+        ::timeKillEvent(m_idTimer);
+        m_idTimer = 0;
+    }
+    m_bStarted = FALSE;
+    return S_OK;
+}
+
+LONGLONG ReplayCaptureSource::GetClock() const
+{
+    LARGE_INTEGER liNow;
+    ::QueryPerformanceCounter(&liNow);
+    return liNow.QuadPart;
+}
+
+ULONGLONG ReplayCaptureSource::GetDueFrames() const
+{
+    ULONGLONG nTicks = GetClock() - m_liStart.QuadPart;
+    ULONGLONG nFreq = m_liFreq.QuadPart;
+    return (nTicks / nFreq) * m_wfx.nSamplesPerSec +
+           (nTicks % nFreq) * m_wfx.nSamplesPerSec / nFreq;
+}
+
+HRESULT ReplayCaptureSource::GetNextPacketSize(UINT32 *pnFrames)
+{
+    *pnFrames = 0;
+    if (!m_bStarted || m_nPosition >= m_nTotal)
+        return S_OK;
+
+    ULONGLONG nDue = 0;
+    if (m_pacing == REPLAY_PACING_REALTIME)
+    {
+        // The oldest periods are overwritten once the buffer is full.
+        nDue = GetDueFrames();
+        if (nDue > m_nPosition + m_nBufferFrames)
+        {
+            ULONGLONG nOver = nDue - m_nPosition - m_nBufferFrames;
+            ULONGLONG nLost = (nOver + m_nPeriodFrames - 1) / m_nPeriodFrames * m_nPeriodFrames;
+            if (nLost > m_nTotal - m_nPosition)
+                nLost = m_nTotal - m_nPosition;
+            m_nPosition += nLost;
+            m_nLost += nLost;
+            m_bDiscontinuity = TRUE;
+            if (m_nPosition >= m_nTotal)
+            {
+                ::SetEvent(m_hFinished);
+                return S_OK;
+            }
+        }
+    }
+
+    ULONGLONG nRemaining = m_nTotal - m_nPosition;
+    UINT32 nFrames = UINT32(nRemaining < m_nPeriodFrames ? nRemaining : m_nPeriodFrames);
+
+    if (m_pacing == REPLAY_PACING_REALTIME)
+    {
+        if (nDue < m_nPosition + nFrames)
+            return S_OK;
+    }
+    else if (++m_nBatch > FLOOD_BATCH)
+    {
+        m_nBatch = 0;
+        ::SetEvent(m_hWakeUp);
+        return S_OK;
+    }
+
+    *pnFrames = nFrames;
+    return S_OK;
+}
+
+HRESULT ReplayCaptureSource::GetBuffer(BYTE **ppData, UINT32 *pnFrames, DWORD *pdwFlags,
+                                       UINT64 *pu64DevicePosition,
+                                       UINT64 *pu64QPCPosition)
+{
+    if (!m_bStarted || m_nPosition >= m_nTotal)
+        return AUDCLNT_S_BUFFER_EMPTY;
+
+    ULONGLONG nRemaining = m_nTotal - m_nPosition;
+    UINT32 nFrames = UINT32(nRemaining < m_nPeriodFrames ? nRemaining : m_nPeriodFrames);
+
+    // The packet points into the signal unless it wraps around its end.
+    const DWORD nBlockAlign = m_wfx.nBlockAlign;
+    const ULONGLONG nDataFrames = m_data.size() / nBlockAlign;
+    DWORD iFrame = DWORD(m_nPosition % nDataFrames);
+    if (iFrame + nFrames <= nDataFrames)
+    {
+        *ppData = &m_data[iFrame * nBlockAlign];
+    }
+    else
+    {
+        DWORD cb1 = DWORD(nDataFrames - iFrame) * nBlockAlign;
+        DWORD cb = nFrames * nBlockAlign;
+        BYTE *pb = m_packet.data();
+        CopyMemory(pb, &m_data[iFrame * nBlockAlign], cb1);
+        for (DWORD cbDone = cb1; cbDone < cb; )
+        {
+            DWORD cbCopy = cb - cbDone;
+            if (cbCopy > m_data.size())
+                cbCopy = DWORD(m_data.size());
+            CopyMemory(pb + cbDone, m_data.data(), cbCopy);
+            cbDone += cbCopy;
+        }
+        *ppData = pb;
+    }
+
+    *pnFrames = nFrames;
+    *pdwFlags = (m_signal == REPLAY_SIGNAL_SILENCE) ? AUDCLNT_BUFFERFLAGS_SILENT : 0;
+    if (m_bDiscontinuity)
+        *pdwFlags |= AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY;
+
+    if (pu64DevicePosition)
+        *pu64DevicePosition = m_nPosition;
+
+    if (pu64QPCPosition)
+    {
+        // In 100-nanosecond units, as IAudioCaptureClient reports it: the
+        // time the first frame of the packet was captured.
+        LONGLONG llTime;
+        ULONGLONG nOffset = 0;
+        if (m_pacing == REPLAY_PACING_REALTIME)
+        {
+            llTime = m_liStart.QuadPart;
+            nOffset = m_nPosition * 10000000 / m_wfx.nSamplesPerSec;
+        }
+        else
+        {
+            llTime = GetClock();
+        }
+        ULONGLONG nTicks = llTime;
+        ULONGLONG nFreq = m_liFreq.QuadPart;
+        *pu64QPCPosition = (nTicks / nFreq) * 10000000 +
+                           (nTicks % nFreq) * 10000000 / nFreq + nOffset;
+    }
+
+    return S_OK;
+}
+
+HRESULT ReplayCaptureSource::ReleaseBuffer(UINT32 nFrames)
+{
+    m_nPosition += nFrames;
+    m_nDelivered += nFrames;
+    m_bDiscontinuity = FALSE;
+    if (m_nPosition >= m_nTotal)
+        ::SetEvent(m_hFinished);
+    return S_OK;
+}
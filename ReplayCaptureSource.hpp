@@ -0,0 +1,128 @@
+#ifndef REPLAY_CAPTURE_SOURCE_HPP_
+#define REPLAY_CAPTURE_SOURCE_HPP_
+
+#include "CaptureSource.hpp"
+#include "Meter.hpp"
+#include <vector>
+
+// The shortest period of the simulated device, in milliseconds.
+#define REPLAY_MINIMUM_PERIOD 3
+// The buffer of the default latency when none is asked for.
+#define REPLAY_DEFAULT_BUFFER 100
+
+enum REPLAY_SIGNAL
+{
+    REPLAY_SIGNAL_FILE,
+    REPLAY_SIGNAL_SILENCE,
+    REPLAY_SIGNAL_SINE,
+    REPLAY_SIGNAL_NOISE
+};
+
+enum REPLAY_PACING
+{
+    // Packets become ready at the rate of the format, one period at a time.
+    REPLAY_PACING_REALTIME,
+    // Packets are always ready, so the pipeline runs as fast as it can.
+    REPLAY_PACING_FLOOD
+};
+
+// Replays a WAV file or a synthetic signal without an audio device, so
+// the capture pipeline can be driven deterministically. Paced in real
+// time, it simulates the clock and the buffer of a device: frames the
+// capture thread has not taken a buffer after they were due are lost a
+// period at a time, and the next packet is flagged as a discontinuity and
+// positioned past them, as a device overwrites its buffer.
+class ReplayCaptureSource : public CaptureSource
+{
+public:
+    ReplayCaptureSource();
+    virtual ~ReplayCaptureSource();
+
+    // The file must be in the format passed to Open.
+    void SetFile(LPCTSTR pszFileName);
+    void SetSignal(REPLAY_SIGNAL signal, DWORD dwFrequency = 1000,
+                   float amplitude = 0.5f);
+    // The float32 format a synthetic signal reports as its mix format. A
+    // file is replayed in its own format only, so it has no mix format.
+    void SetMixFormat(DWORD nSamplesPerSec, WORD nChannels);
+    void SetPacing(REPLAY_PACING pacing);
+    // The period of the default latency. The low latency runs at
+    // REPLAY_MINIMUM_PERIOD if that is shorter.
+    void SetPeriod(DWORD dwMilliseconds);
+    // The number of frames to deliver. Zero replays a file once and a
+    // synthetic signal forever.
+    void SetLength(ULONGLONG nFrames);
+
+    // Signaled when the last packet has been released or Open failed.
+    HANDLE GetFinishedEvent() const
+    {
+        return m_hFinished;
+    }
+    ULONGLONG GetDeliveredFrames() const
+    {
+        return m_nDelivered;
+    }
+    // The frames lost to overruns of the simulated buffer.
+    ULONGLONG GetLostFrames() const
+    {
+        return m_nLost;
+    }
+
+    virtual HRESULT Open(const WAVEFORMATEX *pwfx, HANDLE hWakeUp);
+    virtual void Close();
+    virtual HRESULT GetMixFormat(WAVEFORMATEXTENSIBLE *pwfx);
+    virtual void SetLatency(CAPTURE_LATENCY latency, DWORD dwBufferMilliseconds);
+    virtual HRESULT GetTiming(CAPTURE_TIMING *pTiming);
+
+    virtual HRESULT Start();
+    virtual HRESULT Stop();
+
+    virtual HRESULT GetNextPacketSize(UINT32 *pnFrames);
+    virtual HRESULT GetBuffer(BYTE **ppData, UINT32 *pnFrames, DWORD *pdwFlags,
+                              UINT64 *pu64DevicePosition,
+                              UINT64 *pu64QPCPosition);
+    virtual HRESULT ReleaseBuffer(UINT32 nFrames);
+
+protected:
+    TCHAR m_szFileName[MAX_PATH];
+    REPLAY_SIGNAL m_signal;
+    DWORD m_dwFrequency;
+    float m_amplitude;
+    REPLAY_PACING m_pacing;
+    DWORD m_dwPeriod;
+    CAPTURE_LATENCY m_latency;
+    DWORD m_dwBufferMilliseconds;
+    ULONGLONG m_nLength;
+    DWORD m_nMixSamplesPerSec;
+    WORD m_nMixChannels;
+
+    WAVEFORMATEX m_wfx;
+    SAMPLE_FORMAT m_format;
+    HANDLE m_hWakeUp;
+    HANDLE m_hFinished;
+    MMRESULT m_idTimer;
+    std::vector<BYTE> m_data;
+    std::vector<BYTE> m_packet;
+    DWORD m_dwTimerPeriod;
+    UINT32 m_nPeriodFrames;
+    UINT32 m_nBufferFrames;
+    ULONGLONG m_nPosition;              // of the next frame, on the device's clock
+    ULONGLONG m_nDelivered;
+    ULONGLONG m_nLost;
+    BOOL m_bDiscontinuity;
+    ULONGLONG m_nTotal;
+    UINT32 m_nBatch;
+    LARGE_INTEGER m_liFreq;
+    LARGE_INTEGER m_liStart;
+    BOOL m_bStarted;
+
+    HRESULT LoadFile();
+    HRESULT Synthesize();
+    ULONGLONG GetDueFrames() const;
+
+    // The clock that paces the packets and stamps them, in ticks of
+    // m_liFreq: the performance counter. Checks override it to step time.
+    virtual LONGLONG GetClock() const;
+};
+
+#endif  // ndef REPLAY_CAPTURE_SOURCE_HPP_
@@ -0,0 +1,328 @@
+#include "Resampler.hpp"
+#include "Convert.hpp"
+#include "WaveWriter.hpp"
+#include "WaveReader.hpp"
+#include "Simd.hpp"
+#include <cmath>
+
+#define PI 3.14159265358979323846
+
+struct RESAMPLE_PRESET
+{
+    DWORD nTaps;
+    double rolloff;     // the passband edge relative to the lower Nyquist
+    double beta;        // of the Kaiser window
+};
+
+static const RESAMPLE_PRESET s_presets[] =
+{
+    { 16, 0.85, 6.0 },
+    { 32, 0.91, 8.0 },
+    { 64, 0.95, 10.0 },
+};
+
+const char *get_resample_quality_name(RESAMPLE_QUALITY quality)
+{
+    switch (quality)
+    {
+    case RESAMPLE_FAST:
+        return "fast";
+    case RESAMPLE_HIGH:
+        return "high";
+    default:
+        return "balanced";
+    }
+}
+
+static DWORD get_gcd(DWORD a, DWORD b)
+{
+    while (b)
+    {
+        DWORD t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// The modified Bessel function of the first kind, order zero.
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    for (int k = 1; k < 50; ++k)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static float dot_scalar(const float *x, const float *h, DWORD n)
+{
+    float sum = 0;
+    for (DWORD i = 0; i < n; ++i)
+        sum += x[i] * h[i];
+    return sum;
+}
+
+#ifdef SIMD_X86
+// The tap counts are multiples of eight.
+TARGET_SSE2 static float dot_sse2(const float *x, const float *h, DWORD n)
+{
+    __m128 a = _mm_setzero_ps(), b = _mm_setzero_ps();
+    for (DWORD i = 0; i < n; i += 8)
+    {
+        a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+        b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(h + i + 4)));
+    }
+    a = _mm_add_ps(a, b);
+    a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+    a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+    return _mm_cvtss_f32(a);
+}
+
+TARGET_AVX2 static float dot_avx2(const float *x, const float *h, DWORD n)
+{
+    __m256 a = _mm256_setzero_ps();
+    for (DWORD i = 0; i < n; i += 8)
+        a = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(h + i), a);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+typedef float (*DOT_PROC)(const float *x, const float *h, DWORD n);
+
+static DOT_PROC get_dot_proc()
+{
+#ifdef SIMD_X86
+    switch (get_simd_level())
+    {
+    case SIMD_AVX2:
+        return dot_avx2;
+    case SIMD_SSE2:
+        return dot_sse2;
+    default:
+        break;
+    }
+#endif
+    return dot_scalar;
+}
+
+Resampler::Resampler()
+    : m_nInRate(0)
+    , m_nOutRate(0)
+    , m_nChannels(0)
+    , m_L(1)
+    , m_M(1)
+    , m_nTaps(0)
+    , m_nStride(0)
+    , m_nPlaneFrames(0)
+    , m_nBase(0)
+    , m_nPhase(0)
+{
+}
+
+BOOL Resampler::Init(DWORD nInRate, DWORD nOutRate, WORD nChannels,
+                     RESAMPLE_QUALITY quality)
+{
+    if (nInRate == 0 || nOutRate == 0 || nChannels == 0)
+        return FALSE;
+
+    DWORD gcd = get_gcd(nInRate, nOutRate);
+    DWORD L = nOutRate / gcd, M = nInRate / gcd;
+    if (L > MAX_PHASES)
+        return FALSE;
+
+    const RESAMPLE_PRESET& preset = s_presets[quality];
+    m_nInRate = nInRate;
+    m_nOutRate = nOutRate;
+    m_nChannels = nChannels;
+    m_L = L;
+    m_M = M;
+    m_nTaps = preset.nTaps;
+
+    // The prototype runs at L times the input rate; its cutoff is below
+    // the lower of the two Nyquist frequencies, and the gain of L makes up
+    // for the zeros of the upsampling.
+    const DWORD nLength = L * m_nTaps;
+    const double center = (nLength - 1) / 2.0;
+    const double fc = 0.5 * preset.rolloff / (L > M ? L : M);
+    const double i0beta = bessel_i0(preset.beta);
+
+    m_coefs.resize(nLength);
+    for (DWORD i = 0; i < nLength; ++i)
+    {
+        double t = i - center;
+        double x = 2 * fc * t;
+        double sinc = (x == 0) ? 1.0 : std::sin(PI * x) / (PI * x);
+        double r = t / (center > 0 ? center : 1);
+        double window = bessel_i0(preset.beta * std::sqrt(1 - r * r)) / i0beta;
+
+        DWORD p = i % L, k = i / L;
+        m_coefs[p * m_nTaps + (m_nTaps - 1 - k)] = float(2 * fc * sinc * window * L);
+    }
+
+    Reset();
+    return TRUE;
+}
+
+void Resampler::Reset()
+{
+    m_nStride = m_nTaps;
+    m_planes.assign(m_nChannels * m_nStride, 0.0f);
+    m_pointers.resize(m_nChannels);
+    m_nPlaneFrames = m_nTaps - 1;
+    m_nBase = m_nTaps - 1;
+    m_nPhase = 0;
+}
+
+void Resampler::Reserve(DWORD nFrames)
+{
+    if (m_nPlaneFrames + nFrames <= m_nStride)
+        return;
+
+    DWORD nStride = m_nPlaneFrames + nFrames;
+    std::vector<float> planes(m_nChannels * nStride);
+    for (WORD c = 0; c < m_nChannels; ++c)
+    {
+        CopyMemory(&planes[c * nStride], &m_planes[c * m_nStride],
+                   m_nPlaneFrames * sizeof(float));
+    }
+    m_planes.swap(planes);
+    m_nStride = nStride;
+}
+
+DWORD Resampler::Process(const float *pIn, DWORD nFrames, std::vector<float>& out)
+{
+    Reserve(nFrames);
+    for (WORD c = 0; c < m_nChannels; ++c)
+        m_pointers[c] = &m_planes[c * m_nStride + m_nPlaneFrames];
+    deinterleave_float(pIn, nFrames, m_nChannels, m_pointers.data());
+    m_nPlaneFrames += nFrames;
+
+    ULONGLONG nMax = 0;
+    if (m_nBase < m_nPlaneFrames)
+        nMax = ULONGLONG(m_nPlaneFrames - m_nBase) * m_L / m_M + 2;
+    out.resize(size_t(nMax * m_nChannels));
+
+    const DOT_PROC dot = get_dot_proc();
+    const DWORD nHistory = m_nTaps - 1;
+    float *pOut = out.data();
+    DWORD nOut = 0;
+    while (m_nBase < m_nPlaneFrames)
+    {
+        const float *h = &m_coefs[m_nPhase * m_nTaps];
+        const float *x = &m_planes[m_nBase - nHistory];
+        for (WORD c = 0; c < m_nChannels; ++c, x += m_nStride)
+            *pOut++ = dot(x, h, m_nTaps);
+        ++nOut;
+
+        m_nPhase += m_M;
+        m_nBase += m_nPhase / m_L;
+        m_nPhase %= m_L;
+    }
+    out.resize(nOut * m_nChannels);
+
+    // Keep the frames the next outputs reach back to.
+    DWORD nDrop = m_nPlaneFrames - nHistory;
+    for (WORD c = 0; c < m_nChannels; ++c)
+    {
+        float *pPlane = &m_planes[c * m_nStride];
+        MoveMemory(pPlane, pPlane + nDrop, nHistory * sizeof(float));
+    }
+    m_nPlaneFrames = nHistory;
+    m_nBase -= nDrop;
+
+    return nOut;
+}
+
+DWORD Resampler::Flush(std::vector<float>& out)
+{
+    DWORD nFrames = m_nTaps / 2;
+    m_zeros.assign(nFrames * m_nChannels, 0.0f);
+    return Process(m_zeros.data(), nFrames, out);
+}
+
+BOOL resample_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput, DWORD nOutRate,
+                        RESAMPLE_QUALITY quality, double *pRealtime)
+{
+    WaveReader reader;
+    if (!reader.Open(pszInput))
+        return FALSE;
+
+    const WAVEFORMATEXTENSIBLE& wfx = reader.GetInfo().wfx;
+    SAMPLE_FORMAT format = reader.GetSampleFormat();
+    const WORD nChannels = wfx.Format.nChannels;
+    const DWORD nInRate = wfx.Format.nSamplesPerSec;
+    const WORD nBlockAlign = wfx.Format.nBlockAlign;
+
+    Resampler resampler;
+    if (format == SAMPLE_FORMAT_UNKNOWN || nBlockAlign == 0 ||
+        !resampler.Init(nInRate, nOutRate, nChannels, quality))
+    {
+        return FALSE;
+    }
+
+    WAVEFORMATEXTENSIBLE wfxOut = wfx;
+    wfxOut.Format.nSamplesPerSec = nOutRate;
+    wfxOut.Format.nAvgBytesPerSec = nOutRate * nBlockAlign;
+
+    WaveWriter writer;
+    if (!writer.Open(pszOutput, &wfxOut.Format))
+        return FALSE;
+
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    ::QueryPerformanceFrequency(&liFreq);
+    ::QueryPerformanceCounter(&liStart);
+
+    const DWORD nBlockFrames = 65536;
+    const ULONGLONG nTotal = reader.GetFrameCount();
+    std::vector<float> in, out;
+    std::vector<BYTE> converted;
+    ULONGLONG nInFrames = 0;
+    BOOL bOK = TRUE;
+    for (BOOL bLast = FALSE; bOK && !bLast; )
+    {
+        DWORD nOut;
+        if (nInFrames < nTotal)
+        {
+            DWORD nFrames = (nTotal - nInFrames < nBlockFrames) ?
+                            DWORD(nTotal - nInFrames) : nBlockFrames;
+            const BYTE *pb = reader.GetFrames(nInFrames, nFrames);
+            if (!pb)
+            {
+                bOK = FALSE;
+                break;
+            }
+
+            in.resize(nFrames * nChannels);
+            convert_to_float(format, pb, nFrames * nChannels, in.data());
+            nOut = resampler.Process(in.data(), nFrames, out);
+            nInFrames += nFrames;
+        }
+        else
+        {
+            nOut = resampler.Flush(out);
+            bLast = TRUE;
+        }
+
+        converted.resize(nOut * nBlockAlign);
+        convert_from_float(format, out.data(), nOut * nChannels, converted.data());
+        bOK = writer.Write(converted.data(), DWORD(converted.size()));
+    }
+
+    bOK = writer.Close() && bOK;
+
+    ::QueryPerformanceCounter(&liEnd);
+    if (pRealtime)
+    {
+        double seconds = double(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+        *pRealtime = (seconds > 0) ? (double(nInFrames) / nInRate) / seconds : 0;
+    }
+    return bOK;
+}
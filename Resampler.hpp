@@ -0,0 +1,75 @@
+#ifndef RESAMPLER_HPP_
+#define RESAMPLER_HPP_
+
+#include <windows.h>
+#include <vector>
+
+enum RESAMPLE_QUALITY
+{
+    RESAMPLE_FAST,      // 16 taps per phase
+    RESAMPLE_BALANCED,  // 32 taps per phase
+    RESAMPLE_HIGH       // 64 taps per phase
+};
+
+// A polyphase FIR sample-rate converter for interleaved float32 frames.
+// The ratio is reduced to L/M, so every pair of the usual rates works; a
+// ratio needing more than MAX_PHASES phases is refused. The filter is a
+// Kaiser-windowed sinc and delays the stream by half its length.
+class Resampler
+{
+public:
+    enum { MAX_PHASES = 4096 };
+
+    Resampler();
+
+    BOOL Init(DWORD nInRate, DWORD nOutRate, WORD nChannels,
+              RESAMPLE_QUALITY quality);
+    // Forgets the history, as at the start of a stream.
+    void Reset();
+
+    // out receives the output frames; returns how many there are.
+    DWORD Process(const float *pIn, DWORD nFrames, std::vector<float>& out);
+    // Pushes the tail of the filter out at the end of a stream.
+    DWORD Flush(std::vector<float>& out);
+
+    DWORD GetInRate() const
+    {
+        return m_nInRate;
+    }
+    DWORD GetOutRate() const
+    {
+        return m_nOutRate;
+    }
+
+protected:
+    DWORD m_nInRate;
+    DWORD m_nOutRate;
+    WORD m_nChannels;
+    DWORD m_L;
+    DWORD m_M;
+    DWORD m_nTaps;
+    // Phase p holds its taps reversed at m_coefs[p * m_nTaps], so an output
+    // is a plain dot product with the input before it.
+    std::vector<float> m_coefs;
+    // One plane per channel, m_nStride apart: m_nTaps - 1 frames of
+    // history, then the input.
+    std::vector<float> m_planes;
+    std::vector<float *> m_pointers;
+    DWORD m_nStride;
+    DWORD m_nPlaneFrames;
+    // The next output is phase m_nPhase at input frame m_nBase.
+    DWORD m_nBase;
+    DWORD m_nPhase;
+    std::vector<float> m_zeros;
+
+    void Reserve(DWORD nFrames);
+};
+
+const char *get_resample_quality_name(RESAMPLE_QUALITY quality);
+
+// Converts a WAV file offline to nOutRate, keeping its sample format and
+// channels. pRealtime receives the speed in multiples of real time.
+BOOL resample_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput, DWORD nOutRate,
+                        RESAMPLE_QUALITY quality, double *pRealtime);
+
+#endif  // ndef RESAMPLER_HPP_
@@ -0,0 +1,125 @@
+#include "RingBuffer.hpp"
+
+RingBuffer::RingBuffer()
+    : m_nWritePos(0)
+    , m_nReadPos(0)
+    , m_nOverflows(0)
+    , m_cbDropped(0)
+    , m_cbHighWater(0)
+{
+}
+
+BOOL RingBuffer::Allocate(DWORD cbCapacity)
+{
+    if (cbCapacity == 0)
+        return FALSE;
+
+    m_data.assign(cbCapacity, 0);
+    Reset();
+    return TRUE;
+}
+
+void RingBuffer::Free()
+{
+    std::vector<BYTE>().swap(m_data);
+    Reset();
+}
+
+void RingBuffer::Reset()
+{
+    m_nWritePos.store(0);
+    m_nReadPos.store(0);
+    m_nOverflows.store(0);
+    m_cbDropped.store(0);
+    m_cbHighWater.store(0);
+}
+
+BOOL RingBuffer::Write(LPCVOID pvData, DWORD cbData)
+{
+    const ULONGLONG nWritePos = m_nWritePos.load(std::memory_order_relaxed);
+    const ULONGLONG nReadPos = m_nReadPos.load(std::memory_order_acquire);
+    const DWORD cbCapacity = DWORD(m_data.size());
+    const DWORD cbUsed = DWORD(nWritePos - nReadPos);
+
+    if (cbData > cbCapacity - cbUsed)
+    {
+        m_nOverflows.store(m_nOverflows.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_relaxed);
+        m_cbDropped.store(m_cbDropped.load(std::memory_order_relaxed) + cbData,
+                          std::memory_order_relaxed);
+        return FALSE;
+    }
+
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    DWORD iStart = DWORD(nWritePos % cbCapacity);
+    DWORD cb1 = cbCapacity - iStart;
+    if (cb1 > cbData)
+        cb1 = cbData;
+    CopyMemory(&m_data[iStart], pb, cb1);
+    if (cbData > cb1)
+        CopyMemory(&m_data[0], pb + cb1, cbData - cb1);
+
+    m_nWritePos.store(nWritePos + cbData, std::memory_order_release);
+
+    if (cbUsed + cbData > m_cbHighWater.load(std::memory_order_relaxed))
+        m_cbHighWater.store(cbUsed + cbData, std::memory_order_relaxed);
+
+    return TRUE;
+}
+
+DWORD RingBuffer::GetReadable() const
+{
+    const ULONGLONG nWritePos = m_nWritePos.load(std::memory_order_acquire);
+    const ULONGLONG nReadPos = m_nReadPos.load(std::memory_order_relaxed);
+    return DWORD(nWritePos - nReadPos);
+}
+
+DWORD RingBuffer::Peek(const BYTE **ppb1, DWORD *pcb1,
+                       const BYTE **ppb2, DWORD *pcb2) const
+{
+    const DWORD cbReadable = GetReadable();
+    const DWORD cbCapacity = DWORD(m_data.size());
+    if (cbReadable == 0)
+    {
+        *ppb1 = *ppb2 = NULL;
+        *pcb1 = *pcb2 = 0;
+        return 0;
+    }
+
+    DWORD iStart = DWORD(m_nReadPos.load(std::memory_order_relaxed) % cbCapacity);
+    DWORD cb1 = cbCapacity - iStart;
+    if (cb1 > cbReadable)
+        cb1 = cbReadable;
+
+    *ppb1 = &m_data[iStart];
+    *pcb1 = cb1;
+    *ppb2 = (cbReadable > cb1) ? &m_data[0] : NULL;
+    *pcb2 = cbReadable - cb1;
+    return cbReadable;
+}
+
+void RingBuffer::Consume(DWORD cbData)
+{
+    const ULONGLONG nReadPos = m_nReadPos.load(std::memory_order_relaxed);
+    m_nReadPos.store(nReadPos + cbData, std::memory_order_release);
+}
+
+DWORD RingBuffer::Read(LPVOID pvData, DWORD cbData)
+{
+    const BYTE *pb1, *pb2;
+    DWORD cb1, cb2;
+    DWORD cbReadable = Peek(&pb1, &cb1, &pb2, &cb2);
+    if (cbData > cbReadable)
+        cbData = cbReadable;
+    if (cbData == 0)
+        return 0;
+
+    BYTE *pb = reinterpret_cast<BYTE *>(pvData);
+    DWORD cbFirst = (cbData < cb1) ? cbData : cb1;
+    CopyMemory(pb, pb1, cbFirst);
+    if (cbData > cbFirst)
+        CopyMemory(pb + cbFirst, pb2, cbData - cbFirst);
+
+    Consume(cbData);
+    return cbData;
+}
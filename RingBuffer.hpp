@@ -0,0 +1,61 @@
+#ifndef RING_BUFFER_HPP_
+#define RING_BUFFER_HPP_
+
+#include <windows.h>
+#include <atomic>
+#include <vector>
+
+// A wait-free single-producer/single-consumer ring buffer of bytes.
+// The producer (the capture thread) only copies and publishes the write
+// position; a full ring drops the whole write and counts it as an overflow.
+class RingBuffer
+{
+public:
+    RingBuffer();
+
+    // Not thread-safe. Call these while no thread is using the ring.
+    BOOL Allocate(DWORD cbCapacity);
+    void Free();
+    void Reset();
+
+    // Producer side.
+    BOOL Write(LPCVOID pvData, DWORD cbData);
+
+    // Consumer side. Peek exposes the readable bytes in place as up to
+    // two regions; Consume releases them to the producer.
+    DWORD GetReadable() const;
+    DWORD Peek(const BYTE **ppb1, DWORD *pcb1,
+               const BYTE **ppb2, DWORD *pcb2) const;
+    void Consume(DWORD cbData);
+    DWORD Read(LPVOID pvData, DWORD cbData);
+
+    DWORD GetCapacity() const
+    {
+        return DWORD(m_data.size());
+    }
+    DWORD GetOverflowCount() const
+    {
+        return m_nOverflows.load(std::memory_order_relaxed);
+    }
+    ULONGLONG GetDroppedBytes() const
+    {
+        return m_cbDropped.load(std::memory_order_relaxed);
+    }
+    DWORD GetHighWater() const
+    {
+        return m_cbHighWater.load(std::memory_order_relaxed);
+    }
+
+protected:
+    std::vector<BYTE> m_data;
+    alignas(64) std::atomic<ULONGLONG> m_nWritePos;
+    alignas(64) std::atomic<ULONGLONG> m_nReadPos;
+    alignas(64) std::atomic<DWORD> m_nOverflows;
+    std::atomic<ULONGLONG> m_cbDropped;
+    std::atomic<DWORD> m_cbHighWater;
+
+    RingBuffer(const RingBuffer&);
+    RingBuffer& operator=(const RingBuffer&);
+};
+
+#endif  // ndef RING_BUFFER_HPP_
@@ -0,0 +1,295 @@
+#include "RotatingWaveWriter.hpp"
+
+static ULONGLONG get_file_size(LPCTSTR pszFileName)
+{
+    HANDLE hFile = ::CreateFile(pszFileName, GENERIC_READ,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return 0;
+
+    LARGE_INTEGER li;
+    if (!::GetFileSizeEx(hFile, &li))
+        li.QuadPart = 0;
+    ::CloseHandle(hFile);
+    return li.QuadPart;
+}
+
+RotatingWaveWriter::RotatingWaveWriter()
+    : m_nMaxFrames(0)
+    , m_cbBudget(0)
+    , m_cbReserve(0)
+    , m_bMapped(FALSE)
+    , m_pWriter(NULL)
+    , m_nFiles(0)
+    , m_nFileFrames(0)
+    , m_nFileStart(0)
+    , m_bOK(FALSE)
+    , m_hThread(NULL)
+    , m_hWork(NULL)
+    , m_bStopping(FALSE)
+    , m_bFinalizedOK(TRUE)
+    , m_cbClosed(0)
+    , m_nDeleted(0)
+{
+    m_szBase[0] = m_szExt[0] = m_szFileName[0] = 0;
+    ZeroMemory(&m_wfx, sizeof(m_wfx));
+    ::InitializeCriticalSection(&m_lock);
+}
+
+RotatingWaveWriter::~RotatingWaveWriter()
+{
+    Close();
+    ::DeleteCriticalSection(&m_lock);
+}
+
+void RotatingWaveWriter::SetLimits(ULONGLONG nMaxFrames, ULONGLONG cbBudget)
+{
+    m_nMaxFrames = nMaxFrames;
+    m_cbBudget = cbBudget;
+}
+
+void RotatingWaveWriter::SetPreallocation(ULONGLONG cbReserve)
+{
+    m_cbReserve = cbReserve;
+}
+
+void RotatingWaveWriter::SetMapped(BOOL bMapped)
+{
+    m_bMapped = bMapped;
+}
+
+BOOL RotatingWaveWriter::Open(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx)
+{
+    Close();
+
+    if (m_nMaxFrames == 0 || pwfx->wFormatTag != WAVE_FORMAT_PCM)
+        return FALSE;
+    // A budget must hold the file being written and the last one closed.
+    if (m_cbBudget && m_nMaxFrames > m_cbBudget / 2 / pwfx->nBlockAlign)
+        return FALSE;
+    m_wfx = *pwfx;
+    m_wfx.cbSize = 0;
+
+    // The extension is what follows the last dot of the last component.
+    lstrcpyn(m_szBase, pszFileName, ARRAYSIZE(m_szBase));
+    m_szExt[0] = 0;
+    LPTSTR pchDot = NULL;
+    for (LPTSTR pch = m_szBase; *pch; ++pch)
+    {
+        if (*pch == TEXT('.'))
+            pchDot = pch;
+        else if (*pch == TEXT('\\') || *pch == TEXT('/'))
+            pchDot = NULL;
+    }
+    if (pchDot)
+    {
+        lstrcpyn(m_szExt, pchDot, ARRAYSIZE(m_szExt));
+        *pchDot = 0;
+    }
+
+    m_nFiles = 0;
+    m_nFileFrames = m_nFileStart = 0;
+    m_gaps.clear();
+    m_bOK = TRUE;
+
+    m_bStopping = FALSE;
+    m_bFinalizedOK = TRUE;
+    m_closed.clear();
+    m_cbClosed = 0;
+    m_nDeleted.store(0);
+
+    m_hWork = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!m_hWork)
+        return FALSE;
+    m_hThread = ::CreateThread(NULL, 0, ThreadFunction, this, 0, NULL);
+    if (!m_hThread)
+    {
+        ::CloseHandle(m_hWork);
+        m_hWork = NULL;
+        return FALSE;
+    }
+
+    // The first file is opened now, so that a bad name fails here.
+    return OpenNext();
+}
+
+BOOL RotatingWaveWriter::OpenNext()
+{
+    ++m_nFiles;
+    wsprintf(m_szFileName, TEXT("%s-%06lu%s"), m_szBase, (unsigned long)m_nFiles, m_szExt);
+
+    m_pWriter = new WaveWriter;
+    m_pWriter->SetPreallocation(m_cbReserve);
+    m_pWriter->SetMapped(m_bMapped);
+    if (!m_pWriter->Open(m_szFileName, &m_wfx))
+    {
+        delete m_pWriter;
+        m_pWriter = NULL;
+        return m_bOK = FALSE;
+    }
+    return TRUE;
+}
+
+BOOL RotatingWaveWriter::Write(LPCVOID pvData, DWORD cbData)
+{
+    if (!IsOpen() || !m_bOK)
+        return FALSE;
+
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    const DWORD nBlockAlign = m_wfx.nBlockAlign;
+    while (cbData >= nBlockAlign)
+    {
+        if (!m_pWriter && !OpenNext())
+            return FALSE;
+
+        ULONGLONG nFrames = cbData / nBlockAlign;
+        if (nFrames > m_nMaxFrames - m_nFileFrames)
+            nFrames = m_nMaxFrames - m_nFileFrames;
+        DWORD cb = DWORD(nFrames) * nBlockAlign;
+        if (!m_pWriter->Write(pb, cb))
+            return m_bOK = FALSE;
+        pb += cb;
+        cbData -= cb;
+        m_nFileFrames += nFrames;
+
+        // A full file goes at once, so a gap at the boundary added after
+        // it goes into the next one, before the frame it precedes.
+        if (m_nFileFrames == m_nMaxFrames)
+            Rotate();
+    }
+    return TRUE;
+}
+
+void RotatingWaveWriter::AddGap(const TIMELINE_GAP& gap)
+{
+    m_gaps.push_back(gap);
+}
+
+// Hands the current file to the finalizer.
+void RotatingWaveWriter::Rotate(BOOL bLast)
+{
+    if (!m_pWriter)
+        return;
+
+    // The gaps up to the end of the file go into it, counted from its
+    // start; the later ones wait for the file that holds their frame.
+    const ULONGLONG nFileEnd = m_nFileStart + m_nFileFrames;
+    std::vector<TIMELINE_GAP> gaps;
+    size_t nKept = 0;
+    for (size_t i = 0; i < m_gaps.size(); ++i)
+    {
+        TIMELINE_GAP gap = m_gaps[i];
+        if (bLast || gap.nFrame <= nFileEnd)
+        {
+            gap.nFrame = (gap.nFrame > m_nFileStart) ? gap.nFrame - m_nFileStart : 0;
+            gaps.push_back(gap);
+        }
+        else
+        {
+            m_gaps[nKept++] = gap;
+        }
+    }
+    m_gaps.resize(nKept);
+    if (!gaps.empty())
+    {
+        m_pWriter->AddChunk(TIMELINE_CHUNK_ID, gaps.data(),
+                            DWORD(gaps.size() * sizeof(TIMELINE_GAP)));
+    }
+
+    PENDING_FILE file;
+    file.pWriter = m_pWriter;
+    lstrcpyn(file.szFileName, m_szFileName, ARRAYSIZE(file.szFileName));
+    file.bLast = bLast;
+    ::EnterCriticalSection(&m_lock);
+    m_pending.push_back(file);
+    ::LeaveCriticalSection(&m_lock);
+    ::SetEvent(m_hWork);
+
+    m_pWriter = NULL;
+    m_nFileStart += m_nFileFrames;
+    m_nFileFrames = 0;
+}
+
+BOOL RotatingWaveWriter::Close()
+{
+    if (!IsOpen())
+        return FALSE;
+
+    // Trailing gaps with no frame after them go into the last file.
+    if (!m_pWriter && !m_gaps.empty())
+        OpenNext();
+    Rotate(TRUE);
+
+    ::EnterCriticalSection(&m_lock);
+    m_bStopping = TRUE;
+    ::LeaveCriticalSection(&m_lock);
+    ::SetEvent(m_hWork);
+    ::WaitForSingleObject(m_hThread, INFINITE);
+    ::CloseHandle(m_hThread);
+    m_hThread = NULL;
+    ::CloseHandle(m_hWork);
+    m_hWork = NULL;
+
+    return m_bOK && m_bFinalizedOK;
+}
+
+DWORD WINAPI RotatingWaveWriter::ThreadFunction(LPVOID pContext)
+{
+    RotatingWaveWriter *pThis = reinterpret_cast<RotatingWaveWriter *>(pContext);
+    return pThis->ThreadProc();
+}
+
+DWORD RotatingWaveWriter::ThreadProc()
+{
+    for (;;)
+    {
+        ::WaitForSingleObject(m_hWork, INFINITE);
+
+        for (;;)
+        {
+            ::EnterCriticalSection(&m_lock);
+            if (m_pending.empty())
+            {
+                BOOL bStopping = m_bStopping;
+                ::LeaveCriticalSection(&m_lock);
+                if (bStopping)
+                    return 0;
+                break;
+            }
+            PENDING_FILE file = m_pending.front();
+            m_pending.pop_front();
+            ::LeaveCriticalSection(&m_lock);
+
+            Finalize(file);
+        }
+    }
+}
+
+void RotatingWaveWriter::Finalize(PENDING_FILE& file)
+{
+    if (!file.pWriter->Close())
+        m_bFinalizedOK = FALSE;
+    delete file.pWriter;
+
+    CLOSED_FILE closed;
+    lstrcpyn(closed.szFileName, file.szFileName, ARRAYSIZE(closed.szFileName));
+    closed.cbFile = get_file_size(file.szFileName);
+    m_closed.push_back(closed);
+    m_cbClosed += closed.cbFile;
+
+    if (m_cbBudget == 0)
+        return;
+
+    // Room for the file being written, once it is full. The file just
+    // closed is never deleted.
+    ULONGLONG cbCurrent = file.bLast ? 0 : m_nMaxFrames * m_wfx.nBlockAlign;
+    while (m_closed.size() > 1 && m_cbClosed + cbCurrent > m_cbBudget)
+    {
+        CLOSED_FILE& oldest = m_closed.front();
+        if (::DeleteFile(oldest.szFileName))
+            m_nDeleted.fetch_add(1, std::memory_order_relaxed);
+        m_cbClosed -= oldest.cbFile;
+        m_closed.pop_front();
+    }
+}
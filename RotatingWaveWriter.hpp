@@ -0,0 +1,104 @@
+#ifndef ROTATING_WAVE_WRITER_HPP_
+#define ROTATING_WAVE_WRITER_HPP_
+
+#include "WaveWriter.hpp"
+#include "Timeline.hpp"
+#include <atomic>
+#include <deque>
+#include <vector>
+
+// Writes a recording as a series of WAV files of at most nMaxFrames each,
+// for capture that runs for days. "sound.wav" becomes sound-000001.wav,
+// sound-000002.wav, ... Every frame lands in exactly one file: a write is
+// split at the boundary, and the next file opens on the next frame.
+//
+// A full file is handed to a thread of its own, which flushes, patches and
+// closes it, then deletes the oldest files of this series until the closed
+// ones plus a full current one fit in cbBudget. Only files written since
+// Open are ever deleted, and never the last one closed; Open fails if
+// cbBudget cannot hold two full files.
+class RotatingWaveWriter
+{
+public:
+    RotatingWaveWriter();
+    ~RotatingWaveWriter();
+
+    // All take effect on the next Open. A budget of zero keeps every file.
+    void SetLimits(ULONGLONG nMaxFrames, ULONGLONG cbBudget);
+    void SetPreallocation(ULONGLONG cbReserve);
+    void SetMapped(BOOL bMapped);
+
+    BOOL Open(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx);
+    BOOL Write(LPCVOID pvData, DWORD cbData);
+    // A gap of a sparse recording, with nFrame counted over all the files.
+    // It goes into the file that holds that frame; one at the end of a file
+    // goes into that file if added before the file is full.
+    void AddGap(const TIMELINE_GAP& gap);
+    // Closes the last file and waits until every file is finalized.
+    BOOL Close();
+
+    BOOL IsOpen() const
+    {
+        return m_hThread != NULL;
+    }
+    DWORD GetFileCount() const
+    {
+        return m_nFiles;
+    }
+    DWORD GetDeletedCount() const
+    {
+        return m_nDeleted.load(std::memory_order_relaxed);
+    }
+
+protected:
+    struct CLOSED_FILE
+    {
+        TCHAR szFileName[MAX_PATH];
+        ULONGLONG cbFile;
+    };
+    struct PENDING_FILE
+    {
+        WaveWriter *pWriter;
+        TCHAR szFileName[MAX_PATH];
+        BOOL bLast;
+    };
+
+    ULONGLONG m_nMaxFrames;
+    ULONGLONG m_cbBudget;
+    ULONGLONG m_cbReserve;
+    BOOL m_bMapped;
+    TCHAR m_szBase[MAX_PATH];       // the name without the extension
+    TCHAR m_szExt[MAX_PATH];
+    WAVEFORMATEX m_wfx;
+
+    // The writer thread's.
+    WaveWriter *m_pWriter;
+    TCHAR m_szFileName[MAX_PATH];
+    DWORD m_nFiles;
+    ULONGLONG m_nFileFrames;        // in the current file
+    ULONGLONG m_nFileStart;         // where it starts in the recording
+    std::vector<TIMELINE_GAP> m_gaps;   // not yet in a file, counted over all
+    BOOL m_bOK;
+
+    // The finalizer's.
+    HANDLE m_hThread;
+    HANDLE m_hWork;
+    CRITICAL_SECTION m_lock;
+    std::deque<PENDING_FILE> m_pending;
+    BOOL m_bStopping;
+    BOOL m_bFinalizedOK;
+    std::deque<CLOSED_FILE> m_closed;
+    ULONGLONG m_cbClosed;
+    std::atomic<DWORD> m_nDeleted;
+
+    BOOL OpenNext();
+    void Rotate(BOOL bLast = FALSE);
+    void Finalize(PENDING_FILE& file);
+    static DWORD WINAPI ThreadFunction(LPVOID pContext);
+    DWORD ThreadProc();
+
+    RotatingWaveWriter(const RotatingWaveWriter&);
+    RotatingWaveWriter& operator=(const RotatingWaveWriter&);
+};
+
+#endif  // ndef ROTATING_WAVE_WRITER_HPP_
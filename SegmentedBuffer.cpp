@@ -0,0 +1,64 @@
+#include "SegmentedBuffer.hpp"
+
+SegmentedBuffer::SegmentedBuffer()
+    : m_cbSize(0)
+{
+}
+
+SegmentedBuffer::~SegmentedBuffer()
+{
+    Free();
+}
+
+BOOL SegmentedBuffer::Append(LPCVOID pvData, SIZE_T cbData)
+{
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    while (cbData > 0)
+    {
+        SIZE_T iSegment = m_cbSize / SEGMENT_SIZE;
+        SIZE_T offset = m_cbSize % SEGMENT_SIZE;
+        if (iSegment == m_segments.size())
+        {
+            BYTE *pSegment = reinterpret_cast<BYTE *>(
+                ::VirtualAlloc(NULL, SEGMENT_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+            if (pSegment == NULL)
+                return FALSE;
+            m_segments.push_back(pSegment);
+        }
+
+        SIZE_T cbCopy = SEGMENT_SIZE - offset;
+        if (cbCopy > cbData)
+            cbCopy = cbData;
+        CopyMemory(m_segments[iSegment] + offset, pb, cbCopy);
+        m_cbSize += cbCopy;
+        pb += cbCopy;
+        cbData -= cbCopy;
+    }
+    return TRUE;
+}
+
+void SegmentedBuffer::Clear()
+{
+    m_cbSize = 0;
+}
+
+void SegmentedBuffer::Free()
+{
+    for (size_t i = 0; i < m_segments.size(); ++i)
+        ::VirtualFree(m_segments[i], 0, MEM_RELEASE);
+    std::vector<BYTE *>().swap(m_segments);
+    m_cbSize = 0;
+}
+
+DWORD SegmentedBuffer::GetSegmentCount() const
+{
+    return DWORD((m_cbSize + SEGMENT_SIZE - 1) / SEGMENT_SIZE);
+}
+
+const BYTE *SegmentedBuffer::GetSegment(DWORD iSegment, DWORD *pcbSegment) const
+{
+    SIZE_T offset = SIZE_T(iSegment) * SEGMENT_SIZE;
+    SIZE_T cb = m_cbSize - offset;
+    *pcbSegment = (cb < SEGMENT_SIZE) ? DWORD(cb) : DWORD(SEGMENT_SIZE);
+    return m_segments[iSegment];
+}
@@ -0,0 +1,48 @@
+#ifndef SEGMENTED_BUFFER_HPP_
+#define SEGMENTED_BUFFER_HPP_
+
+#include <windows.h>
+#include <vector>
+
+// A growing store of bytes in fixed segments, for the in-memory recording.
+// Appending never moves what is already there, so growing costs no copy
+// and no more memory than the bytes plus the last segment's unused pages,
+// which VirtualAlloc leaves untouched. Clear keeps the segments for the
+// next recording; Free gives them back.
+//
+// SEGMENT_SIZE is a multiple of WaveWriter::BLOCK_SIZE, so saving writes
+// every whole segment straight from where it lies.
+class SegmentedBuffer
+{
+public:
+    enum { SEGMENT_SIZE = 4 * 1024 * 1024 };
+
+    SegmentedBuffer();
+    ~SegmentedBuffer();
+
+    BOOL Append(LPCVOID pvData, SIZE_T cbData);
+    void Clear();
+    void Free();
+
+    SIZE_T GetSize() const
+    {
+        return m_cbSize;
+    }
+    BOOL IsEmpty() const
+    {
+        return m_cbSize == 0;
+    }
+
+    // The segments holding the bytes, in order. All but the last are full.
+    DWORD GetSegmentCount() const;
+    const BYTE *GetSegment(DWORD iSegment, DWORD *pcbSegment) const;
+
+protected:
+    std::vector<BYTE *> m_segments;     // the ones in use, then the spare ones
+    SIZE_T m_cbSize;
+
+    SegmentedBuffer(const SegmentedBuffer&);
+    SegmentedBuffer& operator=(const SegmentedBuffer&);
+};
+
+#endif  // ndef SEGMENTED_BUFFER_HPP_
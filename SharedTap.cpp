@@ -0,0 +1,341 @@
+#include "SharedTap.hpp"
+#include <cstring>
+
+// The ring starts on a page of its own.
+#define SHARED_TAP_PAGE 4096
+
+SharedTapPublisher::SharedTapPublisher()
+    : m_hMapping(NULL)
+    , m_pHeader(NULL)
+    , m_pRing(NULL)
+    , m_nRingFrames(0)
+    , m_nBlockAlign(0)
+    , m_nWritten(0)
+{
+}
+
+SharedTapPublisher::~SharedTapPublisher()
+{
+    Close();
+}
+
+BOOL SharedTapPublisher::Open(LPCTSTR pszName, const WAVEFORMATEX *pwfx, DWORD nRingFrames)
+{
+    Close();
+
+    if (pwfx->nBlockAlign == 0 || nRingFrames == 0)
+        return FALSE;
+
+    const DWORD cbHeader = (sizeof(SHARED_TAP_HEADER) + SHARED_TAP_PAGE - 1) &
+                           ~DWORD(SHARED_TAP_PAGE - 1);
+    ULONGLONG cbMapping = cbHeader + ULONGLONG(nRingFrames) * pwfx->nBlockAlign;
+    m_hMapping = ::CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                     DWORD(cbMapping >> 32), DWORD(cbMapping), pszName);
+    if (!m_hMapping)
+        return FALSE;
+    BOOL bExisted = (::GetLastError() == ERROR_ALREADY_EXISTS);
+
+    SHARED_TAP_HEADER *pHeader = reinterpret_cast<SHARED_TAP_HEADER *>(
+        ::MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (!pHeader)
+    {
+        ::CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+        return FALSE;
+    }
+
+    // The readers of an earlier publisher keep the mapping of a name alive;
+    // they see the session change, so the header is replaced in a session
+    // of zero, which they take as not ready.
+    DWORD dwSession = 1;
+    if (bExisted)
+    {
+        if (pHeader->dwMagic != SHARED_TAP_MAGIC || pHeader->dwVersion != SHARED_TAP_VERSION ||
+            pHeader->bLive.load(std::memory_order_acquire) || pHeader->cbMapping < cbMapping)
+        {
+            ::UnmapViewOfFile(pHeader);
+            ::CloseHandle(m_hMapping);
+            m_hMapping = NULL;
+            return FALSE;
+        }
+        dwSession = pHeader->dwSession.load(std::memory_order_relaxed) + 1;
+        if (dwSession == 0)
+            dwSession = 1;
+        cbMapping = pHeader->cbMapping;
+        pHeader->dwSession.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    pHeader->dwMagic = SHARED_TAP_MAGIC;
+    pHeader->dwVersion = SHARED_TAP_VERSION;
+    pHeader->cbHeader = cbHeader;
+    pHeader->nRingFrames = nRingFrames;
+    pHeader->cbMapping = cbMapping;
+    ZeroMemory(&pHeader->wfx, sizeof(pHeader->wfx));
+    DWORD cbFormat = sizeof(WAVEFORMATEX) + pwfx->cbSize;
+    if (pwfx->wFormatTag == WAVE_FORMAT_PCM || pwfx->wFormatTag == WAVE_FORMAT_IEEE_FLOAT)
+        cbFormat = sizeof(WAVEFORMATEX);
+    if (cbFormat > sizeof(pHeader->wfx))
+        cbFormat = sizeof(pHeader->wfx);
+    CopyMemory(&pHeader->wfx, pwfx, cbFormat);
+    if (cbFormat == sizeof(WAVEFORMATEX))
+        pHeader->wfx.Format.cbSize = 0;
+    pHeader->nReserved.store(0, std::memory_order_relaxed);
+    pHeader->nWritten.store(0, std::memory_order_relaxed);
+    pHeader->bLive.store(TRUE, std::memory_order_relaxed);
+    pHeader->dwSession.store(dwSession, std::memory_order_release);
+
+    m_pHeader = pHeader;
+    m_pRing = reinterpret_cast<BYTE *>(pHeader) + cbHeader;
+    m_nRingFrames = nRingFrames;
+    m_nBlockAlign = pwfx->nBlockAlign;
+    m_nWritten = 0;
+    return TRUE;
+}
+
+void SharedTapPublisher::Close()
+{
+    if (m_pHeader)
+    {
+        m_pHeader->bLive.store(FALSE, std::memory_order_release);
+        ::UnmapViewOfFile(m_pHeader);
+        m_pHeader = NULL;
+        m_pRing = NULL;
+    }
+    if (m_hMapping)
+    {
+        ::CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+}
+
+void SharedTapPublisher::Write(const BYTE *pb, DWORD nFrames)
+{
+    if (!m_pHeader || nFrames == 0)
+        return;
+
+    // Only the last ring of a longer write could be read.
+    if (nFrames > m_nRingFrames)
+    {
+        if (pb)
+            pb += (nFrames - m_nRingFrames) * m_nBlockAlign;
+        m_nWritten += nFrames - m_nRingFrames;
+        nFrames = m_nRingFrames;
+    }
+
+    const ULONGLONG nEnd = m_nWritten + nFrames;
+    m_pHeader->nReserved.store(nEnd, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    DWORD iFrame = DWORD(m_nWritten % m_nRingFrames);
+    DWORD n1 = m_nRingFrames - iFrame;
+    if (n1 > nFrames)
+        n1 = nFrames;
+    BYTE *pbRing = m_pRing + iFrame * m_nBlockAlign;
+    if (pb)
+    {
+        CopyMemory(pbRing, pb, n1 * m_nBlockAlign);
+        CopyMemory(m_pRing, pb + n1 * m_nBlockAlign, (nFrames - n1) * m_nBlockAlign);
+    }
+    else
+    {
+        ZeroMemory(pbRing, n1 * m_nBlockAlign);
+        ZeroMemory(m_pRing, (nFrames - n1) * m_nBlockAlign);
+    }
+
+    m_pHeader->nWritten.store(nEnd, std::memory_order_release);
+    m_nWritten = nEnd;
+}
+
+SharedTapReader::SharedTapReader()
+    : m_hMapping(NULL)
+    , m_pHeader(NULL)
+    , m_pRing(NULL)
+    , m_dwSession(0)
+    , m_nRingFrames(0)
+    , m_nPosition(0)
+    , m_nLostFrames(0)
+    , m_nOverruns(0)
+    , m_nRestarts(0)
+{
+    ZeroMemory(&m_wfx, sizeof(m_wfx));
+}
+
+SharedTapReader::~SharedTapReader()
+{
+    Close();
+}
+
+BOOL SharedTapReader::Open(LPCTSTR pszName)
+{
+    Close();
+
+    m_hMapping = ::OpenFileMapping(FILE_MAP_READ, FALSE, pszName);
+    if (!m_hMapping)
+        return FALSE;
+
+    m_pHeader = reinterpret_cast<const SHARED_TAP_HEADER *>(
+        ::MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_pHeader)
+    {
+        ::CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+        return FALSE;
+    }
+
+    // A publisher still filling the header in is caught up with by Peek.
+    m_dwSession = 0;
+    m_nLostFrames = 0;
+    m_nOverruns = 0;
+    m_nRestarts = 0;
+    Resync();
+    return TRUE;
+}
+
+void SharedTapReader::Close()
+{
+    if (m_pHeader)
+    {
+        ::UnmapViewOfFile(m_pHeader);
+        m_pHeader = NULL;
+        m_pRing = NULL;
+    }
+    if (m_hMapping)
+    {
+        ::CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+    m_dwSession = 0;
+    m_nRingFrames = 0;
+    ZeroMemory(&m_wfx, sizeof(m_wfx));
+}
+
+BOOL SharedTapReader::IsLive() const
+{
+    return m_pHeader && m_pHeader->bLive.load(std::memory_order_acquire) &&
+           m_pHeader->dwSession.load(std::memory_order_acquire) == m_dwSession;
+}
+
+// Takes the format and the newest position of the publisher's session,
+// unless the header changes meanwhile.
+BOOL SharedTapReader::Resync()
+{
+    DWORD dwSession = m_pHeader->dwSession.load(std::memory_order_acquire);
+    if (dwSession == 0 || m_pHeader->dwMagic != SHARED_TAP_MAGIC ||
+        m_pHeader->dwVersion != SHARED_TAP_VERSION)
+    {
+        return FALSE;
+    }
+
+    WAVEFORMATEXTENSIBLE wfx = m_pHeader->wfx;
+    DWORD cbHeader = m_pHeader->cbHeader;
+    DWORD nRingFrames = m_pHeader->nRingFrames;
+    ULONGLONG cbMapping = m_pHeader->cbMapping;
+    ULONGLONG nWritten = m_pHeader->nWritten.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (m_pHeader->dwSession.load(std::memory_order_relaxed) != dwSession)
+        return FALSE;
+    if (wfx.Format.nBlockAlign == 0 || nRingFrames == 0 ||
+        cbHeader + ULONGLONG(nRingFrames) * wfx.Format.nBlockAlign > cbMapping)
+    {
+        return FALSE;
+    }
+
+    if (m_dwSession)
+        ++m_nRestarts;
+    m_dwSession = dwSession;
+    m_wfx = wfx;
+    m_nRingFrames = nRingFrames;
+    m_pRing = reinterpret_cast<const BYTE *>(m_pHeader) + cbHeader;
+    m_nPosition = nWritten;
+    return TRUE;
+}
+
+DWORD SharedTapReader::Peek(const BYTE **ppb1, DWORD *pnFrames1,
+                            const BYTE **ppb2, DWORD *pnFrames2)
+{
+    *ppb1 = *ppb2 = NULL;
+    *pnFrames1 = *pnFrames2 = 0;
+    if (!m_pHeader)
+        return 0;
+    if (m_pHeader->dwSession.load(std::memory_order_acquire) != m_dwSession && !Resync())
+        return 0;
+
+    // More than a ring behind: on from the newest frame.
+    ULONGLONG nWritten = m_pHeader->nWritten.load(std::memory_order_acquire);
+    if (nWritten - m_nPosition > m_nRingFrames)
+    {
+        m_nLostFrames += nWritten - m_nPosition;
+        ++m_nOverruns;
+        m_nPosition = nWritten;
+        return 0;
+    }
+
+    const DWORD nFrames = DWORD(nWritten - m_nPosition);
+    const DWORD iFrame = DWORD(m_nPosition % m_nRingFrames);
+    DWORD n1 = m_nRingFrames - iFrame;
+    if (n1 > nFrames)
+        n1 = nFrames;
+    if (n1)
+    {
+        *ppb1 = m_pRing + iFrame * m_wfx.Format.nBlockAlign;
+        *pnFrames1 = n1;
+    }
+    if (nFrames > n1)
+    {
+        *ppb2 = m_pRing;
+        *pnFrames2 = nFrames - n1;
+    }
+    return nFrames;
+}
+
+BOOL SharedTapReader::Consume(DWORD nFrames)
+{
+    if (!m_pHeader || !m_dwSession)
+        return FALSE;
+
+    // What the publisher may have started to overwrite since the frames
+    // were read.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    ULONGLONG nReserved = m_pHeader->nReserved.load(std::memory_order_relaxed);
+    if (m_pHeader->dwSession.load(std::memory_order_relaxed) != m_dwSession)
+        return FALSE;
+
+    BOOL bIntact = (nReserved <= m_nPosition + m_nRingFrames);
+    if (!bIntact)
+    {
+        m_nLostFrames += nFrames;
+        ++m_nOverruns;
+    }
+    m_nPosition += nFrames;
+    return bIntact;
+}
+
+DWORD SharedTapReader::Read(LPVOID pvData, DWORD nMaxFrames)
+{
+    const BYTE *pb1, *pb2;
+    DWORD n1, n2;
+    DWORD nFrames = Peek(&pb1, &n1, &pb2, &n2);
+    if (nFrames > nMaxFrames)
+        nFrames = nMaxFrames;
+    if (n1 > nFrames)
+        n1 = nFrames;
+    n2 = nFrames - n1;
+
+    const DWORD nBlockAlign = m_wfx.Format.nBlockAlign;
+    BYTE *pb = reinterpret_cast<BYTE *>(pvData);
+    if (n1)
+        CopyMemory(pb, pb1, n1 * nBlockAlign);
+    if (n2)
+        CopyMemory(pb + n1 * nBlockAlign, pb2, n2 * nBlockAlign);
+    if (nFrames == 0 || !Consume(nFrames))
+        return 0;
+    return nFrames;
+}
+
+ULONGLONG SharedTapReader::GetLag() const
+{
+    if (!m_pHeader || m_pHeader->dwSession.load(std::memory_order_acquire) != m_dwSession)
+        return 0;
+    return m_pHeader->nWritten.load(std::memory_order_acquire) - m_nPosition;
+}
@@ -0,0 +1,151 @@
+#ifndef SHARED_TAP_HPP_
+#define SHARED_TAP_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include <atomic>
+
+#define SHARED_TAP_MAGIC    0x50415452      // "RTAP"
+#define SHARED_TAP_VERSION  1
+
+// The default name of the tap of a recording, in the session's namespace.
+#define SHARED_TAP_DEFAULT_NAME TEXT("Local\\RecordingTap")
+
+// The start of the named mapping of a tap. The ring of nRingFrames frames
+// of wfx follows at cbHeader; frame n of the stream is at n % nRingFrames.
+// Positions count the frames since the publisher opened the tap.
+//
+// The publisher raises nReserved before it overwrites a frame of the ring
+// and nWritten once the frames are there, so a reader can tell afterwards
+// whether what it read in place was still intact.
+struct SHARED_TAP_HEADER
+{
+    DWORD dwMagic;
+    DWORD dwVersion;
+    DWORD cbHeader;
+    DWORD nRingFrames;
+    ULONGLONG cbMapping;
+    WAVEFORMATEXTENSIBLE wfx;
+    std::atomic<DWORD> dwSession;       // changes when a publisher opens the tap again
+    std::atomic<LONG> bLive;            // FALSE once the publisher has closed it
+    alignas(64) std::atomic<ULONGLONG> nReserved;
+    std::atomic<ULONGLONG> nWritten;
+};
+
+// Publishes a live stream in a named shared-memory ring, for any number of
+// SharedTapReaders in other processes. Write is wait-free: it copies the
+// frames into the ring and moves two counters, whatever the readers do. A
+// reader that falls more than the ring behind loses frames, and knows it.
+//
+// One publisher per name. A name whose mapping is still held by readers of
+// a closed publisher is opened again in place, if the ring fits.
+class SharedTapPublisher
+{
+public:
+    SharedTapPublisher();
+    ~SharedTapPublisher();
+
+    BOOL Open(LPCTSTR pszName, const WAVEFORMATEX *pwfx, DWORD nRingFrames);
+    void Close();
+
+    BOOL IsOpen() const
+    {
+        return m_pHeader != NULL;
+    }
+    ULONGLONG GetWrittenFrames() const
+    {
+        return m_nWritten;
+    }
+
+    // Silence if pb is NULL.
+    void Write(const BYTE *pb, DWORD nFrames);
+
+protected:
+    HANDLE m_hMapping;
+    SHARED_TAP_HEADER *m_pHeader;
+    BYTE *m_pRing;
+    DWORD m_nRingFrames;
+    DWORD m_nBlockAlign;
+    ULONGLONG m_nWritten;
+
+    SharedTapPublisher(const SharedTapPublisher&);
+    SharedTapPublisher& operator=(const SharedTapPublisher&);
+};
+
+// Reads a tap in place, without copies, from any process of the session.
+// It starts at the newest frame. When the publisher has got more than the
+// ring ahead, the reader skips to the newest frame and counts the frames
+// it missed; when the publisher opens the tap again, it starts over from
+// the new stream, whose format may have changed.
+class SharedTapReader
+{
+public:
+    SharedTapReader();
+    ~SharedTapReader();
+
+    BOOL Open(LPCTSTR pszName);
+    void Close();
+
+    BOOL IsOpen() const
+    {
+        return m_pHeader != NULL;
+    }
+    // As of the last Peek.
+    const WAVEFORMATEX *GetFormat() const
+    {
+        return &m_wfx.Format;
+    }
+    BOOL IsLive() const;
+
+    // Exposes the frames since the last Consume in the mapping as up to
+    // two regions, and returns how many there are.
+    DWORD Peek(const BYTE **ppb1, DWORD *pnFrames1,
+               const BYTE **ppb2, DWORD *pnFrames2);
+    // Releases the first nFrames of the last Peek. FALSE if the publisher
+    // overwrote some of them meanwhile: what was read of them is garbage.
+    BOOL Consume(DWORD nFrames);
+    // Peek, copy and Consume. Returns the frames copied, 0 if they were
+    // overwritten while being copied.
+    DWORD Read(LPVOID pvData, DWORD nMaxFrames);
+
+    // The next frame to read, in the stream of the publisher.
+    ULONGLONG GetPosition() const
+    {
+        return m_nPosition;
+    }
+    // The frames behind the publisher now.
+    ULONGLONG GetLag() const;
+    ULONGLONG GetLostFrames() const
+    {
+        return m_nLostFrames;
+    }
+    // The times the reader fell behind by more than the ring.
+    DWORD GetOverrunCount() const
+    {
+        return m_nOverruns;
+    }
+    DWORD GetRestartCount() const
+    {
+        return m_nRestarts;
+    }
+
+protected:
+    HANDLE m_hMapping;
+    const SHARED_TAP_HEADER *m_pHeader;
+    const BYTE *m_pRing;
+    DWORD m_dwSession;
+    DWORD m_nRingFrames;
+    WAVEFORMATEXTENSIBLE m_wfx;
+    ULONGLONG m_nPosition;
+    ULONGLONG m_nLostFrames;
+    DWORD m_nOverruns;
+    DWORD m_nRestarts;
+
+    BOOL Resync();
+
+    SharedTapReader(const SharedTapReader&);
+    SharedTapReader& operator=(const SharedTapReader&);
+};
+
+#endif  // ndef SHARED_TAP_HPP_
@@ -0,0 +1,94 @@
+#include "Simd.hpp"
+#ifdef _MSC_VER
+    #include <intrin.h>
+#elif defined(SIMD_X86)
+    #include <cpuid.h>
+#endif
+
+#ifdef SIMD_X86
+static void do_cpuid(int info[4], int leaf, int subleaf)
+{
+#ifdef _MSC_VER
+    __cpuidex(info, leaf, subleaf);
+#else
+    unsigned int a, b, c, d;
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+    info[0] = int(a);
+    info[1] = int(b);
+    info[2] = int(c);
+    info[3] = int(d);
+#endif
+}
+
+static unsigned long long do_xgetbv(unsigned int index)
+{
+#ifdef _MSC_VER
+    return _xgetbv(index);
+#else
+    unsigned int eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+    return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+}
+#endif
+
+static SIMD_LEVEL detect_simd_level()
+{
+#ifdef SIMD_X86
+    int info[4];
+    do_cpuid(info, 0, 0);
+    int nMaxLeaf = info[0];
+
+    do_cpuid(info, 1, 0);
+    bool bSSE2 = (info[3] & (1 << 26)) != 0;
+    bool bOSXSAVE = (info[2] & (1 << 27)) != 0;
+    bool bAVX = (info[2] & (1 << 28)) != 0;
+    bool bFMA = (info[2] & (1 << 12)) != 0;
+    if (!bSSE2)
+        return SIMD_SCALAR;
+
+    // AVX2 needs the OS to save the YMM registers.
+    if (nMaxLeaf >= 7 && bOSXSAVE && bAVX && bFMA &&
+        (do_xgetbv(0) & 0x6) == 0x6)
+    {
+        do_cpuid(info, 7, 0);
+        if (info[1] & (1 << 5))
+            return SIMD_AVX2;
+    }
+    return SIMD_SSE2;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+static SIMD_LEVEL s_supported = detect_simd_level();
+static SIMD_LEVEL s_level = s_supported;
+
+SIMD_LEVEL get_simd_level()
+{
+    return s_level;
+}
+
+SIMD_LEVEL get_supported_simd_level()
+{
+    return s_supported;
+}
+
+SIMD_LEVEL set_simd_level(SIMD_LEVEL level)
+{
+    s_level = (level < s_supported) ? level : s_supported;
+    return s_level;
+}
+
+const char *get_simd_level_name(SIMD_LEVEL level)
+{
+    switch (level)
+    {
+    case SIMD_SSE2:
+        return "SSE2";
+    case SIMD_AVX2:
+        return "AVX2";
+    default:
+        return "scalar";
+    }
+}
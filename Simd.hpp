@@ -0,0 +1,33 @@
+#ifndef SIMD_HPP_
+#define SIMD_HPP_
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+    #define SIMD_X86
+    #include <immintrin.h>
+#endif
+
+// Functions using intrinsics of a higher level than the build's baseline
+// must be marked, so GCC and Clang emit them from one translation unit.
+#if defined(SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+    #define TARGET_SSE2 __attribute__((target("sse2")))
+    #define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+    #define TARGET_SSE2
+    #define TARGET_AVX2
+#endif
+
+enum SIMD_LEVEL
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+// The level the kernels dispatch to. It is the best level the CPU and the
+// OS support unless lowered by set_simd_level (e.g. for benchmarks).
+SIMD_LEVEL get_simd_level();
+SIMD_LEVEL get_supported_simd_level();
+SIMD_LEVEL set_simd_level(SIMD_LEVEL level);
+const char *get_simd_level_name(SIMD_LEVEL level);
+
+#endif  // ndef SIMD_HPP_
@@ -0,0 +1,500 @@
+#include "Spectrum.hpp"
+#include "Convert.hpp"
+#include "Simd.hpp"
+#include <cmath>
+#include <cstring>
+
+static const double PI = 3.14159265358979323846;
+
+// Frames converted at a time.
+#define SPECTRUM_CHUNK 1024
+
+// One stage of radix-2 butterflies of half h over n points.
+static void butterflies_scalar(float *re, float *im, DWORD n, DWORD h,
+                               const float *wr, const float *wi)
+{
+    for (DWORD s = 0; s < n; s += 2 * h)
+    {
+        float *ar = re + s, *ai = im + s;
+        float *br = ar + h, *bi = ai + h;
+        for (DWORD j = 0; j < h; ++j)
+        {
+            float tr = wr[j] * br[j] - wi[j] * bi[j];
+            float ti = wr[j] * bi[j] + wi[j] * br[j];
+            br[j] = ar[j] - tr;
+            bi[j] = ai[j] - ti;
+            ar[j] += tr;
+            ai[j] += ti;
+        }
+    }
+}
+
+#ifdef SIMD_X86
+// h is a multiple of 4.
+TARGET_SSE2
+static void butterflies_sse2(float *re, float *im, DWORD n, DWORD h,
+                             const float *wr, const float *wi)
+{
+    for (DWORD s = 0; s < n; s += 2 * h)
+    {
+        float *ar = re + s, *ai = im + s;
+        float *br = ar + h, *bi = ai + h;
+        for (DWORD j = 0; j < h; j += 4)
+        {
+            __m128 w_r = _mm_loadu_ps(wr + j), w_i = _mm_loadu_ps(wi + j);
+            __m128 b_r = _mm_loadu_ps(br + j), b_i = _mm_loadu_ps(bi + j);
+            __m128 a_r = _mm_loadu_ps(ar + j), a_i = _mm_loadu_ps(ai + j);
+            __m128 tr = _mm_sub_ps(_mm_mul_ps(w_r, b_r), _mm_mul_ps(w_i, b_i));
+            __m128 ti = _mm_add_ps(_mm_mul_ps(w_r, b_i), _mm_mul_ps(w_i, b_r));
+            _mm_storeu_ps(br + j, _mm_sub_ps(a_r, tr));
+            _mm_storeu_ps(bi + j, _mm_sub_ps(a_i, ti));
+            _mm_storeu_ps(ar + j, _mm_add_ps(a_r, tr));
+            _mm_storeu_ps(ai + j, _mm_add_ps(a_i, ti));
+        }
+    }
+}
+
+// h is a multiple of 8.
+TARGET_AVX2
+static void butterflies_avx2(float *re, float *im, DWORD n, DWORD h,
+                             const float *wr, const float *wi)
+{
+    for (DWORD s = 0; s < n; s += 2 * h)
+    {
+        float *ar = re + s, *ai = im + s;
+        float *br = ar + h, *bi = ai + h;
+        for (DWORD j = 0; j < h; j += 8)
+        {
+            __m256 w_r = _mm256_loadu_ps(wr + j), w_i = _mm256_loadu_ps(wi + j);
+            __m256 b_r = _mm256_loadu_ps(br + j), b_i = _mm256_loadu_ps(bi + j);
+            __m256 a_r = _mm256_loadu_ps(ar + j), a_i = _mm256_loadu_ps(ai + j);
+            __m256 tr = _mm256_fmsub_ps(w_r, b_r, _mm256_mul_ps(w_i, b_i));
+            __m256 ti = _mm256_fmadd_ps(w_r, b_i, _mm256_mul_ps(w_i, b_r));
+            _mm256_storeu_ps(br + j, _mm256_sub_ps(a_r, tr));
+            _mm256_storeu_ps(bi + j, _mm256_sub_ps(a_i, ti));
+            _mm256_storeu_ps(ar + j, _mm256_add_ps(a_r, tr));
+            _mm256_storeu_ps(ai + j, _mm256_add_ps(a_i, ti));
+        }
+    }
+    _mm256_zeroupper();
+}
+#endif
+
+typedef void (*BUTTERFLY_PROC)(float *re, float *im, DWORD n, DWORD h,
+                               const float *wr, const float *wi);
+
+static BUTTERFLY_PROC get_butterfly_proc(DWORD h)
+{
+#ifdef SIMD_X86
+    switch (get_simd_level())
+    {
+    case SIMD_AVX2:
+        if (h >= 8)
+            return butterflies_avx2;
+        // fall through
+    case SIMD_SSE2:
+        if (h >= 4)
+            return butterflies_sse2;
+        break;
+    default:
+        break;
+    }
+#endif
+    return butterflies_scalar;
+}
+
+RealFft::RealFft()
+    : m_nSize(0)
+{
+}
+
+BOOL RealFft::Init(DWORD nSize)
+{
+    if (nSize < 8 || nSize > (1 << 20) || (nSize & (nSize - 1)) != 0)
+        return FALSE;
+
+    m_nSize = nSize;
+    const DWORD n = nSize / 2;
+
+    DWORD nBits = 0;
+    while ((DWORD(1) << nBits) < n)
+        ++nBits;
+    m_reverse.resize(n);
+    for (DWORD i = 0; i < n; ++i)
+    {
+        DWORD r = 0;
+        for (DWORD b = 0; b < nBits; ++b)
+            r |= ((i >> b) & 1) << (nBits - 1 - b);
+        m_reverse[i] = r;
+    }
+
+    m_twiddleRe.resize(n);
+    m_twiddleIm.resize(n);
+    for (DWORD h = 1; h < n; h *= 2)
+    {
+        for (DWORD j = 0; j < h; ++j)
+        {
+            double a = -PI * j / h;
+            m_twiddleRe[h - 1 + j] = float(std::cos(a));
+            m_twiddleIm[h - 1 + j] = float(std::sin(a));
+        }
+    }
+
+    m_postRe.resize(n);
+    m_postIm.resize(n);
+    for (DWORD k = 0; k < n; ++k)
+    {
+        double a = -2 * PI * k / nSize;
+        m_postRe[k] = float(std::cos(a));
+        m_postIm[k] = float(std::sin(a));
+    }
+
+    m_re.resize(n);
+    m_im.resize(n);
+    return TRUE;
+}
+
+// The even samples go to the real plane and the odd ones to the imaginary
+// plane; the spectrum of the real signal is untangled from their FFT.
+void RealFft::GetPower(const float *px, float *pPower)
+{
+    const DWORD n = m_nSize / 2;
+    float *re = m_re.data(), *im = m_im.data();
+    for (DWORD i = 0; i < n; ++i)
+    {
+        DWORD r = m_reverse[i];
+        re[i] = px[2 * r];
+        im[i] = px[2 * r + 1];
+    }
+
+    for (DWORD h = 1; h < n; h *= 2)
+    {
+        BUTTERFLY_PROC proc = get_butterfly_proc(h);
+        proc(re, im, n, h, &m_twiddleRe[h - 1], &m_twiddleIm[h - 1]);
+    }
+
+    float x0 = re[0] + im[0], xn = re[0] - im[0];
+    pPower[0] = x0 * x0;
+    pPower[n] = xn * xn;
+    for (DWORD k = 1; k < n; ++k)
+    {
+        float ar = re[k], ai = im[k];
+        float br = re[n - k], bi = im[n - k];
+        float er = 0.5f * (ar + br), ei = 0.5f * (ai - bi);
+        float or_ = 0.5f * (ai + bi), oi = -0.5f * (ar - br);
+        float wr = m_postRe[k], wi = m_postIm[k];
+        float xr = er + wr * or_ - wi * oi;
+        float xi = ei + wr * oi + wi * or_;
+        pPower[k] = xr * xr + xi * xi;
+    }
+}
+
+SpectrumAnalyzer::SpectrumAnalyzer()
+    : m_nFftSize(4096)
+    , m_nSpectraPerSecond(20)
+    , m_format(SAMPLE_FORMAT_UNKNOWN)
+    , m_nHop(0)
+    , m_scale(0)
+    , m_hThread(NULL)
+    , m_hWakeUp(NULL)
+    , m_hShutdown(NULL)
+    , m_hFile(INVALID_HANDLE_VALUE)
+    , m_nFill(0)
+    , m_nSkip(0)
+    , m_nPosition(0)
+{
+    m_szSpectrogram[0] = 0;
+    ZeroMemory(&m_wfx, sizeof(m_wfx));
+    ZeroMemory(&m_info, sizeof(m_info));
+    ::InitializeCriticalSection(&m_lock);
+}
+
+SpectrumAnalyzer::~SpectrumAnalyzer()
+{
+    Stop();
+    ::DeleteCriticalSection(&m_lock);
+}
+
+void SpectrumAnalyzer::SetSize(DWORD nFftSize)
+{
+    m_nFftSize = nFftSize;
+}
+
+void SpectrumAnalyzer::SetRate(DWORD nSpectraPerSecond)
+{
+    m_nSpectraPerSecond = nSpectraPerSecond;
+}
+
+void SpectrumAnalyzer::SetSpectrogramFile(LPCTSTR pszFileName)
+{
+    if (pszFileName)
+        lstrcpyn(m_szSpectrogram, pszFileName, ARRAYSIZE(m_szSpectrogram));
+    else
+        m_szSpectrogram[0] = 0;
+}
+
+BOOL SpectrumAnalyzer::Prepare(const WAVEFORMATEX *pwfx)
+{
+    m_format = get_sample_format(pwfx);
+    if (m_format == SAMPLE_FORMAT_UNKNOWN || m_nSpectraPerSecond == 0 ||
+        !m_fft.Init(m_nFftSize))
+    {
+        return FALSE;
+    }
+
+    CopyMemory(&m_wfx, pwfx, sizeof(m_wfx));
+    m_nHop = m_wfx.nSamplesPerSec / m_nSpectraPerSecond;
+    if (m_nHop == 0)
+        m_nHop = 1;
+
+    // A periodic Hann window. A sine of amplitude 1 peaks at half the sum
+    // of the window.
+    const DWORD n = m_nFftSize;
+    m_window.resize(n);
+    double sum = 0;
+    for (DWORD i = 0; i < n; ++i)
+    {
+        m_window[i] = float(0.5 - 0.5 * std::cos(2 * PI * i / n));
+        sum += m_window[i];
+    }
+    m_scale = float(4 / (sum * sum));
+
+    const WORD nChannels = m_wfx.nChannels;
+    const DWORD nBins = n / 2 + 1;
+    m_interleaved.resize(SPECTRUM_CHUNK * nChannels);
+    m_planes.resize(nChannels);
+    m_pointers.resize(nChannels);
+    for (WORD ch = 0; ch < nChannels; ++ch)
+        m_planes[ch].assign(n + SPECTRUM_CHUNK, 0.0f);
+    m_nFill = m_nSkip = 0;
+    m_nPosition = 0;
+    m_windowed.resize(n);
+    m_power.resize(nBins);
+    m_spectrum.resize(nChannels * nBins);
+
+    ::EnterCriticalSection(&m_lock);
+    m_published.assign(nChannels * nBins, -200.0f);
+    ZeroMemory(&m_info, sizeof(m_info));
+    m_info.nSamplesPerSec = m_wfx.nSamplesPerSec;
+    m_info.nBins = nBins;
+    m_info.nChannels = nChannels;
+    ::LeaveCriticalSection(&m_lock);
+    return TRUE;
+}
+
+BOOL SpectrumAnalyzer::Start(const WAVEFORMATEX *pwfx)
+{
+    Stop();
+
+    if (!Prepare(pwfx))
+        return FALSE;
+
+    // A second of packets, in whole frames.
+    const DWORD nBlockAlign = m_wfx.nBlockAlign;
+    if (!m_ring.Allocate(m_wfx.nSamplesPerSec * nBlockAlign))
+        return FALSE;
+    m_zeros.assign(SPECTRUM_CHUNK * nBlockAlign, (m_format == SAMPLE_FORMAT_U8) ? 0x80 : 0);
+
+    if (m_szSpectrogram[0])
+    {
+        m_hFile = ::CreateFile(m_szSpectrogram, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                               CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            return FALSE;
+
+        SPECTROGRAM_HEADER header;
+        ZeroMemory(&header, sizeof(header));
+        CopyMemory(header.id, "SPGM", 4);
+        header.nBins = m_info.nBins;
+        header.nChannels = m_wfx.nChannels;
+        header.nSamplesPerSec = m_wfx.nSamplesPerSec;
+        header.nFftSize = m_nFftSize;
+        header.nHop = m_nHop;
+        DWORD cbWritten;
+        ::WriteFile(m_hFile, &header, sizeof(header), &cbWritten, NULL);
+    }
+
+    m_hWakeUp = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_hShutdown = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_hThread = ::CreateThread(NULL, 0, ThreadFunction, this, 0, NULL);
+    if (!m_hThread)
+    {
+        Stop();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void SpectrumAnalyzer::Stop()
+{
+    if (m_hThread)
+    {
+        ::SetEvent(m_hShutdown);
+        ::WaitForSingleObject(m_hThread, INFINITE);
+        ::CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+    if (m_hWakeUp)
+    {
+        ::CloseHandle(m_hWakeUp);
+        m_hWakeUp = NULL;
+    }
+    if (m_hShutdown)
+    {
+        ::CloseHandle(m_hShutdown);
+        m_hShutdown = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+    m_ring.Free();
+}
+
+void SpectrumAnalyzer::Write(const BYTE *pb, DWORD cb, BOOL bSilent)
+{
+    if (!bSilent)
+    {
+        m_ring.Write(pb, cb);
+    }
+    else
+    {
+        while (cb > 0)
+        {
+            DWORD cbZeros = (cb < m_zeros.size()) ? cb : DWORD(m_zeros.size());
+            m_ring.Write(m_zeros.data(), cbZeros);
+            cb -= cbZeros;
+        }
+    }
+    ::SetEvent(m_hWakeUp);
+}
+
+BOOL SpectrumAnalyzer::GetSpectrum(SPECTRUM_INFO& info, std::vector<float>& dB) const
+{
+    ::EnterCriticalSection(&m_lock);
+    info = m_info;
+    dB = m_published;
+    ::LeaveCriticalSection(&m_lock);
+    return info.nSpectra > 0;
+}
+
+void SpectrumAnalyzer::Analyze(const BYTE *pb, DWORD cb)
+{
+    const WORD nChannels = m_wfx.nChannels;
+    const DWORD nBlockAlign = m_wfx.nBlockAlign;
+    const DWORD n = m_nFftSize;
+    DWORD nFrames = cb / nBlockAlign;
+    while (nFrames > 0)
+    {
+        DWORD nChunk = (nFrames < SPECTRUM_CHUNK) ? nFrames : SPECTRUM_CHUNK;
+        if (m_nSkip)
+        {
+            if (nChunk > m_nSkip)
+                nChunk = m_nSkip;
+            m_nSkip -= nChunk;
+        }
+        else
+        {
+            // The planes keep fewer than n frames between calls, so a chunk
+            // always fits.
+            convert_to_float(m_format, pb, nChunk * nChannels, m_interleaved.data());
+            for (WORD ch = 0; ch < nChannels; ++ch)
+                m_pointers[ch] = m_planes[ch].data() + m_nFill;
+            deinterleave_float(m_interleaved.data(), nChunk, nChannels, m_pointers.data());
+            m_nFill += nChunk;
+        }
+        m_nPosition += nChunk;
+        pb += nChunk * nBlockAlign;
+        nFrames -= nChunk;
+
+        while (m_nFill >= n)
+        {
+            Compute();
+
+            if (m_nHop < m_nFill)
+            {
+                for (WORD ch = 0; ch < nChannels; ++ch)
+                {
+                    float *pf = m_planes[ch].data();
+                    memmove(pf, pf + m_nHop, (m_nFill - m_nHop) * sizeof(float));
+                }
+                m_nFill -= m_nHop;
+            }
+            else
+            {
+                m_nSkip = m_nHop - m_nFill;
+                m_nFill = 0;
+            }
+        }
+    }
+}
+
+// The spectra of the first n frames of the planes.
+void SpectrumAnalyzer::Compute()
+{
+    const WORD nChannels = m_wfx.nChannels;
+    const DWORD n = m_nFftSize;
+    const DWORD nBins = n / 2 + 1;
+    for (WORD ch = 0; ch < nChannels; ++ch)
+    {
+        const float *pf = m_planes[ch].data();
+        for (DWORD i = 0; i < n; ++i)
+            m_windowed[i] = pf[i] * m_window[i];
+
+        m_fft.GetPower(m_windowed.data(), m_power.data());
+
+        float *pdB = &m_spectrum[ch * nBins];
+        for (DWORD k = 0; k < nBins; ++k)
+            pdB[k] = 10 * std::log10(m_power[k] * m_scale + 1e-20f);
+    }
+
+    ::EnterCriticalSection(&m_lock);
+    m_published.assign(m_spectrum.begin(), m_spectrum.end());
+    m_info.nSpectra++;
+    m_info.nPosition = m_nPosition - (m_nFill - n);
+    ::LeaveCriticalSection(&m_lock);
+
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        DWORD cbWritten;
+        ::WriteFile(m_hFile, m_spectrum.data(), DWORD(m_spectrum.size() * sizeof(float)),
+                    &cbWritten, NULL);
+    }
+}
+
+void SpectrumAnalyzer::Drain()
+{
+    const BYTE *pb1, *pb2;
+    DWORD cb1, cb2;
+    DWORD cb = m_ring.Peek(&pb1, &cb1, &pb2, &cb2);
+    if (cb == 0)
+        return;
+
+    Analyze(pb1, cb1);
+    if (cb2)
+        Analyze(pb2, cb2);
+    m_ring.Consume(cb);
+}
+
+DWORD WINAPI SpectrumAnalyzer::ThreadFunction(LPVOID pContext)
+{
+    SpectrumAnalyzer *pThis = reinterpret_cast<SpectrumAnalyzer *>(pContext);
+    return pThis->ThreadProc();
+}
+
+DWORD SpectrumAnalyzer::ThreadProc()
+{
+    HANDLE waitArray[2] = { m_hShutdown, m_hWakeUp };
+
+    bool bKeepRunning = true;
+    while (bKeepRunning)
+    {
+        DWORD waitResult = ::WaitForMultipleObjects(2, waitArray, FALSE, INFINITE);
+        if (waitResult != WAIT_OBJECT_0 + 1)
+            bKeepRunning = false;
+
+        Drain();
+    }
+    return 0;
+}
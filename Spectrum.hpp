@@ -0,0 +1,139 @@
+#ifndef SPECTRUM_HPP_
+#define SPECTRUM_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <vector>
+#include "Meter.hpp"
+#include "RingBuffer.hpp"
+
+// A real FFT of a power of two points, as a complex FFT of half the size
+// on split real and imaginary planes, whose butterflies run with the
+// kernel of get_simd_level().
+class RealFft
+{
+public:
+    RealFft();
+
+    BOOL Init(DWORD nSize);
+    DWORD GetSize() const
+    {
+        return m_nSize;
+    }
+
+    // The power |X[k]|^2 of the nSize / 2 + 1 bins of px.
+    void GetPower(const float *px, float *pPower);
+
+protected:
+    DWORD m_nSize;
+    std::vector<DWORD> m_reverse;       // bit reversal of the half size
+    std::vector<float> m_twiddleRe;     // per stage of half h, from h - 1
+    std::vector<float> m_twiddleIm;
+    std::vector<float> m_postRe;        // exp(-2 pi i k / nSize)
+    std::vector<float> m_postIm;
+    std::vector<float> m_re;
+    std::vector<float> m_im;
+};
+
+// Bins as 32-bit float dB after a SPECTROGRAM_HEADER, nChannels rows of
+// nBins per frame, channel by channel.
+struct SPECTROGRAM_HEADER
+{
+    char id[4];                 // "SPGM"
+    DWORD nBins;
+    WORD nChannels;
+    WORD wReserved;
+    DWORD nSamplesPerSec;
+    DWORD nFftSize;
+    DWORD nHop;                 // frames between two spectra
+};
+
+struct SPECTRUM_INFO
+{
+    ULONGLONG nSpectra;         // published since Start
+    ULONGLONG nPosition;        // the frame after the last one analyzed
+    DWORD nSamplesPerSec;
+    DWORD nBins;                // bin k is at k * nSamplesPerSec / nFftSize Hz
+    WORD nChannels;
+};
+
+// Runs Hann-windowed FFTs with overlap over a captured stream, off the
+// audio thread. The capture thread only copies its packets into a ring;
+// a thread of the analyzer converts them, takes a spectrum of every
+// channel every hop, publishes the latest in dBFS (a full-scale sine
+// reads 0 dB), and may append it to a spectrogram file.
+class SpectrumAnalyzer
+{
+public:
+    SpectrumAnalyzer();
+    ~SpectrumAnalyzer();
+
+    // All take effect on the next Start. The hop is the rate's share of a
+    // second, so spectra overlap when it is shorter than the FFT.
+    void SetSize(DWORD nFftSize);
+    void SetRate(DWORD nSpectraPerSecond);
+    void SetSpectrogramFile(LPCTSTR pszFileName);
+
+    // pwfx is the format of the packets.
+    BOOL Start(const WAVEFORMATEX *pwfx);
+    void Stop();
+    BOOL IsRunning() const
+    {
+        return m_hThread != NULL;
+    }
+
+    // Capture thread. A full ring drops the packet.
+    void Write(const BYTE *pb, DWORD cb, BOOL bSilent);
+
+    // Any thread. dB receives nChannels rows of nBins.
+    BOOL GetSpectrum(SPECTRUM_INFO& info, std::vector<float>& dB) const;
+
+    // Analyzes interleaved frames on the caller's thread, as the analyzer's
+    // thread does with the ring, e.g. for a file. Call Prepare first, and
+    // nothing else meanwhile.
+    BOOL Prepare(const WAVEFORMATEX *pwfx);
+    void Analyze(const BYTE *pb, DWORD cb);
+
+protected:
+    DWORD m_nFftSize;
+    DWORD m_nSpectraPerSecond;
+    TCHAR m_szSpectrogram[MAX_PATH];
+
+    WAVEFORMATEX m_wfx;
+    SAMPLE_FORMAT m_format;
+    DWORD m_nHop;
+    RealFft m_fft;
+    std::vector<float> m_window;
+    float m_scale;                      // to the power of a full-scale sine
+    RingBuffer m_ring;
+    std::vector<BYTE> m_zeros;
+    HANDLE m_hThread;
+    HANDLE m_hWakeUp;
+    HANDLE m_hShutdown;
+    HANDLE m_hFile;
+
+    // The analyzer's thread's.
+    std::vector<float> m_interleaved;
+    std::vector<std::vector<float> > m_planes;
+    std::vector<float *> m_pointers;
+    DWORD m_nFill;                      // frames in the planes
+    DWORD m_nSkip;                      // frames to drop before the next
+    ULONGLONG m_nPosition;
+    std::vector<float> m_windowed;
+    std::vector<float> m_power;
+    std::vector<float> m_spectrum;
+
+    mutable CRITICAL_SECTION m_lock;
+    std::vector<float> m_published;
+    SPECTRUM_INFO m_info;
+
+    void Compute();
+    void Drain();
+    static DWORD WINAPI ThreadFunction(LPVOID pContext);
+    DWORD ThreadProc();
+
+    SpectrumAnalyzer(const SpectrumAnalyzer&);
+    SpectrumAnalyzer& operator=(const SpectrumAnalyzer&);
+};
+
+#endif  // ndef SPECTRUM_HPP_
@@ -0,0 +1,346 @@
+#include "Telemetry.hpp"
+#include <audioclient.h>
+#include <cmath>
+
+ULONGLONG get_histogram_percentile(const TELEMETRY_HISTOGRAM *pHistogram, double p)
+{
+    if (pHistogram->nCount == 0)
+        return 0;
+
+    ULONGLONG nWanted = ULONGLONG(std::ceil(p * pHistogram->nCount));
+    if (nWanted == 0)
+        nWanted = 1;
+
+    ULONGLONG nSeen = 0;
+    for (int i = 0; i < TELEMETRY_BUCKETS - 1; ++i)
+    {
+        nSeen += pHistogram->buckets[i];
+        if (nSeen >= nWanted)
+        {
+            ULONGLONG nUpper = (i == 0) ? 0 : (ULONGLONG(1) << i) - 1;
+            return (nUpper < pHistogram->nMax) ? nUpper : pHistogram->nMax;
+        }
+    }
+    return pHistogram->nMax;
+}
+
+double get_histogram_mean(const TELEMETRY_HISTOGRAM *pHistogram)
+{
+    if (pHistogram->nCount == 0)
+        return 0;
+    return double(pHistogram->nSum) / double(pHistogram->nCount);
+}
+
+ULONGLONG get_capture_latency(UINT64 u64QPCPosition, LONGLONG llNow, LONGLONG llFrequency)
+{
+    if (llNow <= 0 || llFrequency <= 0)
+        return 0;
+    ULONGLONG nNow = ULONGLONG(llNow / llFrequency) * 1000000 +
+                     ULONGLONG(llNow % llFrequency) * 1000000 / llFrequency;
+    ULONGLONG nCaptured = u64QPCPosition / 10;
+    return (nNow > nCaptured) ? nNow - nCaptured : 0;
+}
+
+struct TELEMETRY_FIELD
+{
+    const char *pszName;
+    const TELEMETRY_HISTOGRAM *pHistogram;
+};
+
+static int get_histogram_fields(const CAPTURE_STATS *pStats, TELEMETRY_FIELD *pFields)
+{
+    int n = 0;
+    pFields[n].pszName = "wake_interval";  pFields[n++].pHistogram = &pStats->wakeInterval;
+    pFields[n].pszName = "wake_jitter";    pFields[n++].pHistogram = &pStats->wakeJitter;
+    pFields[n].pszName = "latency";        pFields[n++].pHistogram = &pStats->latency;
+    pFields[n].pszName = "end_to_end";     pFields[n++].pHistogram = &pStats->endToEnd;
+    pFields[n].pszName = "get_buffer";     pFields[n++].pHistogram = &pStats->getBuffer;
+    pFields[n].pszName = "release_buffer"; pFields[n++].pHistogram = &pStats->releaseBuffer;
+    pFields[n].pszName = "packet_frames";  pFields[n++].pHistogram = &pStats->packetFrames;
+    pFields[n].pszName = "queue_depth";    pFields[n++].pHistogram = &pStats->queueDepth;
+    return n;
+}
+
+void write_capture_stats(FILE *fp, const CAPTURE_STATS *pStats,
+                         TELEMETRY_FORMAT format, BOOL bHeader)
+{
+    TELEMETRY_FIELD fields[8];
+    int nFields = get_histogram_fields(pStats, fields);
+
+    if (format == TELEMETRY_CSV)
+    {
+        if (bHeader)
+        {
+            fprintf(fp, "elapsed_us,wakeups,empty_wakeups,packets,frames,silent,"
+                        "discontinuities,timestamp_errors,position_jumps,missing_frames,"
+                        "overflows,dropped_bytes,period_us,buffer_us");
+            for (int i = 0; i < nFields; ++i)
+            {
+                fprintf(fp, ",%s_mean,%s_p50,%s_p99,%s_max", fields[i].pszName,
+                        fields[i].pszName, fields[i].pszName, fields[i].pszName);
+            }
+            fprintf(fp, "\n");
+        }
+
+        fprintf(fp, "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%lu,%llu,%llu,%llu",
+                (unsigned long long)pStats->nElapsed,
+                (unsigned long long)pStats->nWakeUps,
+                (unsigned long long)pStats->nEmptyWakeUps,
+                (unsigned long long)pStats->nPackets,
+                (unsigned long long)pStats->nFrames,
+                (unsigned long long)pStats->nSilentPackets,
+                (unsigned long long)pStats->nDiscontinuities,
+                (unsigned long long)pStats->nTimestampErrors,
+                (unsigned long long)pStats->nPositionJumps,
+                (unsigned long long)pStats->nMissingFrames,
+                (unsigned long)pStats->nOverflows,
+                (unsigned long long)pStats->cbDropped,
+                (unsigned long long)pStats->nPeriod,
+                (unsigned long long)pStats->nBuffer);
+        for (int i = 0; i < nFields; ++i)
+        {
+            const TELEMETRY_HISTOGRAM *pHistogram = fields[i].pHistogram;
+            fprintf(fp, ",%.1f,%llu,%llu,%llu", get_histogram_mean(pHistogram),
+                    (unsigned long long)get_histogram_percentile(pHistogram, 0.5),
+                    (unsigned long long)get_histogram_percentile(pHistogram, 0.99),
+                    (unsigned long long)pHistogram->nMax);
+        }
+        fprintf(fp, "\n");
+        return;
+    }
+
+    fprintf(fp, "{\"elapsed_us\":%llu,\"wakeups\":%llu,\"empty_wakeups\":%llu,"
+                "\"packets\":%llu,\"frames\":%llu,\"silent\":%llu,"
+                "\"discontinuities\":%llu,\"timestamp_errors\":%llu,"
+                "\"position_jumps\":%llu,\"missing_frames\":%llu,"
+                "\"overflows\":%lu,\"dropped_bytes\":%llu,"
+                "\"period_us\":%llu,\"buffer_us\":%llu",
+            (unsigned long long)pStats->nElapsed,
+            (unsigned long long)pStats->nWakeUps,
+            (unsigned long long)pStats->nEmptyWakeUps,
+            (unsigned long long)pStats->nPackets,
+            (unsigned long long)pStats->nFrames,
+            (unsigned long long)pStats->nSilentPackets,
+            (unsigned long long)pStats->nDiscontinuities,
+            (unsigned long long)pStats->nTimestampErrors,
+            (unsigned long long)pStats->nPositionJumps,
+            (unsigned long long)pStats->nMissingFrames,
+            (unsigned long)pStats->nOverflows,
+            (unsigned long long)pStats->cbDropped,
+            (unsigned long long)pStats->nPeriod,
+            (unsigned long long)pStats->nBuffer);
+    for (int i = 0; i < nFields; ++i)
+    {
+        const TELEMETRY_HISTOGRAM *pHistogram = fields[i].pHistogram;
+        fprintf(fp, ",\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p99\":%llu,"
+                    "\"max\":%llu,\"buckets\":[",
+                fields[i].pszName, (unsigned long long)pHistogram->nCount,
+                get_histogram_mean(pHistogram),
+                (unsigned long long)get_histogram_percentile(pHistogram, 0.5),
+                (unsigned long long)get_histogram_percentile(pHistogram, 0.99),
+                (unsigned long long)pHistogram->nMax);
+        for (int k = 0; k < TELEMETRY_BUCKETS; ++k)
+        {
+            fprintf(fp, (k == 0) ? "%llu" : ",%llu",
+                    (unsigned long long)pHistogram->buckets[k]);
+        }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "}\n");
+}
+
+TelemetryHistogram::TelemetryHistogram()
+{
+    Reset();
+}
+
+void TelemetryHistogram::Reset()
+{
+    m_nCount.store(0);
+    m_nSum.store(0);
+    m_nMax.store(0);
+    for (int i = 0; i < TELEMETRY_BUCKETS; ++i)
+        m_buckets[i].store(0);
+}
+
+void TelemetryHistogram::Add(ULONGLONG nValue)
+{
+    int i = 0;
+    for (ULONGLONG x = nValue; x && i < TELEMETRY_BUCKETS - 1; x >>= 1)
+        ++i;
+
+    increase_counter(m_buckets[i]);
+    increase_counter(m_nCount);
+    increase_counter(m_nSum, nValue);
+    if (m_nMax.load(std::memory_order_relaxed) < nValue)
+        m_nMax.store(nValue, std::memory_order_relaxed);
+}
+
+void TelemetryHistogram::Get(TELEMETRY_HISTOGRAM *pHistogram) const
+{
+    pHistogram->nCount = m_nCount.load(std::memory_order_relaxed);
+    pHistogram->nSum = m_nSum.load(std::memory_order_relaxed);
+    pHistogram->nMax = m_nMax.load(std::memory_order_relaxed);
+    for (int i = 0; i < TELEMETRY_BUCKETS; ++i)
+        pHistogram->buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+}
+
+CaptureTelemetry::CaptureTelemetry()
+{
+    WAVEFORMATEX wfx;
+    ZeroMemory(&wfx, sizeof(wfx));
+    Reset(&wfx);
+}
+
+void CaptureTelemetry::Reset(const WAVEFORMATEX *pwfx)
+{
+    LARGE_INTEGER li;
+    ::QueryPerformanceFrequency(&li);
+    m_llFrequency = li.QuadPart;
+    m_llStart = Now();
+    m_nAvgBytesPerSec = pwfx->nAvgBytesPerSec;
+    m_nSamplesPerSec = pwfx->nSamplesPerSec;
+
+    m_llLastWakeUp = 0;
+    m_averageInterval = 0;
+    m_bPositioned = FALSE;
+    m_u64NextPosition = 0;
+    m_bStamped = FALSE;
+    m_u64QPCPosition = 0;
+
+    m_nPeriod.store(0);
+    m_nBuffer.store(0);
+    m_nWakeUps.store(0);
+    m_nEmptyWakeUps.store(0);
+    m_nPackets.store(0);
+    m_nFrames.store(0);
+    m_nSilentPackets.store(0);
+    m_nDiscontinuities.store(0);
+    m_nTimestampErrors.store(0);
+    m_nPositionJumps.store(0);
+    m_nMissingFrames.store(0);
+    m_wakeInterval.Reset();
+    m_wakeJitter.Reset();
+    m_latency.Reset();
+    m_endToEnd.Reset();
+    m_getBuffer.Reset();
+    m_releaseBuffer.Reset();
+    m_packetFrames.Reset();
+    m_queueDepth.Reset();
+}
+
+ULONGLONG CaptureTelemetry::ToMicroseconds(LONGLONG llTicks) const
+{
+    if (llTicks <= 0)
+        return 0;
+    return ULONGLONG(llTicks / m_llFrequency) * 1000000 +
+           ULONGLONG(llTicks % m_llFrequency) * 1000000 / m_llFrequency;
+}
+
+void CaptureTelemetry::OnTiming(UINT32 nPeriodFrames, UINT32 nBufferFrames)
+{
+    if (m_nSamplesPerSec == 0)
+        return;
+    m_nPeriod.store(ULONGLONG(nPeriodFrames) * 1000000 / m_nSamplesPerSec,
+                    std::memory_order_relaxed);
+    m_nBuffer.store(ULONGLONG(nBufferFrames) * 1000000 / m_nSamplesPerSec,
+                    std::memory_order_relaxed);
+}
+
+void CaptureTelemetry::OnWakeUp(BOOL bPacketReady)
+{
+    LONGLONG llNow = Now();
+    increase_counter(m_nWakeUps);
+    if (!bPacketReady)
+        increase_counter(m_nEmptyWakeUps);
+
+    // The jitter is taken from the period of the source, or from a running
+    // average of the interval if the period is not known.
+    if (m_llLastWakeUp)
+    {
+        ULONGLONG nInterval = ToMicroseconds(llNow - m_llLastWakeUp);
+        m_wakeInterval.Add(nInterval);
+        if (m_averageInterval == 0)
+            m_averageInterval = double(nInterval);
+        double expected = double(m_nPeriod.load(std::memory_order_relaxed));
+        if (expected == 0)
+            expected = m_averageInterval;
+        m_wakeJitter.Add(ULONGLONG(std::fabs(nInterval - expected)));
+        m_averageInterval += (nInterval - m_averageInterval) / 16;
+    }
+    m_llLastWakeUp = llNow;
+}
+
+void CaptureTelemetry::OnGetBuffer(LONGLONG llBefore, UINT32 nFrames, DWORD dwFlags,
+                                   UINT64 u64DevicePosition, UINT64 u64QPCPosition)
+{
+    LONGLONG llNow = Now();
+    m_getBuffer.Add(ToMicroseconds(llNow - llBefore));
+
+    increase_counter(m_nPackets);
+    increase_counter(m_nFrames, nFrames);
+    m_packetFrames.Add(nFrames);
+    if (dwFlags & AUDCLNT_BUFFERFLAGS_SILENT)
+        increase_counter(m_nSilentPackets);
+    if (dwFlags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)
+        increase_counter(m_nDiscontinuities);
+
+    if (dwFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR)
+    {
+        increase_counter(m_nTimestampErrors);
+    }
+    else
+    {
+        m_latency.Add(get_capture_latency(u64QPCPosition, llNow, m_llFrequency));
+    }
+    m_bStamped = !(dwFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR);
+    m_u64QPCPosition = u64QPCPosition;
+
+    if (m_bPositioned && u64DevicePosition != m_u64NextPosition)
+    {
+        increase_counter(m_nPositionJumps);
+        if (u64DevicePosition > m_u64NextPosition)
+            increase_counter(m_nMissingFrames, u64DevicePosition - m_u64NextPosition);
+    }
+    m_u64NextPosition = u64DevicePosition + nFrames;
+    m_bPositioned = TRUE;
+}
+
+void CaptureTelemetry::OnReleaseBuffer(LONGLONG llBefore)
+{
+    LONGLONG llNow = Now();
+    m_releaseBuffer.Add(ToMicroseconds(llNow - llBefore));
+    if (m_bStamped)
+        m_endToEnd.Add(get_capture_latency(m_u64QPCPosition, llNow, m_llFrequency));
+}
+
+void CaptureTelemetry::OnQueueDepth(DWORD cbQueued)
+{
+    if (m_nAvgBytesPerSec)
+        m_queueDepth.Add(ULONGLONG(cbQueued) * 1000000 / m_nAvgBytesPerSec);
+}
+
+void CaptureTelemetry::GetStats(CAPTURE_STATS *pStats) const
+{
+    ZeroMemory(pStats, sizeof(*pStats));
+    pStats->nElapsed = ToMicroseconds(Now() - m_llStart);
+    pStats->nWakeUps = m_nWakeUps.load(std::memory_order_relaxed);
+    pStats->nEmptyWakeUps = m_nEmptyWakeUps.load(std::memory_order_relaxed);
+    pStats->nPackets = m_nPackets.load(std::memory_order_relaxed);
+    pStats->nFrames = m_nFrames.load(std::memory_order_relaxed);
+    pStats->nSilentPackets = m_nSilentPackets.load(std::memory_order_relaxed);
+    pStats->nDiscontinuities = m_nDiscontinuities.load(std::memory_order_relaxed);
+    pStats->nTimestampErrors = m_nTimestampErrors.load(std::memory_order_relaxed);
+    pStats->nPositionJumps = m_nPositionJumps.load(std::memory_order_relaxed);
+    pStats->nMissingFrames = m_nMissingFrames.load(std::memory_order_relaxed);
+    pStats->nPeriod = m_nPeriod.load(std::memory_order_relaxed);
+    pStats->nBuffer = m_nBuffer.load(std::memory_order_relaxed);
+    m_wakeInterval.Get(&pStats->wakeInterval);
+    m_wakeJitter.Get(&pStats->wakeJitter);
+    m_latency.Get(&pStats->latency);
+    m_endToEnd.Get(&pStats->endToEnd);
+    m_getBuffer.Get(&pStats->getBuffer);
+    m_releaseBuffer.Get(&pStats->releaseBuffer);
+    m_packetFrames.Get(&pStats->packetFrames);
+    m_queueDepth.Get(&pStats->queueDepth);
+}
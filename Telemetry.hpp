@@ -0,0 +1,173 @@
+#ifndef TELEMETRY_HPP_
+#define TELEMETRY_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <atomic>
+#include <cstdio>
+
+#define TELEMETRY_BUCKETS 24
+
+// Adds n to a counter that only one thread writes and any thread reads, so
+// a relaxed load and store do, without a read-modify-write.
+inline void increase_counter(std::atomic<ULONGLONG>& counter, ULONGLONG n = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+// A histogram on a log2 scale: bucket 0 counts the zeros, and bucket i the
+// values in [2^(i-1), 2^i). The last bucket also takes everything above.
+struct TELEMETRY_HISTOGRAM
+{
+    ULONGLONG nCount;
+    ULONGLONG nSum;
+    ULONGLONG nMax;
+    ULONGLONG buckets[TELEMETRY_BUCKETS];
+};
+
+// The upper bound of the bucket that holds the fraction p of the values,
+// or nMax if that is lower.
+ULONGLONG get_histogram_percentile(const TELEMETRY_HISTOGRAM *pHistogram, double p);
+double get_histogram_mean(const TELEMETRY_HISTOGRAM *pHistogram);
+
+// The time in microseconds from u64QPCPosition, a packet's stamp in
+// 100-nanosecond units as IAudioCaptureClient::GetBuffer gives it, to
+// llNow, a performance counter of llFrequency ticks per second. Zero if the
+// stamp is later.
+ULONGLONG get_capture_latency(UINT64 u64QPCPosition, LONGLONG llNow, LONGLONG llFrequency);
+
+// What the capture thread has seen since the last StartHearing. Times are
+// in microseconds.
+struct CAPTURE_STATS
+{
+    ULONGLONG nElapsed;                 // since the start
+    ULONGLONG nWakeUps;
+    ULONGLONG nEmptyWakeUps;            // woken with no packet ready
+    ULONGLONG nPackets;
+    ULONGLONG nFrames;
+    ULONGLONG nSilentPackets;
+    ULONGLONG nDiscontinuities;         // AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY
+    ULONGLONG nTimestampErrors;         // AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR
+    ULONGLONG nPositionJumps;           // device positions not following on
+    ULONGLONG nMissingFrames;           // skipped over by those jumps
+    DWORD nOverflows;                   // of the ring, filled in by Recording
+    ULONGLONG cbDropped;
+    ULONGLONG nPeriod;                  // of the stream, zero if not known
+    ULONGLONG nBuffer;                  // of the stream, zero if not known
+    TELEMETRY_HISTOGRAM wakeInterval;   // between two wake-ups
+    TELEMETRY_HISTOGRAM wakeJitter;     // from the period, or the average interval
+    TELEMETRY_HISTOGRAM latency;        // from the packet's QPC position to GetBuffer
+    TELEMETRY_HISTOGRAM endToEnd;       // from the packet's QPC position to ReleaseBuffer
+    TELEMETRY_HISTOGRAM getBuffer;      // spent inside GetBuffer
+    TELEMETRY_HISTOGRAM releaseBuffer;  // spent inside ReleaseBuffer
+    TELEMETRY_HISTOGRAM packetFrames;   // in frames
+    TELEMETRY_HISTOGRAM queueDepth;     // audio waiting in the ring after a write
+};
+
+enum TELEMETRY_FORMAT
+{
+    TELEMETRY_CSV,      // one row of summaries per dump
+    TELEMETRY_JSON      // one object per line, with the buckets
+};
+
+// Writes one dump. The CSV header goes before the first row if bHeader.
+void write_capture_stats(FILE *fp, const CAPTURE_STATS *pStats,
+                         TELEMETRY_FORMAT format, BOOL bHeader);
+
+// A histogram with a single writer. Adding is a few relaxed stores, and
+// readers on other threads see each counter whole.
+class TelemetryHistogram
+{
+public:
+    TelemetryHistogram();
+
+    void Reset();
+    void Add(ULONGLONG nValue);
+    void Get(TELEMETRY_HISTOGRAM *pHistogram) const;
+
+protected:
+    std::atomic<ULONGLONG> m_nCount;
+    std::atomic<ULONGLONG> m_nSum;
+    std::atomic<ULONGLONG> m_nMax;
+    std::atomic<ULONGLONG> m_buckets[TELEMETRY_BUCKETS];
+
+    TelemetryHistogram(const TelemetryHistogram&);
+    TelemetryHistogram& operator=(const TelemetryHistogram&);
+};
+
+// The instrumentation of Recording::ThreadProc. The On methods are called
+// from the capture thread only; each costs a QueryPerformanceCounter at
+// most and a few stores, so it stays on. GetStats may be called from any
+// thread at any time. The counters are read one by one, so they may be a
+// packet apart from each other.
+class CaptureTelemetry
+{
+public:
+    CaptureTelemetry();
+
+    // Not thread-safe. Call this before the capture thread starts. pwfx is
+    // the format of the packets.
+    void Reset(const WAVEFORMATEX *pwfx);
+
+    LONGLONG Now() const
+    {
+        LARGE_INTEGER li;
+        ::QueryPerformanceCounter(&li);
+        return li.QuadPart;
+    }
+
+    // The period and the buffer the source got from Open, in frames.
+    void OnTiming(UINT32 nPeriodFrames, UINT32 nBufferFrames);
+    void OnWakeUp(BOOL bPacketReady);
+    // llBefore is Now() before GetBuffer.
+    void OnGetBuffer(LONGLONG llBefore, UINT32 nFrames, DWORD dwFlags,
+                     UINT64 u64DevicePosition, UINT64 u64QPCPosition);
+    // The packet has been handed to the consumers by then.
+    void OnReleaseBuffer(LONGLONG llBefore);
+    void OnQueueDepth(DWORD cbQueued);
+
+    void GetStats(CAPTURE_STATS *pStats) const;
+
+protected:
+    LONGLONG m_llFrequency;
+    LONGLONG m_llStart;
+    DWORD m_nAvgBytesPerSec;
+    DWORD m_nSamplesPerSec;
+
+    // The capture thread's.
+    LONGLONG m_llLastWakeUp;
+    double m_averageInterval;
+    BOOL m_bPositioned;
+    UINT64 m_u64NextPosition;
+    BOOL m_bStamped;                    // the last packet's QPC position is good
+    UINT64 m_u64QPCPosition;
+
+    std::atomic<ULONGLONG> m_nPeriod;
+    std::atomic<ULONGLONG> m_nBuffer;
+
+    std::atomic<ULONGLONG> m_nWakeUps;
+    std::atomic<ULONGLONG> m_nEmptyWakeUps;
+    std::atomic<ULONGLONG> m_nPackets;
+    std::atomic<ULONGLONG> m_nFrames;
+    std::atomic<ULONGLONG> m_nSilentPackets;
+    std::atomic<ULONGLONG> m_nDiscontinuities;
+    std::atomic<ULONGLONG> m_nTimestampErrors;
+    std::atomic<ULONGLONG> m_nPositionJumps;
+    std::atomic<ULONGLONG> m_nMissingFrames;
+    TelemetryHistogram m_wakeInterval;
+    TelemetryHistogram m_wakeJitter;
+    TelemetryHistogram m_latency;
+    TelemetryHistogram m_endToEnd;
+    TelemetryHistogram m_getBuffer;
+    TelemetryHistogram m_releaseBuffer;
+    TelemetryHistogram m_packetFrames;
+    TelemetryHistogram m_queueDepth;
+
+    ULONGLONG ToMicroseconds(LONGLONG llTicks) const;
+
+    CaptureTelemetry(const CaptureTelemetry&);
+    CaptureTelemetry& operator=(const CaptureTelemetry&);
+};
+
+#endif  // ndef TELEMETRY_HPP_
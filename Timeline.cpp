@@ -0,0 +1,126 @@
+#include "Timeline.hpp"
+#include "WaveReader.hpp"
+#include "WaveWriter.hpp"
+
+ULONGLONG get_timeline_position(const TIMELINE_GAP *pGaps, DWORD nGaps,
+                                ULONGLONG nFrame)
+{
+    ULONGLONG nSkipped = 0;
+    for (DWORD i = 0; i < nGaps && pGaps[i].nFrame <= nFrame; ++i)
+        nSkipped += pGaps[i].nFrames;
+    return nFrame + nSkipped;
+}
+
+static BOOL read_gaps(HANDLE hFile, const WAVE_FILE_INFO *pInfo,
+                      std::vector<TIMELINE_GAP>& gaps)
+{
+    gaps.clear();
+
+    ULONGLONG offset;
+    DWORD cb;
+    if (!find_wave_chunk(hFile, pInfo, TIMELINE_CHUNK_ID, &offset, &cb))
+        return TRUE;
+
+    gaps.resize(cb / sizeof(TIMELINE_GAP));
+    if (gaps.empty())
+        return TRUE;
+
+    LARGE_INTEGER li;
+    li.QuadPart = LONGLONG(offset);
+    DWORD cbRead, cbGaps = DWORD(gaps.size() * sizeof(TIMELINE_GAP));
+    return ::SetFilePointerEx(hFile, li, NULL, FILE_BEGIN) &&
+           ::ReadFile(hFile, gaps.data(), cbGaps, &cbRead, NULL) && cbRead == cbGaps;
+}
+
+BOOL read_timeline(LPCTSTR pszFileName, std::vector<TIMELINE_GAP>& gaps)
+{
+    HANDLE hFile = ::CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    WAVE_FILE_INFO info;
+    BOOL bOK = read_wave_header(hFile, &info) && read_gaps(hFile, &info, gaps);
+    ::CloseHandle(hFile);
+    return bOK;
+}
+
+BOOL expand_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput, ULONGLONG *pnFrames)
+{
+    HANDLE hFile = ::CreateFile(pszInput, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    WAVE_FILE_INFO info;
+    std::vector<TIMELINE_GAP> gaps;
+    if (!read_wave_header(hFile, &info) || !read_gaps(hFile, &info, gaps))
+    {
+        ::CloseHandle(hFile);
+        return FALSE;
+    }
+
+    const WAVEFORMATEX *pwfx = &info.wfx.Format;
+    const DWORD nBlockAlign = pwfx->nBlockAlign;
+    ULONGLONG cbAvailable = info.cbFile - info.offData;
+    if (cbAvailable > info.cbData)
+        cbAvailable = info.cbData;
+    const ULONGLONG nStored = cbAvailable / nBlockAlign;
+    const ULONGLONG nFrames = get_timeline_position(gaps.data(), DWORD(gaps.size()), nStored);
+
+    // The whole output is known, so it is allocated at once. 8-bit PCM is
+    // unsigned, and its silence is 0x80.
+    WaveWriter writer;
+    writer.SetPreallocation(nFrames * nBlockAlign);
+    if (!writer.Open(pszOutput, pwfx))
+    {
+        ::CloseHandle(hFile);
+        return FALSE;
+    }
+
+    const DWORD cbBuffer = WaveWriter::BLOCK_SIZE * 4 - (WaveWriter::BLOCK_SIZE * 4) % nBlockAlign;
+    std::vector<BYTE> buffer(cbBuffer);
+    std::vector<BYTE> silence(cbBuffer, (pwfx->wBitsPerSample == 8) ? 0x80 : 0);
+
+    LARGE_INTEGER li;
+    li.QuadPart = LONGLONG(info.offData);
+    BOOL bOK = ::SetFilePointerEx(hFile, li, NULL, FILE_BEGIN);
+
+    ULONGLONG nFrame = 0;
+    for (size_t iGap = 0; bOK && iGap <= gaps.size(); ++iGap)
+    {
+        ULONGLONG nEnd = (iGap < gaps.size()) ? gaps[iGap].nFrame : nStored;
+        if (nEnd > nStored)
+            nEnd = nStored;
+
+        ULONGLONG cbCopy = (nEnd > nFrame) ? (nEnd - nFrame) * nBlockAlign : 0;
+        while (bOK && cbCopy > 0)
+        {
+            DWORD cb = (cbCopy < cbBuffer) ? DWORD(cbCopy) : cbBuffer;
+            DWORD cbRead;
+            bOK = ::ReadFile(hFile, buffer.data(), cb, &cbRead, NULL) && cbRead == cb &&
+                  writer.Write(buffer.data(), cb);
+            cbCopy -= cb;
+        }
+        if (nEnd > nFrame)
+            nFrame = nEnd;
+
+        if (iGap == gaps.size())
+            break;
+
+        ULONGLONG cbSilence = gaps[iGap].nFrames * nBlockAlign;
+        while (bOK && cbSilence > 0)
+        {
+            DWORD cb = (cbSilence < cbBuffer) ? DWORD(cbSilence) : cbBuffer;
+            bOK = writer.Write(silence.data(), cb);
+            cbSilence -= cb;
+        }
+    }
+
+    ::CloseHandle(hFile);
+    if (!writer.Close())
+        bOK = FALSE;
+    if (pnFrames)
+        *pnFrames = nFrames;
+    return bOK;
+}
@@ -0,0 +1,30 @@
+#ifndef TIMELINE_HPP_
+#define TIMELINE_HPP_
+
+#include <windows.h>
+#include <vector>
+
+// A run of silence left out of a sparse recording: nFrames frames of the
+// original timeline were not stored before the stored frame nFrame.
+struct TIMELINE_GAP
+{
+    ULONGLONG nFrame;
+    ULONGLONG nFrames;
+};
+
+// The chunk after "data" that holds the gaps of a sparse WAV file in
+// order, as little-endian TIMELINE_GAPs.
+#define TIMELINE_CHUNK_ID "gaps"
+
+// Where a stored frame lies on the original timeline.
+ULONGLONG get_timeline_position(const TIMELINE_GAP *pGaps, DWORD nGaps,
+                                ULONGLONG nFrame);
+
+// A file without the chunk has no gaps.
+BOOL read_timeline(LPCTSTR pszFileName, std::vector<TIMELINE_GAP>& gaps);
+
+// Writes the original timeline of a sparse WAV file, with silence in the
+// gaps. pnFrames receives its length.
+BOOL expand_wave_file(LPCTSTR pszInput, LPCTSTR pszOutput, ULONGLONG *pnFrames);
+
+#endif  // ndef TIMELINE_HPP_
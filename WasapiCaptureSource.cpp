@@ -0,0 +1,213 @@
+#include "WasapiCaptureSource.hpp"
+#include "win/resource.h"
+
+#ifndef AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM
+    #define AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM 0x80000000
+#endif
+#ifndef AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY
+    #define AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY 0x08000000
+#endif
+
+WasapiCaptureSource::WasapiCaptureSource()
+    : m_DevicePeriod(0)
+    , m_bLoopback(FALSE)
+    , m_latency(CAPTURE_LATENCY_DEFAULT)
+    , m_dwBufferMilliseconds(0)
+{
+    ZeroMemory(&m_timing, sizeof(m_timing));
+}
+
+WasapiCaptureSource::~WasapiCaptureSource()
+{
+    Close();
+}
+
+void WasapiCaptureSource::SetDevice(CComPtr<IMMDevice> pDevice)
+{
+    m_pDevice = pDevice;
+}
+
+void WasapiCaptureSource::SetLatency(CAPTURE_LATENCY latency, DWORD dwBufferMilliseconds)
+{
+    m_latency = latency;
+    m_dwBufferMilliseconds = dwBufferMilliseconds;
+}
+
+HRESULT WasapiCaptureSource::GetTiming(CAPTURE_TIMING *pTiming)
+{
+    if (!m_pAudioClient)
+        return E_POINTER;
+    *pTiming = m_timing;
+    return S_OK;
+}
+
+HRESULT WasapiCaptureSource::Initialize(DWORD StreamFlags, const WAVEFORMATEX *pwfx)
+{
+    const DWORD nSamplesPerSec = pwfx->nSamplesPerSec;
+
+#ifdef __IAudioClient3_INTERFACE_DEFINED__
+    if (m_latency == CAPTURE_LATENCY_LOW)
+    {
+        // The shortest period comes without the engine's conversion, so it
+        // may refuse a format other than its own.
+        CComPtr<IAudioClient3> pAudioClient3;
+        pAudioClient3 = m_pAudioClient;
+        UINT32 nDefault, nFundamental, nMinimum, nMaximum;
+        if (pAudioClient3 &&
+            SUCCEEDED(pAudioClient3->GetSharedModeEnginePeriod(pwfx, &nDefault, &nFundamental,
+                                                               &nMinimum, &nMaximum)))
+        {
+            HRESULT hr = pAudioClient3->InitializeSharedAudioStream(
+                StreamFlags & ~(AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM |
+                                AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY),
+                nMinimum, pwfx, NULL);
+            if (SUCCEEDED(hr))
+            {
+                m_timing.nPeriodFrames = nMinimum;
+                return S_OK;
+            }
+            if (hr == AUDCLNT_E_WRONG_ENDPOINT_TYPE)
+                return hr;
+        }
+    }
+#endif
+
+    // A shared stream runs at the engine's period; the minimum one of
+    // GetDevicePeriod is for exclusive streams. The buffer is whole periods.
+    m_timing.nPeriodFrames = get_period_frames(m_DevicePeriod, nSamplesPerSec);
+    REFERENCE_TIME hnsBuffer = 0;
+    if (m_latency == CAPTURE_LATENCY_LOW || m_dwBufferMilliseconds)
+    {
+        UINT32 nBufferFrames = get_buffer_frames(m_timing.nPeriodFrames, nSamplesPerSec,
+                                                 m_dwBufferMilliseconds);
+        hnsBuffer = get_frames_duration(nBufferFrames, nSamplesPerSec);
+    }
+
+    return m_pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
+                                      StreamFlags,
+                                      hnsBuffer, 0, pwfx, 0);
+}
+
+HRESULT WasapiCaptureSource::Open(const WAVEFORMATEX *pwfx, HANDLE hWakeUp)
+{
+    HRESULT hr;
+
+    Close();
+    if (!m_pDevice)
+        return E_POINTER;
+
+    hr = m_pDevice->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&m_pAudioClient);
+    if (FAILED(hr))
+        return hr;
+
+    hr = m_pAudioClient->GetDevicePeriod(&m_DevicePeriod, NULL);
+    assert(SUCCEEDED(hr));
+
+    DWORD StreamFlags =
+        AUDCLNT_STREAMFLAGS_EVENTCALLBACK |
+        AUDCLNT_STREAMFLAGS_NOPERSIST |
+        AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM |
+        AUDCLNT_STREAMFLAGS_LOOPBACK;
+
+    hr = Initialize(StreamFlags, pwfx);
+    if (SUCCEEDED(hr))
+    {
+        // A loopback stream gets no packets while nothing is rendered.
+        m_bLoopback = TRUE;
+        ::PlaySound(MAKEINTRESOURCE(IDR_SILENT_WAV), GetModuleHandle(NULL),
+                    SND_ASYNC | SND_LOOP | SND_NODEFAULT |
+                    SND_RESOURCE);
+    }
+    else if (hr == AUDCLNT_E_WRONG_ENDPOINT_TYPE)
+    {
+        StreamFlags &= ~AUDCLNT_STREAMFLAGS_LOOPBACK;
+        hr = Initialize(StreamFlags, pwfx);
+    }
+    if (FAILED(hr))
+    {
+        Close();
+        return hr;
+    }
+
+    hr = m_pAudioClient->SetEventHandle(hWakeUp);
+    assert(SUCCEEDED(hr));
+
+    m_timing.nSamplesPerSec = pwfx->nSamplesPerSec;
+    hr = m_pAudioClient->GetBufferSize(&m_timing.nBufferFrames);
+    assert(SUCCEEDED(hr));
+
+    hr = m_pAudioClient->GetService(__uuidof(IAudioCaptureClient), (void**)&m_pCaptureClient);
+    if (FAILED(hr))
+        Close();
+    return hr;
+}
+
+void WasapiCaptureSource::Close()
+{
+    m_pCaptureClient.Release();
+    m_pAudioClient.Release();
+
+    if (m_bLoopback)
+    {
+        ::PlaySound(NULL, NULL, 0);
+        m_bLoopback = FALSE;
+    }
+}
+
+HRESULT WasapiCaptureSource::GetMixFormat(WAVEFORMATEXTENSIBLE *pwfx)
+{
+    if (!m_pDevice)
+        return E_POINTER;
+
+    CComPtr<IAudioClient> pAudioClient;
+    HRESULT hr = m_pDevice->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&pAudioClient);
+    if (FAILED(hr))
+        return hr;
+
+    WAVEFORMATEX *pMix = NULL;
+    hr = pAudioClient->GetMixFormat(&pMix);
+    if (FAILED(hr))
+        return hr;
+
+    DWORD cbMix = sizeof(WAVEFORMATEX) + pMix->cbSize;
+    if (cbMix > sizeof(*pwfx))
+        cbMix = sizeof(*pwfx);
+    ZeroMemory(pwfx, sizeof(*pwfx));
+    CopyMemory(pwfx, pMix, cbMix);
+    pwfx->Format.cbSize = WORD(cbMix - sizeof(WAVEFORMATEX));
+
+    CoTaskMemFree(pMix);
+    return S_OK;
+}
+
+HRESULT WasapiCaptureSource::Start()
+{
+    if (!m_pAudioClient)
+        return E_POINTER;
+    return m_pAudioClient->Start();
+}
+
+HRESULT WasapiCaptureSource::Stop()
+{
+    if (!m_pAudioClient)
+        return E_POINTER;
+    return m_pAudioClient->Stop();
+}
+
+HRESULT WasapiCaptureSource::GetNextPacketSize(UINT32 *pnFrames)
+{
+    return m_pCaptureClient->GetNextPacketSize(pnFrames);
+}
+
+HRESULT WasapiCaptureSource::GetBuffer(BYTE **ppData, UINT32 *pnFrames, DWORD *pdwFlags,
+                                       UINT64 *pu64DevicePosition,
+                                       UINT64 *pu64QPCPosition)
+{
+    return m_pCaptureClient->GetBuffer(ppData, pnFrames, pdwFlags,
+                                       pu64DevicePosition, pu64QPCPosition);
+}
+
+HRESULT WasapiCaptureSource::ReleaseBuffer(UINT32 nFrames)
+{
+    return m_pCaptureClient->ReleaseBuffer(nFrames);
+}
@@ -0,0 +1,49 @@
+#ifndef WASAPI_CAPTURE_SOURCE_HPP_
+#define WASAPI_CAPTURE_SOURCE_HPP_
+
+#include "CaptureSource.hpp"
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include "CComPtr.hpp"
+
+// Captures an endpoint in shared mode. A render endpoint is captured in
+// loopback mode. The low latency runs the engine at its shortest period
+// through IAudioClient3 where there is one; elsewhere, and when the engine
+// refuses, the period stays the engine's and only the buffer shrinks.
+class WasapiCaptureSource : public CaptureSource
+{
+public:
+    WasapiCaptureSource();
+    virtual ~WasapiCaptureSource();
+
+    void SetDevice(CComPtr<IMMDevice> pDevice);
+
+    virtual HRESULT Open(const WAVEFORMATEX *pwfx, HANDLE hWakeUp);
+    virtual void Close();
+    virtual HRESULT GetMixFormat(WAVEFORMATEXTENSIBLE *pwfx);
+    virtual void SetLatency(CAPTURE_LATENCY latency, DWORD dwBufferMilliseconds);
+    virtual HRESULT GetTiming(CAPTURE_TIMING *pTiming);
+
+    virtual HRESULT Start();
+    virtual HRESULT Stop();
+
+    virtual HRESULT GetNextPacketSize(UINT32 *pnFrames);
+    virtual HRESULT GetBuffer(BYTE **ppData, UINT32 *pnFrames, DWORD *pdwFlags,
+                              UINT64 *pu64DevicePosition,
+                              UINT64 *pu64QPCPosition);
+    virtual HRESULT ReleaseBuffer(UINT32 nFrames);
+
+protected:
+    CComPtr<IMMDevice> m_pDevice;
+    CComPtr<IAudioClient> m_pAudioClient;
+    CComPtr<IAudioCaptureClient> m_pCaptureClient;
+    REFERENCE_TIME m_DevicePeriod;
+    BOOL m_bLoopback;
+    CAPTURE_LATENCY m_latency;
+    DWORD m_dwBufferMilliseconds;
+    CAPTURE_TIMING m_timing;
+
+    HRESULT Initialize(DWORD StreamFlags, const WAVEFORMATEX *pwfx);
+};
+
+#endif  // ndef WASAPI_CAPTURE_SOURCE_HPP_
@@ -0,0 +1,342 @@
+#include "WaveReader.hpp"
+#include <cmath>
+
+// Frames measured at a time.
+#define VERIFY_FRAMES (1024 * 1024)
+
+static BOOL read_at(HANDLE hFile, ULONGLONG offset, LPVOID pv, DWORD cb)
+{
+    LARGE_INTEGER li;
+    li.QuadPart = LONGLONG(offset);
+    DWORD cbRead;
+    return ::SetFilePointerEx(hFile, li, NULL, FILE_BEGIN) &&
+           ::ReadFile(hFile, pv, cb, &cbRead, NULL) && cbRead == cb;
+}
+
+static DWORD get_dword(const BYTE *pb)
+{
+    return pb[0] | (pb[1] << 8) | (pb[2] << 16) | (DWORD(pb[3]) << 24);
+}
+
+static ULONGLONG get_qword(const BYTE *pb)
+{
+    return get_dword(pb) | (ULONGLONG(get_dword(pb + 4)) << 32);
+}
+
+BOOL read_wave_header(HANDLE hFile, WAVE_FILE_INFO *pInfo)
+{
+    ZeroMemory(pInfo, sizeof(*pInfo));
+
+    LARGE_INTEGER liSize;
+    if (!::GetFileSizeEx(hFile, &liSize))
+        return FALSE;
+    pInfo->cbFile = liSize.QuadPart;
+
+    BYTE riff[12];
+    if (!read_at(hFile, 0, riff, sizeof(riff)) || memcmp(riff + 8, "WAVE", 4) != 0)
+        return FALSE;
+    if (memcmp(riff, "RF64", 4) == 0)
+        pInfo->bRF64 = TRUE;
+    else if (memcmp(riff, "RIFF", 4) != 0)
+        return FALSE;
+
+    ULONGLONG cbData64 = 0;
+    BOOL bFormat = FALSE;
+    ULONGLONG offset = sizeof(riff);
+    while (offset + 8 <= pInfo->cbFile)
+    {
+        BYTE ck[8];
+        if (!read_at(hFile, offset, ck, sizeof(ck)))
+            return FALSE;
+        DWORD cb = get_dword(ck + 4);
+
+        if (memcmp(ck, "ds64", 4) == 0 && cb >= 16)
+        {
+            BYTE ds64[16];
+            if (!read_at(hFile, offset + 8, ds64, sizeof(ds64)))
+                return FALSE;
+            cbData64 = get_qword(ds64 + 8);
+        }
+        else if (memcmp(ck, "fmt ", 4) == 0 && cb >= sizeof(PCMWAVEFORMAT))
+        {
+            DWORD cbFormat = (cb < sizeof(pInfo->wfx)) ? cb : DWORD(sizeof(pInfo->wfx));
+            if (!read_at(hFile, offset + 8, &pInfo->wfx, cbFormat))
+                return FALSE;
+            if (cbFormat < sizeof(WAVEFORMATEX))
+                pInfo->wfx.Format.cbSize = 0;
+            bFormat = TRUE;
+        }
+        else if (memcmp(ck, "data", 4) == 0)
+        {
+            pInfo->offData = offset + 8;
+            pInfo->cbData = cb;
+            if (pInfo->bRF64 && cb == 0xFFFFFFFF)
+                pInfo->cbData = cbData64;
+            return bFormat && pInfo->wfx.Format.nBlockAlign != 0;
+        }
+
+        offset += 8 + ULONGLONG(cb) + (cb & 1);
+    }
+
+    return FALSE;
+}
+
+BOOL find_wave_chunk(HANDLE hFile, const WAVE_FILE_INFO *pInfo, const char *pszId,
+                     ULONGLONG *pOffset, DWORD *pcb)
+{
+    ULONGLONG offset = 12;
+    while (offset + 8 <= pInfo->cbFile)
+    {
+        BYTE ck[8];
+        if (!read_at(hFile, offset, ck, sizeof(ck)))
+            return FALSE;
+
+        ULONGLONG cb = get_dword(ck + 4);
+        if (offset + 8 == pInfo->offData)
+            cb = pInfo->cbData;
+        if (memcmp(ck, pszId, 4) == 0)
+        {
+            *pOffset = offset + 8;
+            *pcb = DWORD(cb);
+            return offset + 8 + cb <= pInfo->cbFile;
+        }
+
+        offset += 8 + cb + (cb & 1);
+    }
+    return FALSE;
+}
+
+WaveReader::WaveReader()
+    : m_hFile(INVALID_HANDLE_VALUE)
+    , m_hMapping(NULL)
+    , m_format(SAMPLE_FORMAT_UNKNOWN)
+    , m_nFrames(0)
+    , m_pView(NULL)
+    , m_offView(0)
+    , m_cbView(0)
+    , m_bWhole(FALSE)
+    , m_dwGranularity(0)
+{
+    ZeroMemory(&m_info, sizeof(m_info));
+}
+
+WaveReader::~WaveReader()
+{
+    Close();
+}
+
+BOOL WaveReader::Open(LPCTSTR pszFileName)
+{
+    Close();
+
+    m_hFile = ::CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    if (!read_wave_header(m_hFile, &m_info))
+    {
+        Close();
+        return FALSE;
+    }
+    m_format = get_sample_format(&m_info.wfx.Format);
+
+    ULONGLONG cbPresent = m_info.cbFile - m_info.offData;
+    if (cbPresent > m_info.cbData)
+        cbPresent = m_info.cbData;
+    m_nFrames = cbPresent / m_info.wfx.Format.nBlockAlign;
+
+    // The sizes are those of find_wave_chunk; a chunk cut short ends the
+    // index.
+    ULONGLONG offset = 12;
+    while (offset + 8 <= m_info.cbFile)
+    {
+        BYTE ck[8];
+        if (!read_at(m_hFile, offset, ck, sizeof(ck)))
+            break;
+
+        WAVE_CHUNK chunk;
+        CopyMemory(chunk.id, ck, 4);
+        chunk.offset = offset + 8;
+        chunk.cb = get_dword(ck + 4);
+        if (chunk.offset == m_info.offData)
+            chunk.cb = m_info.cbData;
+        m_chunks.push_back(chunk);
+
+        offset = chunk.offset + chunk.cb + (chunk.cb & 1);
+    }
+
+    SYSTEM_INFO si;
+    ::GetSystemInfo(&si);
+    m_dwGranularity = si.dwAllocationGranularity;
+
+    m_hMapping = ::CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_hMapping == NULL)
+    {
+        Close();
+        return FALSE;
+    }
+
+    if (m_info.cbFile <= ULONGLONG(SIZE_T(-1)))
+    {
+        m_pView = reinterpret_cast<const BYTE *>(
+            ::MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+        if (m_pView)
+        {
+            m_offView = 0;
+            m_cbView = m_info.cbFile;
+            m_bWhole = TRUE;
+        }
+    }
+    return TRUE;
+}
+
+void WaveReader::Close()
+{
+    Unmap();
+    m_bWhole = FALSE;
+    if (m_hMapping)
+    {
+        ::CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+    ZeroMemory(&m_info, sizeof(m_info));
+    m_format = SAMPLE_FORMAT_UNKNOWN;
+    m_nFrames = 0;
+    m_chunks.clear();
+}
+
+void WaveReader::Unmap()
+{
+    if (m_pView)
+    {
+        ::UnmapViewOfFile(m_pView);
+        m_pView = NULL;
+    }
+    m_offView = m_cbView = 0;
+}
+
+// A view starts at a multiple of the allocation granularity.
+const BYTE *WaveReader::GetBytes(ULONGLONG offset, ULONGLONG cb)
+{
+    if (cb == 0 || offset > m_info.cbFile || cb > m_info.cbFile - offset)
+        return NULL;
+    if (m_pView && offset >= m_offView && offset + cb <= m_offView + m_cbView)
+        return m_pView + (offset - m_offView);
+    if (m_bWhole)
+        return NULL;
+
+    Unmap();
+    ULONGLONG offView = offset - offset % m_dwGranularity;
+    ULONGLONG cbView = offset + cb - offView;
+    if (cbView < WINDOW_SIZE)
+        cbView = WINDOW_SIZE;
+    if (cbView > m_info.cbFile - offView)
+        cbView = m_info.cbFile - offView;
+    if (cbView > ULONGLONG(SIZE_T(-1)))
+        return NULL;
+
+    m_pView = reinterpret_cast<const BYTE *>(
+        ::MapViewOfFile(m_hMapping, FILE_MAP_READ, DWORD(offView >> 32), DWORD(offView),
+                        SIZE_T(cbView)));
+    if (m_pView == NULL)
+        return NULL;
+    m_offView = offView;
+    m_cbView = cbView;
+    return m_pView + (offset - offView);
+}
+
+const WAVE_CHUNK *WaveReader::FindChunk(const char *pszId) const
+{
+    for (size_t i = 0; i < m_chunks.size(); ++i)
+    {
+        if (memcmp(m_chunks[i].id, pszId, 4) == 0)
+            return &m_chunks[i];
+    }
+    return NULL;
+}
+
+const BYTE *WaveReader::GetChunkData(const WAVE_CHUNK *pChunk, ULONGLONG *pcb)
+{
+    ULONGLONG cb = pChunk->cb;
+    if (pChunk->offset >= m_info.cbFile)
+        cb = 0;
+    else if (cb > m_info.cbFile - pChunk->offset)
+        cb = m_info.cbFile - pChunk->offset;
+    *pcb = cb;
+    return GetBytes(pChunk->offset, cb);
+}
+
+const BYTE *WaveReader::GetFrames(ULONGLONG nFrame, ULONGLONG nFrames)
+{
+    if (nFrame > m_nFrames || nFrames > m_nFrames - nFrame)
+        return NULL;
+    const DWORD nBlockAlign = m_info.wfx.Format.nBlockAlign;
+    return GetBytes(m_info.offData + nFrame * nBlockAlign, nFrames * nBlockAlign);
+}
+
+BOOL verify_wave_file(LPCTSTR pszFileName, WAVE_VERIFY_RESULT *pResult)
+{
+    ZeroMemory(pResult, sizeof(*pResult));
+
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    ::QueryPerformanceFrequency(&liFreq);
+    ::QueryPerformanceCounter(&liStart);
+
+    WaveReader reader;
+    if (!reader.Open(pszFileName))
+        return FALSE;
+
+    WAVE_FILE_INFO& info = pResult->info;
+    info = reader.GetInfo();
+    const WAVEFORMATEX *pwfx = &info.wfx.Format;
+    DWORD nBlockAlign = pwfx->nBlockAlign;
+    pResult->nFrames = reader.GetFrameCount();
+    pResult->bComplete = (info.cbFile - info.offData >= info.cbData &&
+                          info.cbData % nBlockAlign == 0);
+    pResult->nChannels = (pwfx->nChannels < METER_MAX_CHANNELS) ?
+                         pwfx->nChannels : METER_MAX_CHANNELS;
+
+    SAMPLE_FORMAT format = reader.GetSampleFormat();
+    BOOL bOK = TRUE;
+    if (format != SAMPLE_FORMAT_UNKNOWN && pResult->nFrames > 0)
+    {
+        double sumsq[METER_MAX_CHANNELS] = { 0 };
+        for (ULONGLONG nFrame = 0; bOK && nFrame < pResult->nFrames; )
+        {
+            ULONGLONG nLeft = pResult->nFrames - nFrame;
+            DWORD nFrames = (nLeft < VERIFY_FRAMES) ? DWORD(nLeft) : VERIFY_FRAMES;
+            const BYTE *pb = reader.GetFrames(nFrame, nFrames);
+            if (pb == NULL)
+            {
+                bOK = FALSE;
+                break;
+            }
+
+            METER_LEVELS levels;
+            measure_levels(format, pb, nFrames, pwfx->nChannels, &levels);
+            for (WORD ch = 0; ch < levels.nChannels; ++ch)
+            {
+                if (pResult->peak[ch] < levels.peak[ch])
+                    pResult->peak[ch] = levels.peak[ch];
+                sumsq[ch] += levels.sumsq[ch];
+                pResult->clips[ch] += levels.clips[ch];
+            }
+            nFrame += nFrames;
+        }
+
+        for (WORD ch = 0; ch < pResult->nChannels; ++ch)
+            pResult->rms[ch] = std::sqrt(sumsq[ch] / double(pResult->nFrames));
+    }
+
+    reader.Close();
+
+    ::QueryPerformanceCounter(&liEnd);
+    pResult->seconds = double(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+    return bOK;
+}
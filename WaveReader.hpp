@@ -0,0 +1,139 @@
+#ifndef WAVE_READER_HPP_
+#define WAVE_READER_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include <vector>
+#include "Meter.hpp"
+
+// Where the audio of a RIFF or RF64 WAVE file lies.
+struct WAVE_FILE_INFO
+{
+    WAVEFORMATEXTENSIBLE wfx;
+    BOOL bRF64;
+    ULONGLONG cbFile;
+    ULONGLONG offData;
+    ULONGLONG cbData;           // as the header says; the file may be shorter
+};
+
+// Reads the chunks up to "data". In RF64 the sizes of -1 are taken from
+// the ds64 chunk.
+BOOL read_wave_header(HANDLE hFile, WAVE_FILE_INFO *pInfo);
+// Finds another chunk of the file read by read_wave_header, before or after
+// "data". pOffset receives where its body starts.
+BOOL find_wave_chunk(HANDLE hFile, const WAVE_FILE_INFO *pInfo, const char *pszId,
+                     ULONGLONG *pOffset, DWORD *pcb);
+
+// A chunk of a WAVE file, whose body starts at offset.
+struct WAVE_CHUNK
+{
+    char id[4];
+    ULONGLONG offset;
+    ULONGLONG cb;               // as the header says, or from ds64 in RF64
+};
+
+// Maps a RIFF or RF64 WAVE file read-only and hands out views of its
+// frames in place, without copying them. The chunks are indexed once on
+// Open, so finding a chunk or a range of frames takes constant time.
+//
+// Where the address space allows, the file is mapped whole and every view
+// stays valid until Close. Otherwise, as for a file of many GB in a 32-bit
+// process, the views come from a window of at least WINDOW_SIZE that moves
+// as needed, and a view stays valid only until the next call.
+class WaveReader
+{
+public:
+    enum { WINDOW_SIZE = 64 * 1024 * 1024 };
+
+    WaveReader();
+    ~WaveReader();
+
+    BOOL Open(LPCTSTR pszFileName);
+    void Close();
+    BOOL IsOpen() const
+    {
+        return m_hFile != INVALID_HANDLE_VALUE;
+    }
+
+    const WAVE_FILE_INFO& GetInfo() const
+    {
+        return m_info;
+    }
+    const WAVEFORMATEX *GetFormat() const
+    {
+        return &m_info.wfx.Format;
+    }
+    SAMPLE_FORMAT GetSampleFormat() const
+    {
+        return m_format;
+    }
+    // The whole frames present, fewer than the header says if the file
+    // was cut short.
+    ULONGLONG GetFrameCount() const
+    {
+        return m_nFrames;
+    }
+
+    DWORD GetChunkCount() const
+    {
+        return DWORD(m_chunks.size());
+    }
+    const WAVE_CHUNK *GetChunk(DWORD iChunk) const
+    {
+        return &m_chunks[iChunk];
+    }
+    // The first chunk of that id, or NULL.
+    const WAVE_CHUNK *FindChunk(const char *pszId) const;
+    // The body of a chunk, up to the end of the file.
+    const BYTE *GetChunkData(const WAVE_CHUNK *pChunk, ULONGLONG *pcb);
+
+    // nFrames frames from nFrame, interleaved as in the file, or NULL if
+    // they are not all there.
+    const BYTE *GetFrames(ULONGLONG nFrame, ULONGLONG nFrames);
+    // The same, as samples of the type of the format: BYTE for 8 and 24
+    // bits, INT16, INT32 or float. They may be unaligned, which x86 reads.
+    template <typename T>
+    const T *GetSamples(ULONGLONG nFrame, ULONGLONG nFrames)
+    {
+        return reinterpret_cast<const T *>(GetFrames(nFrame, nFrames));
+    }
+
+protected:
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+    WAVE_FILE_INFO m_info;
+    SAMPLE_FORMAT m_format;
+    ULONGLONG m_nFrames;
+    std::vector<WAVE_CHUNK> m_chunks;
+    const BYTE *m_pView;
+    ULONGLONG m_offView;
+    ULONGLONG m_cbView;
+    BOOL m_bWhole;
+    DWORD m_dwGranularity;
+
+    const BYTE *GetBytes(ULONGLONG offset, ULONGLONG cb);
+    void Unmap();
+
+    WaveReader(const WaveReader&);
+    WaveReader& operator=(const WaveReader&);
+};
+
+struct WAVE_VERIFY_RESULT
+{
+    WAVE_FILE_INFO info;
+    BOOL bComplete;             // all of the data is there, in whole frames
+    ULONGLONG nFrames;          // the whole frames that are there
+    WORD nChannels;             // measured, up to METER_MAX_CHANNELS
+    float peak[METER_MAX_CHANNELS];
+    double rms[METER_MAX_CHANNELS];
+    ULONGLONG clips[METER_MAX_CHANNELS];
+    double seconds;             // the time it took
+};
+
+// Checks the structure of a WAVE file against its size and measures the
+// levels of all its audio. The data is read through a WaveReader, so a
+// file of many GB takes about as long as the disk needs to deliver it.
+BOOL verify_wave_file(LPCTSTR pszFileName, WAVE_VERIFY_RESULT *pResult);
+
+#endif  // ndef WAVE_READER_HPP_
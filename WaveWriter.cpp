@@ -0,0 +1,550 @@
+#include "WaveWriter.hpp"
+#include <mmreg.h>
+
+// The body of a ds64 chunk: the RIFF, data and sample counts in 64 bits,
+// and an empty table of other chunk sizes.
+#define CB_DS64 28
+
+WaveWriter::WaveWriter()
+    : m_hFile(INVALID_HANDLE_VALUE)
+    , m_cbHeader(0)
+    , m_nBlockAlign(1)
+    , m_offFact(0)
+    , m_nSampleLength(ULONGLONG(-1))
+    , m_cbBlock(0)
+    , m_cbData(0)
+    , m_cbReserve(0)
+    , m_cbFile(0)
+    , m_bMapped(FALSE)
+    , m_bOK(FALSE)
+    , m_hMapping(NULL)
+    , m_pView(NULL)
+    , m_offView(0)
+    , m_cbView(0)
+    , m_dwGranularity(65536)
+{
+}
+
+WaveWriter::~WaveWriter()
+{
+    Close();
+}
+
+void WaveWriter::SetPreallocation(ULONGLONG cbReserve)
+{
+    m_cbReserve = cbReserve;
+}
+
+void WaveWriter::SetMapped(BOOL bMapped)
+{
+    m_bMapped = bMapped;
+}
+
+void WaveWriter::SetSampleLength(ULONGLONG nFrames)
+{
+    m_nSampleLength = nFrames;
+}
+
+static void put_fourcc(std::vector<BYTE>& header, const char *psz)
+{
+    header.insert(header.end(), psz, psz + 4);
+}
+
+static void put_dword(std::vector<BYTE>& header, DWORD dw)
+{
+    for (int i = 0; i < 4; ++i)
+        header.push_back(BYTE(dw >> (i * 8)));
+}
+
+BOOL WaveWriter::Open(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx)
+{
+    Close();
+
+    // The mapping needs read access as well.
+    m_hFile = ::CreateFile(pszFileName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    // A plain PCM format has no cbSize member in the file.
+    DWORD cbFormat = sizeof(PCMWAVEFORMAT);
+    if (pwfx->wFormatTag != WAVE_FORMAT_PCM)
+        cbFormat = sizeof(WAVEFORMATEX) + pwfx->cbSize;
+
+    std::vector<BYTE> header;
+    put_fourcc(header, "RIFF");
+    put_dword(header, 0);
+    put_fourcc(header, "WAVE");
+    put_fourcc(header, "JUNK");
+    put_dword(header, CB_DS64);
+    header.resize(header.size() + CB_DS64);
+    put_fourcc(header, "fmt ");
+    put_dword(header, cbFormat);
+    const BYTE *pbFormat = reinterpret_cast<const BYTE *>(pwfx);
+    header.insert(header.end(), pbFormat, pbFormat + cbFormat);
+    if (cbFormat & 1)
+        header.push_back(0);
+    m_offFact = 0;
+    if (pwfx->wFormatTag != WAVE_FORMAT_PCM && pwfx->wFormatTag != WAVE_FORMAT_IEEE_FLOAT &&
+        pwfx->wFormatTag != WAVE_FORMAT_EXTENSIBLE)
+    {
+        put_fourcc(header, "fact");
+        put_dword(header, sizeof(DWORD));
+        m_offFact = DWORD(header.size());
+        put_dword(header, 0);
+    }
+    put_fourcc(header, "data");
+    put_dword(header, 0);
+
+    m_cbHeader = DWORD(header.size());
+    m_nBlockAlign = pwfx->nBlockAlign ? pwfx->nBlockAlign : 1;
+    m_nSampleLength = ULONGLONG(-1);
+    m_cbData = 0;
+    m_cbFile = m_cbHeader;
+    m_cbBlock = 0;
+    m_bOK = TRUE;
+
+    DWORD cbWritten;
+    if (!::WriteFile(m_hFile, header.data(), m_cbHeader, &cbWritten, NULL) ||
+        cbWritten != m_cbHeader)
+    {
+        Close();
+        return FALSE;
+    }
+
+    if (m_bMapped)
+    {
+        SYSTEM_INFO info;
+        ::GetSystemInfo(&info);
+        m_dwGranularity = info.dwAllocationGranularity;
+    }
+    else
+    {
+        m_block.resize(BLOCK_SIZE);
+    }
+
+    if ((m_bMapped || m_cbReserve > 0) && !Extend(m_cbHeader + 1))
+    {
+        Close();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL WaveWriter::WriteAt(ULONGLONG offset, LPCVOID pv, DWORD cb)
+{
+    LARGE_INTEGER li;
+    li.QuadPart = LONGLONG(offset);
+    DWORD cbWritten;
+    return ::SetFilePointerEx(m_hFile, li, NULL, FILE_BEGIN) &&
+           ::WriteFile(m_hFile, pv, cb, &cbWritten, NULL) && cbWritten == cb;
+}
+
+BOOL WaveWriter::SetFileSize(ULONGLONG cb)
+{
+    LARGE_INTEGER li;
+    li.QuadPart = LONGLONG(cb);
+    return ::SetFilePointerEx(m_hFile, li, NULL, FILE_BEGIN) &&
+           ::SetEndOfFile(m_hFile);
+}
+
+// Grows the file to hold cbNeeded bytes, a whole step at a time. The
+// mapping is sized by the file, so it is made again on the next MapAt.
+BOOL WaveWriter::Extend(ULONGLONG cbNeeded)
+{
+    ULONGLONG cbStep = m_cbReserve;
+    if (cbStep == 0)
+        cbStep = MAP_WINDOW;
+
+    ULONGLONG cbFile = m_cbFile;
+    while (cbFile < cbNeeded)
+        cbFile += cbStep;
+
+    Unmap();
+    if (m_hMapping)
+    {
+        ::CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+
+    LARGE_INTEGER zero, pos;
+    zero.QuadPart = 0;
+    if (!::SetFilePointerEx(m_hFile, zero, &pos, FILE_CURRENT) ||
+        !SetFileSize(cbFile) ||
+        !::SetFilePointerEx(m_hFile, pos, NULL, FILE_BEGIN))
+    {
+        return FALSE;
+    }
+
+    m_cbFile = cbFile;
+    return TRUE;
+}
+
+// Maps the window that holds offset, from a multiple of the allocation
+// granularity.
+BOOL WaveWriter::MapAt(ULONGLONG offset)
+{
+    Unmap();
+
+    if (m_hMapping == NULL)
+    {
+        m_hMapping = ::CreateFileMapping(m_hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+        if (m_hMapping == NULL)
+            return FALSE;
+    }
+
+    ULONGLONG offView = offset - offset % m_dwGranularity;
+    ULONGLONG cbView = m_cbFile - offView;
+    if (cbView > MAP_WINDOW)
+        cbView = MAP_WINDOW;
+
+    m_pView = reinterpret_cast<BYTE *>(
+        ::MapViewOfFile(m_hMapping, FILE_MAP_WRITE, DWORD(offView >> 32),
+                        DWORD(offView), SIZE_T(cbView)));
+    if (m_pView == NULL)
+        return FALSE;
+
+    m_offView = offView;
+    m_cbView = DWORD(cbView);
+    return TRUE;
+}
+
+void WaveWriter::Unmap()
+{
+    if (m_pView)
+    {
+        ::UnmapViewOfFile(m_pView);
+        m_pView = NULL;
+    }
+    m_cbView = 0;
+}
+
+BOOL WaveWriter::WriteMapped(const BYTE *pb, DWORD cb)
+{
+    ULONGLONG offset = m_cbHeader + m_cbData;
+    if (offset + cb > m_cbFile && !Extend(offset + cb))
+        return FALSE;
+
+    while (cb > 0)
+    {
+        if (m_pView == NULL || offset >= m_offView + m_cbView)
+        {
+            if (!MapAt(offset))
+                return FALSE;
+        }
+
+        DWORD cbCopy = DWORD(m_offView + m_cbView - offset);
+        if (cbCopy > cb)
+            cbCopy = cb;
+        CopyMemory(m_pView + (offset - m_offView), pb, cbCopy);
+        offset += cbCopy;
+        pb += cbCopy;
+        cb -= cbCopy;
+    }
+    return TRUE;
+}
+
+// Writes at the file pointer, growing a preallocated file first.
+BOOL WaveWriter::WriteOut(const BYTE *pb, DWORD cb)
+{
+    LARGE_INTEGER zero, pos;
+    zero.QuadPart = 0;
+    if (m_cbReserve > 0)
+    {
+        if (!::SetFilePointerEx(m_hFile, zero, &pos, FILE_CURRENT))
+            return FALSE;
+        if (ULONGLONG(pos.QuadPart) + cb > m_cbFile && !Extend(pos.QuadPart + cb))
+            return FALSE;
+    }
+
+    DWORD cbWritten;
+    return ::WriteFile(m_hFile, pb, cb, &cbWritten, NULL) && cbWritten == cb;
+}
+
+BOOL WaveWriter::FlushBlock()
+{
+    if (m_cbBlock == 0)
+        return TRUE;
+
+    // The block was counted as it filled; it never reached the file.
+    BOOL bOK = WriteOut(m_block.data(), m_cbBlock);
+    if (!bOK)
+        m_cbData -= m_cbBlock;
+    m_cbBlock = 0;
+    return bOK;
+}
+
+BOOL WaveWriter::Write(LPCVOID pvData, DWORD cbData)
+{
+    if (m_hFile == INVALID_HANDLE_VALUE || !m_bOK)
+        return FALSE;
+
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    if (m_bMapped)
+    {
+        m_bOK = WriteMapped(pb, cbData);
+        if (m_bOK)
+            m_cbData += cbData;
+        return m_bOK;
+    }
+
+    // Only what has been written out or taken into the block is counted,
+    // so that after a failure the header tells what the file really holds.
+
+    // Top up the pending block first.
+    if (m_cbBlock > 0)
+    {
+        DWORD cbCopy = DWORD(m_block.size()) - m_cbBlock;
+        if (cbCopy > cbData)
+            cbCopy = cbData;
+        CopyMemory(&m_block[m_cbBlock], pb, cbCopy);
+        m_cbBlock += cbCopy;
+        m_cbData += cbCopy;
+        pb += cbCopy;
+        cbData -= cbCopy;
+
+        if (m_cbBlock == m_block.size() && !FlushBlock())
+            return m_bOK = FALSE;
+    }
+
+    // Whole blocks go straight from the caller's buffer.
+    DWORD cbDirect = cbData - cbData % DWORD(m_block.size());
+    if (cbDirect > 0)
+    {
+        if (!WriteOut(pb, cbDirect))
+            return m_bOK = FALSE;
+        m_cbData += cbDirect;
+        pb += cbDirect;
+        cbData -= cbDirect;
+    }
+
+    if (cbData > 0)
+    {
+        CopyMemory(&m_block[m_cbBlock], pb, cbData);
+        m_cbBlock += cbData;
+        m_cbData += cbData;
+    }
+
+    return TRUE;
+}
+
+void WaveWriter::AddChunk(const char *pszId, LPCVOID pvData, DWORD cbData)
+{
+    put_fourcc(m_trailer, pszId);
+    put_dword(m_trailer, cbData);
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    m_trailer.insert(m_trailer.end(), pb, pb + cbData);
+    if (cbData & 1)
+        m_trailer.push_back(0);
+}
+
+BOOL WaveWriter::WriteSizes()
+{
+    ULONGLONG nFrames = m_nSampleLength;
+    if (nFrames == ULONGLONG(-1))
+        nFrames = m_cbData / m_nBlockAlign;
+    if (m_offFact)
+    {
+        DWORD nFrames32 = (nFrames < 0xFFFFFFFF) ? DWORD(nFrames) : 0xFFFFFFFF;
+        if (!WriteAt(m_offFact, &nFrames32, sizeof(nFrames32)))
+            return FALSE;
+    }
+
+    ULONGLONG cbRiff = m_cbHeader - 8 + m_cbData + (m_cbData & 1) + m_trailer.size();
+    if (cbRiff <= 0xFFFFFFFF)
+    {
+        DWORD cbRiff32 = DWORD(cbRiff), cbData32 = DWORD(m_cbData);
+        return WriteAt(4, &cbRiff32, sizeof(cbRiff32)) &&
+               WriteAt(m_cbHeader - 4, &cbData32, sizeof(cbData32));
+    }
+
+    // RF64: the 32-bit sizes are -1 and the real ones are in ds64, which
+    // takes the place of the JUNK chunk.
+    std::vector<BYTE> ds64;
+    put_fourcc(ds64, "ds64");
+    put_dword(ds64, CB_DS64);
+    ULONGLONG sizes[] = { cbRiff, m_cbData, nFrames };
+    for (size_t i = 0; i < ARRAYSIZE(sizes); ++i)
+    {
+        put_dword(ds64, DWORD(sizes[i]));
+        put_dword(ds64, DWORD(sizes[i] >> 32));
+    }
+    put_dword(ds64, 0);
+
+    std::vector<BYTE> riff;
+    put_fourcc(riff, "RF64");
+    put_dword(riff, 0xFFFFFFFF);
+
+    DWORD cbMax = 0xFFFFFFFF;
+    return WriteAt(0, riff.data(), DWORD(riff.size())) &&
+           WriteAt(12, ds64.data(), DWORD(ds64.size())) &&
+           WriteAt(m_cbHeader - 4, &cbMax, sizeof(cbMax));
+}
+
+BOOL WaveWriter::Close()
+{
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    BOOL bOK = m_bOK && FlushBlock();
+
+    Unmap();
+    if (m_hMapping)
+    {
+        ::CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+
+    // Cut the preallocation, and pad the data to an even size.
+    ULONGLONG cbEnd = m_cbHeader + m_cbData;
+    if (m_cbFile > cbEnd && !SetFileSize(cbEnd))
+        bOK = FALSE;
+    BYTE bPad = 0;
+    if ((m_cbData & 1) && !WriteAt(cbEnd, &bPad, 1))
+        bOK = FALSE;
+    if (!m_trailer.empty() &&
+        !WriteAt(cbEnd + (m_cbData & 1), m_trailer.data(), DWORD(m_trailer.size())))
+    {
+        bOK = FALSE;
+    }
+    if (!WriteSizes())
+        bOK = FALSE;
+
+    ::CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+
+    std::vector<BYTE>().swap(m_block);
+    std::vector<BYTE>().swap(m_trailer);
+    m_cbBlock = 0;
+    m_cbFile = 0;
+    m_bOK = FALSE;
+    return bOK;
+}
+
+WaveStreamWriter::WaveStreamWriter()
+    : m_hOutput(NULL)
+    , m_cbBlock(0)
+    , m_cbWritten(0)
+    , m_cbDropped(0)
+    , m_bOK(FALSE)
+{
+}
+
+WaveStreamWriter::~WaveStreamWriter()
+{
+    Close();
+}
+
+BOOL WaveStreamWriter::Open(HANDLE hOutput, const WAVEFORMATEX *pwfx, BOOL bHeader)
+{
+    Close();
+
+    if (hOutput == NULL || hOutput == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    m_hOutput = hOutput;
+    m_block.resize(BLOCK_SIZE);
+    m_cbBlock = 0;
+    m_cbWritten = 0;
+    m_cbDropped = 0;
+    m_bOK = TRUE;
+    if (!bHeader)
+        return TRUE;
+
+    DWORD cbFormat = sizeof(PCMWAVEFORMAT);
+    if (pwfx->wFormatTag != WAVE_FORMAT_PCM)
+        cbFormat = sizeof(WAVEFORMATEX) + pwfx->cbSize;
+
+    std::vector<BYTE> header;
+    put_fourcc(header, "RIFF");
+    put_dword(header, 0xFFFFFFFF);
+    put_fourcc(header, "WAVE");
+    put_fourcc(header, "fmt ");
+    put_dword(header, cbFormat);
+    const BYTE *pbFormat = reinterpret_cast<const BYTE *>(pwfx);
+    header.insert(header.end(), pbFormat, pbFormat + cbFormat);
+    if (cbFormat & 1)
+        header.push_back(0);
+    put_fourcc(header, "data");
+    put_dword(header, 0xFFFFFFFF);
+
+    // The header goes out at once, so that the reader can set up.
+    if (!Write(header.data(), DWORD(header.size())) || !Flush())
+    {
+        Close();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL WaveStreamWriter::WriteOut(const BYTE *pb, DWORD cb)
+{
+    if (!m_bOK)
+    {
+        m_cbDropped += cb;
+        return FALSE;
+    }
+
+    DWORD cbWritten;
+    if (!::WriteFile(m_hOutput, pb, cb, &cbWritten, NULL) || cbWritten != cb)
+    {
+        m_bOK = FALSE;
+        m_cbDropped += cb;
+        return FALSE;
+    }
+    m_cbWritten += cb;
+    return TRUE;
+}
+
+BOOL WaveStreamWriter::Write(LPCVOID pvData, DWORD cbData)
+{
+    if (!m_hOutput)
+        return FALSE;
+
+    const BYTE *pb = reinterpret_cast<const BYTE *>(pvData);
+    while (cbData > 0)
+    {
+        // A block's worth goes out as it is.
+        if (m_cbBlock == 0 && cbData >= BLOCK_SIZE)
+        {
+            DWORD cb = cbData - cbData % BLOCK_SIZE;
+            WriteOut(pb, cb);
+            pb += cb;
+            cbData -= cb;
+            continue;
+        }
+
+        DWORD cb = BLOCK_SIZE - m_cbBlock;
+        if (cb > cbData)
+            cb = cbData;
+        CopyMemory(&m_block[m_cbBlock], pb, cb);
+        m_cbBlock += cb;
+        pb += cb;
+        cbData -= cb;
+        if (m_cbBlock == BLOCK_SIZE)
+            Flush();
+    }
+    return m_bOK;
+}
+
+BOOL WaveStreamWriter::Flush()
+{
+    if (m_cbBlock)
+    {
+        WriteOut(m_block.data(), m_cbBlock);
+        m_cbBlock = 0;
+    }
+    return m_bOK;
+}
+
+BOOL WaveStreamWriter::Close()
+{
+    if (!m_hOutput)
+        return FALSE;
+
+    BOOL bOK = Flush();
+    m_hOutput = NULL;
+    std::vector<BYTE>().swap(m_block);
+    m_bOK = FALSE;
+    return bOK;
+}
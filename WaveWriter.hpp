@@ -0,0 +1,139 @@
+#ifndef WAVE_WRITER_HPP_
+#define WAVE_WRITER_HPP_
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <vector>
+
+// Writes a RIFF/WAVE file incrementally. The headers are written on Open,
+// audio is buffered and written in large blocks, and the chunk sizes are
+// patched on Close. A JUNK chunk is reserved in front of "fmt ", so that a
+// file past 4 GB becomes RF64 with a ds64 chunk in its place (EBU 3306).
+//
+// With a preallocation the file is extended ahead of the data in large
+// steps and cut to size on Close, which keeps it in few fragments. The
+// mapped mode copies the audio into the preallocated file through a view
+// of MAP_WINDOW bytes that slides along, instead of calling WriteFile.
+//
+// A compressed format gets a "fact" chunk in front of "data", which holds
+// the sample length set by SetSampleLength.
+class WaveWriter
+{
+public:
+    enum { BLOCK_SIZE = 256 * 1024, MAP_WINDOW = 64 * 1024 * 1024 };
+
+    WaveWriter();
+    ~WaveWriter();
+
+    // Both take effect on the next Open. The file grows by cbReserve bytes
+    // at a time, or by MAP_WINDOW if zero and mapped.
+    void SetPreallocation(ULONGLONG cbReserve);
+    void SetMapped(BOOL bMapped);
+
+    BOOL Open(LPCTSTR pszFileName, const WAVEFORMATEX *pwfx);
+    BOOL Write(LPCVOID pvData, DWORD cbData);
+    // The frames of audio in the data, for the "fact" chunk and ds64 on
+    // Close, when the data is not in whole frames of nBlockAlign.
+    void SetSampleLength(ULONGLONG nFrames);
+    // Adds a chunk to be written after "data" on Close.
+    void AddChunk(const char *pszId, LPCVOID pvData, DWORD cbData);
+    BOOL Close();
+
+    BOOL IsOpen() const
+    {
+        return m_hFile != INVALID_HANDLE_VALUE;
+    }
+    ULONGLONG GetDataSize() const
+    {
+        return m_cbData;
+    }
+
+protected:
+    HANDLE m_hFile;
+    DWORD m_cbHeader;               // where the data starts
+    WORD m_nBlockAlign;
+    DWORD m_offFact;                // where the sample length is, or zero
+    ULONGLONG m_nSampleLength;      // -1 for the data in frames
+    std::vector<BYTE> m_block;
+    DWORD m_cbBlock;
+    std::vector<BYTE> m_trailer;    // the chunks after "data"
+    ULONGLONG m_cbData;
+    ULONGLONG m_cbReserve;
+    ULONGLONG m_cbFile;             // the allocated length of the file
+    BOOL m_bMapped;
+    BOOL m_bOK;
+
+    // The mapped mode's.
+    HANDLE m_hMapping;
+    BYTE *m_pView;
+    ULONGLONG m_offView;
+    DWORD m_cbView;
+    DWORD m_dwGranularity;
+
+    BOOL WriteOut(const BYTE *pb, DWORD cb);
+    BOOL FlushBlock();
+    BOOL WriteAt(ULONGLONG offset, LPCVOID pv, DWORD cb);
+    BOOL Extend(ULONGLONG cbNeeded);
+    BOOL SetFileSize(ULONGLONG cb);
+    BOOL MapAt(ULONGLONG offset);
+    void Unmap();
+    BOOL WriteMapped(const BYTE *pb, DWORD cb);
+    BOOL WriteSizes();
+
+    WaveWriter(const WaveWriter&);
+    WaveWriter& operator=(const WaveWriter&);
+};
+
+// Writes a stream to a handle that cannot seek, such as a pipe or the
+// standard output: WAV whose RIFF and "data" sizes say 0xFFFFFFFF, as
+// readers of a stream take them, or raw frames without a header. Writes
+// are gathered into a block and go out when it is full or on Flush, so a
+// backlog goes out in large writes while a steady stream is flushed packet
+// by packet. Once the reader has gone, the rest is counted as dropped.
+// The handle stays the caller's.
+class WaveStreamWriter
+{
+public:
+    enum { BLOCK_SIZE = 64 * 1024 };
+
+    WaveStreamWriter();
+    ~WaveStreamWriter();
+
+    BOOL Open(HANDLE hOutput, const WAVEFORMATEX *pwfx, BOOL bHeader);
+    BOOL Write(LPCVOID pvData, DWORD cbData);
+    BOOL Flush();
+    BOOL Close();
+
+    BOOL IsOpen() const
+    {
+        return m_hOutput != NULL;
+    }
+    // FALSE once a write has failed, as when the reader closes the pipe.
+    BOOL IsConnected() const
+    {
+        return m_bOK;
+    }
+    ULONGLONG GetWrittenBytes() const
+    {
+        return m_cbWritten;
+    }
+    ULONGLONG GetDroppedBytes() const
+    {
+        return m_cbDropped;
+    }
+
+protected:
+    HANDLE m_hOutput;
+    std::vector<BYTE> m_block;
+    DWORD m_cbBlock;
+    ULONGLONG m_cbWritten;
+    ULONGLONG m_cbDropped;
+    BOOL m_bOK;
+
+    BOOL WriteOut(const BYTE *pb, DWORD cb);
+
+    WaveStreamWriter(const WaveStreamWriter&);
+    WaveStreamWriter& operator=(const WaveStreamWriter&);
+};
+
+#endif  // ndef WAVE_WRITER_HPP_
@@ -0,0 +1,1013 @@
+// bench.cpp --- micro-benchmarks of the recording hot paths
+//    ex) bench              (all benchmarks)
+//    ex) bench -quick scan  (only the names containing "scan", fewer rounds)
+#include "../Recording.hpp"
+#include "../MultiRecording.hpp"
+#include "../ReplayCaptureSource.hpp"
+#include "../Simd.hpp"
+#include "../Convert.hpp"
+#include "../Resampler.hpp"
+#include "../WaveReader.hpp"
+#include "../Spectrum.hpp"
+#include "../Loudness.hpp"
+#include "../Dynamics.hpp"
+#include "../BatchProcessor.hpp"
+#include "../SharedTap.hpp"
+#include <cstring>
+#include <cmath>
+
+#define BENCH_RATE      48000
+#define BENCH_CHANNELS  2
+#define PACKET_FRAMES   (BENCH_RATE / 100)  // 10 ms, the shared-mode period
+
+static BOOL s_bQuick = FALSE;
+static int s_nFilters = 0;
+static char **s_ppszFilters = NULL;
+static volatile DWORD s_dwSink;     // keeps the reads of the views
+
+class Stopwatch
+{
+public:
+    Stopwatch()
+    {
+        ::QueryPerformanceFrequency(&m_liFreq);
+        Restart();
+    }
+    void Restart()
+    {
+        ::QueryPerformanceCounter(&m_liStart);
+    }
+    double GetSeconds() const
+    {
+        LARGE_INTEGER liNow;
+        ::QueryPerformanceCounter(&liNow);
+        return double(liNow.QuadPart - m_liStart.QuadPart) / m_liFreq.QuadPart;
+    }
+
+protected:
+    LARGE_INTEGER m_liFreq;
+    LARGE_INTEGER m_liStart;
+};
+
+static BOOL is_selected(const char *pszName)
+{
+    if (s_nFilters == 0)
+        return TRUE;
+    for (int i = 0; i < s_nFilters; ++i)
+    {
+        if (strstr(pszName, s_ppszFilters[i]))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void report(const char *pszName, ULONGLONG nFrames, ULONGLONG cbData,
+                   double seconds)
+{
+    if (nFrames == 0 || seconds <= 0)
+        return;
+    // The real-time multiple is how many such streams one core keeps up with.
+    printf("%-32s %10.3f ns/frame %10.1f MB/s %10.1fx realtime\n", pszName,
+           seconds * 1e9 / nFrames, cbData / seconds / 1e6,
+           double(nFrames) / BENCH_RATE / seconds);
+}
+
+static void get_format(WAVEFORMATEX *pwfx, SAMPLE_FORMAT format)
+{
+    static const WORD s_bits[] = { 0, 8, 16, 24, 32, 32 };
+    ZeroMemory(pwfx, sizeof(*pwfx));
+    pwfx->wFormatTag = (format == SAMPLE_FORMAT_F32) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+    pwfx->nChannels = BENCH_CHANNELS;
+    pwfx->nSamplesPerSec = BENCH_RATE;
+    pwfx->wBitsPerSample = s_bits[format];
+    pwfx->nBlockAlign = pwfx->wBitsPerSample * pwfx->nChannels / 8;
+    pwfx->nAvgBytesPerSec = pwfx->nSamplesPerSec * pwfx->nBlockAlign;
+}
+
+// Noise at about -6 dBFS, so the kernels see no denormals and few clips.
+static void fill_noise(SAMPLE_FORMAT format, std::vector<BYTE>& data)
+{
+    DWORD seed = 1;
+    if (format == SAMPLE_FORMAT_F32)
+    {
+        float *pf = reinterpret_cast<float *>(data.data());
+        for (size_t i = 0; i < data.size() / sizeof(float); ++i)
+        {
+            seed = seed * 1664525 + 1013904223;
+            pf[i] = 0.5f * (float(seed >> 8) / 8388608.0f - 1.0f);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        data[i] = BYTE(seed >> 24);
+    }
+}
+
+static void get_temp_file_name(LPTSTR pszFileName)
+{
+    TCHAR szDir[MAX_PATH];
+    ::GetTempPath(ARRAYSIZE(szDir), szDir);
+    ::GetTempFileName(szDir, TEXT("bch"), 0, pszFileName);
+}
+
+// ScanBuffer: measure_levels on 10 ms packets at every supported SIMD level.
+static void bench_scan()
+{
+    static const SAMPLE_FORMAT s_formats[] =
+    {
+        SAMPLE_FORMAT_U8, SAMPLE_FORMAT_S16, SAMPLE_FORMAT_S24,
+        SAMPLE_FORMAT_S32, SAMPLE_FORMAT_F32
+    };
+    static const char *s_names[] = { "", "u8", "s16", "s24", "s32", "f32" };
+
+    const DWORD nPackets = s_bQuick ? 1000 : 20000;
+    const SIMD_LEVEL saved = get_simd_level();
+
+    for (size_t iFormat = 0; iFormat < ARRAYSIZE(s_formats); ++iFormat)
+    {
+        SAMPLE_FORMAT format = s_formats[iFormat];
+        WAVEFORMATEX wfx;
+        get_format(&wfx, format);
+
+        // One second of packets, so the input does not stay in L1.
+        std::vector<BYTE> data(BENCH_RATE * wfx.nBlockAlign);
+        fill_noise(format, data);
+        const DWORD cbPacket = PACKET_FRAMES * wfx.nBlockAlign;
+        const DWORD nPerSecond = DWORD(data.size() / cbPacket);
+
+        for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+        {
+            set_simd_level(SIMD_LEVEL(level));
+
+            char szName[64];
+            sprintf(szName, "scan/%s/%s", s_names[format],
+                    get_simd_level_name(SIMD_LEVEL(level)));
+
+            METER_LEVELS levels;
+            Stopwatch sw;
+            for (DWORD i = 0; i < nPackets; ++i)
+            {
+                const BYTE *pb = &data[(i % nPerSecond) * cbPacket];
+                measure_levels(format, pb, PACKET_FRAMES, wfx.nChannels, &levels);
+            }
+            double seconds = sw.GetSeconds();
+
+            report(szName, ULONGLONG(nPackets) * PACKET_FRAMES,
+                   ULONGLONG(nPackets) * cbPacket, seconds);
+        }
+    }
+
+    set_simd_level(saved);
+}
+
+// The native mode's conversion stage: float32 to each format, and the
+// stereo split.
+static void bench_convert()
+{
+    static const SAMPLE_FORMAT s_formats[] =
+    {
+        SAMPLE_FORMAT_U8, SAMPLE_FORMAT_S16, SAMPLE_FORMAT_S24, SAMPLE_FORMAT_S32
+    };
+    static const char *s_names[] = { "", "u8", "s16", "s24", "s32", "f32" };
+
+    const DWORD nPackets = s_bQuick ? 1000 : 20000;
+    const DWORD nSamples = PACKET_FRAMES * BENCH_CHANNELS;
+    const DWORD cbPacket = nSamples * sizeof(float);
+    const SIMD_LEVEL saved = get_simd_level();
+
+    std::vector<BYTE> data(BENCH_RATE * BENCH_CHANNELS * sizeof(float));
+    fill_noise(SAMPLE_FORMAT_F32, data);
+    const float *pf = reinterpret_cast<const float *>(data.data());
+    const DWORD nPerSecond = BENCH_RATE / PACKET_FRAMES;
+    std::vector<BYTE> out(nSamples * 4);
+
+    for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+    {
+        set_simd_level(SIMD_LEVEL(level));
+
+        for (size_t iFormat = 0; iFormat < ARRAYSIZE(s_formats); ++iFormat)
+        {
+            SAMPLE_FORMAT format = s_formats[iFormat];
+            char szName[64];
+            sprintf(szName, "convert/%s/%s", s_names[format],
+                    get_simd_level_name(SIMD_LEVEL(level)));
+
+            Stopwatch sw;
+            for (DWORD i = 0; i < nPackets; ++i)
+                convert_from_float(format, pf + (i % nPerSecond) * nSamples, nSamples, out.data());
+            double seconds = sw.GetSeconds();
+
+            report(szName, ULONGLONG(nPackets) * PACKET_FRAMES,
+                   ULONGLONG(nPackets) * cbPacket, seconds);
+        }
+
+        std::vector<float> left(PACKET_FRAMES), right(PACKET_FRAMES);
+        float *planes[2] = { left.data(), right.data() };
+        char szName[64];
+        sprintf(szName, "convert/deinterleave/%s", get_simd_level_name(SIMD_LEVEL(level)));
+
+        Stopwatch sw;
+        for (DWORD i = 0; i < nPackets; ++i)
+            deinterleave_float(pf + (i % nPerSecond) * nSamples, PACKET_FRAMES, 2, planes);
+        double seconds = sw.GetSeconds();
+
+        report(szName, ULONGLONG(nPackets) * PACKET_FRAMES,
+               ULONGLONG(nPackets) * cbPacket, seconds);
+    }
+
+    set_simd_level(saved);
+}
+
+// The Resampler from the 48 kHz mix to the other rates of s_wave_formats,
+// for each preset at every supported SIMD level.
+static void bench_resample()
+{
+    static const DWORD s_rates[] = { 44100, 22050, 96000 };
+
+    const DWORD nPackets = s_bQuick ? 200 : 2000;
+    const DWORD nSamples = PACKET_FRAMES * BENCH_CHANNELS;
+    const SIMD_LEVEL saved = get_simd_level();
+
+    std::vector<BYTE> data(BENCH_RATE * BENCH_CHANNELS * sizeof(float));
+    fill_noise(SAMPLE_FORMAT_F32, data);
+    const float *pf = reinterpret_cast<const float *>(data.data());
+    const DWORD nPerSecond = BENCH_RATE / PACKET_FRAMES;
+    std::vector<float> out;
+
+    for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+    {
+        set_simd_level(SIMD_LEVEL(level));
+
+        for (int quality = RESAMPLE_FAST; quality <= RESAMPLE_HIGH; ++quality)
+        {
+            for (size_t iRate = 0; iRate < ARRAYSIZE(s_rates); ++iRate)
+            {
+                Resampler resampler;
+                resampler.Init(BENCH_RATE, s_rates[iRate], BENCH_CHANNELS,
+                               RESAMPLE_QUALITY(quality));
+
+                char szName[64];
+                sprintf(szName, "resample/%lu/%s/%s", (unsigned long)s_rates[iRate],
+                        get_resample_quality_name(RESAMPLE_QUALITY(quality)),
+                        get_simd_level_name(SIMD_LEVEL(level)));
+
+                Stopwatch sw;
+                for (DWORD i = 0; i < nPackets; ++i)
+                    resampler.Process(pf + (i % nPerSecond) * nSamples, PACKET_FRAMES, out);
+                double seconds = sw.GetSeconds();
+
+                report(szName, ULONGLONG(nPackets) * PACKET_FRAMES,
+                       ULONGLONG(nPackets) * nSamples * sizeof(float), seconds);
+            }
+        }
+    }
+
+    set_simd_level(saved);
+}
+
+// The SpectrumAnalyzer's thread: a 4096-point RealFft, and the whole
+// analysis of 96 kHz 8-channel float32 with 50 spectra a second, which
+// overlap by half, at every supported SIMD level.
+static void bench_spectrum()
+{
+    const DWORD nFfts = s_bQuick ? 2000 : 20000;
+    const SIMD_LEVEL saved = get_simd_level();
+
+    WAVEFORMATEX wfx;
+    get_format(&wfx, SAMPLE_FORMAT_F32);
+    wfx.nChannels = 8;
+    wfx.nSamplesPerSec = 96000;
+    wfx.nBlockAlign = wfx.nChannels * sizeof(float);
+    wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
+
+    std::vector<BYTE> data(wfx.nSamplesPerSec * wfx.nBlockAlign);
+    fill_noise(SAMPLE_FORMAT_F32, data);
+    const DWORD nSeconds = s_bQuick ? 2 : 10;
+    const DWORD cbPacket = wfx.nSamplesPerSec / 100 * wfx.nBlockAlign;
+
+    for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+    {
+        set_simd_level(SIMD_LEVEL(level));
+
+        RealFft fft;
+        fft.Init(4096);
+        std::vector<float> power(4096 / 2 + 1);
+        const float *pf = reinterpret_cast<const float *>(data.data());
+
+        char szName[64];
+        sprintf(szName, "spectrum/fft4096/%s", get_simd_level_name(SIMD_LEVEL(level)));
+        Stopwatch sw;
+        for (DWORD i = 0; i < nFfts; ++i)
+            fft.GetPower(pf + (i % 64) * 4096, power.data());
+        double seconds = sw.GetSeconds();
+        report(szName, ULONGLONG(nFfts) * 4096, ULONGLONG(nFfts) * 4096 * sizeof(float),
+               seconds);
+
+        SpectrumAnalyzer analyzer;
+        analyzer.SetSize(4096);
+        analyzer.SetRate(50);
+        analyzer.Prepare(&wfx);
+
+        sprintf(szName, "spectrum/96k8ch/%s", get_simd_level_name(SIMD_LEVEL(level)));
+        sw.Restart();
+        for (DWORD i = 0; i < nSeconds * 100; ++i)
+            analyzer.Analyze(&data[(i % 100) * cbPacket], cbPacket);
+        seconds = sw.GetSeconds();
+
+        // Counted in frames of BENCH_RATE, so that the multiple is real time.
+        ULONGLONG nFrames = ULONGLONG(nSeconds) * wfx.nSamplesPerSec;
+        report(szName, nFrames * BENCH_RATE / wfx.nSamplesPerSec,
+               nFrames * wfx.nBlockAlign, seconds);
+    }
+
+    set_simd_level(saved);
+}
+
+// The loudness meter on 10 ms packets of 16-bit stereo, as the capture
+// thread feeds it, and of float 5.1, per SIMD level.
+static void bench_loudness()
+{
+    const DWORD nSeconds = s_bQuick ? 10 : 60;
+    const SIMD_LEVEL saved = get_simd_level();
+
+    for (int iFormat = 0; iFormat < 2; ++iFormat)
+    {
+        WAVEFORMATEX wfx;
+        get_format(&wfx, iFormat ? SAMPLE_FORMAT_F32 : SAMPLE_FORMAT_S16);
+        if (iFormat)
+        {
+            wfx.nChannels = 6;
+            wfx.nBlockAlign = wfx.nChannels * sizeof(float);
+            wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
+        }
+
+        std::vector<BYTE> data(wfx.nSamplesPerSec * wfx.nBlockAlign);
+        fill_noise(get_sample_format(&wfx), data);
+        const DWORD cbPacket = PACKET_FRAMES * wfx.nBlockAlign;
+
+        for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+        {
+            set_simd_level(SIMD_LEVEL(level));
+
+            LoudnessMeter meter;
+            meter.Reset(&wfx);
+
+            char szName[64];
+            sprintf(szName, "loudness/%s/%s", iFormat ? "f32x6" : "s16x2",
+                    get_simd_level_name(SIMD_LEVEL(level)));
+            Stopwatch sw;
+            for (DWORD i = 0; i < nSeconds * 100; ++i)
+                meter.Update(&data[(i % 100) * cbPacket], PACKET_FRAMES);
+            double seconds = sw.GetSeconds();
+
+            ULONGLONG nFrames = ULONGLONG(nSeconds) * wfx.nSamplesPerSec;
+            report(szName, nFrames, nFrames * wfx.nBlockAlign, seconds);
+        }
+    }
+
+    set_simd_level(saved);
+}
+
+// The AGC and the limiter on 10 ms packets of float stereo, as the writer
+// runs them, per SIMD level. The ceiling is below the peaks of the noise,
+// so the limiter works throughout.
+static void bench_dynamics()
+{
+    const DWORD nSeconds = s_bQuick ? 10 : 60;
+    const SIMD_LEVEL saved = get_simd_level();
+
+    std::vector<BYTE> data(BENCH_RATE * BENCH_CHANNELS * sizeof(float));
+    fill_noise(SAMPLE_FORMAT_F32, data);
+    const float *pf = reinterpret_cast<const float *>(data.data());
+    const DWORD nPacket = PACKET_FRAMES * BENCH_CHANNELS;
+
+    DYNAMICS_SETTINGS settings;
+    get_default_dynamics(&settings);
+    settings.ceilingDB = -12;
+    std::vector<float> out;
+    for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+    {
+        set_simd_level(SIMD_LEVEL(level));
+
+        DynamicsProcessor dynamics;
+        dynamics.Init(&settings, BENCH_RATE, BENCH_CHANNELS);
+
+        char szName[64];
+        sprintf(szName, "dynamics/%s", get_simd_level_name(SIMD_LEVEL(level)));
+        Stopwatch sw;
+        for (DWORD i = 0; i < nSeconds * 100; ++i)
+            dynamics.Process(pf + (i % 100) * nPacket, PACKET_FRAMES, out);
+        double seconds = sw.GetSeconds();
+
+        ULONGLONG nFrames = ULONGLONG(nSeconds) * BENCH_RATE;
+        report(szName, nFrames, nFrames * BENCH_CHANNELS * sizeof(float), seconds);
+    }
+
+    set_simd_level(saved);
+}
+
+// SharedTapPublisher on 10 ms packets, as the capture thread calls it, then
+// with 4 readers measuring each packet in place after it, in this process.
+static void bench_tap()
+{
+    const DWORD nSeconds = s_bQuick ? 10 : 60;
+    WAVEFORMATEX wfx;
+    get_format(&wfx, SAMPLE_FORMAT_S16);
+    std::vector<BYTE> data(BENCH_RATE * wfx.nBlockAlign);
+    fill_noise(SAMPLE_FORMAT_S16, data);
+    const DWORD cbPacket = PACKET_FRAMES * wfx.nBlockAlign;
+
+    TCHAR szName[64];
+    wsprintf(szName, TEXT("Local\\RecordingBench-%lu"), ::GetCurrentProcessId());
+    for (DWORD nReaders = 0; nReaders <= 4; nReaders += 4)
+    {
+        SharedTapPublisher publisher;
+        if (!publisher.Open(szName, &wfx, 2 * BENCH_RATE))
+        {
+            puts("tap: cannot create the mapping");
+            return;
+        }
+        SharedTapReader readers[4];
+        for (DWORD i = 0; i < nReaders; ++i)
+            readers[i].Open(szName);
+
+        METER_LEVELS levels;
+        Stopwatch sw;
+        for (DWORD i = 0; i < nSeconds * 100; ++i)
+        {
+            publisher.Write(&data[(i % 100) * cbPacket], PACKET_FRAMES);
+            for (DWORD j = 0; j < nReaders; ++j)
+            {
+                const BYTE *pb1, *pb2;
+                DWORD n1, n2;
+                DWORD n = readers[j].Peek(&pb1, &n1, &pb2, &n2);
+                if (n1)
+                    measure_levels(SAMPLE_FORMAT_S16, pb1, n1, wfx.nChannels, &levels);
+                if (n2)
+                    measure_levels(SAMPLE_FORMAT_S16, pb2, n2, wfx.nChannels, &levels);
+                readers[j].Consume(n);
+            }
+        }
+        double seconds = sw.GetSeconds();
+
+        ULONGLONG nFrames = ULONGLONG(nSeconds) * BENCH_RATE;
+        report(nReaders ? "tap/publish+4 readers" : "tap/publish", nFrames,
+               nFrames * wfx.nBlockAlign, seconds);
+        if (nReaders)
+        {
+            printf("%-32s %10llu frames lost\n", "",
+                   (unsigned long long)readers[0].GetLostFrames());
+        }
+    }
+}
+
+// The in-memory mode: 10 ms packets appended to a growing vector, as
+// DrainRing used to, and to the SegmentedBuffer it now appends to, and the
+// ring the capture thread fills.
+static void bench_append()
+{
+    WAVEFORMATEX wfx;
+    get_format(&wfx, SAMPLE_FORMAT_S16);
+
+    const DWORD nMinutes = s_bQuick ? 1 : 10;
+    const DWORD nPackets = nMinutes * 60 * 100;
+    const DWORD cbPacket = PACKET_FRAMES * wfx.nBlockAlign;
+    std::vector<BYTE> packet(cbPacket);
+    fill_noise(SAMPLE_FORMAT_S16, packet);
+
+    {
+        std::vector<BYTE> wave_data;
+        double worst = 0;
+        Stopwatch sw, swPacket;
+        for (DWORD i = 0; i < nPackets; ++i)
+        {
+            swPacket.Restart();
+            wave_data.insert(wave_data.end(), packet.begin(), packet.end());
+            double t = swPacket.GetSeconds();
+            if (t > worst)
+                worst = t;
+        }
+        double seconds = sw.GetSeconds();
+
+        char szName[64];
+        sprintf(szName, "append/vector/%lumin", (unsigned long)nMinutes);
+        report(szName, ULONGLONG(nPackets) * PACKET_FRAMES,
+               ULONGLONG(nPackets) * cbPacket, seconds);
+        printf("%-32s %10.3f ms worst packet\n", "", worst * 1000);
+    }
+
+    {
+        SegmentedBuffer wave_data;
+        double worst = 0;
+        Stopwatch sw, swPacket;
+        for (DWORD i = 0; i < nPackets; ++i)
+        {
+            swPacket.Restart();
+            wave_data.Append(packet.data(), cbPacket);
+            double t = swPacket.GetSeconds();
+            if (t > worst)
+                worst = t;
+        }
+        double seconds = sw.GetSeconds();
+
+        char szName[64];
+        sprintf(szName, "append/segmented/%lumin", (unsigned long)nMinutes);
+        report(szName, ULONGLONG(nPackets) * PACKET_FRAMES,
+               ULONGLONG(nPackets) * cbPacket, seconds);
+        printf("%-32s %10.3f ms worst packet\n", "", worst * 1000);
+    }
+
+    {
+        RingBuffer ring;
+        ring.Allocate(2 * BENCH_RATE * wfx.nBlockAlign);
+        std::vector<BYTE> out(cbPacket);
+        Stopwatch sw;
+        for (DWORD i = 0; i < nPackets; ++i)
+        {
+            ring.Write(packet.data(), cbPacket);
+            ring.Read(out.data(), cbPacket);
+        }
+        double seconds = sw.GetSeconds();
+
+        report("append/ring", ULONGLONG(nPackets) * PACKET_FRAMES,
+               ULONGLONG(nPackets) * cbPacket, seconds);
+    }
+}
+
+// WaveWriter fed 10 ms packets.
+static void bench_writer(const char *pszName, LPCTSTR pszFileName,
+                         const WAVEFORMATEX *pwfx, const std::vector<BYTE>& data,
+                         ULONGLONG cbReserve, BOOL bMapped)
+{
+    const DWORD cbPacket = PACKET_FRAMES * pwfx->nBlockAlign;
+    WaveWriter writer;
+    writer.SetPreallocation(cbReserve);
+    writer.SetMapped(bMapped);
+    Stopwatch sw;
+    writer.Open(pszFileName, pwfx);
+    for (size_t ib = 0; ib + cbPacket <= data.size(); ib += cbPacket)
+        writer.Write(&data[ib], cbPacket);
+    writer.Close();
+    double seconds = sw.GetSeconds();
+    report(pszName, data.size() / pwfx->nBlockAlign, data.size(), seconds);
+}
+
+// save_pcm_wave_file on one large buffer, WaveWriter fed 10 ms packets with
+// and without preallocation and mapping, and verify_wave_file and
+// WaveReader on the result.
+static void bench_save()
+{
+    WAVEFORMATEX wfx;
+    get_format(&wfx, SAMPLE_FORMAT_S16);
+
+    const DWORD cbData = (s_bQuick ? 16 : 256) * 1024 * 1024;
+    std::vector<BYTE> data(cbData - cbData % wfx.nBlockAlign);
+    fill_noise(SAMPLE_FORMAT_S16, data);
+    const ULONGLONG nFrames = data.size() / wfx.nBlockAlign;
+
+    TCHAR szFileName[MAX_PATH];
+    get_temp_file_name(szFileName);
+
+    {
+        Stopwatch sw;
+        save_pcm_wave_file(szFileName, &wfx, data.data(), data.size());
+        double seconds = sw.GetSeconds();
+        report("save/pcm_wave_file", nFrames, data.size(), seconds);
+    }
+
+    {
+        SegmentedBuffer segmented;
+        segmented.Append(data.data(), data.size());
+        Stopwatch sw;
+        save_pcm_wave_file(szFileName, &wfx, segmented);
+        double seconds = sw.GetSeconds();
+        report("save/pcm_wave_file/segmented", nFrames, data.size(), seconds);
+    }
+
+    const ULONGLONG cbStep = 64 * 1024 * 1024;
+    bench_writer("save/writer", szFileName, &wfx, data, 0, FALSE);
+    bench_writer("save/writer/prealloc", szFileName, &wfx, data, cbStep, FALSE);
+    bench_writer("save/writer/mapped", szFileName, &wfx, data, cbStep, TRUE);
+
+    {
+        WAVE_VERIFY_RESULT result;
+        verify_wave_file(szFileName, &result);
+        report("save/verify", result.nFrames, data.size(), result.seconds);
+    }
+
+    // WaveReader's views: in order, a packet at a time, summed, and a
+    // frame at a time from anywhere in the file.
+    {
+        WaveReader reader;
+        reader.Open(szFileName);
+        const ULONGLONG nFileFrames = reader.GetFrameCount();
+        Stopwatch sw;
+        DWORD dwSum = 0;
+        for (ULONGLONG nFrame = 0; nFrame + PACKET_FRAMES <= nFileFrames; nFrame += PACKET_FRAMES)
+        {
+            const INT16 *ps = reader.GetSamples<INT16>(nFrame, PACKET_FRAMES);
+            for (DWORD i = 0; i < PACKET_FRAMES * BENCH_CHANNELS; ++i)
+                dwSum += ps[i];
+        }
+        double seconds = sw.GetSeconds();
+        report("save/read/stream", nFileFrames, nFileFrames * wfx.nBlockAlign, seconds);
+
+        const DWORD nReads = s_bQuick ? 100000 : 1000000;
+        sw.Restart();
+        for (DWORD i = 0; i < nReads; ++i)
+        {
+            ULONGLONG nFrame = (ULONGLONG(i) * 2654435761u) % nFileFrames;
+            dwSum += *reader.GetSamples<INT16>(nFrame, 1);
+        }
+        seconds = sw.GetSeconds();
+        printf("%-32s %10.1f ns/read\n", "save/read/random", seconds * 1e9 / nReads);
+        s_dwSink = dwSum;
+    }
+
+    ::DeleteFile(szFileName);
+}
+
+// FlacEncoder on a tone with a little noise, which compresses like music
+// more than white noise does, on 1, 2 and 4 threads.
+static void bench_flac()
+{
+    static const DWORD s_threads[] = { 1, 2, 4 };
+
+    WAVEFORMATEX wfx;
+    get_format(&wfx, SAMPLE_FORMAT_S16);
+
+    const DWORD nFrames = (s_bQuick ? 10 : 120) * BENCH_RATE;
+    std::vector<BYTE> data(nFrames * wfx.nBlockAlign);
+    INT16 *ps = reinterpret_cast<INT16 *>(data.data());
+    DWORD seed = 1;
+    for (DWORD i = 0; i < nFrames * BENCH_CHANNELS; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        double x = 8000 * std::sin(i * 0.0131) + 3000 * std::sin(i * 0.00173);
+        ps[i] = INT16(x + INT16(seed >> 16) / 256);
+    }
+
+    TCHAR szFileName[MAX_PATH];
+    get_temp_file_name(szFileName);
+
+    for (size_t i = 0; i < ARRAYSIZE(s_threads); ++i)
+    {
+        const DWORD cbPacket = PACKET_FRAMES * wfx.nBlockAlign;
+        FlacEncoder encoder;
+        Stopwatch sw;
+        encoder.Open(szFileName, &wfx, s_threads[i]);
+        for (size_t ib = 0; ib + cbPacket <= data.size(); ib += cbPacket)
+            encoder.Write(&data[ib], cbPacket);
+        encoder.Close();
+        double seconds = sw.GetSeconds();
+
+        char szName[64];
+        sprintf(szName, "flac/s16/%lu threads", (unsigned long)s_threads[i]);
+        report(szName, nFrames, data.size(), seconds);
+        if (i == 0)
+        {
+            printf("%-32s %10.1f %% of the size\n", "",
+                   100.0 * encoder.GetOutputSize() / encoder.GetInputSize());
+        }
+    }
+
+    ::DeleteFile(szFileName);
+}
+
+// ImaAdpcmEncoder on the signal of bench_flac, written a packet at a time
+// with and without verification, then the blocks decoded in memory.
+static void bench_adpcm()
+{
+    WAVEFORMATEX wfx;
+    get_format(&wfx, SAMPLE_FORMAT_S16);
+
+    const DWORD nFrames = (s_bQuick ? 10 : 120) * BENCH_RATE;
+    std::vector<BYTE> data(nFrames * wfx.nBlockAlign);
+    INT16 *ps = reinterpret_cast<INT16 *>(data.data());
+    DWORD seed = 1;
+    for (DWORD i = 0; i < nFrames * BENCH_CHANNELS; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        double x = 8000 * std::sin(i * 0.0131) + 3000 * std::sin(i * 0.00173);
+        ps[i] = INT16(x + INT16(seed >> 16) / 256);
+    }
+
+    TCHAR szFileName[MAX_PATH];
+    get_temp_file_name(szFileName);
+
+    const DWORD cbPacket = PACKET_FRAMES * wfx.nBlockAlign;
+    for (int bVerify = 0; bVerify <= 1; ++bVerify)
+    {
+        ImaAdpcmEncoder encoder;
+        encoder.SetVerification(bVerify);
+        Stopwatch sw;
+        encoder.Open(szFileName, &wfx);
+        for (size_t ib = 0; ib + cbPacket <= data.size(); ib += cbPacket)
+            encoder.Write(&data[ib], cbPacket);
+        encoder.Close();
+        double seconds = sw.GetSeconds();
+
+        report(bVerify ? "adpcm/encode/verified" : "adpcm/encode", nFrames, data.size(), seconds);
+        if (bVerify)
+        {
+            printf("%-32s %10.1f %% of the size, SNR %.1f dB\n", "",
+                   100.0 * encoder.GetOutputSize() / encoder.GetInputSize(), encoder.GetSnr());
+        }
+    }
+
+    IMAADPCMWAVEFORMAT wfxAdpcm;
+    get_ima_adpcm_format(&wfx, &wfxAdpcm);
+    const DWORD nPerBlock = wfxAdpcm.wSamplesPerBlock;
+    const DWORD nBlocks = nFrames / nPerBlock;
+    std::vector<BYTE> blocks(nBlocks * wfxAdpcm.wfx.nBlockAlign);
+    IMA_ADPCM_STATE states[BENCH_CHANNELS];
+    ZeroMemory(states, sizeof(states));
+    for (DWORD i = 0; i < nBlocks; ++i)
+    {
+        ima_adpcm_encode_block(&wfxAdpcm, ps + i * nPerBlock * BENCH_CHANNELS, states,
+                               &blocks[i * wfxAdpcm.wfx.nBlockAlign]);
+    }
+
+    std::vector<INT16> decoded(nPerBlock * BENCH_CHANNELS);
+    Stopwatch sw;
+    for (DWORD i = 0; i < nBlocks; ++i)
+        ima_adpcm_decode_block(&wfxAdpcm, &blocks[i * wfxAdpcm.wfx.nBlockAlign], decoded.data());
+    double seconds = sw.GetSeconds();
+    s_dwSink = decoded[0];
+    report("adpcm/decode", ULONGLONG(nBlocks) * nPerBlock,
+           ULONGLONG(nBlocks) * nPerBlock * wfx.nBlockAlign, seconds);
+
+    ::DeleteFile(szFileName);
+}
+
+// BatchProcessor over 32 files of 2 s, analyzed, converted to 24 bits
+// and encoded, on 1, 2 and 4 threads. The files stay in the cache, so this
+// is the scaling of the work, not of the disk.
+static void bench_batch()
+{
+    static const DWORD s_threads[] = { 1, 2, 4 };
+    static const BATCH_OPERATION s_operations[] = { BATCH_ANALYZE, BATCH_CONVERT, BATCH_ENCODE };
+    static const char *s_names[] = { "analyze", "convert", "encode" };
+
+    WAVEFORMATEX wfx;
+    get_format(&wfx, SAMPLE_FORMAT_S16);
+    std::vector<BYTE> data(2 * BENCH_RATE * wfx.nBlockAlign);
+    fill_noise(SAMPLE_FORMAT_S16, data);
+
+    const DWORD nFiles = s_bQuick ? 8 : 32;
+    std::vector<BATCH_FILE> files;
+    TCHAR szFileName[MAX_PATH];
+    for (DWORD i = 0; i < nFiles; ++i)
+    {
+        get_temp_file_name(szFileName);
+        save_pcm_wave_file(szFileName, &wfx, data.data(), data.size());
+        add_batch_file(files, szFileName, NULL, NULL);
+        wsprintf(files.back().szOutput, TEXT("%s.out"), szFileName);
+    }
+
+    for (size_t iOperation = 0; iOperation < ARRAYSIZE(s_operations); ++iOperation)
+    {
+        BATCH_OPTIONS options;
+        ZeroMemory(&options, sizeof(options));
+        options.operation = s_operations[iOperation];
+        if (options.operation == BATCH_CONVERT)
+            options.format = SAMPLE_FORMAT_S24;
+
+        for (size_t i = 0; i < ARRAYSIZE(s_threads); ++i)
+        {
+            BatchProcessor processor;
+            BATCH_STATS stats;
+            processor.Run(files, options, s_threads[i], &stats);
+
+            char szName[64];
+            sprintf(szName, "batch/%s/%lu threads", s_names[iOperation],
+                    (unsigned long)s_threads[i]);
+            report(szName, ULONGLONG(nFiles) * (data.size() / wfx.nBlockAlign),
+                   stats.cbInput, stats.seconds);
+        }
+    }
+
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        ::DeleteFile(files[i].szInput);
+        ::DeleteFile(files[i].szOutput);
+    }
+}
+
+// The whole capture path: a flooding replay source through Recording into
+// a streamed file, directly in s16 and converted from the float32 mix.
+static void bench_pipeline_mode(BOOL bNative)
+{
+    const DWORD nSeconds = s_bQuick ? 10 : 120;
+
+    ReplayCaptureSource source;
+    source.SetSignal(REPLAY_SIGNAL_NOISE);
+    source.SetPacing(REPLAY_PACING_FLOOD);
+    source.SetLength(ULONGLONG(nSeconds) * BENCH_RATE);
+
+    TCHAR szFileName[MAX_PATH];
+    get_temp_file_name(szFileName);
+
+    double seconds;
+    {
+        Recording rec;
+        rec.SetInfo(BENCH_CHANNELS, BENCH_RATE, 16);
+        rec.SetSource(&source);
+        rec.SetStreaming(TRUE);
+        rec.SetNativeFormat(bNative);
+        rec.SetFileName(szFileName);
+
+        Stopwatch sw;
+        rec.StartHearing();
+        rec.SetRecording(TRUE);
+        ::WaitForSingleObject(source.GetFinishedEvent(), INFINITE);
+        rec.StopHearing();
+        seconds = sw.GetSeconds();
+
+        if (rec.GetOverflowCount())
+        {
+            printf("%-32s %10lu packets dropped\n", "",
+                   (unsigned long)rec.GetOverflowCount());
+        }
+    }
+
+    report(bNative ? "pipeline/native/s16" : "pipeline/replay/s16",
+           source.GetDeliveredFrames(),
+           source.GetDeliveredFrames() * BENCH_CHANNELS * (bNative ? 4 : 2), seconds);
+
+    ::DeleteFile(szFileName);
+}
+
+static void bench_pipeline()
+{
+    bench_pipeline_mode(FALSE);
+    bench_pipeline_mode(TRUE);
+}
+
+// The end-to-end latency of the capture thread against the simulated clock
+// of a real-time replay source, at each latency, and the frames the
+// simulated buffer lost. It runs in real time, so it measures no speed.
+static void bench_latency_mode(const char *pszName, CAPTURE_LATENCY latency,
+                               DWORD dwBuffer)
+{
+    const DWORD nSeconds = s_bQuick ? 2 : 10;
+
+    ReplayCaptureSource source;
+    source.SetSignal(REPLAY_SIGNAL_NOISE);
+    source.SetLength(ULONGLONG(nSeconds) * BENCH_RATE);
+
+    CAPTURE_STATS stats;
+    {
+        Recording rec;
+        rec.SetInfo(BENCH_CHANNELS, BENCH_RATE, 16);
+        rec.SetSource(&source);
+        rec.SetCaptureLatency(latency, dwBuffer);
+
+        rec.StartHearing();
+        ::WaitForSingleObject(source.GetFinishedEvent(), INFINITE);
+        rec.StopHearing();
+        rec.GetCaptureStats(stats);
+    }
+
+    printf("%-32s %6.2f ms period %6.2f ms buffer %8.3f ms p50 %8.3f ms p99 "
+           "%8.3f ms max %8llu lost\n", pszName,
+           stats.nPeriod / 1000.0, stats.nBuffer / 1000.0,
+           get_histogram_percentile(&stats.endToEnd, 0.5) / 1000.0,
+           get_histogram_percentile(&stats.endToEnd, 0.99) / 1000.0,
+           stats.endToEnd.nMax / 1000.0,
+           (unsigned long long)source.GetLostFrames());
+}
+
+static void bench_latency()
+{
+    bench_latency_mode("latency/default", CAPTURE_LATENCY_DEFAULT, 0);
+    bench_latency_mode("latency/default/20 ms", CAPTURE_LATENCY_DEFAULT, 20);
+    bench_latency_mode("latency/low", CAPTURE_LATENCY_LOW, 0);
+    bench_latency_mode("latency/low/10 ms", CAPTURE_LATENCY_LOW, 10);
+}
+
+// MultiRecording: flooding replay sources on a few capture threads, into
+// a file each or into one multitrack file.
+static void bench_multi_mode(DWORD nStreams, DWORD nThreads, BOOL bMultitrack)
+{
+    const DWORD nSeconds = s_bQuick ? 5 : 30;
+
+    std::vector<ReplayCaptureSource> sources(nStreams);
+    std::vector<HANDLE> finished(nStreams);
+    std::vector<TCHAR> names(nStreams * MAX_PATH);
+    TCHAR szMultitrack[MAX_PATH];
+    get_temp_file_name(szMultitrack);
+
+    double seconds;
+    {
+        MultiRecording multi;
+        multi.SetInfo(BENCH_RATE, 16);
+        multi.SetThreadCount(nThreads);
+        multi.SetMultitrack(bMultitrack ? szMultitrack : NULL);
+        for (DWORD i = 0; i < nStreams; ++i)
+        {
+            sources[i].SetSignal(REPLAY_SIGNAL_NOISE);
+            sources[i].SetPacing(REPLAY_PACING_FLOOD);
+            sources[i].SetLength(ULONGLONG(nSeconds) * BENCH_RATE);
+            finished[i] = sources[i].GetFinishedEvent();
+
+            get_temp_file_name(&names[i * MAX_PATH]);
+            multi.AddSource(&sources[i], BENCH_CHANNELS, &names[i * MAX_PATH]);
+        }
+
+        Stopwatch sw;
+        multi.Start();
+        ::WaitForMultipleObjects(nStreams, finished.data(), TRUE, INFINITE);
+        multi.Stop();
+        seconds = sw.GetSeconds();
+
+        DWORD nOverflows = 0;
+        for (DWORD i = 0; i < nStreams; ++i)
+        {
+            MULTI_STREAM_INFO info;
+            multi.GetStreamInfo(i, info);
+            nOverflows += info.nOverflows;
+        }
+        if (nOverflows)
+            printf("%-32s %10lu packets dropped\n", "", (unsigned long)nOverflows);
+    }
+
+    char szName[64];
+    sprintf(szName, "multi/%lux/%s/%lu threads", (unsigned long)nStreams,
+            bMultitrack ? "multitrack" : "separate", (unsigned long)nThreads);
+
+    // The real-time multiple counts the streams together.
+    ULONGLONG nFrames = ULONGLONG(nStreams) * nSeconds * BENCH_RATE;
+    report(szName, nFrames, nFrames * BENCH_CHANNELS * 2, seconds);
+
+    for (DWORD i = 0; i < nStreams; ++i)
+        ::DeleteFile(&names[i * MAX_PATH]);
+    ::DeleteFile(szMultitrack);
+}
+
+static void bench_multi()
+{
+    static const DWORD s_threads[] = { 1, 2, 4 };
+    for (size_t i = 0; i < ARRAYSIZE(s_threads); ++i)
+    {
+        bench_multi_mode(16, s_threads[i], FALSE);
+        bench_multi_mode(16, s_threads[i], TRUE);
+    }
+}
+
+struct BENCH_ENTRY
+{
+    const char *pszName;
+    void (*pfn)();
+};
+
+static const BENCH_ENTRY s_entries[] =
+{
+    { "scan", bench_scan },
+    { "convert", bench_convert },
+    { "resample", bench_resample },
+    { "spectrum", bench_spectrum },
+    { "loudness", bench_loudness },
+    { "dynamics", bench_dynamics },
+    { "tap", bench_tap },
+    { "append", bench_append },
+    { "save", bench_save },
+    { "flac", bench_flac },
+    { "adpcm", bench_adpcm },
+    { "batch", bench_batch },
+    { "pipeline", bench_pipeline },
+    { "latency", bench_latency },
+    { "multi", bench_multi },
+};
+
+int main(int argc, char **argv)
+{
+    int iArg = 1;
+    if (iArg < argc && strcmp(argv[iArg], "-quick") == 0)
+    {
+        s_bQuick = TRUE;
+        ++iArg;
+    }
+    s_nFilters = argc - iArg;
+    s_ppszFilters = argv + iArg;
+
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (FAILED(hr))
+        return -1;
+
+    printf("SIMD: %s, %d Hz, %d channels, %d-frame packets\n",
+           get_simd_level_name(get_supported_simd_level()),
+           BENCH_RATE, BENCH_CHANNELS, PACKET_FRAMES);
+
+    for (size_t i = 0; i < ARRAYSIZE(s_entries); ++i)
+    {
+        if (is_selected(s_entries[i].pszName))
+            s_entries[i].pfn();
+    }
+
+    CoUninitialize();
+    return 0;
+}
@@ -1,6 +1,389 @@
 #include "../Recording.hpp"
+#include "../MultiRecording.hpp"
+#include "../ReplayCaptureSource.hpp"
+#include "../Resampler.hpp"
+#include "../WaveReader.hpp"
+#include "../BatchProcessor.hpp"
+#include "../Simd.hpp"
+#include <cstring>
+#include <cmath>
+#include <io.h>
 
-int JustDoIt(INT iDev)
+// Appends the capture stats of a recording to a file every second while it
+// runs, and once more when stopped. A ".json" file gets JSON lines, and any
+// other file CSV.
+class StatsDumper
+{
+public:
+    StatsDumper()
+        : m_pRec(NULL)
+        , m_fp(NULL)
+        , m_format(TELEMETRY_CSV)
+        , m_hStop(NULL)
+        , m_hThread(NULL)
+    {
+    }
+
+    ~StatsDumper()
+    {
+        Stop();
+    }
+
+    BOOL Start(Recording *pRec, const char *pszFileName)
+    {
+        if (!pszFileName)
+            return TRUE;
+
+        m_fp = fopen(pszFileName, "w");
+        if (!m_fp)
+        {
+            printf("Cannot write %s.\n", pszFileName);
+            return FALSE;
+        }
+
+        const char *pchDot = strrchr(pszFileName, '.');
+        m_format = (pchDot && _stricmp(pchDot, ".json") == 0) ? TELEMETRY_JSON : TELEMETRY_CSV;
+        m_pRec = pRec;
+        m_hStop = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_hThread = ::CreateThread(NULL, 0, ThreadFunction, this, 0, NULL);
+        return m_hThread != NULL;
+    }
+
+    void Stop()
+    {
+        if (m_hThread)
+        {
+            ::SetEvent(m_hStop);
+            ::WaitForSingleObject(m_hThread, INFINITE);
+            ::CloseHandle(m_hThread);
+            m_hThread = NULL;
+        }
+        if (m_hStop)
+        {
+            ::CloseHandle(m_hStop);
+            m_hStop = NULL;
+        }
+        if (m_fp)
+        {
+            fclose(m_fp);
+            m_fp = NULL;
+        }
+    }
+
+protected:
+    Recording *m_pRec;
+    FILE *m_fp;
+    TELEMETRY_FORMAT m_format;
+    HANDLE m_hStop;
+    HANDLE m_hThread;
+
+    static DWORD WINAPI ThreadFunction(LPVOID pContext)
+    {
+        StatsDumper *pThis = reinterpret_cast<StatsDumper *>(pContext);
+        BOOL bHeader = TRUE;
+        for (;;)
+        {
+            BOOL bStopping = (::WaitForSingleObject(pThis->m_hStop, 1000) != WAIT_TIMEOUT);
+
+            CAPTURE_STATS stats;
+            pThis->m_pRec->GetCaptureStats(stats);
+            write_capture_stats(pThis->m_fp, &stats, pThis->m_format, bHeader);
+            fflush(pThis->m_fp);
+            bHeader = FALSE;
+
+            if (bStopping)
+                break;
+        }
+        return 0;
+    }
+};
+
+// Takes 4096-point spectra 20 times a second into a spectrogram file.
+void SetSpectrogram(Recording& rec, const char *pszFileName)
+{
+    if (!pszFileName)
+        return;
+
+    TCHAR szFileName[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszFileName, -1, szFileName, MAX_PATH);
+    rec.SetSpectrum(4096, 20, szFileName);
+}
+
+// Prints the timing the source got and the latency it gave.
+void PrintLatency(const Recording& rec)
+{
+    CAPTURE_STATS stats;
+    rec.GetCaptureStats(stats);
+    if (stats.nPeriod == 0)
+        return;
+
+    printf("Period %.2f ms, buffer %.2f ms.\n", stats.nPeriod / 1000.0, stats.nBuffer / 1000.0);
+    printf("End-to-end latency %.2f ms on average, %.2f ms at p99, %.2f ms at most.\n",
+           get_histogram_mean(&stats.endToEnd) / 1000.0,
+           get_histogram_percentile(&stats.endToEnd, 0.99) / 1000.0,
+           stats.endToEnd.nMax / 1000.0);
+    if (stats.nPositionJumps)
+    {
+        printf("Missed %llu frames in %llu jumps of the device position.\n",
+               (unsigned long long)stats.nMissingFrames,
+               (unsigned long long)stats.nPositionJumps);
+    }
+}
+
+// Prints the strongest bin of the last spectrum of each channel.
+void PrintSpectrumPeaks(const Recording& rec)
+{
+    SPECTRUM_INFO info;
+    std::vector<float> dB;
+    if (!rec.GetSpectrum(info, dB))
+        return;
+
+    printf("Took %llu spectra.\n", (unsigned long long)info.nSpectra);
+    const DWORD nFftSize = (info.nBins - 1) * 2;
+    for (WORD ch = 0; ch < info.nChannels; ++ch)
+    {
+        const float *pdB = &dB[ch * info.nBins];
+        DWORD iPeak = 0;
+        for (DWORD k = 1; k < info.nBins; ++k)
+        {
+            if (pdB[k] > pdB[iPeak])
+                iPeak = k;
+        }
+        printf("Channel %u: peak at %.1f Hz, %.1f dB\n", ch,
+               double(iPeak) * info.nSamplesPerSec / nFftSize, pdB[iPeak]);
+    }
+}
+
+// Prints what a LoudnessMeter has measured.
+void PrintLoudnessInfo(const LOUDNESS_INFO& info)
+{
+    printf("Integrated %.1f LUFS, range %.1f LU.\n", info.integrated, info.range);
+    printf("Momentary %.1f LUFS at most, short-term %.1f LUFS at most.\n",
+           info.maxMomentary, info.maxShortTerm);
+    printf("True peak %.1f dBTP.\n", get_true_peak_db(&info));
+    for (WORD ch = 0; ch < info.nChannels; ++ch)
+    {
+        printf("  channel %u: true peak %.1f dBTP, sample peak %.1f dBFS\n", ch,
+               20 * log10(info.truePeak[ch] + 1e-10),
+               20 * log10(info.samplePeak[ch] + 1e-10));
+    }
+}
+
+void PrintLoudness(const Recording& rec)
+{
+    LOUDNESS_INFO info;
+    if (rec.GetLoudness(info))
+        PrintLoudnessInfo(info);
+}
+
+// Prints what the AGC and the limiter did and the latency they added.
+void PrintDynamics(const Recording& rec)
+{
+    DYNAMICS_INFO info;
+    DWORD nLatency;
+    if (!rec.GetDynamicsInfo(info, nLatency))
+        return;
+
+    printf("AGC gain %+.1f dB; limited %.1f s, by up to %.1f dB; %.2f ms of look-ahead.\n",
+           info.agcGainDB, double(info.nLimitedFrames) / rec.m_wfx.nSamplesPerSec,
+           info.maxReductionDB, nLatency * 1000.0 / rec.m_wfx.nSamplesPerSec);
+}
+
+// -agc <target dB> and -limit <ceiling dB> turn the dynamics on. The
+// limiter is always on with them; the AGC only with -agc.
+BOOL ParseDynamics(int argc, char **argv, int& iArg, DYNAMICS_SETTINGS *pSettings)
+{
+    if (iArg + 1 >= argc)
+        return FALSE;
+    if (strcmp(argv[iArg], "-agc") == 0)
+    {
+        pSettings->bAgc = TRUE;
+        pSettings->targetDB = float(atof(argv[++iArg]));
+        return TRUE;
+    }
+    if (strcmp(argv[iArg], "-limit") == 0)
+    {
+        pSettings->ceilingDB = float(atof(argv[++iArg]));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// The options of a capture from a device, a file or a tone. A file or a
+// tone ignores the options of a device.
+struct CAPTURE_OPTIONS
+{
+    OUTPUT_FORMAT output;
+    BOOL bMapped;
+    BOOL bNative;               // device only
+    DWORD dwPreroll;            // device only, in seconds
+    BOOL bSparse;               // device only
+    DWORD dwRotate;             // device only, in seconds; zero writes one file
+    DWORD dwBudget;             // device only, in MB; zero keeps every file
+    BOOL bFlood;                // file or tone only
+    const char *pszStats;
+    const char *pszSpectrum;
+    CAPTURE_LATENCY latency;
+    DWORD dwBuffer;
+    BOOL bLoudness;
+    BOOL bDynamics;
+    DYNAMICS_SETTINGS dynamics;
+    const char *pszTap;
+    BOOL bStdout;
+    const char *pszPipe;
+    BOOL bRaw;
+};
+
+// Reads the options of a capture from argv[iArg] on. Unknown ones are
+// skipped.
+void ParseCaptureOptions(int argc, char **argv, int iArg, CAPTURE_OPTIONS *pOptions)
+{
+    ZeroMemory(pOptions, sizeof(*pOptions));
+    pOptions->output = OUTPUT_WAV;
+    pOptions->latency = CAPTURE_LATENCY_DEFAULT;
+    get_default_dynamics(&pOptions->dynamics);
+    pOptions->dynamics.bAgc = FALSE;
+
+    for (; iArg < argc; ++iArg)
+    {
+        if (ParseDynamics(argc, argv, iArg, &pOptions->dynamics))
+            pOptions->bDynamics = TRUE;
+        else if (strcmp(argv[iArg], "-native") == 0)
+            pOptions->bNative = TRUE;
+        else if (strcmp(argv[iArg], "-flac") == 0)
+            pOptions->output = OUTPUT_FLAC;
+        else if (strcmp(argv[iArg], "-adpcm") == 0)
+            pOptions->output = OUTPUT_IMA_ADPCM;
+        else if (strcmp(argv[iArg], "-mapped") == 0)
+            pOptions->bMapped = TRUE;
+        else if (strcmp(argv[iArg], "-preroll") == 0 && iArg + 1 < argc)
+            pOptions->dwPreroll = atoi(argv[++iArg]);
+        else if (strcmp(argv[iArg], "-sparse") == 0)
+            pOptions->bSparse = TRUE;
+        else if (strcmp(argv[iArg], "-rotate") == 0 && iArg + 1 < argc)
+            pOptions->dwRotate = atoi(argv[++iArg]);
+        else if (strcmp(argv[iArg], "-budget") == 0 && iArg + 1 < argc)
+            pOptions->dwBudget = atoi(argv[++iArg]);
+        else if (strcmp(argv[iArg], "-flood") == 0)
+            pOptions->bFlood = TRUE;
+        else if (strcmp(argv[iArg], "-stats") == 0 && iArg + 1 < argc)
+            pOptions->pszStats = argv[++iArg];
+        else if (strcmp(argv[iArg], "-spectrum") == 0 && iArg + 1 < argc)
+            pOptions->pszSpectrum = argv[++iArg];
+        else if (strcmp(argv[iArg], "-lowlatency") == 0)
+            pOptions->latency = CAPTURE_LATENCY_LOW;
+        else if (strcmp(argv[iArg], "-buffer") == 0 && iArg + 1 < argc)
+            pOptions->dwBuffer = atoi(argv[++iArg]);
+        else if (strcmp(argv[iArg], "-loudness") == 0)
+            pOptions->bLoudness = TRUE;
+        else if (strcmp(argv[iArg], "-tap") == 0 && iArg + 1 < argc)
+            pOptions->pszTap = argv[++iArg];
+        else if (strcmp(argv[iArg], "-stdout") == 0)
+            pOptions->bStdout = TRUE;
+        else if (strcmp(argv[iArg], "-pipe") == 0 && iArg + 1 < argc)
+            pOptions->pszPipe = argv[++iArg];
+        else if (strcmp(argv[iArg], "-raw") == 0)
+            pOptions->bRaw = TRUE;
+    }
+}
+
+// Publishes the capture under pszName for -listen in other processes.
+void SetTap(Recording& rec, const char *pszName)
+{
+    if (!pszName)
+        return;
+
+    TCHAR szName[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszName, -1, szName, MAX_PATH);
+    rec.SetTap(szName);
+}
+
+// The handle -stdout or -pipe stream to, or NULL. The messages of the
+// console go to stderr once the audio has stdout; a pipe waits for its
+// reader to connect.
+HANDLE OpenStreamOutput(BOOL bStdout, const char *pszPipe)
+{
+    if (bStdout)
+    {
+        HANDLE hOutput;
+        if (!DuplicateHandle(GetCurrentProcess(), GetStdHandle(STD_OUTPUT_HANDLE),
+                             GetCurrentProcess(), &hOutput, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        {
+            return NULL;
+        }
+        fflush(stdout);
+        _dup2(_fileno(stderr), _fileno(stdout));
+        return hOutput;
+    }
+    if (!pszPipe)
+        return NULL;
+
+    TCHAR szName[MAX_PATH], szPipe[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszPipe, -1, szName, MAX_PATH);
+    wsprintf(szPipe, TEXT("\\\\.\\pipe\\%s"), szName);
+    HANDLE hPipe = CreateNamedPipe(szPipe, PIPE_ACCESS_OUTBOUND, PIPE_TYPE_BYTE | PIPE_WAIT, 1,
+                                   WaveStreamWriter::BLOCK_SIZE, 0, 0, NULL);
+    if (hPipe == INVALID_HANDLE_VALUE)
+    {
+        printf("Cannot create the pipe %s.\n", pszPipe);
+        return NULL;
+    }
+    printf("Waiting for a reader on \\\\.\\pipe\\%s\n", pszPipe);
+    fflush(stdout);
+    if (!ConnectNamedPipe(hPipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+    {
+        CloseHandle(hPipe);
+        return NULL;
+    }
+    return hPipe;
+}
+
+void PrintStreamed(const Recording& rec, HANDLE hOutput)
+{
+    if (!hOutput)
+        return;
+
+    printf("Streamed %.1f MB.\n", rec.GetStreamedBytes() / 1e6);
+    if (rec.GetUnstreamedBytes())
+    {
+        printf("The reader went away: %.1f MB were left out.\n",
+               rec.GetUnstreamedBytes() / 1e6);
+    }
+}
+
+// Sets up what a capture from a device, a file or a tone share. The
+// audio goes to hOutput if there is one, or else to a file.
+void SetCaptureOptions(Recording& rec, const CAPTURE_OPTIONS& options, HANDLE hOutput)
+{
+    rec.SetStreaming(TRUE);
+    rec.SetCaptureLatency(options.latency, options.dwBuffer);
+    if (hOutput)
+    {
+        rec.SetOutputHandle(hOutput, !options.bRaw);
+    }
+    else if (options.output == OUTPUT_FLAC)
+    {
+        rec.SetOutputFormat(OUTPUT_FLAC);
+        rec.SetFileName(TEXT("sound.flac"));
+    }
+    else if (options.output == OUTPUT_IMA_ADPCM)
+    {
+        // sound.wav at 4 bits a sample.
+        rec.SetOutputFormat(OUTPUT_IMA_ADPCM);
+    }
+    else if (options.bMapped)
+    {
+        // Ten minutes of file at a time.
+        rec.SetPreallocation(600, TRUE);
+    }
+
+    SetSpectrogram(rec, options.pszSpectrum);
+    rec.SetLoudness(options.bLoudness);
+    rec.SetDynamics(options.bDynamics ? &options.dynamics : NULL);
+    SetTap(rec, options.pszTap);
+}
+
+int JustDoIt(INT iDev, const CAPTURE_OPTIONS& options, HANDLE hOutput)
 {
     CComPtr<IMMDevice> pDevice;
     CComPtr<IMMDeviceEnumerator> pMMDeviceEnumerator;
@@ -20,23 +403,608 @@ int JustDoIt(INT iDev)
 
     Recording rec;
     rec.SetDevice(pDevice);
+    rec.SetNativeFormat(options.bNative);
+    SetCaptureOptions(rec, options, hOutput);
+    rec.SetSilenceSkipping(options.bSparse);
+
+    // sound-000001.wav, ... of dwRotate seconds, in dwBudget MB at most.
+    if (options.dwRotate)
+        rec.SetRotation(options.dwRotate, 0, ULONGLONG(options.dwBudget) * 1024 * 1024);
 
+    // The recording starts up to dwPreroll seconds before the key.
+    rec.SetPrerollDuration(options.dwPreroll * 1000);
     rec.StartHearing();
+
+    // The budget must hold two files, the one written and the last one.
+    if (options.dwRotate && options.dwBudget)
+    {
+        ULONGLONG cbFiles = ULONGLONG(rec.m_wfx.nAvgBytesPerSec) * options.dwRotate * 2;
+        if (ULONGLONG(options.dwBudget) * 1024 * 1024 < cbFiles)
+        {
+            printf("A budget of %lu MB cannot hold two files of %lu s: it takes %llu MB.\n",
+                   (unsigned long)options.dwBudget, (unsigned long)options.dwRotate,
+                   (unsigned long long)((cbFiles + 1024 * 1024 - 1) / (1024 * 1024)));
+            rec.StopHearing();
+            return -1;
+        }
+    }
+
+    StatsDumper dumper;
+    dumper.Start(&rec, options.pszStats);
+    if (options.dwPreroll)
+    {
+        puts("Press Enter key to start recording");
+        fflush(stdout);
+        getchar();
+    }
     rec.SetRecording(TRUE);
     puts("Press Enter key to stop recording");
     fflush(stdout);
     getchar();
     rec.StopHearing();
+    dumper.Stop();
+
+    if (rec.GetOverflowCount())
+    {
+        printf("Dropped %lu packets (%llu bytes): the writer fell behind.\n",
+               (unsigned long)rec.GetOverflowCount(),
+               (unsigned long long)rec.GetDroppedBytes());
+    }
+    if (options.bSparse)
+    {
+        printf("Left out %.1f s of silence.\n",
+               double(rec.GetSkippedFrames()) / rec.m_wfx.nSamplesPerSec);
+        if (rec.GetGapOverflowCount())
+        {
+            printf("Delayed %lu gaps: the writer fell behind.\n",
+                   (unsigned long)rec.GetGapOverflowCount());
+        }
+    }
+    if (options.dwRotate)
+    {
+        printf("Wrote %lu files, deleted %lu.\n", (unsigned long)rec.GetRotatedFileCount(),
+               (unsigned long)rec.GetDeletedFileCount());
+    }
+    PrintLatency(rec);
+    PrintSpectrumPeaks(rec);
+    PrintLoudness(rec);
+    PrintDynamics(rec);
+    PrintStreamed(rec, hOutput);
 
     puts("Finish.");
     return 0;
 }
 
+// Transcodes a saved recording to FLAC offline.
+int DoEncode(const char *pszInput, const char *pszOutput, DWORD nThreads)
+{
+    TCHAR szInput[MAX_PATH], szOutput[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszInput, -1, szInput, MAX_PATH);
+    MultiByteToWideChar(CP_ACP, 0, pszOutput, -1, szOutput, MAX_PATH);
+
+    double realtime = 0, ratio = 0;
+    if (!flac_encode_wave_file(szInput, szOutput, nThreads, &realtime, &ratio))
+    {
+        printf("Cannot encode %s.\n", pszInput);
+        return -1;
+    }
+
+    printf("Encoded at %.1fx real time to %.1f%% of the size.\n", realtime, ratio * 100);
+    return 0;
+}
+
+// Compresses a saved 16-bit recording to IMA ADPCM, checking it on the way.
+int DoAdpcm(const char *pszInput, const char *pszOutput)
+{
+    TCHAR szInput[MAX_PATH], szOutput[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszInput, -1, szInput, MAX_PATH);
+    MultiByteToWideChar(CP_ACP, 0, pszOutput, -1, szOutput, MAX_PATH);
+
+    double realtime = 0, ratio = 0, snr = 0;
+    if (!ima_adpcm_encode_wave_file(szInput, szOutput, &realtime, &ratio, &snr))
+    {
+        printf("Cannot encode %s.\n", pszInput);
+        return -1;
+    }
+
+    printf("Encoded at %.1fx real time to %.1f%% of the size, SNR %.1f dB.\n",
+           realtime, ratio * 100, snr);
+    return 0;
+}
+
+// Decodes an IMA ADPCM recording back to 16-bit PCM.
+int DoDecode(const char *pszInput, const char *pszOutput)
+{
+    TCHAR szInput[MAX_PATH], szOutput[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszInput, -1, szInput, MAX_PATH);
+    MultiByteToWideChar(CP_ACP, 0, pszOutput, -1, szOutput, MAX_PATH);
+
+    ULONGLONG nFrames = 0;
+    if (!ima_adpcm_decode_wave_file(szInput, szOutput, &nFrames))
+    {
+        printf("Cannot decode %s.\n", pszInput);
+        return -1;
+    }
+
+    printf("Decoded %llu frames.\n", (unsigned long long)nFrames);
+    return 0;
+}
+
+// Puts the silence back into a sparse recording.
+int DoExpand(const char *pszInput, const char *pszOutput)
+{
+    TCHAR szInput[MAX_PATH], szOutput[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszInput, -1, szInput, MAX_PATH);
+    MultiByteToWideChar(CP_ACP, 0, pszOutput, -1, szOutput, MAX_PATH);
+
+    std::vector<TIMELINE_GAP> gaps;
+    ULONGLONG nFrames = 0;
+    if (!read_timeline(szInput, gaps) || !expand_wave_file(szInput, szOutput, &nFrames))
+    {
+        printf("Cannot expand %s.\n", pszInput);
+        return -1;
+    }
+
+    printf("Filled %lu gaps; %llu frames in all.\n", (unsigned long)gaps.size(),
+           (unsigned long long)nFrames);
+    return 0;
+}
+
+// Reads a WAV or RF64 file through and reports its levels.
+int DoVerify(const char *pszFileName)
+{
+    TCHAR szFileName[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszFileName, -1, szFileName, MAX_PATH);
+
+    WAVE_VERIFY_RESULT result;
+    if (!verify_wave_file(szFileName, &result))
+    {
+        printf("Cannot verify %s.\n", pszFileName);
+        return -1;
+    }
+
+    const WAVEFORMATEX *pwfx = &result.info.wfx.Format;
+    printf("%s, %lu Hz, %u-bit, %u channel(s), %llu frames (%.1f s).\n",
+           result.info.bRF64 ? "RF64" : "RIFF",
+           (unsigned long)pwfx->nSamplesPerSec, pwfx->wBitsPerSample, pwfx->nChannels,
+           (unsigned long long)result.nFrames,
+           double(result.nFrames) / pwfx->nSamplesPerSec);
+    for (WORD ch = 0; ch < result.nChannels; ++ch)
+    {
+        printf("  channel %u: peak %.1f dBFS, RMS %.1f dBFS, %llu clips\n", ch,
+               20 * log10(result.peak[ch] + 1e-10),
+               20 * log10(result.rms[ch] + 1e-10),
+               (unsigned long long)result.clips[ch]);
+    }
+    printf("Read %.1f MB in %.2f s (%.0f MB/s).\n", result.info.cbFile / 1e6,
+           result.seconds, result.info.cbFile / 1e6 / (result.seconds + 1e-9));
+
+    if (!result.bComplete)
+    {
+        printf("Truncated: the header says %llu bytes of data.\n",
+               (unsigned long long)result.info.cbData);
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the tap of another process for dwSeconds in place, measuring it,
+// and may write what came to pszOutput. The file holds the first stream
+// the tap had, should its publisher start again.
+int DoListen(const char *pszName, DWORD dwSeconds, const char *pszOutput)
+{
+    TCHAR szName[MAX_PATH], szOutput[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszName, -1, szName, MAX_PATH);
+    if (pszOutput)
+        MultiByteToWideChar(CP_ACP, 0, pszOutput, -1, szOutput, MAX_PATH);
+
+    SharedTapReader reader;
+    if (!reader.Open(szName))
+    {
+        printf("Cannot open the tap %s.\n", pszName);
+        return -1;
+    }
+
+    WaveWriter writer;
+    BOOL bWriting = (pszOutput != NULL);
+    float peak = 0;
+    ULONGLONG nFrames = 0, nMaxLag = 0;
+    DWORD nTorn = 0;
+    const DWORD dwStart = ::GetTickCount();
+    while (::GetTickCount() - dwStart < dwSeconds * 1000)
+    {
+        const BYTE *pb[2];
+        DWORD n[2];
+        DWORD nAvailable = reader.Peek(&pb[0], &n[0], &pb[1], &n[1]);
+        if (nAvailable == 0)
+        {
+            ::Sleep(5);
+            continue;
+        }
+        if (nAvailable > nMaxLag)
+            nMaxLag = nAvailable;
+
+        const WAVEFORMATEX *pwfx = reader.GetFormat();
+        if (bWriting && reader.GetRestartCount())
+            bWriting = FALSE;
+        if (bWriting && !writer.IsOpen() && !writer.Open(szOutput, pwfx))
+        {
+            printf("Cannot write %s.\n", pszOutput);
+            bWriting = FALSE;
+        }
+
+        float peakNow = peak;
+        for (int i = 0; i < 2; ++i)
+        {
+            if (!n[i])
+                continue;
+            METER_LEVELS levels;
+            measure_levels(get_sample_format(pwfx), pb[i], n[i], pwfx->nChannels, &levels);
+            for (WORD ch = 0; ch < levels.nChannels; ++ch)
+            {
+                if (levels.peak[ch] > peakNow)
+                    peakNow = levels.peak[ch];
+            }
+            if (bWriting)
+                writer.Write(pb[i], n[i] * pwfx->nBlockAlign);
+        }
+
+        // The measures of overwritten frames do not count; the file keeps
+        // them, and the count of lost frames says how many they are.
+        if (reader.Consume(nAvailable))
+        {
+            peak = peakNow;
+            nFrames += nAvailable;
+        }
+        else
+        {
+            ++nTorn;
+        }
+    }
+    writer.Close();
+
+    if (!reader.GetFormat()->nSamplesPerSec)
+    {
+        printf("Nothing was published on %s.\n", pszName);
+        return 1;
+    }
+
+    const WAVEFORMATEX *pwfx = reader.GetFormat();
+    printf("Read %llu frames (%.1f s) at %lu Hz, %u channel(s), peak %.1f dBFS.\n",
+           (unsigned long long)nFrames, double(nFrames) / pwfx->nSamplesPerSec,
+           (unsigned long)pwfx->nSamplesPerSec, pwfx->nChannels, 20 * log10(peak + 1e-10));
+    printf("Lost %llu frames in %lu overruns (%lu while reading), %.1f ms behind at most, "
+           "%lu restarts.\n",
+           (unsigned long long)reader.GetLostFrames(), (unsigned long)reader.GetOverrunCount(),
+           (unsigned long)nTorn, 1000.0 * nMaxLag / pwfx->nSamplesPerSec,
+           (unsigned long)reader.GetRestartCount());
+    return 0;
+}
+
+// Runs an operation over a directory of WAV files, or the files listed one
+// per line in @list.txt. Analyze may write a CSV report to pszOutput;
+// convert and encode write into the directory pszOutput.
+int DoBatch(const char *pszInput, const char *pszOutput, const BATCH_OPTIONS& options,
+            DWORD nThreads)
+{
+    const BOOL bAnalyze = (options.operation == BATCH_ANALYZE);
+    TCHAR szOutput[MAX_PATH] = TEXT("");
+    if (pszOutput)
+        MultiByteToWideChar(CP_ACP, 0, pszOutput, -1, szOutput, MAX_PATH);
+    LPCTSTR pszOutputDir = NULL;
+    if (!bAnalyze)
+    {
+        if (!pszOutput)
+        {
+            puts("No output directory.");
+            return -1;
+        }
+        ::CreateDirectory(szOutput, NULL);
+        pszOutputDir = szOutput;
+    }
+    LPCTSTR pszExt = (options.operation == BATCH_ENCODE) ? TEXT(".flac") : NULL;
+
+    std::vector<BATCH_FILE> files;
+    BOOL bListed = TRUE;
+    TCHAR szPath[MAX_PATH];
+    if (pszInput[0] == '@')
+    {
+        FILE *fp = fopen(pszInput + 1, "r");
+        if (!fp)
+        {
+            printf("Cannot read %s.\n", pszInput + 1);
+            return -1;
+        }
+        char szLine[MAX_PATH];
+        while (fgets(szLine, sizeof(szLine), fp))
+        {
+            szLine[strcspn(szLine, "\r\n")] = 0;
+            if (!szLine[0])
+                continue;
+            MultiByteToWideChar(CP_ACP, 0, szLine, -1, szPath, MAX_PATH);
+            if (!add_batch_file(files, szPath, pszOutputDir, pszExt))
+            {
+                printf("Cannot open %s.\n", szLine);
+                bListed = FALSE;
+            }
+        }
+        fclose(fp);
+    }
+    else
+    {
+        MultiByteToWideChar(CP_ACP, 0, pszInput, -1, szPath, MAX_PATH);
+        DWORD dwAttributes = ::GetFileAttributes(szPath);
+        if (dwAttributes != INVALID_FILE_ATTRIBUTES && (dwAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            bListed = add_batch_directory(files, szPath, pszOutputDir, pszExt);
+        else
+            bListed = add_batch_file(files, szPath, pszOutputDir, pszExt);
+    }
+    if (files.empty())
+    {
+        printf("No files in %s.\n", pszInput);
+        return -1;
+    }
+
+    BatchProcessor processor;
+    BATCH_STATS stats;
+    processor.Run(files, options, nThreads, &stats);
+
+    FILE *fpReport = NULL;
+    if (bAnalyze && pszOutput)
+    {
+        fpReport = fopen(pszOutput, "w");
+        if (fpReport)
+            fprintf(fpReport, "file,ok,complete,frames,rate,bits,channels,peak_dbfs,rms_dbfs,clips\n");
+    }
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        const BATCH_FILE& file = files[i];
+        if (!file.bOK)
+            printf("Failed: %ls\n", file.szInput);
+        if (!fpReport)
+            continue;
+
+        // The loudest channel.
+        const WAVE_VERIFY_RESULT& result = file.verify;
+        const WAVEFORMATEX *pwfx = &result.info.wfx.Format;
+        float peak = 0;
+        double rms = 0;
+        ULONGLONG clips = 0;
+        for (WORD ch = 0; ch < result.nChannels; ++ch)
+        {
+            if (peak < result.peak[ch])
+                peak = result.peak[ch];
+            if (rms < result.rms[ch])
+                rms = result.rms[ch];
+            clips += result.clips[ch];
+        }
+        fprintf(fpReport, "\"%ls\",%d,%d,%llu,%lu,%u,%u,%.2f,%.2f,%llu\n", file.szInput,
+                file.bOK ? 1 : 0, result.bComplete ? 1 : 0, (unsigned long long)file.nFrames,
+                (unsigned long)pwfx->nSamplesPerSec, pwfx->wBitsPerSample, pwfx->nChannels,
+                20 * log10(peak + 1e-10), 20 * log10(rms + 1e-10), (unsigned long long)clips);
+    }
+    if (fpReport)
+        fclose(fpReport);
+
+    double seconds = stats.seconds + 1e-9;
+    printf("Processed %lu files (%lu failed) on %lu threads in %.2f s, %lu stolen.\n",
+           (unsigned long)stats.nFiles, (unsigned long)stats.nFailed,
+           (unsigned long)stats.nThreads, stats.seconds, (unsigned long)stats.nSteals);
+    printf("%.1f files/s, %.1f MB/s in, %.1f MB/s out.\n", stats.nFiles / seconds,
+           stats.cbInput / 1e6 / seconds, stats.cbOutput / 1e6 / seconds);
+
+    return (stats.nFailed || !bListed) ? 1 : 0;
+}
+
+// Records several devices at once, into sound0.wav, sound1.wav, ... or
+// into one multitrack file.
+int DoMulti(const std::vector<INT>& devices, LPCTSTR pszMultitrack)
+{
+    CComPtr<IMMDeviceEnumerator> pMMDeviceEnumerator;
+    CComPtr<IMMDeviceCollection> pMMDeviceCollection;
+
+    HRESULT hr = CoCreateInstance(
+        __uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL,
+        __uuidof(IMMDeviceEnumerator),
+        (void**)&pMMDeviceEnumerator);
+    assert(SUCCEEDED(hr));
+
+    pMMDeviceEnumerator->EnumAudioEndpoints(eAll, DEVICE_STATE_ACTIVE, &pMMDeviceCollection);
+    assert(pMMDeviceCollection);
+
+    MultiRecording multi;
+    multi.SetInfo(48000, 16);
+    multi.SetMultitrack(pszMultitrack);
+    for (size_t i = 0; i < devices.size(); ++i)
+    {
+        CComPtr<IMMDevice> pDevice;
+        pMMDeviceCollection->Item(devices[i], &pDevice);
+        if (!pDevice)
+        {
+            printf("No device #%d.\n", devices[i]);
+            return -1;
+        }
+
+        TCHAR szFileName[MAX_PATH];
+        wsprintf(szFileName, TEXT("sound%u.wav"), UINT(i));
+        if (multi.AddDevice(pDevice, 2, szFileName) < 0)
+        {
+            printf("Too many devices.\n");
+            return -1;
+        }
+    }
+
+    if (!multi.Start())
+    {
+        puts("Cannot start recording.");
+        return -1;
+    }
+    puts("Press Enter key to stop recording");
+    fflush(stdout);
+    getchar();
+    multi.Stop();
+
+    for (DWORD i = 0; i < multi.GetStreamCount(); ++i)
+    {
+        MULTI_STREAM_INFO info;
+        multi.GetStreamInfo(i, info);
+        if (FAILED(info.hr))
+        {
+            printf("#%d: failed (0x%08lX)\n", devices[i], (unsigned long)info.hr);
+            continue;
+        }
+        printf("#%d: %llu frames, %llu lost, %lu packets dropped, offset %lld frames\n",
+               devices[i], (unsigned long long)info.nFrames,
+               (unsigned long long)info.nGapFrames, (unsigned long)info.nOverflows,
+               (long long)multi.GetTrackOffset(i));
+    }
+
+    puts("Finish.");
+    return 0;
+}
+
+// Drives the pipeline from a file or a tone instead of a device. A source
+// of finite length stops by itself.
+int DoReplay(ReplayCaptureSource& source, BOOL bFinite, const CAPTURE_OPTIONS& options,
+             HANDLE hOutput)
+{
+    Recording rec;
+    rec.SetInfo(2, 48000, 16);
+    rec.SetSource(&source);
+    SetCaptureOptions(rec, options, hOutput);
+
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liStart);
+
+    rec.StartHearing();
+    rec.SetRecording(TRUE);
+
+    StatsDumper dumper;
+    dumper.Start(&rec, options.pszStats);
+    if (bFinite)
+    {
+        WaitForSingleObject(source.GetFinishedEvent(), INFINITE);
+    }
+    else
+    {
+        puts("Press Enter key to stop recording");
+        fflush(stdout);
+        getchar();
+    }
+    rec.StopHearing();
+    dumper.Stop();
+
+    QueryPerformanceCounter(&liEnd);
+    double seconds = double(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+    double audio = double(source.GetDeliveredFrames()) / rec.m_wfx.nSamplesPerSec;
+    printf("Replayed %.3f s of audio in %.3f s (%.1fx real time).\n",
+           audio, seconds, seconds > 0 ? audio / seconds : 0.0);
+
+    if (rec.GetOverflowCount())
+    {
+        printf("Dropped %lu packets (%llu bytes): the writer fell behind.\n",
+               (unsigned long)rec.GetOverflowCount(),
+               (unsigned long long)rec.GetDroppedBytes());
+    }
+    PrintLatency(rec);
+    if (source.GetLostFrames())
+    {
+        printf("Lost %llu frames: the capture thread fell behind the buffer.\n",
+               (unsigned long long)source.GetLostFrames());
+    }
+    PrintSpectrumPeaks(rec);
+    PrintLoudness(rec);
+    PrintDynamics(rec);
+    PrintStreamed(rec, hOutput);
+
+    puts("Finish.");
+    return 0;
+}
+
+// Measures the loudness of a saved recording offline.
+int DoLoudness(const char *pszFileName)
+{
+    TCHAR szFileName[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszFileName, -1, szFileName, MAX_PATH);
+
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liStart);
+
+    LOUDNESS_INFO info;
+    WaveReader reader;
+    if (!reader.Open(szFileName) || !measure_wave_loudness(szFileName, &info))
+    {
+        printf("Cannot measure %s.\n", pszFileName);
+        return -1;
+    }
+
+    QueryPerformanceCounter(&liEnd);
+    double seconds = double(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+    double audio = double(info.nFrames) / reader.GetFormat()->nSamplesPerSec;
+    PrintLoudnessInfo(info);
+    printf("Measured %.1f s of audio in %.3f s (%.0fx real time, %s).\n", audio, seconds,
+           seconds > 0 ? audio / seconds : 0.0, get_simd_level_name(get_simd_level()));
+    return 0;
+}
+
+// Converts a saved recording offline.
+int DoResample(const char *pszInput, const char *pszOutput, DWORD nRate,
+               RESAMPLE_QUALITY quality)
+{
+    TCHAR szInput[MAX_PATH], szOutput[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, pszInput, -1, szInput, MAX_PATH);
+    MultiByteToWideChar(CP_ACP, 0, pszOutput, -1, szOutput, MAX_PATH);
+
+    double realtime = 0;
+    if (!resample_wave_file(szInput, szOutput, nRate, quality, &realtime))
+    {
+        printf("Cannot resample %s.\n", pszInput);
+        return -1;
+    }
+
+    printf("Resampled at %.1fx real time (%s).\n", realtime,
+           get_resample_quality_name(quality));
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     if (argc <= 1)
     {
-        puts("Usage: console <device-number>");
+        puts("Usage: console <device-number> [-native] [-flac | -adpcm | -mapped] [-preroll <seconds>]\n"
+             "                                [-sparse]\n"
+             "                                [-stats <stats.csv | stats.json>]\n"
+             "                                [-rotate <seconds> [-budget <MB>]] [-spectrum <file.spg>]\n"
+             "                                [-lowlatency] [-buffer <ms>] [-loudness]\n"
+             "                                [-agc <target dB>] [-limit <ceiling dB>] [-tap <name>]\n"
+             "                                [-stdout | -pipe <name>] [-raw]\n"
+             "       console -multi <device-number>... [-multitrack <output.wav>]\n"
+             "       console -replay <input.wav> [-flood] [-flac | -adpcm | -mapped]\n"
+             "                                [-stats <stats.csv | stats.json>] [-spectrum <file.spg>]\n"
+             "                                [-lowlatency] [-buffer <ms>] [-loudness]\n"
+             "                                [-agc <target dB>] [-limit <ceiling dB>] [-tap <name>]\n"
+             "                                [-stdout | -pipe <name>] [-raw]\n"
+             "       console -tone <hz> [<seconds>] [-flood] [-flac | -adpcm | -mapped]\n"
+             "                                [-stats <stats.csv | stats.json>] [-spectrum <file.spg>]\n"
+             "                                [-lowlatency] [-buffer <ms>] [-loudness]\n"
+             "                                [-agc <target dB>] [-limit <ceiling dB>] [-tap <name>]\n"
+             "                                [-stdout | -pipe <name>] [-raw]\n"
+             "       console -resample <input.wav> <output.wav> <hz> [fast|balanced|high]\n"
+             "       console -encode <input.wav> <output.flac> [<threads>]\n"
+             "       console -adpcm <input.wav> <output.wav>\n"
+             "       console -decode <input.wav> <output.wav>\n"
+             "       console -verify <input.wav>\n"
+             "       console -listen <name> <seconds> [<output.wav>]\n"
+             "       console -loudness <input.wav>\n"
+             "       console -expand <sparse.wav> <output.wav>\n"
+             "       console -batch analyze <dir | @list.txt> [<report.csv>] [-threads <n>]\n"
+             "       console -batch convert <dir | @list.txt> <output-dir> [-bits 8|16|24|32|float]\n"
+             "                                [-rate <hz>] [-quality fast|balanced|high]\n"
+             "                                [-start <ms>] [-length <ms>] [-threads <n>]\n"
+             "       console -batch encode <dir | @list.txt> <output-dir> [the options of convert]\n"
+             "The replayed input must be 48000 Hz, 16-bit stereo.");
         return -1;
     }
 
@@ -44,8 +1012,160 @@ int main(int argc, char **argv)
     if (FAILED(hr))
         return -1;
 
-    int iDev = atoi(argv[1]);
-    int ret = JustDoIt(iDev);
+    int ret;
+    if (strcmp(argv[1], "-resample") == 0 && argc > 4)
+    {
+        RESAMPLE_QUALITY quality = RESAMPLE_BALANCED;
+        if (argc > 5 && strcmp(argv[5], "fast") == 0)
+            quality = RESAMPLE_FAST;
+        else if (argc > 5 && strcmp(argv[5], "high") == 0)
+            quality = RESAMPLE_HIGH;
+
+        ret = DoResample(argv[2], argv[3], atoi(argv[4]), quality);
+    }
+    else if (strcmp(argv[1], "-encode") == 0 && argc > 3)
+    {
+        ret = DoEncode(argv[2], argv[3], (argc > 4) ? atoi(argv[4]) : 0);
+    }
+    else if (strcmp(argv[1], "-adpcm") == 0 && argc > 3)
+    {
+        ret = DoAdpcm(argv[2], argv[3]);
+    }
+    else if (strcmp(argv[1], "-decode") == 0 && argc > 3)
+    {
+        ret = DoDecode(argv[2], argv[3]);
+    }
+    else if (strcmp(argv[1], "-expand") == 0 && argc > 3)
+    {
+        ret = DoExpand(argv[2], argv[3]);
+    }
+    else if (strcmp(argv[1], "-verify") == 0 && argc > 2)
+    {
+        ret = DoVerify(argv[2]);
+    }
+    else if (strcmp(argv[1], "-listen") == 0 && argc > 3)
+    {
+        ret = DoListen(argv[2], atoi(argv[3]), (argc > 4) ? argv[4] : NULL);
+    }
+    else if (strcmp(argv[1], "-loudness") == 0 && argc > 2)
+    {
+        ret = DoLoudness(argv[2]);
+    }
+    else if (strcmp(argv[1], "-batch") == 0 && argc > 3)
+    {
+        BATCH_OPTIONS options;
+        ZeroMemory(&options, sizeof(options));
+        options.quality = RESAMPLE_BALANCED;
+        if (strcmp(argv[2], "convert") == 0)
+            options.operation = BATCH_CONVERT;
+        else if (strcmp(argv[2], "encode") == 0)
+            options.operation = BATCH_ENCODE;
+        else
+            options.operation = BATCH_ANALYZE;
+
+        int iArg = 4;
+        const char *pszOutput = NULL;
+        if (iArg < argc && argv[iArg][0] != '-')
+            pszOutput = argv[iArg++];
+        DWORD nThreads = 0;
+        for (; iArg < argc; ++iArg)
+        {
+            if (iArg + 1 >= argc)
+                break;
+            if (strcmp(argv[iArg], "-threads") == 0)
+                nThreads = atoi(argv[++iArg]);
+            else if (strcmp(argv[iArg], "-rate") == 0)
+                options.nRate = atoi(argv[++iArg]);
+            else if (strcmp(argv[iArg], "-start") == 0)
+                options.dwStartMilliseconds = atoi(argv[++iArg]);
+            else if (strcmp(argv[iArg], "-length") == 0)
+                options.dwLengthMilliseconds = atoi(argv[++iArg]);
+            else if (strcmp(argv[iArg], "-quality") == 0)
+            {
+                ++iArg;
+                if (strcmp(argv[iArg], "fast") == 0)
+                    options.quality = RESAMPLE_FAST;
+                else if (strcmp(argv[iArg], "high") == 0)
+                    options.quality = RESAMPLE_HIGH;
+            }
+            else if (strcmp(argv[iArg], "-bits") == 0)
+            {
+                ++iArg;
+                if (strcmp(argv[iArg], "float") == 0)
+                    options.format = SAMPLE_FORMAT_F32;
+                else if (atoi(argv[iArg]) == 8)
+                    options.format = SAMPLE_FORMAT_U8;
+                else if (atoi(argv[iArg]) == 16)
+                    options.format = SAMPLE_FORMAT_S16;
+                else if (atoi(argv[iArg]) == 24)
+                    options.format = SAMPLE_FORMAT_S24;
+                else if (atoi(argv[iArg]) == 32)
+                    options.format = SAMPLE_FORMAT_S32;
+            }
+        }
+
+        ret = DoBatch(argv[3], pszOutput, options, nThreads);
+    }
+    else if (strcmp(argv[1], "-multi") == 0)
+    {
+        std::vector<INT> devices;
+        TCHAR szMultitrack[MAX_PATH] = TEXT("");
+        for (int iArg = 2; iArg < argc; ++iArg)
+        {
+            if (strcmp(argv[iArg], "-multitrack") == 0 && iArg + 1 < argc)
+                MultiByteToWideChar(CP_ACP, 0, argv[++iArg], -1, szMultitrack, MAX_PATH);
+            else
+                devices.push_back(atoi(argv[iArg]));
+        }
+
+        ret = DoMulti(devices, szMultitrack[0] ? szMultitrack : NULL);
+    }
+    else if (strcmp(argv[1], "-replay") == 0 || strcmp(argv[1], "-tone") == 0)
+    {
+        ReplayCaptureSource source;
+        BOOL bFinite = TRUE;
+        int iArg = 2;
+        if (strcmp(argv[1], "-replay") == 0)
+        {
+            TCHAR szFileName[MAX_PATH] = TEXT("");
+            if (iArg < argc)
+                MultiByteToWideChar(CP_ACP, 0, argv[iArg++], -1, szFileName, MAX_PATH);
+            source.SetFile(szFileName);
+        }
+        else if (iArg < argc)
+        {
+            source.SetSignal(REPLAY_SIGNAL_SINE, atoi(argv[iArg++]));
+            if (iArg < argc && argv[iArg][0] != '-')
+                source.SetLength(ULONGLONG(atof(argv[iArg++]) * 48000));
+            else
+                bFinite = FALSE;
+        }
+        CAPTURE_OPTIONS options;
+        ParseCaptureOptions(argc, argv, iArg, &options);
+        if (options.bFlood)
+            source.SetPacing(REPLAY_PACING_FLOOD);
+
+        HANDLE hOutput = OpenStreamOutput(options.bStdout, options.pszPipe);
+        if ((options.bStdout || options.pszPipe) && !hOutput)
+            ret = -1;
+        else
+            ret = DoReplay(source, bFinite, options, hOutput);
+        if (hOutput)
+            CloseHandle(hOutput);
+    }
+    else
+    {
+        CAPTURE_OPTIONS options;
+        ParseCaptureOptions(argc, argv, 2, &options);
+
+        HANDLE hOutput = OpenStreamOutput(options.bStdout, options.pszPipe);
+        if ((options.bStdout || options.pszPipe) && !hOutput)
+            ret = -1;
+        else
+            ret = JustDoIt(atoi(argv[1]), options, hOutput);
+        if (hOutput)
+            CloseHandle(hOutput);
+    }
 
     CoUninitialize();
     return ret;
@@ -0,0 +1,1113 @@
+// tests.cpp --- checks of the recording engine
+//    ex) tests              (all checks)
+//    ex) tests tap          (only the names containing "tap")
+// The multi-process checks run this program again as a publisher and as
+// readers of a tap; the exit code is the number of failed checks.
+#include "../Convert.hpp"
+#include "../Simd.hpp"
+#include "../FlacEncoder.hpp"
+#include "../RotatingWaveWriter.hpp"
+#include "../ReplayCaptureSource.hpp"
+#include "../Telemetry.hpp"
+#include "../Loudness.hpp"
+#include "../Dynamics.hpp"
+#include "../ImaAdpcm.hpp"
+#include "../WaveReader.hpp"
+#include "../SharedTap.hpp"
+#include <limits>
+#include <cmath>
+#include <audioclient.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+
+static int s_nFailures = 0;
+static int s_nFilters = 0;
+static char **s_ppszFilters = NULL;
+
+#define CHECK(expr) check((expr), #expr, __FILE__, __LINE__)
+
+static BOOL check(BOOL bOK, const char *pszExpr, const char *pszFile, int nLine)
+{
+    if (!bOK)
+    {
+        printf("%s(%d): check failed: %s\n", pszFile, nLine, pszExpr);
+        ++s_nFailures;
+    }
+    return bOK;
+}
+
+static BOOL is_selected(const char *pszName)
+{
+    if (s_nFilters == 0)
+        return TRUE;
+    for (int i = 0; i < s_nFilters; ++i)
+    {
+        if (strstr(pszName, s_ppszFilters[i]))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+// Plain integer PCM.
+static void get_test_format(WAVEFORMATEX *pwfx, DWORD nRate, WORD nChannels,
+                            WORD wBitsPerSample)
+{
+    ZeroMemory(pwfx, sizeof(*pwfx));
+    pwfx->wFormatTag = WAVE_FORMAT_PCM;
+    pwfx->nChannels = nChannels;
+    pwfx->nSamplesPerSec = nRate;
+    pwfx->wBitsPerSample = wBitsPerSample;
+    pwfx->nBlockAlign = WORD(nChannels * wBitsPerSample / 8);
+    pwfx->nAvgBytesPerSec = nRate * pwfx->nBlockAlign;
+}
+
+// A file of this process in the temporary directory.
+static void get_temp_name(LPTSTR pszFileName, LPCTSTR pszSuffix)
+{
+    TCHAR szDir[MAX_PATH];
+    ::GetTempPath(MAX_PATH, szDir);
+    wsprintf(pszFileName, TEXT("%sRecordingTest-%lu%s"), szDir, ::GetCurrentProcessId(),
+             pszSuffix);
+}
+
+static BOOL read_file(LPCTSTR pszFileName, std::vector<BYTE>& data)
+{
+    data.clear();
+    HANDLE hFile = ::CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    LARGE_INTEGER li;
+    DWORD cbRead = 0;
+    BOOL bOK = ::GetFileSizeEx(hFile, &li);
+    if (bOK && li.QuadPart > 0)
+    {
+        data.resize(size_t(li.QuadPart));
+        bOK = ::ReadFile(hFile, &data[0], DWORD(data.size()), &cbRead, NULL) &&
+              cbRead == data.size();
+    }
+    ::CloseHandle(hFile);
+    return bOK;
+}
+
+// Every kernel turns NaN into silence, in its vector part and in its
+// scalar tail alike, and leaves the samples around it as they are.
+static void test_convert_nan()
+{
+    static const SAMPLE_FORMAT s_formats[] =
+    {
+        SAMPLE_FORMAT_U8, SAMPLE_FORMAT_S16, SAMPLE_FORMAT_S24, SAMPLE_FORMAT_S32
+    };
+    const DWORD nSamples = 45;
+    std::vector<float> in(nSamples), zeroed(nSamples);
+    for (DWORD i = 0; i < nSamples; ++i)
+    {
+        in[i] = zeroed[i] = float(i % 9) / 4 - 1;   // -1 to 1, full scale at both ends
+        if (i % 7 == 3)
+        {
+            in[i] = std::numeric_limits<float>::quiet_NaN();
+            zeroed[i] = 0;
+        }
+    }
+
+    const SIMD_LEVEL saved = get_simd_level();
+    for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+    {
+        set_simd_level(SIMD_LEVEL(level));
+        for (size_t i = 0; i < ARRAYSIZE(s_formats); ++i)
+        {
+            std::vector<BYTE> expected(nSamples * 4), actual(nSamples * 4);
+            convert_from_float(s_formats[i], &zeroed[0], nSamples, &expected[0]);
+            convert_from_float(s_formats[i], &in[0], nSamples, &actual[0]);
+            if (!CHECK(expected == actual))
+            {
+                printf("    %s, format %d\n", get_simd_level_name(SIMD_LEVEL(level)),
+                       int(s_formats[i]));
+            }
+        }
+    }
+    set_simd_level(saved);
+}
+
+// The test suite of RFC 1321, the last one fed a byte at a time.
+static void test_flac_md5()
+{
+    static const char *s_vectors[][2] =
+    {
+        { "", "d41d8cd98f00b204e9800998ecf8427e" },
+        { "a", "0cc175b9c0f1b6a831c399e269772661" },
+        { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+        { "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+        { "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+        { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+          "d174ab98d277d9f5a5611c2c9f419d9f" },
+        { "1234567890123456789012345678901234567890"
+          "1234567890123456789012345678901234567890",
+          "57edf4a22be3c955ac49da2e2107b67a" },
+    };
+    for (size_t i = 0; i < ARRAYSIZE(s_vectors); ++i)
+    {
+        const BYTE *pb = reinterpret_cast<const BYTE *>(s_vectors[i][0]);
+        const DWORD cb = DWORD(strlen(s_vectors[i][0]));
+        MD5_CONTEXT md5;
+        md5_init(&md5);
+        if (i == ARRAYSIZE(s_vectors) - 1)
+        {
+            for (DWORD j = 0; j < cb; ++j)
+                md5_update(&md5, pb + j, 1);
+        }
+        else
+        {
+            md5_update(&md5, pb, cb);
+        }
+        BYTE digest[16];
+        md5_final(&md5, digest);
+
+        char szDigest[33];
+        for (int j = 0; j < 16; ++j)
+            sprintf(szDigest + 2 * j, "%02x", digest[j]);
+        if (!CHECK(strcmp(szDigest, s_vectors[i][1]) == 0))
+            printf("    \"%s\": %s\n", s_vectors[i][0], szDigest);
+    }
+}
+
+// Bit by bit, as the format defines them, apart from the tables of the
+// encoder.
+static BYTE get_test_crc8(const BYTE *pb, size_t cb)
+{
+    BYTE crc = 0;
+    for (size_t i = 0; i < cb; ++i)
+    {
+        crc ^= pb[i];
+        for (int j = 0; j < 8; ++j)
+            crc = BYTE((crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1));
+    }
+    return crc;
+}
+
+static WORD get_test_crc16(const BYTE *pb, size_t cb)
+{
+    WORD crc = 0;
+    for (size_t i = 0; i < cb; ++i)
+    {
+        crc ^= WORD(pb[i] << 8);
+        for (int j = 0; j < 8; ++j)
+            crc = WORD((crc & 0x8000) ? (crc << 1) ^ 0x8005 : (crc << 1));
+    }
+    return crc;
+}
+
+// The header of a frame at pb, if there is one whose CRC-8 holds.
+// pnNumber receives its UTF-8 frame number, and pcbHeader its size.
+static BOOL parse_flac_frame_header(const BYTE *pb, size_t cb, DWORD *pnNumber,
+                                    DWORD *pcbHeader)
+{
+    if (cb < 6 || pb[0] != 0xFF || pb[1] != 0xF8)
+        return FALSE;
+
+    DWORD i = 4;
+    DWORD nNumber = pb[i++];
+    if (nNumber & 0x80)
+    {
+        DWORD nMore = 0, mask = 0x40;
+        for (; nNumber & mask; mask >>= 1)
+            ++nMore;
+        if (nMore == 0 || i + nMore >= cb)
+            return FALSE;
+        nNumber &= mask - 1;
+        for (; nMore > 0; --nMore)
+        {
+            if ((pb[i] & 0xC0) != 0x80)
+                return FALSE;
+            nNumber = (nNumber << 6) | (pb[i++] & 0x3F);
+        }
+    }
+
+    const BYTE nBlockCode = pb[2] >> 4, nRateCode = pb[2] & 0x0F;
+    i += (nBlockCode == 6) ? 1 : (nBlockCode == 7) ? 2 : 0;
+    i += (nRateCode == 12) ? 1 : (nRateCode == 13 || nRateCode == 14) ? 2 : 0;
+    if (i >= cb || get_test_crc8(pb, i) != pb[i])
+        return FALSE;
+
+    *pnNumber = nNumber;
+    *pcbHeader = i + 1;
+    return TRUE;
+}
+
+// STREAMINFO is patched with the frame count and the MD5 of the signed
+// samples, and every frame has its number and both CRCs. 8-bit mono at
+// 11025 Hz has 2-byte frame numbers and the rate in the header; 16-bit
+// stereo ends with a short block.
+static void test_flac_stream()
+{
+    static const struct
+    {
+        DWORD nRate;
+        WORD nChannels;
+        WORD wBitsPerSample;
+        DWORD nFrames;
+        DWORD nThreads;
+    } s_streams[] =
+    {
+        { 11025, 1, 8, 130 * FlacEncoder::BLOCK_FRAMES + 1000, 0 },
+        { 48000, 2, 16, 2 * FlacEncoder::BLOCK_FRAMES + 200, 1 },
+    };
+    TCHAR szFileName[MAX_PATH];
+    get_temp_name(szFileName, TEXT(".flac"));
+
+    for (size_t iStream = 0; iStream < ARRAYSIZE(s_streams); ++iStream)
+    {
+        const DWORD nFrames = s_streams[iStream].nFrames;
+        WAVEFORMATEX wfx;
+        get_test_format(&wfx, s_streams[iStream].nRate, s_streams[iStream].nChannels,
+                        s_streams[iStream].wBitsPerSample);
+
+        // A sine with some noise, so that the residuals are not all zero.
+        std::vector<BYTE> pcm(size_t(nFrames) * wfx.nBlockAlign);
+        DWORD dwSeed = 1;
+        for (DWORD i = 0; i < nFrames * wfx.nChannels; ++i)
+        {
+            dwSeed = dwSeed * 1664525 + 1013904223;
+            double x = 0.5 * sin(i / wfx.nChannels * 0.05) + (int(dwSeed >> 28) - 8) / 256.0;
+            if (wfx.wBitsPerSample == 8)
+            {
+                pcm[i] = BYTE(128 + int(x * 127));
+            }
+            else
+            {
+                INT16 y = INT16(x * 32767);
+                CopyMemory(&pcm[2 * i], &y, sizeof(y));
+            }
+        }
+
+        FlacEncoder encoder;
+        if (!CHECK(encoder.Open(szFileName, &wfx, s_streams[iStream].nThreads)))
+            continue;
+        for (DWORD i = 0; i < nFrames; i += 3000)
+        {
+            DWORD n = (nFrames - i < 3000) ? nFrames - i : 3000;
+            CHECK(encoder.Write(&pcm[size_t(i) * wfx.nBlockAlign], n * wfx.nBlockAlign));
+        }
+        CHECK(encoder.Close());
+
+        std::vector<BYTE> flac;
+        if (!CHECK(read_file(szFileName, flac)) || !CHECK(flac.size() > 42) ||
+            !CHECK(memcmp(&flac[0], "fLaC\x80\0\0\x22", 8) == 0))
+        {
+            continue;
+        }
+        const BYTE *pInfo = &flac[8];
+        ULONGLONG nTotal = (ULONGLONG(pInfo[13] & 0x0F) << 32) | (DWORD(pInfo[14]) << 24) |
+                           (DWORD(pInfo[15]) << 16) | (DWORD(pInfo[16]) << 8) | pInfo[17];
+        CHECK(nTotal == nFrames);
+
+        // The signature is of signed samples.
+        if (wfx.wBitsPerSample == 8)
+        {
+            for (size_t i = 0; i < pcm.size(); ++i)
+                pcm[i] ^= 0x80;
+        }
+        MD5_CONTEXT md5;
+        md5_init(&md5);
+        md5_update(&md5, &pcm[0], DWORD(pcm.size()));
+        BYTE digest[16];
+        md5_final(&md5, digest);
+        CHECK(memcmp(pInfo + 18, digest, 16) == 0);
+
+        // A frame ends where the next one starts, or at the end of the file.
+        size_t offFrame = 42;
+        DWORD nNumber = 0, cbMin = 0xFFFFFFFF, cbMax = 0;
+        while (offFrame < flac.size())
+        {
+            DWORD nFound, cbHeader;
+            if (!CHECK(parse_flac_frame_header(&flac[offFrame], flac.size() - offFrame,
+                                               &nFound, &cbHeader)))
+            {
+                break;
+            }
+            CHECK(nFound == nNumber);
+
+            size_t offEnd = offFrame + cbHeader + 2;
+            for (; offEnd < flac.size(); ++offEnd)
+            {
+                DWORD nNext, cbNext;
+                if (parse_flac_frame_header(&flac[offEnd], flac.size() - offEnd,
+                                            &nNext, &cbNext) &&
+                    nNext == nNumber + 1 &&
+                    get_test_crc16(&flac[offFrame], offEnd - offFrame - 2) ==
+                        ((flac[offEnd - 2] << 8) | flac[offEnd - 1]))
+                {
+                    break;
+                }
+            }
+            if (!CHECK(get_test_crc16(&flac[offFrame], offEnd - offFrame - 2) ==
+                       ((flac[offEnd - 2] << 8) | flac[offEnd - 1])))
+            {
+                break;
+            }
+            DWORD cbFrame = DWORD(offEnd - offFrame);
+            cbMin = (cbFrame < cbMin) ? cbFrame : cbMin;
+            cbMax = (cbFrame > cbMax) ? cbFrame : cbMax;
+            offFrame = offEnd;
+            ++nNumber;
+        }
+        CHECK(nNumber == (nFrames + FlacEncoder::BLOCK_FRAMES - 1) / FlacEncoder::BLOCK_FRAMES);
+        CHECK(DWORD((pInfo[4] << 16) | (pInfo[5] << 8) | pInfo[6]) == cbMin);
+        CHECK(DWORD((pInfo[7] << 16) | (pInfo[8] << 8) | pInfo[9]) == cbMax);
+    }
+    ::DeleteFile(szFileName);
+}
+
+// Gaps are counted over the whole recording, and each lands in the file
+// that holds its frame, even when added before that file is open.
+static void test_rotate_gaps()
+{
+    TCHAR szFileName[MAX_PATH];
+    get_temp_name(szFileName, TEXT(".wav"));
+    WAVEFORMATEX wfx;
+    get_test_format(&wfx, 48000, 1, 32);
+
+    RotatingWaveWriter writer;
+    writer.SetLimits(1000, 0);
+    if (!CHECK(writer.Open(szFileName, &wfx)))
+        return;
+    std::vector<DWORD> frames(1000);
+    TIMELINE_GAP gap;
+    CHECK(writer.Write(&frames[0], 900 * sizeof(DWORD)));
+    gap.nFrame = 950;
+    gap.nFrames = 10;
+    writer.AddGap(gap);
+    gap.nFrame = 1000;                      // at the end of the first file
+    gap.nFrames = 20;
+    writer.AddGap(gap);
+    gap.nFrame = 1400;                      // in the second
+    gap.nFrames = 50;
+    writer.AddGap(gap);
+    CHECK(writer.Write(&frames[0], 600 * sizeof(DWORD)));
+    gap.nFrame = 1500;                      // after the last frame
+    gap.nFrames = 30;
+    writer.AddGap(gap);
+    CHECK(writer.Close());
+    CHECK(writer.GetFileCount() == 2);
+
+    static const TIMELINE_GAP s_expected[2][2] =
+    {
+        { { 950, 10 }, { 1000, 20 } },
+        { { 400, 50 }, { 500, 30 } },
+    };
+    TCHAR szBase[MAX_PATH];
+    lstrcpyn(szBase, szFileName, lstrlen(szFileName) - 3);
+    for (DWORD i = 0; i < 2; ++i)
+    {
+        TCHAR szPart[MAX_PATH];
+        wsprintf(szPart, TEXT("%s-%06lu.wav"), szBase, i + 1);
+        std::vector<TIMELINE_GAP> gaps;
+        if (CHECK(read_timeline(szPart, gaps)) && CHECK(gaps.size() == 2))
+        {
+            for (DWORD j = 0; j < 2; ++j)
+            {
+                CHECK(gaps[j].nFrame == s_expected[i][j].nFrame &&
+                      gaps[j].nFrames == s_expected[i][j].nFrames);
+            }
+        }
+        ::DeleteFile(szPart);
+    }
+}
+
+// A budget holds two files at least, and the file just closed is kept
+// even if it alone overruns the budget.
+static void test_rotate_budget()
+{
+    TCHAR szFileName[MAX_PATH];
+    get_temp_name(szFileName, TEXT("-budget.wav"));
+    WAVEFORMATEX wfx;
+    get_test_format(&wfx, 48000, 1, 32);
+
+    RotatingWaveWriter writer;
+    writer.SetLimits(1000, 2 * 1000 * sizeof(DWORD) - 1);
+    CHECK(!writer.Open(szFileName, &wfx));
+
+    // With their headers, a closed file and a full current one are over.
+    writer.SetLimits(1000, 2 * 1000 * sizeof(DWORD));
+    if (!CHECK(writer.Open(szFileName, &wfx)))
+        return;
+    std::vector<DWORD> frames(3000);
+    CHECK(writer.Write(&frames[0], 3000 * sizeof(DWORD)));
+    CHECK(writer.Close());
+    CHECK(writer.GetFileCount() == 3);
+    CHECK(writer.GetDeletedCount() == 2);
+
+    TCHAR szBase[MAX_PATH];
+    lstrcpyn(szBase, szFileName, lstrlen(szFileName) - 3);
+    for (DWORD i = 0; i < 3; ++i)
+    {
+        TCHAR szPart[MAX_PATH];
+        wsprintf(szPart, TEXT("%s-%06lu.wav"), szBase, i + 1);
+        CHECK(::DeleteFile(szPart) == (i == 2));
+    }
+}
+
+// A replay whose clock only moves when the check says so.
+class SteppedReplaySource : public ReplayCaptureSource
+{
+public:
+    SteppedReplaySource() : m_llNow(0)
+    {
+    }
+    LONGLONG GetFrequency() const
+    {
+        return m_liFreq.QuadPart;
+    }
+    void SetTime(DWORD dwMilliseconds)
+    {
+        m_llNow = 1000 * m_liFreq.QuadPart + m_liFreq.QuadPart * dwMilliseconds / 1000;
+    }
+
+protected:
+    LONGLONG m_llNow;
+
+    virtual LONGLONG GetClock() const
+    {
+        return m_llNow;
+    }
+};
+
+// A paced packet is stamped with the time its first frame was due, so the
+// latency of taking it is the age of that frame. A capture thread that
+// falls more than the buffer behind loses whole periods and sees the next
+// packet flagged, past them.
+static void test_replay_clock()
+{
+    WAVEFORMATEXTENSIBLE wfx;
+    get_float_format(&wfx, 48000, 2);
+    HANDLE hWakeUp = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    SteppedReplaySource source;
+    source.SetSignal(REPLAY_SIGNAL_SINE);
+    source.SetPeriod(10);
+    source.SetLatency(CAPTURE_LATENCY_DEFAULT, 100);
+    if (!CHECK(SUCCEEDED(source.Open(&wfx.Format, hWakeUp))))
+    {
+        ::CloseHandle(hWakeUp);
+        return;
+    }
+    CAPTURE_TIMING timing;
+    CHECK(SUCCEEDED(source.GetTiming(&timing)));
+    CHECK(timing.nPeriodFrames == 480);
+    const LONGLONG llFreq = source.GetFrequency();
+
+    source.SetTime(0);
+    CHECK(SUCCEEDED(source.Start()));
+
+    UINT32 nFrames;
+    BYTE *pb;
+    DWORD dwFlags;
+    UINT64 u64Position, u64QPC;
+    source.SetTime(5);
+    CHECK(SUCCEEDED(source.GetNextPacketSize(&nFrames)) && nFrames == 0);
+
+    // Each packet on time, taken 4 ms after its last frame.
+    for (DWORD i = 0; i < 2; ++i)
+    {
+        source.SetTime(10 * i + 14);
+        CHECK(SUCCEEDED(source.GetNextPacketSize(&nFrames)) && nFrames == 480);
+        CHECK(source.GetBuffer(&pb, &nFrames, &dwFlags, &u64Position, &u64QPC) == S_OK);
+        CHECK(u64Position == 480 * i && dwFlags == 0);
+        LONGLONG llNow = 1000 * llFreq + llFreq * (10 * i + 14) / 1000;
+        CHECK(get_capture_latency(u64QPC, llNow, llFreq) == 14000);
+        source.ReleaseBuffer(nFrames);
+    }
+
+    // Late by the buffer, two periods and 2 ms: three periods are lost.
+    const DWORD dwLate = 20 + timing.nBufferFrames / 48 + 20 + 2;
+    source.SetTime(dwLate);
+    CHECK(SUCCEEDED(source.GetNextPacketSize(&nFrames)) && nFrames == 480);
+    CHECK(source.GetLostFrames() == 3 * 480);
+    CHECK(source.GetBuffer(&pb, &nFrames, &dwFlags, &u64Position, &u64QPC) == S_OK);
+    CHECK(u64Position == 5 * 480);
+    CHECK(dwFlags == AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY);
+    LONGLONG llNow = 1000 * llFreq + llFreq * dwLate / 1000;
+    CHECK(get_capture_latency(u64QPC, llNow, llFreq) == ULONGLONG(dwLate - 50) * 1000);
+    source.ReleaseBuffer(nFrames);
+
+    // The flag is for that packet only.
+    source.SetTime(dwLate + 10);
+    CHECK(SUCCEEDED(source.GetNextPacketSize(&nFrames)) && nFrames == 480);
+    CHECK(source.GetBuffer(&pb, &nFrames, &dwFlags, &u64Position, &u64QPC) == S_OK);
+    CHECK(u64Position == 6 * 480 && dwFlags == 0);
+    source.ReleaseBuffer(nFrames);
+    CHECK(source.GetDeliveredFrames() == 4 * 480);
+
+    source.Close();
+    ::CloseHandle(hWakeUp);
+}
+
+static const double PI = 3.14159265358979323846;
+
+// A 1 kHz sine at -23 dBFS in both channels of a stereo stream reads
+// -23 LUFS, as in EBU Tech 3341, with every kernel.
+static void test_loudness_sine()
+{
+    const DWORD nRate = 48000, nFrames = 20 * nRate;
+    WAVEFORMATEXTENSIBLE wfx;
+    get_float_format(&wfx, nRate, 2);
+    const float amplitude = float(pow(10.0, -23.0 / 20));
+    std::vector<float> frames(2 * nFrames);
+    for (DWORD i = 0; i < nFrames; ++i)
+        frames[2 * i] = frames[2 * i + 1] = amplitude * float(sin(2 * PI * 1000 * i / nRate));
+
+    const SIMD_LEVEL saved = get_simd_level();
+    for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+    {
+        set_simd_level(SIMD_LEVEL(level));
+        LoudnessMeter meter;
+        if (!CHECK(meter.Reset(&wfx.Format)))
+            break;
+        for (DWORD i = 0; i < nFrames; i += 480)
+            meter.Update(reinterpret_cast<const BYTE *>(&frames[2 * i]), 480);
+
+        LOUDNESS_INFO info;
+        meter.GetState(&info);
+        if (!CHECK(fabs(info.integrated + 23) < 0.1) ||
+            !CHECK(fabs(info.shortTerm + 23) < 0.1) || !CHECK(info.range < 0.1) ||
+            !CHECK(fabs(get_true_peak_db(&info) + 23) < 0.1))
+        {
+            printf("    %s: %.2f LUFS, short-term %.2f LUFS, LRA %.2f LU, %.2f dBTP\n",
+                   get_simd_level_name(SIMD_LEVEL(level)), info.integrated, info.shortTerm,
+                   info.range, get_true_peak_db(&info));
+        }
+    }
+    set_simd_level(saved);
+}
+
+// A burst far over full scale comes out no louder than the ceiling, with
+// the AGC on or off and with every kernel, and the output has the length
+// of the input once flushed. Without the AGC, what comes before the
+// look-ahead reaches the burst is untouched.
+static void test_dynamics_limit()
+{
+    const DWORD nRate = 48000, nFrames = nRate;
+    const DWORD nBurst = nRate / 2, nBurstFrames = nRate / 5;
+    std::vector<float> in(2 * nFrames);
+    for (DWORD i = 0; i < nFrames; ++i)
+    {
+        float x = float(sin(2 * PI * 440 * i / nRate));
+        x *= (i >= nBurst && i < nBurst + nBurstFrames) ? 4.0f : 0.1f;
+        in[2 * i] = x;
+        in[2 * i + 1] = -x;
+    }
+
+    const SIMD_LEVEL saved = get_simd_level();
+    for (int level = SIMD_SCALAR; level <= get_supported_simd_level(); ++level)
+    {
+        set_simd_level(SIMD_LEVEL(level));
+        for (int bAgc = FALSE; bAgc <= TRUE; ++bAgc)
+        {
+            DYNAMICS_SETTINGS settings;
+            get_default_dynamics(&settings);
+            settings.bAgc = bAgc;
+            DynamicsProcessor dynamics;
+            if (!CHECK(dynamics.Init(&settings, nRate, 2)))
+                continue;
+
+            // Packets of an odd size, so that blocks straddle them.
+            std::vector<float> out, packet;
+            for (DWORD i = 0; i < nFrames; i += 441)
+            {
+                DWORD n = (nFrames - i < 441) ? nFrames - i : 441;
+                n = dynamics.Process(&in[2 * i], n, packet);
+                out.insert(out.end(), packet.begin(), packet.begin() + 2 * n);
+            }
+            DWORD n = dynamics.Flush(packet);
+            out.insert(out.end(), packet.begin(), packet.begin() + 2 * n);
+
+            const float ceiling = float(pow(10.0, settings.ceilingDB / 20));
+            float peak = 0;
+            for (size_t i = 0; i < out.size(); ++i)
+                peak = (fabs(out[i]) > peak) ? float(fabs(out[i])) : peak;
+            DWORD nUntouched = nBurst - dynamics.GetLatency() - DynamicsProcessor::BLOCK_FRAMES;
+            if (!CHECK(out.size() == in.size()) || !CHECK(peak <= ceiling * 1.00001f) ||
+                !CHECK(bAgc || memcmp(&out[0], &in[0], 2 * nUntouched * sizeof(float)) == 0))
+            {
+                printf("    %s, AGC %d: %lu frames out, peak %.4f\n",
+                       get_simd_level_name(SIMD_LEVEL(level)), bAgc,
+                       (unsigned long)(out.size() / 2), peak);
+            }
+        }
+    }
+    set_simd_level(saved);
+}
+
+// A stereo sine survives a round trip through a file at a faithful SNR.
+// At 44100 Hz the blocks are 2048 bytes of 2041 frames, the last one is
+// padded, and "fact" has the frames before the padding.
+static void test_adpcm_roundtrip()
+{
+    const DWORD nRate = 44100, nFrames = 10000;
+    WAVEFORMATEX wfx;
+    get_test_format(&wfx, nRate, 2, 16);
+    std::vector<INT16> pcm(2 * nFrames);
+    for (DWORD i = 0; i < nFrames; ++i)
+    {
+        pcm[2 * i] = INT16(16000 * sin(2 * PI * 440 * i / nRate));
+        pcm[2 * i + 1] = INT16(8000 * sin(2 * PI * 1000 * i / nRate));
+    }
+
+    TCHAR szAdpcm[MAX_PATH], szDecoded[MAX_PATH];
+    get_temp_name(szAdpcm, TEXT("-adpcm.wav"));
+    get_temp_name(szDecoded, TEXT("-decoded.wav"));
+    ImaAdpcmEncoder encoder;
+    encoder.SetVerification(TRUE);
+    if (!CHECK(encoder.Open(szAdpcm, &wfx)))
+        return;
+    for (DWORD i = 0; i < nFrames; i += 1234)
+    {
+        DWORD n = (nFrames - i < 1234) ? nFrames - i : 1234;
+        CHECK(encoder.Write(&pcm[2 * i], n * wfx.nBlockAlign));
+    }
+    CHECK(encoder.Close());
+    CHECK(encoder.GetSnr() > 30);
+
+    WaveReader reader;
+    if (CHECK(reader.Open(szAdpcm)))
+    {
+        const IMAADPCMWAVEFORMAT *pwfx =
+            reinterpret_cast<const IMAADPCMWAVEFORMAT *>(reader.GetFormat());
+        CHECK(pwfx->wfx.wFormatTag == WAVE_FORMAT_IMA_ADPCM);
+        CHECK(pwfx->wfx.nBlockAlign == 2048 && pwfx->wSamplesPerBlock == 2041);
+        CHECK(reader.GetFrameCount() == 5);
+
+        ULONGLONG cbFact = 0;
+        const WAVE_CHUNK *pFact = reader.FindChunk("fact");
+        const BYTE *pbFact = pFact ? reader.GetChunkData(pFact, &cbFact) : NULL;
+        DWORD nFact = 0;
+        if (CHECK(pbFact && cbFact >= sizeof(DWORD)))
+            CopyMemory(&nFact, pbFact, sizeof(nFact));
+        CHECK(nFact == nFrames);
+        reader.Close();
+    }
+
+    ULONGLONG nDecoded = 0;
+    CHECK(ima_adpcm_decode_wave_file(szAdpcm, szDecoded, &nDecoded));
+    CHECK(nDecoded == nFrames);
+    if (CHECK(reader.Open(szDecoded)) && CHECK(reader.GetFrameCount() == nFrames))
+    {
+        const INT16 *pDecoded = reader.GetSamples<INT16>(0, nFrames);
+        double signal = 0, noise = 0;
+        for (DWORD i = 0; i < 2 * nFrames; ++i)
+        {
+            signal += double(pcm[i]) * pcm[i];
+            noise += double(pcm[i] - pDecoded[i]) * (pcm[i] - pDecoded[i]);
+        }
+        double snr = 10 * log10(signal / noise);
+        if (!CHECK(snr > 30))
+            printf("    SNR %.1f dB\n", snr);
+        reader.Close();
+    }
+    ::DeleteFile(szAdpcm);
+    ::DeleteFile(szDecoded);
+
+    // nBlockAlign and wSamplesPerBlock are WORDs.
+    get_test_format(&wfx, 352800, 8, 16);
+    CHECK(!is_ima_adpcm_input(&wfx));
+    get_test_format(&wfx, 129 * 11025, 1, 16);
+    CHECK(!is_ima_adpcm_input(&wfx));
+    get_test_format(&wfx, 128 * 11025, 1, 16);
+    CHECK(is_ima_adpcm_input(&wfx));
+}
+
+// The multi-process tap: a first session of TAP_PACKETS1 packets, then
+// the publisher opens the tap again at another rate for TAP_PACKETS2.
+#define TAP_READERS         3       // the last one stalls
+#define TAP_RING_FRAMES     16384
+#define TAP_PACKET_FRAMES   256
+#define TAP_PACKETS1        1024
+#define TAP_PACKETS2        256
+#define TAP_RATE1           48000
+#define TAP_RATE2           44100
+#define TAP_TIMEOUT         60000   // ms
+
+// Mono 32-bit PCM, so that each sample can carry the number of its frame.
+static void get_tap_format(WAVEFORMATEX *pwfx, DWORD nRate)
+{
+    get_test_format(pwfx, nRate, 1, 32);
+}
+
+// Frame n of session s carries (s << 24) + n.
+static void publish_frames(SharedTapPublisher& publisher, DWORD nSession, DWORD nFrames)
+{
+    std::vector<DWORD> frames(nFrames);
+    DWORD nFirst = DWORD(publisher.GetWrittenFrames());
+    for (DWORD i = 0; i < nFrames; ++i)
+        frames[i] = (nSession << 24) + nFirst + i;
+    publisher.Write(reinterpret_cast<const BYTE *>(&frames[0]), nFrames);
+}
+
+// Checks that the frames read are those at the position of the reader.
+static BOOL is_continuous(const DWORD *pdw, DWORD nFrames, DWORD nSession,
+                          ULONGLONG nPosition)
+{
+    for (DWORD i = 0; i < nFrames; ++i)
+    {
+        if (pdw[i] != (nSession << 24) + DWORD(nPosition + i))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void get_tap_name(LPTSTR pszName, DWORD dwOwner, LPCTSTR pszSuffix)
+{
+    wsprintf(pszName, TEXT("Local\\RecordingTest-%lu%s"), dwOwner, pszSuffix);
+}
+
+// A reader more than the ring behind skips to the newest frame and counts
+// what it missed, then reads on without a gap.
+static void test_tap_overrun()
+{
+    TCHAR szName[64];
+    get_tap_name(szName, ::GetCurrentProcessId(), TEXT("-overrun"));
+    WAVEFORMATEX wfx;
+    get_tap_format(&wfx, TAP_RATE1);
+
+    SharedTapPublisher publisher;
+    if (!CHECK(publisher.Open(szName, &wfx, 1000)))
+        return;
+    SharedTapReader reader;
+    if (!CHECK(reader.Open(szName)))
+        return;
+
+    DWORD buf[2000];
+    publish_frames(publisher, 1, 480);
+    CHECK(reader.Read(buf, 2000) == 480);
+    CHECK(is_continuous(buf, 480, 1, 0));
+
+    publish_frames(publisher, 1, 2400);
+    CHECK(reader.GetLag() == 2400);
+    CHECK(reader.Read(buf, 2000) == 0);
+    CHECK(reader.GetOverrunCount() == 1);
+    CHECK(reader.GetLostFrames() == 2400);
+    CHECK(reader.GetPosition() == 2880);
+
+    publish_frames(publisher, 1, 960);
+    CHECK(reader.Read(buf, 2000) == 960);
+    CHECK(is_continuous(buf, 960, 1, 2880));
+    CHECK(reader.GetOverrunCount() == 1);
+    CHECK(reader.GetLag() == 0);
+}
+
+// Frames overwritten between Peek and Consume are reported as lost.
+static void test_tap_torn()
+{
+    TCHAR szName[64];
+    get_tap_name(szName, ::GetCurrentProcessId(), TEXT("-torn"));
+    WAVEFORMATEX wfx;
+    get_tap_format(&wfx, TAP_RATE1);
+
+    SharedTapPublisher publisher;
+    if (!CHECK(publisher.Open(szName, &wfx, 1000)))
+        return;
+    SharedTapReader reader;
+    if (!CHECK(reader.Open(szName)))
+        return;
+
+    // Wrapping around the end of the ring: two regions, both intact.
+    publish_frames(publisher, 1, 700);
+    DWORD buf[1000];
+    CHECK(reader.Read(buf, 1000) == 700);
+    publish_frames(publisher, 1, 600);
+    const BYTE *pb1, *pb2;
+    DWORD n1, n2;
+    DWORD nFrames = reader.Peek(&pb1, &n1, &pb2, &n2);
+    CHECK(nFrames == 600 && n1 == 300 && n2 == 300);
+    CHECK(is_continuous(reinterpret_cast<const DWORD *>(pb1), n1, 1, 700));
+    CHECK(is_continuous(reinterpret_cast<const DWORD *>(pb2), n2, 1, 1000));
+    CHECK(reader.Consume(nFrames));
+
+    // Overwritten while being read.
+    publish_frames(publisher, 1, 500);
+    nFrames = reader.Peek(&pb1, &n1, &pb2, &n2);
+    CHECK(nFrames == 500);
+    publish_frames(publisher, 1, 600);
+    CHECK(!reader.Consume(nFrames));
+    CHECK(reader.GetOverrunCount() == 1);
+    CHECK(reader.GetLostFrames() == 500);
+    CHECK(reader.GetPosition() == 1800);
+
+    // Still within the ring after that.
+    CHECK(reader.Read(buf, 1000) == 600);
+    CHECK(is_continuous(buf, 600, 1, 1800));
+}
+
+// A reader follows the publisher into a new session, in its new format.
+static void test_tap_restart()
+{
+    TCHAR szName[64];
+    get_tap_name(szName, ::GetCurrentProcessId(), TEXT("-restart"));
+    WAVEFORMATEX wfx;
+    get_tap_format(&wfx, TAP_RATE1);
+
+    SharedTapPublisher publisher;
+    if (!CHECK(publisher.Open(szName, &wfx, 1000)))
+        return;
+    SharedTapReader reader;
+    if (!CHECK(reader.Open(szName)))
+        return;
+
+    DWORD buf[1000];
+    publish_frames(publisher, 1, 480);
+    CHECK(reader.Read(buf, 1000) == 480);
+    CHECK(reader.IsLive());
+
+    publisher.Close();
+    CHECK(!reader.IsLive());
+    CHECK(reader.Read(buf, 1000) == 0);
+
+    get_tap_format(&wfx, TAP_RATE2);
+    if (!CHECK(publisher.Open(szName, &wfx, 500)))
+        return;
+    publish_frames(publisher, 2, 300);
+    CHECK(reader.Read(buf, 1000) == 0);     // starts at the newest frame
+    CHECK(reader.GetRestartCount() == 1);
+    CHECK(reader.GetFormat()->nSamplesPerSec == TAP_RATE2);
+    CHECK(reader.GetPosition() == 300);
+    CHECK(reader.IsLive());
+
+    publish_frames(publisher, 2, 200);
+    CHECK(reader.Read(buf, 1000) == 200);
+    CHECK(is_continuous(buf, 200, 2, 300));
+    CHECK(reader.GetLostFrames() == 0);
+
+    // Only one publisher at a time.
+    SharedTapPublisher second;
+    CHECK(!second.Open(szName, &wfx, 500));
+}
+
+// The publisher process of test_tap_processes.
+static int run_tap_publisher(DWORD dwOwner)
+{
+    TCHAR szName[64];
+    get_tap_name(szName, dwOwner, TEXT("-processes"));
+    WAVEFORMATEX wfx;
+    get_tap_format(&wfx, TAP_RATE1);
+
+    SharedTapPublisher publisher;
+    if (!CHECK(publisher.Open(szName, &wfx, TAP_RING_FRAMES)))
+        return s_nFailures;
+    ::Sleep(500);   // for the readers to attach
+    for (DWORD i = 0; i < TAP_PACKETS1; ++i)
+    {
+        publish_frames(publisher, 1, TAP_PACKET_FRAMES);
+        ::Sleep(1);
+    }
+    publisher.Close();
+
+    // For the readers to drain the first session.
+    ::Sleep(500);
+
+    get_tap_format(&wfx, TAP_RATE2);
+    if (!CHECK(publisher.Open(szName, &wfx, TAP_RING_FRAMES / 2)))
+        return s_nFailures;
+    for (DWORD i = 0; i < TAP_PACKETS2; ++i)
+    {
+        publish_frames(publisher, 2, TAP_PACKET_FRAMES);
+        ::Sleep(1);
+    }
+    publisher.Close();
+    return s_nFailures;
+}
+
+// A reader process of test_tap_processes. Every frame read must carry its
+// position, and the frames read and lost must add up to each session.
+static int run_tap_reader(DWORD dwOwner, BOOL bStall)
+{
+    TCHAR szName[64];
+    get_tap_name(szName, dwOwner, TEXT("-processes"));
+
+    SharedTapReader reader;
+    DWORD dwStart = ::GetTickCount();
+    while (!reader.Open(szName))
+    {
+        if (!CHECK(::GetTickCount() - dwStart < TAP_TIMEOUT))
+            return s_nFailures;
+        ::Sleep(1);
+    }
+
+    DWORD nSession = 0;
+    BOOL bStalled = FALSE;
+    ULONGLONG nStart = 0, nRead = 0, nLost = 0;
+    for (;;)
+    {
+        if (!CHECK(::GetTickCount() - dwStart < TAP_TIMEOUT))
+            return s_nFailures;
+
+        // Done once the second session is closed and drained.
+        BOOL bClosed = (nSession == 2 && !reader.IsLive());
+        const BYTE *pb1, *pb2;
+        DWORD n1, n2;
+        ULONGLONG nLostBefore = reader.GetLostFrames();
+        DWORD nRestarts = reader.GetRestartCount();
+        DWORD nFrames = reader.Peek(&pb1, &n1, &pb2, &n2);
+        DWORD nNewSession = (reader.GetFormat()->nSamplesPerSec == TAP_RATE2) ? 2 : 1;
+        if (reader.GetFormat()->nBlockAlign && nNewSession != nSession)
+        {
+            // The first session must be complete by the restart.
+            if (nSession)
+            {
+                CHECK(reader.GetRestartCount() == nRestarts + 1);
+                CHECK(nStart + nRead + nLost == ULONGLONG(TAP_PACKETS1) * TAP_PACKET_FRAMES);
+                CHECK(nRead > 0);
+            }
+            nSession = nNewSession;
+            nStart = reader.GetPosition();
+            nRead = nLost = 0;
+            nLostBefore = reader.GetLostFrames();
+        }
+        nLost += reader.GetLostFrames() - nLostBefore;
+
+        if (nFrames)
+        {
+            ULONGLONG nPosition = reader.GetPosition();
+            const DWORD *pdw1 = reinterpret_cast<const DWORD *>(pb1);
+            const DWORD *pdw2 = reinterpret_cast<const DWORD *>(pb2);
+            BOOL bContinuous = is_continuous(pdw1, n1, nSession, nPosition) &&
+                               is_continuous(pdw2, n2, nSession, nPosition + n1);
+            nLostBefore = reader.GetLostFrames();
+            if (reader.Consume(nFrames))
+            {
+                CHECK(bContinuous);
+                nRead += nFrames;
+            }
+            nLost += reader.GetLostFrames() - nLostBefore;
+        }
+
+        // Stall in the first session until more than a ring behind.
+        if (bStall && !bStalled && nSession == 1 && nRead > 0)
+        {
+            bStalled = TRUE;
+            DWORD nOverruns = reader.GetOverrunCount();
+            while (reader.GetLag() <= 2 * TAP_RING_FRAMES)
+            {
+                if (!CHECK(::GetTickCount() - dwStart < TAP_TIMEOUT))
+                    return s_nFailures;
+                ::Sleep(1);
+            }
+            ULONGLONG nLag = reader.GetLag();
+            nLostBefore = reader.GetLostFrames();
+            CHECK(reader.Peek(&pb1, &n1, &pb2, &n2) == 0);
+            CHECK(reader.GetOverrunCount() == nOverruns + 1);
+            CHECK(reader.GetLostFrames() - nLostBefore >= nLag);
+            nLost += reader.GetLostFrames() - nLostBefore;
+            CHECK(reader.GetLag() < TAP_RING_FRAMES);
+        }
+
+        if (nFrames == 0)
+        {
+            if (bClosed)
+                break;
+            ::Sleep(1);
+        }
+    }
+
+    CHECK(reader.GetRestartCount() == 1);
+    CHECK(nStart + nRead + nLost == ULONGLONG(TAP_PACKETS2) * TAP_PACKET_FRAMES);
+    CHECK(nRead > 0);
+    if (bStall)
+        CHECK(reader.GetOverrunCount() >= 1);
+    else
+        CHECK(reader.GetOverrunCount() == 0 && reader.GetLostFrames() == 0);
+    return s_nFailures;
+}
+
+static BOOL spawn(LPCTSTR pszArgs, PROCESS_INFORMATION *ppi)
+{
+    TCHAR szExe[MAX_PATH];
+    ::GetModuleFileName(NULL, szExe, MAX_PATH);
+    TCHAR szCmdLine[MAX_PATH + 64];
+    wsprintf(szCmdLine, TEXT("\"%s\" %s"), szExe, pszArgs);
+
+    STARTUPINFO si;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    return ::CreateProcess(NULL, szCmdLine, NULL, NULL, FALSE, 0, NULL, NULL, &si, ppi);
+}
+
+// One publisher process and TAP_READERS reader processes, one of which
+// falls behind by more than the ring; the publisher restarts midway.
+static void test_tap_processes()
+{
+    const DWORD dwOwner = ::GetCurrentProcessId();
+    PROCESS_INFORMATION pis[TAP_READERS + 1];
+    DWORD nProcesses = 0;
+    TCHAR szArgs[64];
+    for (DWORD i = 0; i < TAP_READERS; ++i)
+    {
+        wsprintf(szArgs, TEXT("-tap-reader %lu %d"), dwOwner, i == TAP_READERS - 1);
+        if (CHECK(spawn(szArgs, &pis[nProcesses])))
+            ++nProcesses;
+    }
+    wsprintf(szArgs, TEXT("-tap-publisher %lu"), dwOwner);
+    if (CHECK(spawn(szArgs, &pis[nProcesses])))
+        ++nProcesses;
+
+    for (DWORD i = 0; i < nProcesses; ++i)
+    {
+        DWORD dwExitCode = DWORD(-1);
+        if (CHECK(::WaitForSingleObject(pis[i].hProcess, TAP_TIMEOUT) == WAIT_OBJECT_0))
+            ::GetExitCodeProcess(pis[i].hProcess, &dwExitCode);
+        else
+            ::TerminateProcess(pis[i].hProcess, DWORD(-1));
+        CHECK(dwExitCode == 0);
+        ::CloseHandle(pis[i].hThread);
+        ::CloseHandle(pis[i].hProcess);
+    }
+}
+
+struct TEST_ENTRY
+{
+    const char *pszName;
+    void (*pfn)();
+};
+
+static const TEST_ENTRY s_entries[] =
+{
+    { "convert/nan", test_convert_nan },
+    { "flac/md5", test_flac_md5 },
+    { "flac/stream", test_flac_stream },
+    { "rotate/gaps", test_rotate_gaps },
+    { "rotate/budget", test_rotate_budget },
+    { "replay/clock", test_replay_clock },
+    { "loudness/sine", test_loudness_sine },
+    { "dynamics/limit", test_dynamics_limit },
+    { "adpcm/roundtrip", test_adpcm_roundtrip },
+    { "tap/overrun", test_tap_overrun },
+    { "tap/torn", test_tap_torn },
+    { "tap/restart", test_tap_restart },
+    { "tap/processes", test_tap_processes },
+};
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "-tap-publisher") == 0)
+        return run_tap_publisher(strtoul(argv[2], NULL, 10));
+    if (argc == 4 && strcmp(argv[1], "-tap-reader") == 0)
+        return run_tap_reader(strtoul(argv[2], NULL, 10), atoi(argv[3]));
+
+    s_nFilters = argc - 1;
+    s_ppszFilters = argv + 1;
+
+    for (size_t i = 0; i < ARRAYSIZE(s_entries); ++i)
+    {
+        if (!is_selected(s_entries[i].pszName))
+            continue;
+        int nFailures = s_nFailures;
+        s_entries[i].pfn();
+        printf("%-32s %s\n", s_entries[i].pszName,
+               (s_nFailures == nFailures) ? "ok" : "FAILED");
+    }
+
+    return s_nFailures;
+}
@@ -120,6 +120,9 @@ public:
         ::InitCommonControls();
 
         get_wave_formats(m_formats);
+
+        // psh1 keeps the moment before the click.
+        m_rec.SetPrerollDuration(5000);
     }
 
     BOOL OnInitDialog(HWND hwnd, HWND hwndFocus, LPARAM lParam)
@@ -268,8 +271,8 @@ public:
 
     void OnTimer(HWND hwnd, UINT id)
     {
-        LONG nValue = m_rec.m_nValue;
-        LONG nMax = m_rec.m_nMax;
+        LONG nValue, nMax;
+        m_rec.GetMeter(nValue, nMax);
         SendDlgItemMessage(hwnd, scr1, PBM_SETRANGE32, 0, nMax);
         SendDlgItemMessage(hwnd, scr1, PBM_SETPOS, nValue, 0);
     }